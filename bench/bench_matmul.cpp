@@ -0,0 +1,348 @@
+#include "api_wrapper/matmul_api.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+/**
+ * Sweep square, tall-skinny and gemv-like shapes over every matmul type, and split
+ * the time of each matmul into the phases it goes through on the npu.
+ *
+ * The cold path creates a context for every matmul (create, alloc, copy_in, run,
+ * readback, destroy), the warm path reuses a plan from the MatmulCache and the api
+ * path is a full matmul_npu call with a warm cache.
+ *
+ * usage: ./bench_matmul [--json file] [--iterations n] [--quick] [--shapes MxKxN,...]
+ */
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_us(bench_clock::time_point start) {
+    return std::chrono::duration<double, std::micro>(bench_clock::now() - start).count();
+}
+
+static double median(std::vector<double> values) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+struct bench_shape {
+    const char* kind;
+    int32_t M, K, N;
+};
+
+/**
+ * Median time of every phase of one path, in microseconds
+ */
+struct bench_phases {
+    double create = 0, alloc = 0, copy_in = 0, run = 0, readback = 0, destroy = 0, total = 0;
+};
+
+static const char* tensor_name(rknn_tensor_type type) {
+    switch (type) {
+        case RKNN_TENSOR_FLOAT16: return "f16";
+        case RKNN_TENSOR_FLOAT32: return "f32";
+        case RKNN_TENSOR_INT8: return "i8";
+        case RKNN_TENSOR_INT32: return "i32";
+        default: return "?";
+    }
+}
+
+static std::string type_name(const _matmul_type_entry& entry) {
+    return std::string(tensor_name(entry.a)) + "x" + tensor_name(entry.b) + "->" + tensor_name(entry.c);
+}
+
+/**
+ * @brief A matmul from scratch, the way make_matmul and free_matmul do it
+ */
+static bench_phases bench_cold(
+    int32_t M, int32_t K, int32_t N, _rknn_matmul_type type,
+    const void* a, const void* b, void* c, int32_t iterations) {
+
+    std::vector<double> create, alloc, copy_in, run, readback, destroy, total;
+    for (int32_t i = 0; i < iterations; i++) {
+        bench_clock::time_point start = bench_clock::now();
+
+        bench_clock::time_point phase = bench_clock::now();
+        rknn_matmul_ctx ctx;
+        rknn_matmul_info info;
+        rknn_matmul_io_attr io_attr;
+        memset(&info, 0, sizeof(info));
+        memset(&io_attr, 0, sizeof(io_attr));
+        info.M = M;
+        info.K = K;
+        info.N = N;
+        info.type = type;
+        if (rknn_matmul_create(&ctx, &info, &io_attr) < 0) {
+            printf("rknn_matmul_create fail for %dx%dx%d\n", M, K, N);
+            abort();
+        }
+        create.push_back(elapsed_us(phase));
+
+        phase = bench_clock::now();
+        rknn_tensor_mem* mem_a = rknn_create_mem(ctx, io_attr.A.size);
+        rknn_tensor_mem* mem_b = rknn_create_mem(ctx, io_attr.B.size);
+        rknn_tensor_mem* mem_c = rknn_create_mem(ctx, io_attr.C.size);
+        alloc.push_back(elapsed_us(phase));
+
+        phase = bench_clock::now();
+        memcpy(mem_a->virt_addr, a, io_attr.A.size);
+        memcpy(mem_b->virt_addr, b, io_attr.B.size);
+        rknn_matmul_set_io_mem(ctx, mem_a, &io_attr.A);
+        rknn_matmul_set_io_mem(ctx, mem_b, &io_attr.B);
+        rknn_matmul_set_io_mem(ctx, mem_c, &io_attr.C);
+        copy_in.push_back(elapsed_us(phase));
+
+        phase = bench_clock::now();
+        rknn_matmul_run(ctx);
+        run.push_back(elapsed_us(phase));
+
+        phase = bench_clock::now();
+        memcpy(c, mem_c->virt_addr, io_attr.C.size);
+        readback.push_back(elapsed_us(phase));
+
+        phase = bench_clock::now();
+        rknn_destroy_mem(ctx, mem_a);
+        rknn_destroy_mem(ctx, mem_b);
+        rknn_destroy_mem(ctx, mem_c);
+        rknn_matmul_destroy(ctx);
+        destroy.push_back(elapsed_us(phase));
+
+        total.push_back(elapsed_us(start));
+    }
+
+    bench_phases phases;
+    phases.create = median(create);
+    phases.alloc = median(alloc);
+    phases.copy_in = median(copy_in);
+    phases.run = median(run);
+    phases.readback = median(readback);
+    phases.destroy = median(destroy);
+    phases.total = median(total);
+    return phases;
+}
+
+/**
+ * @brief A matmul on a plan reused from the MatmulCache, the way cached_matmul does it
+ */
+static bench_phases bench_warm(
+    int32_t M, int32_t K, int32_t N, _rknn_matmul_type type,
+    const void* a, const void* b, void* c, size_t c_bytes, int32_t iterations) {
+
+    std::vector<double> alloc, copy_in, run, readback, destroy, total;
+    for (int32_t i = 0; i <= iterations; i++) {
+        bench_clock::time_point start = bench_clock::now();
+
+        bench_clock::time_point phase = bench_clock::now();
+        std::shared_ptr<MatmulPlanBase> plan = MatmulCache::instance().acquire({M, K, N, type, 0, 0, RKNN_NPU_CORE_AUTO});
+        rknn_tensor_mem* mem_c = NpuMemoryPool::instance().acquire(plan->context(), plan->io_attr().C.size);
+        const double alloc_us = elapsed_us(phase);
+
+        phase = bench_clock::now();
+        plan->load(a, b);
+        const double copy_in_us = elapsed_us(phase);
+
+        phase = bench_clock::now();
+        plan->run_bound(mem_c);
+        const double run_us = elapsed_us(phase);
+
+        phase = bench_clock::now();
+        memcpy(c, mem_c->virt_addr, c_bytes);
+        const double readback_us = elapsed_us(phase);
+
+        phase = bench_clock::now();
+        NpuMemoryPool::instance().release(plan->context(), mem_c);
+        plan.reset();
+        const double destroy_us = elapsed_us(phase);
+
+        // the first iteration fills the cache and the pool
+        if (i > 0) {
+            alloc.push_back(alloc_us);
+            copy_in.push_back(copy_in_us);
+            run.push_back(run_us);
+            readback.push_back(readback_us);
+            destroy.push_back(destroy_us);
+            total.push_back(elapsed_us(start));
+        }
+    }
+
+    bench_phases phases;
+    phases.alloc = median(alloc);
+    phases.copy_in = median(copy_in);
+    phases.run = median(run);
+    phases.readback = median(readback);
+    phases.destroy = median(destroy);
+    phases.total = median(total);
+    return phases;
+}
+
+/**
+ * @brief A full matmul_npu call with a warm cache, including the copy of the result to the host
+ */
+static bench_phases bench_api(
+    int32_t M, int32_t K, int32_t N, _rknn_matmul_type type,
+    void* a, void* b, void* c, size_t c_bytes, int32_t iterations) {
+
+    std::vector<double> total;
+    for (int32_t i = 0; i <= iterations; i++) {
+        bench_clock::time_point start = bench_clock::now();
+        tensor_result result = matmul_npu(M, K, N, type, a, b);
+        memcpy(c, result.resultMatrix->virt_addr, c_bytes);
+        release_result(result);
+        if (i > 0) {
+            total.push_back(elapsed_us(start));
+        }
+    }
+    bench_phases phases;
+    phases.total = median(total);
+    return phases;
+}
+
+/**
+ * @brief Fill a float16 or int8 matrix with ones, the run time does not depend on the values
+ */
+static void fill_ones(std::vector<uint8_t>& data, size_t elem_size) {
+    const float16 one(1.0f);
+    for (size_t i = 0; i < data.size(); i += elem_size) {
+        if (elem_size == 2) {
+            memcpy(&data[i], &one, 2);
+        } else {
+            data[i] = 1;
+        }
+    }
+}
+
+static void write_phases(FILE* out, const char* path, const bench_phases& phases, double gops) {
+    fprintf(
+        out, "\"%s\": {\"create_us\": %.2f, \"alloc_us\": %.2f, \"copy_in_us\": %.2f, \"run_us\": %.2f, "
+        "\"readback_us\": %.2f, \"destroy_us\": %.2f, \"total_us\": %.2f, \"gops\": %.3f}",
+        path, phases.create, phases.alloc, phases.copy_in, phases.run,
+        phases.readback, phases.destroy, phases.total, gops
+    );
+}
+
+int main(int argc, char** argv) {
+
+    std::string json_path;
+    int32_t iterations = 10;
+    bool quick = false;
+    std::vector<bench_shape> shapes = {
+        {"square", 64, 64, 64}, {"square", 256, 256, 256}, {"square", 512, 512, 512},
+        {"square", 1024, 1024, 1024}, {"square", 2048, 2048, 2048},
+        {"tall_skinny", 4096, 128, 64}, {"tall_skinny", 16384, 64, 32}, {"tall_skinny", 4096, 1024, 16},
+        {"gemv", 1, 1024, 1024}, {"gemv", 1, 4096, 4096}, {"gemv", 8, 4096, 4096},
+    };
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--json" && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (arg == "--iterations" && i + 1 < argc) {
+            iterations = std::max(1, atoi(argv[++i]));
+        } else if (arg == "--quick") {
+            quick = true;
+        } else if (arg == "--shapes" && i + 1 < argc) {
+            shapes.clear();
+            std::string list = argv[++i];
+            size_t begin = 0;
+            while (begin < list.size()) {
+                size_t end = list.find(',', begin);
+                end = end == std::string::npos ? list.size() : end;
+                int32_t M, K, N;
+                if (sscanf(list.substr(begin, end - begin).c_str(), "%dx%dx%d", &M, &K, &N) == 3) {
+                    shapes.push_back({"custom", M, K, N});
+                }
+                begin = end + 1;
+            }
+        } else {
+            printf("usage: %s [--json file] [--iterations n] [--quick] [--shapes MxKxN,...]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (quick) {
+        shapes.erase(std::remove_if(shapes.begin(), shapes.end(), [](const bench_shape& shape) {
+            return (int64_t) shape.M * shape.K * shape.N > ((int64_t) 1 << 26);
+        }), shapes.end());
+    }
+    // creating a context per matmul is slow, the cold path runs fewer times
+    const int32_t cold_iterations = std::max(1, iterations / 3);
+
+    FILE* json = nullptr;
+    if (!json_path.empty()) {
+        json = fopen(json_path.c_str(), "w");
+        if (json == nullptr) {
+            printf("can not write %s\n", json_path.c_str());
+            return 1;
+        }
+#ifdef RKNN_EMULATED
+        const char* runtime = "emulated";
+#else
+        const char* runtime = "rknpu";
+#endif
+        fprintf(
+            json, "{\n  \"runtime\": \"%s\", \"compiler\": \"%s\", \"iterations\": %d,\n  \"results\": [\n",
+            runtime, __VERSION__, iterations
+        );
+    }
+
+    printf(
+        "%-12s %-12s %18s | %9s %9s %9s %9s %9s | %9s %9s %9s | %8s %8s\n",
+        "type", "shape", "MxKxN", "create", "alloc", "copy_in", "run", "readback",
+        "cold", "warm", "api", "GOPS", "warm GOPS"
+    );
+
+    bool first = true;
+    for (int32_t t = 0; t < matmul_type_count; t++) {
+        const _matmul_type_entry& entry = matmul_type_table[t];
+        for (const bench_shape& shape : shapes) {
+            const int32_t M = shape.M, K = shape.K, N = shape.N;
+            std::vector<uint8_t> a((size_t) M * K * entry.a_size), b((size_t) K * N * entry.b_size);
+            std::vector<uint8_t> c((size_t) M * N * entry.c_size);
+            fill_ones(a, entry.a_size);
+            fill_ones(b, entry.b_size);
+
+            bench_phases cold = bench_cold(M, K, N, entry.type, a.data(), b.data(), c.data(), cold_iterations);
+            bench_phases warm = bench_warm(M, K, N, entry.type, a.data(), b.data(), c.data(), c.size(), iterations);
+            bench_phases api = bench_api(M, K, N, entry.type, a.data(), b.data(), c.data(), c.size(), iterations);
+
+            const double ops = 2.0 * M * K * N;
+            const double cold_gops = ops / cold.total / 1e3;
+            const double warm_gops = ops / warm.total / 1e3;
+            const double api_gops = ops / api.total / 1e3;
+
+            printf(
+                "%-12s %-12s %6dx%5dx%5d | %9.1f %9.1f %9.1f %9.1f %9.1f | %9.1f %9.1f %9.1f | %8.2f %8.2f\n",
+                type_name(entry).c_str(), shape.kind, M, K, N,
+                cold.create, cold.alloc, cold.copy_in, cold.run, cold.readback,
+                cold.total, warm.total, api.total, cold_gops, warm_gops
+            );
+
+            if (json != nullptr) {
+                fprintf(
+                    json, "%s    {\"type\": \"%s\", \"kind\": \"%s\", \"M\": %d, \"K\": %d, \"N\": %d,\n      ",
+                    first ? "" : ",\n", type_name(entry).c_str(), shape.kind, M, K, N
+                );
+                write_phases(json, "cold", cold, cold_gops);
+                fprintf(json, ",\n      ");
+                write_phases(json, "warm", warm, warm_gops);
+                fprintf(json, ",\n      ");
+                write_phases(json, "api", api, api_gops);
+                fprintf(json, "}");
+                first = false;
+            }
+        }
+        // the contexts of one type are not reused by the next
+        MatmulCache::instance().clear();
+    }
+
+    if (json != nullptr) {
+        fprintf(json, "\n  ]\n}\n");
+        fclose(json);
+        printf("results written to %s\n", json_path.c_str());
+    }
+}
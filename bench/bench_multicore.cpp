@@ -0,0 +1,47 @@
+#include "api_wrapper/matmul_api.hpp"
+#include <iostream>
+#include <vector>
+#include <chrono>
+
+/**
+ * Time one int8 matmul split between 1, 2 and 3 npu cores.
+ * 
+ * usage: ./bench_multicore [M K N] [iterations]
+ */
+int main(int argc, char** argv) {
+
+    int M = argc > 3 ? atoi(argv[1]) : 4096;
+    int K = argc > 3 ? atoi(argv[2]) : 4096;
+    int N = argc > 3 ? atoi(argv[3]) : 4096;
+    int iterations = argc > 4 ? atoi(argv[4]) : 5;
+
+    std::vector<int8_t> a((size_t) M * K, 2);
+    std::vector<int8_t> b((size_t) K * N, 3);
+
+    double baseline = 0;
+
+    for (int cores = 1; cores <= NPU_MAX_CORES; cores++) {
+        multicore_config config = {true, cores, {1.0f, 1.0f, 1.0f}, false, 0};
+
+        // the first run creates the contexts of this split
+        tensor_result warmup = multicore_matmul(M, K, N, RKNN_INT8_MM_INT8_TO_INT32, a.data(), b.data(), config);
+        release_result(warmup);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            tensor_result result = multicore_matmul(M, K, N, RKNN_INT8_MM_INT8_TO_INT32, a.data(), b.data(), config);
+            release_result(result);
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+
+        double seconds = std::chrono::duration<double>(end - start).count() / iterations;
+        if (cores == 1) {
+            baseline = seconds;
+        }
+
+        std::cout << "cores: " << cores
+                  << "  time: " << seconds << "s"
+                  << "  GOPS: " << 2.0 * M * K * N / seconds / 1.0E9
+                  << "  speedup: " << baseline / seconds << "x\n";
+    }
+}
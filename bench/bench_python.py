@@ -0,0 +1,93 @@
+"""
+Time the python bindings on the shapes of bench_matmul, and the overhead they add
+on top of the C++ matmul_npu call.
+
+usage: python3 bench/bench_python.py [--cpp bench.json] [--json bench_python.json]
+                                     [--iterations n] [--quick] [--shapes MxKxN,...]
+"""
+import argparse
+import json
+import statistics
+import time
+
+import numpy as np
+import matnpu
+
+# the same shapes as bench/bench_matmul.cpp
+SHAPES = [
+    ("square", 64, 64, 64), ("square", 256, 256, 256), ("square", 512, 512, 512),
+    ("square", 1024, 1024, 1024), ("square", 2048, 2048, 2048),
+    ("tall_skinny", 4096, 128, 64), ("tall_skinny", 16384, 64, 32), ("tall_skinny", 4096, 1024, 16),
+    ("gemv", 1, 1024, 1024), ("gemv", 1, 4096, 4096), ("gemv", 8, 4096, 4096),
+]
+
+# type name as bench_matmul writes it, the binding and the input dtypes
+TYPES = [
+    ("f16xf16->f16", matnpu.matmul_f16, np.float16, np.float16),
+    ("f16xf16->f32", matnpu.matmul_f32, np.float16, np.float16),
+    ("f16xi8->f16", matnpu.matmul_f16, np.float16, np.int8),
+    ("i8xi8->i8", matnpu.matmul_i8, np.int8, np.int8),
+    ("i8xi8->i32", matnpu.matmul_i32, np.int8, np.int8),
+]
+
+
+def time_us(run, iterations):
+    run()  # fills the plan cache
+    times = []
+    for _ in range(iterations):
+        start = time.perf_counter()
+        run()
+        times.append((time.perf_counter() - start) * 1e6)
+    return statistics.median(times)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--cpp", help="json written by bench_matmul, to report the binding overhead")
+    parser.add_argument("--json", help="write the results to this file")
+    parser.add_argument("--iterations", type=int, default=10)
+    parser.add_argument("--quick", action="store_true", help="skip the shapes above 2^26 multiply-accumulates")
+    parser.add_argument("--shapes", help="comma separated MxKxN list instead of the default sweep")
+    args = parser.parse_args()
+
+    shapes = SHAPES
+    if args.shapes:
+        shapes = [("custom", *map(int, s.split("x"))) for s in args.shapes.split(",")]
+    if args.quick:
+        shapes = [s for s in shapes if s[1] * s[2] * s[3] <= 1 << 26]
+
+    cpp = {}
+    if args.cpp:
+        with open(args.cpp) as f:
+            for r in json.load(f)["results"]:
+                cpp[(r["type"], r["M"], r["K"], r["N"])] = r["api"]["total_us"]
+
+    print(f"{'type':12s} {'shape':12s} {'MxKxN':>18s} | {'python':>9s} {'c++':>9s} {'overhead':>9s} | {'GOPS':>8s}")
+    results = []
+    for name, matmul, a_type, b_type in TYPES:
+        for kind, M, K, N in shapes:
+            a = np.ones((M, K), dtype=a_type)
+            b = np.ones((K, N), dtype=b_type)
+            python_us = time_us(lambda: matmul(a, b), args.iterations)
+            cpp_us = cpp.get((name, M, K, N))
+            overhead_us = python_us - cpp_us if cpp_us is not None else None
+            gops = 2.0 * M * K * N / python_us / 1e3
+
+            print(
+                f"{name:12s} {kind:12s} {M:6d}x{K:5d}x{N:5d} | {python_us:9.1f} "
+                f"{cpp_us if cpp_us is not None else float('nan'):9.1f} "
+                f"{overhead_us if overhead_us is not None else float('nan'):9.1f} | {gops:8.2f}"
+            )
+            results.append({
+                "type": name, "kind": kind, "M": M, "K": K, "N": N,
+                "python_us": python_us, "cpp_us": cpp_us, "overhead_us": overhead_us, "gops": gops,
+            })
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"iterations": args.iterations, "results": results}, f, indent=2)
+        print(f"results written to {args.json}")
+
+
+if __name__ == "__main__":
+    main()
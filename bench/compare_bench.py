@@ -0,0 +1,46 @@
+"""
+Compare two json files written by bench_matmul, e.g. before and after a change.
+
+usage: python3 bench/compare_bench.py base.json new.json [--path warm] [--threshold 5]
+"""
+import argparse
+import json
+
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    return data, {(r["type"], r["M"], r["K"], r["N"]): r for r in data["results"]}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("base")
+    parser.add_argument("new")
+    parser.add_argument("--path", default="warm", choices=["cold", "warm", "api"])
+    parser.add_argument("--threshold", type=float, default=5.0,
+                        help="mark changes larger than this percentage")
+    args = parser.parse_args()
+
+    base_info, base = load(args.base)
+    new_info, new = load(args.new)
+    print(f"base: {base_info.get('runtime')} {base_info.get('compiler')}  "
+          f"new: {new_info.get('runtime')} {new_info.get('compiler')}  path: {args.path}")
+    print(f"{'type':12s} {'MxKxN':>18s} | {'base us':>10s} {'new us':>10s} {'speedup':>8s}")
+
+    for key, r in new.items():
+        if key not in base:
+            continue
+        before = base[key][args.path]["total_us"]
+        after = r[args.path]["total_us"]
+        speedup = before / after if after > 0 else float("inf")
+        change = (speedup - 1.0) * 100.0
+        mark = ""
+        if abs(change) >= args.threshold:
+            mark = "  faster" if change > 0 else "  SLOWER"
+        name, M, K, N = key
+        print(f"{name:12s} {M:6d}x{K:5d}x{N:5d} | {before:10.1f} {after:10.1f} {speedup:7.2f}x{mark}")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,166 +1,165 @@
 #ifndef MATMUL_NPU
 #define MATMUL_NPU
 
-#include <rknpu/rknn_matmul_api.h>
-#include <type_traits>
-#include <iostream>
-#include <cstring>
-#include "utils/half.hpp"
-
-using float16 = half_float::half;
-typedef float float32;
-
-/**
- * @brief Utility function to choose flag from the _rknn_matmul_types
- * 
- * @param To    The type of the output matrix
- * @param Ti1   The type of the first input martix
- * @param Ti2   The type of the second input matrix
- * 
- * @return _rknn_matmul_ type flag for the matmul operation
- */
-template<typename To, typename Ti1, typename Ti2>
-_rknn_matmul_type choose_matmul_type() {
-    if (
-        std::is_same<float16, Ti1>::value && 
-        std::is_same<float16, Ti2>::value && 
-        std::is_same<float16, To>::value) {
-        return RKNN_FLOAT16_MM_FLOAT16_TO_FLOAT16;
-    } else if (
-        std::is_same<float16, Ti1>::value && 
-        std::is_same<float16, Ti2>::value && 
-        std::is_same<float32, To>::value)  {
-        return RKNN_FLOAT16_MM_FLOAT16_TO_FLOAT32;
-    } else if (
-        std::is_same<float16, Ti1>::value &&
-        std::is_same<int8_t, Ti2>::value  &&
-        std::is_same<float16, To>::value ) { 
-        return RKNN_FLOAT16_MM_INT8_TO_FLOAT16; 
-    } else if (
-        std::is_same<int8_t, Ti1>::value && 
-        std::is_same<int8_t, Ti2>::value && 
-        std::is_same<int8_t, To>::value)  {
-        return RKNN_INT8_MM_INT8_TO_INT8;
-    } else if (
-        std::is_same<int8_t, Ti1>::value && 
-        std::is_same<int8_t, Ti2>::value && 
-        std::is_same<int32_t, To>::value)  {
-        return RKNN_INT8_MM_INT8_TO_INT32;
-    } else {
-        std::cout << "unsupported combination of types:\n";
-        std::cout << "please enter types from avilable types\n";
-        std::cout << "1. float16, float16, float16\n";
-        std::cout << "2. float16, float16, float32\n";
-        std::cout << "3. float16, int8_t, float16\n";
-        std::cout << "4. int8_t, int8_t, int8_t\n";
-        std::cout << "5. int8_t, int8_t, int32_t\n";
-        abort();
-    }
-
-}
+#include "api_wrapper/matmul_ctx.hpp"
+#include "api_wrapper/matmul_cache.hpp"
+#include "api_wrapper/matmul_weights.hpp"
+#include "api_wrapper/matmul_tiling.hpp"
+#include "api_wrapper/matmul_multicore.hpp"
+#include "api_wrapper/matmul_dispatch.hpp"
+#include "api_wrapper/matmul_coexec.hpp"
+#include "api_wrapper/matmul_tuner.hpp"
+#include "api_wrapper/matmul_epilogue.hpp"
 
 /**
- * Struct that wraps all the built in rknn types 
- * and contains the result pointer
- * 
- * @param To The type of the output matrix
+ * The way a matmul runs, see route_matmul
  */
-struct _matmul_ctx {
-    rknn_context ctx;
-    rknn_matmul_info info;
-    rknn_matmul_io_attr io_attr;
-    rknn_tensor_mem* matrixA;
-    rknn_tensor_mem* matrixB;
-    rknn_tensor_mem* matrixC;
+enum _matmul_route {
+    MATMUL_ROUTE_CPU = 0,
+    MATMUL_ROUTE_TUNED,
+    MATMUL_ROUTE_COEXEC,
+    MATMUL_ROUTE_TILED,
+    MATMUL_ROUTE_MULTICORE,
+    MATMUL_ROUTE_CACHED         /* one context from the MatmulCache, see prepare_matmul */
 };
 
 /**
- * Struct that contains the result tensor of the matmul and it's context
+ * The route of a matmul and the configuration it runs with
+ *
+ * @param tuned The tuned configuration, for MATMUL_ROUTE_TUNED
  */
-struct tensor_result {
-    rknn_context ctx;
-    rknn_tensor_mem* resultMatrix;
-
-    tensor_result(rknn_context ctx, rknn_tensor_mem* resultMatrix) 
-        : ctx(ctx), resultMatrix(resultMatrix) {}
+struct _matmul_routing {
+    _matmul_route route;
+    tuned_config tuned;
 };
 
 /**
- * @brief ## __Create a matmul operation for the npu__
- * 
- * @param To The type of the output matrix
- * 
- * @return _matmul_ctx with the currect context for the rknn_matmul_run function
+ * @brief Choose how a matmul runs, matmul_npu and submit_matmul both follow it
+ *
+ * @return The first of: the cpu, a tuned configuration, cpu and npu co-execution, 
+ *         tiling, multiple cores and a single cached context that applies
  */
-_matmul_ctx* make_matmul(
-    int32_t num_rows_a, int32_t num_cols_a, int32_t num_cols_b, _rknn_matmul_type type
-    ) {
-
-    /* create a matmul_ctx struct */
-    _matmul_ctx* matmul_ctx = (_matmul_ctx*)malloc(sizeof(_matmul_ctx));
-
-    /* set all field to zero */
-    memset(matmul_ctx, 0, sizeof(_matmul_ctx));
-
-    matmul_ctx->info.M             = num_rows_a; /* set first matrix rows */
-    matmul_ctx->info.K             = num_cols_a; /* set first matrix cols */
-    matmul_ctx->info.N             = num_cols_b; /* set second matrix cols */
-    matmul_ctx->info.type          = type; /* set the dtypes of the input and output matrices*/
-    matmul_ctx->info.AC_layout     = 0; /* set the layout of matrices A and C */
-    matmul_ctx->info.B_layout      = 0; /* set the layout of matrix B */
-    
-
-    // create the matmul operation
-    int ret = rknn_matmul_create(&matmul_ctx->ctx, &matmul_ctx->info, &matmul_ctx->io_attr);
-    if (ret < 0) {
-        printf("rknn_matmul_create fail! ret=%d\n", ret);
-        abort();
-    }
-
-    // create the memory for the matrices in the npu
-    matmul_ctx->matrixA = rknn_create_mem(matmul_ctx->ctx, matmul_ctx->io_attr.A.size);
-    matmul_ctx->matrixB = rknn_create_mem(matmul_ctx->ctx, matmul_ctx->io_attr.B.size);
-    matmul_ctx->matrixC = rknn_create_mem(matmul_ctx->ctx, matmul_ctx->io_attr.C.size);
+_matmul_routing route_matmul(
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    const void* b,
+    _matmul_layout layout
+) {
+    _matmul_routing routing = {MATMUL_ROUTE_CACHED, {}};
+    const int64_t macs = (int64_t) num_rows_a * num_cols_a * num_cols_b;
 
+    if (runs_on_cpu(num_rows_a, num_cols_a, num_cols_b, type, b, layout)) {
+        routing.route = MATMUL_ROUTE_CPU;
+        return routing;
+    }
 
-    // set the memory in the npu
-    rknn_matmul_set_io_mem(matmul_ctx->ctx, matmul_ctx->matrixA, &matmul_ctx->io_attr.A);
-    rknn_matmul_set_io_mem(matmul_ctx->ctx, matmul_ctx->matrixB, &matmul_ctx->io_attr.B);
-    rknn_matmul_set_io_mem(matmul_ctx->ctx, matmul_ctx->matrixC, &matmul_ctx->io_attr.C);
+    const bool native_b = NpuMemoryRegistry::instance().find(b).layout == NPU_LAYOUT_NATIVE_B;
+    if (layout != MATMUL_LAYOUT_NATIVE && !native_b &&
+        find_tuned_config(num_rows_a, num_cols_a, num_cols_b, type, routing.tuned)) {
+        routing.route = MATMUL_ROUTE_TUNED;
+        return routing;
+    }
 
-    return matmul_ctx;
+    const coexec_config& coexec = matmul_coexec_config();
+    const multicore_config& multicore = matmul_multicore_config();
+    if (coexec.enabled && macs >= coexec.min_macs && !native_b) {
+        routing.route = MATMUL_ROUTE_COEXEC;
+    } else if (needs_tiling(num_rows_a, num_cols_a, num_cols_b)) {
+        routing.route = MATMUL_ROUTE_TILED;
+    } else if (multicore.enabled && macs >= multicore.min_macs) {
+        routing.route = MATMUL_ROUTE_MULTICORE;
+    }
+    return routing;
 }
 
 /**
- * @brief Set the matrix data in the npu
- * 
- * @param Ti The type of the input matrix
- * @param ctx The context for the matmul operation
- * @param mem The information of the matrix tensor memory
- * @param attr The attributes of the matrix tensor
+ * @brief Run a matmul the way route_matmul chose
+ *
+ * @param epilogue Applied while C is read, nullptr for none
  */
-void set_matrix_data(
-    rknn_matmul_ctx* ctx, 
-    rknn_tensor_mem* mem, 
-    rknn_matmul_tensor_attr* attr, 
-    const void* data ) {
-
-    memcpy(mem->virt_addr, data, mem->size);
-    rknn_matmul_set_io_mem(*ctx, mem, attr);
+tensor_result run_matmul_route(
+    const _matmul_routing& routing,
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    const void* a,
+    const void* b,
+    _matmul_layout layout,
+    const matmul_epilogue* epilogue = nullptr
+) {
+    switch (routing.route) {
+        case MATMUL_ROUTE_CPU: {
+            tensor_result result = cpu_matmul_tensor(num_rows_a, num_cols_a, num_cols_b, type, a, b, layout);
+            if (epilogue == nullptr) {
+                return result;
+            }
+            return apply_epilogue(
+                result, num_rows_a, num_cols_b, matmul_type_entry(type).c, *epilogue
+            );
+        }
+        case MATMUL_ROUTE_TUNED:
+            return tuned_matmul(num_rows_a, num_cols_a, num_cols_b, type, a, b, routing.tuned, epilogue);
+        case MATMUL_ROUTE_COEXEC:
+            return coexec_matmul(
+                num_rows_a, num_cols_a, num_cols_b, type, a, b, matmul_coexec_config(), epilogue
+            );
+        case MATMUL_ROUTE_TILED:
+            return tiled_matmul(
+                num_rows_a, num_cols_a, num_cols_b, type, a, b, matmul_shape_limits(), epilogue
+            );
+        case MATMUL_ROUTE_MULTICORE:
+            return multicore_matmul(
+                num_rows_a, num_cols_a, num_cols_b, type, a, b, matmul_multicore_config(), epilogue
+            );
+        default:
+            return cached_matmul(num_rows_a, num_cols_a, num_cols_b, type, a, b, layout, 0, epilogue);
+    }
 }
 
 /**
- * @brief Free the matrices tensors 
+ * @brief Performs matrix multiplication on the npu 
+ * 
+ * @param num_rows_a The number of rows in the first input mat
+ * @param num_cols_a The number of columns in the first input mat
+ * @param num_cols_b The number of columns in the second input mat
+ * @param type The matmul type flag
+ * @param a The data of the first input matrix 
+ * @param b The data of the second input matrix 
+ * @param layout The layout of matrices A and C, see _matmul_layout
+ * 
+ * @return tensor_result that has inside the pointer to the result of the matmul,
+ *         free it with release_result
  * 
- * @param To The type of the input matrix
- * @param ctx The context of the matmul operation
+ * @note The shape of the result is (num_rows_a, num_cols_b)
+ * @note The context is taken from the process wide MatmulCache
+ * @note Matmuls larger than matmul_shape_limits are tiled and return a row major result
+ * @note With matmul_multicore_config().enabled large matmuls are split between the npu cores
+ * @note With matmul_dispatch_model().enabled matmuls the model predicts to be faster 
+ *       on the cpu run there, see runs_on_cpu
+ * @note With matmul_coexec_config().enabled large matmuls are split between the cpu and the npu
+ * @note Shapes in the MatmulTuningDatabase run their tuned configuration, unless C is native
  */
-void free_matmul(_matmul_ctx* ctx) {
-    rknn_destroy_mem(ctx->ctx, ctx->matrixA);
-    rknn_destroy_mem(ctx->ctx, ctx->matrixB);
-    free(ctx);
+tensor_result matmul_npu(
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    void* a,
+    void* b,
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL
+) {
+
+    return run_matmul_route(
+        route_matmul(num_rows_a, num_cols_a, num_cols_b, type, b, layout),
+        num_rows_a, num_cols_a, num_cols_b, type, a, b, layout
+    );
+
 }
 
+
 /**
  * @brief Performs matrix multiplication on the npu 
  * 
@@ -172,10 +171,13 @@ void free_matmul(_matmul_ctx* ctx) {
  * @param num_cols_b The number of columns in the second input mat
  * @param a The data of the first input matrix 
  * @param b The data of the second input matrix 
+ * @param layout The layout of matrices A and C, see _matmul_layout
  * 
- * @return _matmul_ctx<To> that has inside the pointer to the result of the matmul.
+ * @return tensor_result that has inside the pointer to the result of the matmul,
+ *         free it with release_result
  * 
  * @note The shape of the result is (num_rows_a, num_cols_b)
+ * @note The context is taken from the process wide MatmulCache
  */
 template<typename To, typename Ti1, typename Ti2> 
 tensor_result matmul_npu(
@@ -183,38 +185,28 @@ tensor_result matmul_npu(
     uint32_t num_cols_a,
     uint32_t num_cols_b,
     Ti1* a,
-    Ti2* b
+    Ti2* b,
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL
 ) {
 
-    _matmul_ctx* ctx = make_matmul(
-        num_rows_a, num_cols_a, num_cols_b, choose_matmul_type<To, Ti1, Ti2>()
+    return matmul_npu(
+        num_rows_a, num_cols_a, num_cols_b, choose_matmul_type<To, Ti1, Ti2>(), a, b, layout
     );
 
-    set_matrix_data(&ctx->ctx, ctx->matrixA, &ctx->io_attr.A, a);
-    set_matrix_data(&ctx->ctx, ctx->matrixB, &ctx->io_attr.B, b);
-    rknn_matmul_run(ctx->ctx);
-
-    tensor_result result(ctx->ctx, ctx->matrixC);
-    free_matmul(ctx);
-
-    return result;
-
 }
 
 
 /**
- * @brief Performs matrix multiplication on the npu 
+ * @brief Performs matrix multiplication on the npu and applies an epilogue to C
  * 
- * @param num_rows_a The number of rows in the first input mat
- * @param num_cols_a The number of columns in the first input mat
- * @param num_cols_b The number of columns in the second input mat
- * @param type The matmul type flag
- * @param a The data of the first input matrix 
- * @param b The data of the second input matrix 
+ * The epilogue runs in the pass that reads C out of npu memory, instead of 
+ * separate passes over the result for the bias, the activation and the conversion.
  * 
- * @return _matmul_ctx<To> that has inside the pointer to the result of the matmul.
+ * @param type The matmul type flag, the epilogue converts C from it's type to epilogue.output
+ * @param epilogue See matmul_epilogue
+ * @param layout MATMUL_LAYOUT_NORMAL or MATMUL_LAYOUT_PERF, the epilogue needs a row major C
  * 
- * @note The shape of the result is (num_rows_a, num_cols_b)
+ * @return tensor_result with the (num_rows_a, num_cols_b) result, free it with release_result
  */
 tensor_result matmul_npu(
     uint32_t num_rows_a,
@@ -222,24 +214,74 @@ tensor_result matmul_npu(
     uint32_t num_cols_b,
     _rknn_matmul_type type,
     void* a,
-    void* b
+    void* b,
+    const matmul_epilogue& epilogue,
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL
 ) {
 
-    _matmul_ctx* ctx = make_matmul(
-        num_rows_a, num_cols_a, num_cols_b, type
+    if (layout == MATMUL_LAYOUT_NATIVE) {
+        printf("matmul epilogue: the result must be row major, use MATMUL_LAYOUT_PERF\n");
+        abort();
+    }
+    return run_matmul_route(
+        route_matmul(num_rows_a, num_cols_a, num_cols_b, type, b, layout),
+        num_rows_a, num_cols_a, num_cols_b, type, a, b, layout, &epilogue
     );
 
-    set_matrix_data(&ctx->ctx, ctx->matrixA, &ctx->io_attr.A, a);
-    set_matrix_data(&ctx->ctx, ctx->matrixB, &ctx->io_attr.B, b);
-    rknn_matmul_run(ctx->ctx);
+}
 
-    tensor_result result(ctx->ctx, ctx->matrixC);
-    free_matmul(ctx);
 
-    return result;
+/**
+ * @brief Performs matrix multiplication on the npu and applies an epilogue to C
+ * 
+ * The matmul runs with the widest C the npu has for Ti1 x Ti2 (float32 for float16,
+ * int32 for int8) and the epilogue converts it to To, overriding epilogue.output.
+ * 
+ * @param epilogue See matmul_epilogue
+ * 
+ * @return tensor_result with the (num_rows_a, num_cols_b) result, free it with release_result
+ */
+template<typename To, typename Ti1, typename Ti2> 
+tensor_result matmul_npu(
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    Ti1* a,
+    Ti2* b,
+    const matmul_epilogue& epilogue,
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL
+) {
+
+    _rknn_matmul_type type;
+    if (!find_widest_matmul_type(tensor_type_of<Ti1>(), tensor_type_of<Ti2>(), &type)) {
+        printf("matmul epilogue: unsupported input types\n");
+        abort();
+    }
+    matmul_epilogue typed = epilogue;
+    typed.output = tensor_type_of<To>();
+    return matmul_npu(num_rows_a, num_cols_a, num_cols_b, type, a, b, typed, layout);
 
 }
 
 
-#endif
+/**
+ * @brief Performs matrix multiplication by packed weights and applies an epilogue to C
+ * 
+ * @param epilogue See matmul_epilogue, C has the type of the weights' matmul
+ * 
+ * @return tensor_result with the (num_rows_a, weights.cols()) result, free it with release_result
+ */
+tensor_result matmul_npu(
+    uint32_t num_rows_a, const void* a, const NpuWeights& weights, 
+    const matmul_epilogue& epilogue, _matmul_layout layout = MATMUL_LAYOUT_NORMAL) {
 
+    if (layout == MATMUL_LAYOUT_NATIVE) {
+        printf("matmul epilogue: the result must be row major, use MATMUL_LAYOUT_PERF\n");
+        abort();
+    }
+    return matmul_npu(num_rows_a, a, weights, layout, &epilogue);
+
+}
+
+
+#endif
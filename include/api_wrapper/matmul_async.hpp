@@ -0,0 +1,411 @@
+#ifndef MATMUL_ASYNC
+#define MATMUL_ASYNC
+
+#include "api_wrapper/matmul_api.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <thread>
+
+/**
+ * A matmul submitted to the MatmulQueue
+ *
+ * @param load Copies the inputs to the npu, empty for matmuls that only have run
+ * @param run Runs a matmul that is not split into a load and a run (tiled, multi core)
+ * @param waiting_since When the job entered it's current queue, for the MatmulTracer
+ */
+struct _matmul_job {
+    std::function<_pending_matmul()> load;
+    std::function<tensor_result()> run;
+    _pending_matmul pending;
+    std::promise<tensor_result> promise;
+    std::chrono::steady_clock::time_point waiting_since;
+};
+
+/**
+ * @brief Process wide queue that runs submitted matmuls in the background
+ *
+ * A loader thread copies the inputs of the next matmul to the npu while a
+ * runner thread waits on the npu for the current one. Only one loaded matmul
+ * waits for the runner at a time, so the inputs are double buffered: the
+ * copy-in of job N + 1 overlaps the npu run of job N.
+ */
+class MatmulQueue {
+
+    private:
+
+        std::mutex lock;
+        std::condition_variable changed;
+        std::deque<_matmul_job> submitted;
+        std::deque<_matmul_job> loaded;
+        bool stopping = false;
+        bool loader_done = false;
+        std::thread loader;
+        std::thread runner;
+
+        MatmulQueue() {
+            loader = std::thread(&MatmulQueue::load_loop, this);
+            runner = std::thread(&MatmulQueue::run_loop, this);
+        }
+
+        /**
+         * @brief Trace the time a job waited, in the submitted queue or loaded for the runner
+         */
+        static void trace_wait(const char* name, const _matmul_job& job) {
+            MatmulTracer& tracer = MatmulTracer::instance();
+            if (tracer.tracing()) {
+                tracer.span(name, job.waiting_since, std::chrono::steady_clock::now());
+            }
+        }
+
+        void load_loop() {
+            while (true) {
+                _matmul_job job;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    // the next job is loaded only once the previous one reached the runner
+                    changed.wait(guard, [this]() {
+                        return (!submitted.empty() && loaded.empty()) || (stopping && submitted.empty());
+                    });
+                    if (submitted.empty()) {
+                        loader_done = true;
+                        changed.notify_all();
+                        return;
+                    }
+                    job = std::move(submitted.front());
+                    submitted.pop_front();
+                }
+                trace_wait("queued", job);
+
+                if (job.load) {
+                    try {
+                        job.pending = job.load();
+                    } catch (...) {
+                        job.promise.set_exception(std::current_exception());
+                        continue;
+                    }
+                }
+
+                job.waiting_since = std::chrono::steady_clock::now();
+                {
+                    std::lock_guard<std::mutex> guard(lock);
+                    loaded.push_back(std::move(job));
+                }
+                changed.notify_all();
+            }
+        }
+
+        void run_loop() {
+            while (true) {
+                _matmul_job job;
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    changed.wait(guard, [this]() { return !loaded.empty() || loader_done; });
+                    if (loaded.empty()) {
+                        return;
+                    }
+                    job = std::move(loaded.front());
+                    loaded.pop_front();
+                }
+                changed.notify_all();
+                trace_wait("loaded", job);
+
+                try {
+                    job.promise.set_value(job.load ? finish_matmul(job.pending) : job.run());
+                } catch (...) {
+                    job.promise.set_exception(std::current_exception());
+                }
+            }
+        }
+
+    public:
+
+        static MatmulQueue& instance() {
+            static MatmulQueue queue;
+            return queue;
+        }
+
+        MatmulQueue(const MatmulQueue&) = delete;
+        MatmulQueue& operator=(const MatmulQueue&) = delete;
+
+        /**
+         * @brief Finish the submitted matmuls and stop the threads
+         */
+        ~MatmulQueue() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            changed.notify_all();
+            loader.join();
+            runner.join();
+        }
+
+        /**
+         * @brief Queue a matmul
+         *
+         * @param load Loads the inputs on the loader thread, see prepare_matmul
+         * @param run Used instead of load for matmuls that run as a whole on the runner thread
+         *
+         * @return Future of the result
+         */
+        std::future<tensor_result> submit(
+            std::function<_pending_matmul()> load,
+            std::function<tensor_result()> run = nullptr) {
+            _matmul_job job;
+            job.load = std::move(load);
+            job.run = std::move(run);
+            job.waiting_since = std::chrono::steady_clock::now();
+            std::future<tensor_result> result = job.promise.get_future();
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                submitted.push_back(std::move(job));
+            }
+            changed.notify_all();
+            return result;
+        }
+};
+
+/**
+ * @brief Handle of a submitted matmul
+ *
+ * A result that is never taken with get is released when the handle is destroyed,
+ * after waiting for the matmul to finish.
+ */
+class MatmulFuture {
+
+    private:
+
+        std::future<tensor_result> result;
+
+        void discard() {
+            if (!result.valid()) {
+                return;
+            }
+            try {
+                tensor_result r = result.get();
+                release_result(r);
+            } catch (...) {}
+        }
+
+    public:
+
+        MatmulFuture() {}
+
+        explicit MatmulFuture(std::future<tensor_result> result) : result(std::move(result)) {}
+
+        MatmulFuture(MatmulFuture&&) = default;
+
+        MatmulFuture& operator=(MatmulFuture&& other) {
+            if (this != &other) {
+                discard();
+                result = std::move(other.result);
+            }
+            return *this;
+        }
+
+        ~MatmulFuture() {
+            discard();
+        }
+
+        /**
+         * @brief Check if the result was not taken yet
+         */
+        bool valid() const { return result.valid(); }
+
+        /**
+         * @brief Check if the matmul finished, without blocking
+         *
+         * @return true as well when there is no result to wait for (taken or moved from)
+         */
+        bool ready() const {
+            return !result.valid() || result.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }
+
+        /**
+         * @brief Block until the matmul finished, returns right away when there is no result
+         */
+        void wait() const {
+            if (result.valid()) {
+                result.wait();
+            }
+        }
+
+        /**
+         * @brief Block until the matmul finished and take the result
+         *
+         * @return tensor_result, free it with release_result
+         */
+        tensor_result get() {
+            if (!result.valid()) {
+                printf("matmul future: the result was already taken\n");
+                abort();
+            }
+            return result.get();
+        }
+};
+
+/**
+ * @brief Submit a matrix multiplication to the npu without waiting for it
+ *
+ * Takes the same arguments as matmul_npu and runs the way it would, see route_matmul.
+ * The copy of the inputs of a single context matmul runs on a background thread 
+ * and overlaps the npu run of the previously submitted matmul.
+ *
+ * @return Handle of the result, see MatmulFuture
+ *
+ * @note a and b are read after the call returns, keep them alive and unchanged
+ *       until the result is ready
+ */
+MatmulFuture submit_matmul(
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    const void* a,
+    const void* b,
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL
+) {
+    const _matmul_routing routing = route_matmul(num_rows_a, num_cols_a, num_cols_b, type, b, layout);
+
+    // every other route overlaps it's own copies (or runs on the cpu), it runs as a whole
+    if (routing.route != MATMUL_ROUTE_CACHED) {
+        return MatmulFuture(MatmulQueue::instance().submit(nullptr, [=]() {
+            return run_matmul_route(routing, num_rows_a, num_cols_a, num_cols_b, type, a, b, layout);
+        }));
+    }
+    return MatmulFuture(MatmulQueue::instance().submit([=]() {
+        return prepare_matmul(num_rows_a, num_cols_a, num_cols_b, type, a, b, layout);
+    }));
+}
+
+/**
+ * @brief Submit a matrix multiplication with an epilogue without waiting for it
+ *
+ * Takes the same arguments as the epilogue matmul_npu.
+ *
+ * @note The arrays of the epilogue are read after the call returns too
+ */
+MatmulFuture submit_matmul(
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    const void* a,
+    const void* b,
+    const matmul_epilogue& epilogue,
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL
+) {
+    if (layout == MATMUL_LAYOUT_NATIVE) {
+        printf("matmul epilogue: the result must be row major, use MATMUL_LAYOUT_PERF\n");
+        abort();
+    }
+    const _matmul_routing routing = route_matmul(num_rows_a, num_cols_a, num_cols_b, type, b, layout);
+
+    if (routing.route != MATMUL_ROUTE_CACHED) {
+        return MatmulFuture(MatmulQueue::instance().submit(nullptr, [=]() {
+            return run_matmul_route(
+                routing, num_rows_a, num_cols_a, num_cols_b, type, a, b, layout, &epilogue
+            );
+        }));
+    }
+    return MatmulFuture(MatmulQueue::instance().submit([=]() {
+        return prepare_matmul(num_rows_a, num_cols_a, num_cols_b, type, a, b, layout, 0, &epilogue);
+    }));
+}
+
+/**
+ * @brief Submit a multiplication by packed weights without waiting for it
+ *
+ * @note a and the weights are read after the call returns, keep them alive
+ *       until the result is ready
+ */
+MatmulFuture submit_matmul(
+    uint32_t num_rows_a, const void* a, const NpuWeights& weights,
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL) {
+
+    const NpuWeights* w = &weights;
+    // more rows than one context or row major weights that are tiled, see the weights matmul_npu
+    if (needs_tiling(num_rows_a, weights.rows(), weights.cols())) {
+        return MatmulFuture(MatmulQueue::instance().submit(nullptr, [=]() {
+            return matmul_npu(num_rows_a, a, *w, layout);
+        }));
+    }
+    const int16_t b_layout = weights.is_native() ? 1 : 0;
+    return MatmulFuture(MatmulQueue::instance().submit([=]() {
+        return prepare_matmul(num_rows_a, w->rows(), w->cols(), w->type(), a, w->data(), layout, b_layout);
+    }));
+}
+
+/**
+ * @brief Submit a multiplication by packed weights with an epilogue without waiting for it
+ */
+MatmulFuture submit_matmul(
+    uint32_t num_rows_a, const void* a, const NpuWeights& weights,
+    const matmul_epilogue& epilogue, _matmul_layout layout = MATMUL_LAYOUT_NORMAL) {
+
+    if (layout == MATMUL_LAYOUT_NATIVE) {
+        printf("matmul epilogue: the result must be row major, use MATMUL_LAYOUT_PERF\n");
+        abort();
+    }
+    const NpuWeights* w = &weights;
+    if (needs_tiling(num_rows_a, weights.rows(), weights.cols())) {
+        return MatmulFuture(MatmulQueue::instance().submit(nullptr, [=]() {
+            return matmul_npu(num_rows_a, a, *w, layout, &epilogue);
+        }));
+    }
+    const int16_t b_layout = weights.is_native() ? 1 : 0;
+    return MatmulFuture(MatmulQueue::instance().submit([=]() {
+        return prepare_matmul(
+            num_rows_a, w->rows(), w->cols(), w->type(), a, w->data(), layout, b_layout, &epilogue
+        );
+    }));
+}
+
+/**
+ * @brief Typed version of submit_matmul
+ *
+ * @param To - The type of the output matrix
+ * @param Ti1 - The type of the first input matrix (inferred automatically)
+ * @param Ti2 - The type of the second input matrix (inferred automatically)
+ */
+template<typename To, typename Ti1, typename Ti2>
+MatmulFuture submit_matmul(
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    const Ti1* a,
+    const Ti2* b,
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL
+) {
+    return submit_matmul(
+        num_rows_a, num_cols_a, num_cols_b, choose_matmul_type<To, Ti1, Ti2>(), a, b, layout
+    );
+}
+
+/**
+ * @brief Typed version of submit_matmul with an epilogue, see the typed epilogue matmul_npu
+ */
+template<typename To, typename Ti1, typename Ti2>
+MatmulFuture submit_matmul(
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    const Ti1* a,
+    const Ti2* b,
+    const matmul_epilogue& epilogue,
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL
+) {
+    _rknn_matmul_type type;
+    if (!find_widest_matmul_type(tensor_type_of<Ti1>(), tensor_type_of<Ti2>(), &type)) {
+        printf("matmul epilogue: unsupported input types\n");
+        abort();
+    }
+    matmul_epilogue typed = epilogue;
+    typed.output = tensor_type_of<To>();
+    return submit_matmul(num_rows_a, num_cols_a, num_cols_b, type, a, b, typed, layout);
+}
+
+#endif
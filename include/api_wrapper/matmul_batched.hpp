@@ -0,0 +1,232 @@
+#ifndef MATMUL_BATCHED
+#define MATMUL_BATCHED
+
+#include "api_wrapper/matmul_api.hpp"
+#include <future>
+#include <vector>
+
+/**
+ * @brief Runs a batch of same shaped matmuls on two cached plans
+ *
+ * The inputs of item i are copied to one plan while the other plan runs
+ * item i - 1, and the result of every item is read back into it's slice
+ * of a single (batch, M, N) output.
+ *
+ * @param a The data of the first input matrix of every item
+ * @param b The data of the second input matrix of every item
+ * @param b_layout The layout of the B matrices (0 - normal, 1 - native)
+ *
+ * @return tensor_result with the row major (batch, num_rows_a, num_cols_b) result
+ */
+tensor_result run_batched(
+    uint32_t batch,
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    const void* const* a,
+    const void* const* b,
+    int16_t b_layout,
+    _matmul_layout layout
+) {
+    if (batch == 0) {
+        printf("matmul batch must not be empty\n");
+        abort();
+    }
+
+    const int32_t M = num_rows_a, K = num_cols_a, N = num_cols_b;
+    const size_t c_bytes = (size_t) M * N * matmul_type_sizes(type).c;
+
+    tensor_result result = npu_alloc_tensor(batch * c_bytes);
+    uint8_t* c = (uint8_t*) result.resultMatrix->virt_addr;
+
+    if (needs_tiling(M, K, N)) {
+        // a native B always fits in one context, only the rows of A are too many
+        for (uint32_t i = 0; i < batch; i++) {
+            tensor_result item = b_layout ? 
+                row_chunked_matmul(M, K, N, type, a[i], b[i], b_layout, layout) :
+                matmul_npu(M, K, N, type, (void*) a[i], (void*) b[i]);
+            memcpy(c + i * c_bytes, item.resultMatrix->virt_addr, c_bytes);
+            release_result(item);
+        }
+        return result;
+    }
+
+    const int16_t ac_layout = layout == MATMUL_LAYOUT_NORMAL ? 0 : 1;
+    std::shared_ptr<MatmulPlanBase> plans[2];
+    for (int p = 0; p < 2; p++) {
+        plans[p] = MatmulCache::instance().acquire({M, K, N, type, ac_layout, b_layout, RKNN_NPU_CORE_AUTO});
+    }
+    const rknn_matmul_tensor_attr& c_attr = plans[0]->io_attr().C;
+    const int32_t c_group = native_group(&c_attr);
+    const size_t c_elem = tensor_type_size(c_attr.type);
+
+    auto store = [&](uint32_t i, const void* item) {
+        MatmulPhaseTimer timer(MATMUL_PHASE_READBACK, M, K, N);
+        MatmulStats::instance().copied_out(c_bytes);
+        if (ac_layout) {
+            unpack_native(c + i * c_bytes, item, M, N, c_group, c_elem);
+        } else {
+            memcpy(c + i * c_bytes, item, c_bytes);
+        }
+    };
+
+    std::future<void*> running;
+    for (uint32_t i = 0; i < batch; i++) {
+        std::shared_ptr<MatmulPlanBase> plan = plans[i % 2];
+        plan->load(a[i], b[i]);
+
+        if (running.valid()) {
+            store(i - 1, running.get());
+        }
+        running = std::async(std::launch::async, [plan]() {
+            plan->run_bound(plan->result());
+            return plan->result()->virt_addr;
+        });
+    }
+    if (running.valid()) {
+        store(batch - 1, running.get());
+    }
+
+    return result;
+}
+
+/**
+ * @brief Performs a batch of same shaped matrix multiplications on the npu
+ *
+ * Every item is (num_rows_a, num_cols_a) x (num_cols_a, num_cols_b). All the
+ * items run on the same two contexts, and the copy of every item overlaps the
+ * npu run of the previous one. When every item uses the same B and the npu
+ * takes it in the native layout (see native_b_supported) it is packed once
+ * and bound to every run without a copy.
+ *
+ * @param batch The number of items
+ * @param a Pointers to the row major first input matrix of every item
+ * @param b Pointers to the row major second input matrix of every item
+ * @param layout MATMUL_LAYOUT_PERF packs A and unpacks C on the npu side,
+ *               the result is row major with either layout
+ *
+ * @return tensor_result with the row major (batch, num_rows_a, num_cols_b) result,
+ *         free it with release_result
+ */
+tensor_result matmul_npu_batched(
+    uint32_t batch,
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    const void* const* a,
+    const void* const* b,
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL
+) {
+    if (batch == 0) {
+        printf("matmul batch must not be empty\n");
+        abort();
+    }
+
+    bool shared_b = batch > 1;
+    for (uint32_t i = 1; i < batch && shared_b; i++) {
+        shared_b = b[i] == b[0];
+    }
+
+    _npu_mem_entry b_entry = NpuMemoryRegistry::instance().find(b[0]);
+    if (b_entry.mem != nullptr || !shared_b || needs_tiling(num_rows_a, num_cols_a, num_cols_b) ||
+        !native_b_supported(num_cols_a, num_cols_b)) {
+        int16_t b_layout = b_entry.layout == NPU_LAYOUT_NATIVE_B ? 1 : 0;
+        return run_batched(
+            batch, num_rows_a, num_cols_a, num_cols_b, type, a, b, b_layout, layout
+        );
+    }
+
+    NpuWeights weights(num_cols_a, num_cols_b, type, b[0]);
+    std::vector<const void*> packed(batch, weights.data());
+    return run_batched(
+        batch, num_rows_a, num_cols_a, num_cols_b, type, a, packed.data(), 1, layout
+    );
+}
+
+/**
+ * @brief Performs a batch of matrix multiplications on strided (batch, rows, cols) stacks
+ *
+ * @param a The first item of the first input stack
+ * @param stride_a The number of elements between the A of two items, 0 to use one A for all
+ * @param b The first item of the second input stack
+ * @param stride_b The number of elements between the B of two items, 0 to use one B for all
+ *
+ * @return tensor_result with the row major (batch, num_rows_a, num_cols_b) result,
+ *         free it with release_result
+ */
+tensor_result matmul_npu_batched(
+    uint32_t batch,
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    const void* a,
+    int64_t stride_a,
+    const void* b,
+    int64_t stride_b,
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL
+) {
+    const _matmul_type_sizes sizes = matmul_type_sizes(type);
+    std::vector<const void*> a_items(batch), b_items(batch);
+    for (uint32_t i = 0; i < batch; i++) {
+        a_items[i] = (const uint8_t*) a + i * stride_a * sizes.a;
+        b_items[i] = (const uint8_t*) b + i * stride_b * sizes.b;
+    }
+    return matmul_npu_batched(
+        batch, num_rows_a, num_cols_a, num_cols_b, type, a_items.data(), b_items.data(), layout
+    );
+}
+
+/**
+ * @brief Performs a batch of multiplications by the same packed weights
+ *
+ * @param a The first item of the (batch, num_rows_a, weights.rows()) input stack
+ * @param stride_a The number of elements between the A of two items
+ *
+ * @return tensor_result with the row major (batch, num_rows_a, weights.cols()) result,
+ *         free it with release_result
+ */
+tensor_result matmul_npu_batched(
+    uint32_t batch, uint32_t num_rows_a, const void* a, int64_t stride_a,
+    const NpuWeights& weights, _matmul_layout layout = MATMUL_LAYOUT_NORMAL) {
+
+    const _matmul_type_sizes sizes = matmul_type_sizes(weights.type());
+    std::vector<const void*> a_items(batch), b_items(batch, weights.data());
+    for (uint32_t i = 0; i < batch; i++) {
+        a_items[i] = (const uint8_t*) a + i * stride_a * sizes.a;
+    }
+
+    return run_batched(
+        batch, num_rows_a, weights.rows(), weights.cols(), weights.type(),
+        a_items.data(), b_items.data(), weights.is_native() ? 1 : 0, layout
+    );
+}
+
+/**
+ * @brief Typed version of the strided matmul_npu_batched
+ *
+ * @param To - The type of the output matrix
+ * @param Ti1 - The type of the first input matrix (inferred automatically)
+ * @param Ti2 - The type of the second input matrix (inferred automatically)
+ */
+template<typename To, typename Ti1, typename Ti2>
+tensor_result matmul_npu_batched(
+    uint32_t batch,
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    const Ti1* a,
+    int64_t stride_a,
+    const Ti2* b,
+    int64_t stride_b,
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL
+) {
+    return matmul_npu_batched(
+        batch, num_rows_a, num_cols_a, num_cols_b, choose_matmul_type<To, Ti1, Ti2>(),
+        (const void*) a, stride_a, (const void*) b, stride_b, layout
+    );
+}
+
+#endif
@@ -0,0 +1,441 @@
+#ifndef MATMUL_CACHE
+#define MATMUL_CACHE
+
+#include "api_wrapper/matmul_plan.hpp"
+#include "api_wrapper/matmul_epilogue.hpp"
+#include "api_wrapper/matmul_tuning.hpp"
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Key of a cached matmul plan
+ * 
+ * @param core_mask The npu cores the plan is pinned to, RKNN_NPU_CORE_AUTO when left out
+ */
+struct _plan_key {
+    int32_t M;
+    int32_t K;
+    int32_t N;
+    _rknn_matmul_type type;
+    int16_t AC_layout;
+    int16_t B_layout;
+    rknn_core_mask core_mask;
+
+    bool operator==(const _plan_key& other) const {
+        return M == other.M && K == other.K && N == other.N && type == other.type &&
+            AC_layout == other.AC_layout && B_layout == other.B_layout &&
+            core_mask == other.core_mask;
+    }
+};
+
+struct _plan_key_hash {
+    size_t operator()(const _plan_key& key) const {
+        size_t h = std::hash<int32_t>()(key.M);
+        h = h * 31 + std::hash<int32_t>()(key.K);
+        h = h * 31 + std::hash<int32_t>()(key.N);
+        h = h * 31 + std::hash<int32_t>()((int32_t) key.type);
+        h = h * 31 + std::hash<int32_t>()((key.AC_layout << 16) | key.B_layout);
+        h = h * 31 + std::hash<int32_t>()((int32_t) key.core_mask);
+        return h;
+    }
+};
+
+/**
+ * Counters of the plan cache
+ *
+ * @param contexts The number of idle contexts retained by the cache
+ * @param bytes The npu memory held by the retained contexts
+ */
+struct matmul_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t contexts;
+    uint64_t bytes;
+};
+
+/**
+ * @brief Process wide LRU cache of matmul plans keyed on (M, K, N, type, layout)
+ *
+ * A plan is handed out exclusively by acquire and goes back to the cache when
+ * the returned pointer is dropped, so several threads asking for the same shape
+ * get different contexts. The lookup only takes a shared lock on the map and
+ * a short per shape lock, the map is locked exclusively only to insert or evict.
+ */
+class MatmulCache {
+
+    private:
+
+        struct _slot {
+            std::mutex lock;
+            std::vector<std::unique_ptr<MatmulPlanBase>> idle;
+            std::atomic<uint64_t> last_used{0};
+        };
+
+        std::shared_mutex map_lock;
+        std::unordered_map<_plan_key, std::shared_ptr<_slot>, _plan_key_hash> slots;
+
+        std::atomic<uint64_t> clock{0};
+        std::atomic<uint64_t> hits{0};
+        std::atomic<uint64_t> misses{0};
+        std::atomic<uint64_t> evictions{0};
+        std::atomic<uint64_t> contexts{0};
+        std::atomic<uint64_t> bytes{0};
+
+        std::atomic<size_t> max_contexts{32};
+        std::atomic<size_t> max_bytes{(size_t) 512 << 20};
+
+        std::shared_ptr<_slot> find_slot(const _plan_key& key) {
+            std::shared_lock<std::shared_mutex> read(map_lock);
+            auto it = slots.find(key);
+            return it == slots.end() ? nullptr : it->second;
+        }
+
+        void push_idle(_slot& slot, std::unique_ptr<MatmulPlanBase>& plan) {
+            std::lock_guard<std::mutex> guard(slot.lock);
+            contexts += 1;
+            bytes += plan->bytes();
+            slot.idle.push_back(std::move(plan));
+            slot.last_used.store(++clock, std::memory_order_relaxed);
+        }
+
+        void release(const _plan_key& key, MatmulPlanBase* plan) {
+            std::unique_ptr<MatmulPlanBase> owned(plan);
+            size_t plan_bytes = plan->bytes();
+
+            if (max_contexts.load() == 0 || plan_bytes > max_bytes.load()) {
+                return;
+            }
+
+            /* push under the map lock so trim can not erase the slot in between */
+            {
+                std::shared_lock<std::shared_mutex> read(map_lock);
+                auto it = slots.find(key);
+                if (it != slots.end()) {
+                    push_idle(*it->second, owned);
+                }
+            }
+            if (owned) {
+                std::unique_lock<std::shared_mutex> write(map_lock);
+                std::shared_ptr<_slot>& entry = slots[key];
+                if (!entry) {
+                    entry = std::make_shared<_slot>();
+                }
+                push_idle(*entry, owned);
+            }
+
+            trim(max_contexts.load(), max_bytes.load());
+        }
+
+        /**
+         * @brief Evict least recently used idle plans until the limits are met
+         */
+        void trim(size_t context_limit, size_t byte_limit) {
+            while (contexts.load() > context_limit || bytes.load() > byte_limit) {
+                std::unique_ptr<MatmulPlanBase> victim;
+                {
+                    std::unique_lock<std::shared_mutex> write(map_lock);
+                    auto oldest = slots.end();
+                    for (auto it = slots.begin(); it != slots.end(); ++it) {
+                        if (oldest == slots.end() ||
+                            it->second->last_used.load() < oldest->second->last_used.load()) {
+                            oldest = it;
+                        }
+                    }
+                    if (oldest == slots.end()) {
+                        return;
+                    }
+                    std::shared_ptr<_slot> slot = oldest->second;
+                    bool drained;
+                    {
+                        std::lock_guard<std::mutex> guard(slot->lock);
+                        if (!slot->idle.empty()) {
+                            victim = std::move(slot->idle.front());
+                            slot->idle.erase(slot->idle.begin());
+                            contexts -= 1;
+                            bytes -= victim->bytes();
+                            evictions += 1;
+                        }
+                        drained = slot->idle.empty();
+                    }
+                    /* erased after the slot lock is released, the slot may be freed with it */
+                    if (drained) {
+                        slots.erase(oldest);
+                    }
+                }
+            }
+        }
+
+    public:
+
+        MatmulCache() = default;
+        MatmulCache(const MatmulCache&) = delete;
+        MatmulCache& operator=(const MatmulCache&) = delete;
+
+        /**
+         * @brief The cache used by matmul_npu, Matrix::matmul and MatNpu::matmul
+         *
+         * @note Intentionally never destroyed, results may outlive static destructors
+         */
+        static MatmulCache& instance() {
+            static MatmulCache* cache = new MatmulCache();
+            return *cache;
+        }
+
+        /**
+         * @brief Get an idle plan for the key, creating one on a miss
+         *
+         * @return The plan, returned to the cache when the last reference is dropped
+         */
+        std::shared_ptr<MatmulPlanBase> acquire(const _plan_key& key) {
+            MatmulPlanBase* plan = nullptr;
+
+            std::shared_ptr<_slot> slot = find_slot(key);
+            if (slot) {
+                std::lock_guard<std::mutex> guard(slot->lock);
+                if (!slot->idle.empty()) {
+                    plan = slot->idle.back().release();
+                    slot->idle.pop_back();
+                    slot->last_used.store(++clock, std::memory_order_relaxed);
+                    contexts -= 1;
+                    bytes -= plan->bytes();
+                }
+            }
+
+            if (plan != nullptr) {
+                hits += 1;
+            } else {
+                misses += 1;
+                plan = new MatmulPlanBase(
+                    key.M, key.K, key.N, key.type, key.AC_layout, key.B_layout, key.core_mask
+                );
+            }
+
+            return std::shared_ptr<MatmulPlanBase>(
+                plan, [this, key](MatmulPlanBase* p) { release(key, p); }
+            );
+        }
+
+        /**
+         * @brief Check if acquire would be served without creating a context
+         */
+        bool has_idle(const _plan_key& key) {
+            std::shared_ptr<_slot> slot = find_slot(key);
+            if (!slot) {
+                return false;
+            }
+            std::lock_guard<std::mutex> guard(slot->lock);
+            return !slot->idle.empty();
+        }
+
+        /**
+         * @brief Set the capacity of the cache, evicting plans above it
+         *
+         * @param context_limit The maximum number of idle contexts, 0 disables the cache
+         * @param byte_limit The maximum npu memory held by idle contexts
+         */
+        void configure(size_t context_limit, size_t byte_limit) {
+            max_contexts = context_limit;
+            max_bytes = byte_limit;
+            trim(context_limit, byte_limit);
+        }
+
+        /**
+         * @brief Drop all the idle plans
+         */
+        void clear() {
+            trim(0, 0);
+        }
+
+        matmul_cache_stats stats() const {
+            return {
+                hits.load(), misses.load(), evictions.load(),
+                contexts.load(), bytes.load()
+            };
+        }
+};
+
+/**
+ * A matmul whose inputs are on the npu and that is ready to run
+ *
+ * @param plan The plan the inputs were loaded into, held until the run
+ * @param c The result tensor, nullptr when the result is read from the plan's own C
+ * @param epilogue Applied while C is read, when fused is set
+ */
+struct _pending_matmul {
+    std::shared_ptr<MatmulPlanBase> plan;
+    rknn_tensor_mem* c = nullptr;
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL;
+    matmul_epilogue epilogue;
+    bool fused = false;
+};
+
+/**
+ * @brief Take a plan from the cache and load the inputs of a matmul into it
+ *
+ * @param layout The layout of matrices A and C, see _matmul_layout
+ * @param b_layout The layout of matrix B (0 - normal, 1 - native)
+ * @param epilogue Applied while C is read, nullptr for none, C must not be native
+ *
+ * @return The loaded matmul, run it with finish_matmul
+ *
+ * @note Normal layout matmuls follow the layouts in the MatmulTuningDatabase
+ */
+_pending_matmul prepare_matmul(
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    const void* a,
+    const void* b,
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL,
+    int16_t b_layout = 0,
+    const matmul_epilogue* epilogue = nullptr
+) {
+    // row major matmuls run in the layouts tuned for their shape
+    tuned_config tuned;
+    if (layout == MATMUL_LAYOUT_NORMAL && b_layout == 0 &&
+        MatmulTuningDatabase::instance().find(num_rows_a, num_cols_a, num_cols_b, type, tuned)) {
+        layout = tuned.ac_layout ? MATMUL_LAYOUT_PERF : MATMUL_LAYOUT_NORMAL;
+        b_layout = tuned.b_layout;
+    }
+
+    int16_t ac_layout = layout == MATMUL_LAYOUT_NORMAL ? 0 : 1;
+    _plan_key key = {
+        (int32_t) num_rows_a, (int32_t) num_cols_a, (int32_t) num_cols_b, type, 
+        ac_layout, b_layout, RKNN_NPU_CORE_AUTO
+    };
+    _pending_matmul pending;
+    pending.plan = MatmulCache::instance().acquire(key);
+    pending.layout = layout;
+    if (epilogue != nullptr) {
+        pending.epilogue = *epilogue;
+        pending.fused = true;
+    }
+
+    // the performance layout reads back from the plan's own C tensor
+    if (layout != MATMUL_LAYOUT_PERF) {
+        pending.c = NpuMemoryPool::instance().acquire(
+            pending.plan->context(), pending.plan->io_attr().C.size
+        );
+    }
+    pending.plan->load(a, b);
+    return pending;
+}
+
+/**
+ * @brief Run a matmul loaded by prepare_matmul and read C into a row major destination
+ *
+ * Reading C out of npu memory is the only pass over it, the unpack of a native C
+ * and the epilogue of the matmul happen in that pass.
+ *
+ * @param dst The (M, N) row major destination, of the epilogue's output type
+ */
+void finish_matmul_into(_pending_matmul& pending, void* dst) {
+    std::shared_ptr<MatmulPlanBase> plan = std::move(pending.plan);
+    const rknn_matmul_info& info = plan->info();
+    const rknn_matmul_tensor_attr& c_attr = plan->io_attr().C;
+    const size_t elem_size = tensor_type_size(c_attr.type);
+    const int32_t group = info.AC_layout ? native_group(&c_attr) : 0;
+
+    // the performance layout reads back from the plan's own C tensor
+    rknn_tensor_mem* c = pending.layout == MATMUL_LAYOUT_PERF ? plan->result() : pending.c;
+    plan->run_bound(c);
+
+    {
+        MatmulPhaseTimer timer(MATMUL_PHASE_READBACK, info.M, info.K, info.N);
+        if (pending.fused) {
+            epilogue_block(
+                dst, info.N, c->virt_addr, c_attr.type, group ? info.M : info.N, group, 
+                info.M, info.N, pending.epilogue
+            );
+        } else if (group) {
+            unpack_native(dst, c->virt_addr, info.M, info.N, group, elem_size);
+        } else {
+            memcpy(dst, c->virt_addr, (size_t) info.M * info.N * elem_size);
+        }
+        MatmulStats::instance().copied_out((size_t) info.M * info.N * elem_size);
+    }
+
+    if (c != plan->result()) {
+        NpuMemoryPool::instance().release(plan->context(), pending.c);
+    }
+}
+
+/**
+ * @brief Run a matmul loaded by prepare_matmul and return the plan to the cache
+ *
+ * @return tensor_result owning the result tensor and keeping the context alive
+ */
+tensor_result finish_matmul(_pending_matmul& pending) {
+    const rknn_matmul_info& info = pending.plan->info();
+    const rknn_tensor_type c_type = pending.plan->io_attr().C.type;
+    const size_t elem_size = tensor_type_size(c_type);
+    const size_t out_size = pending.fused ? 
+        tensor_type_size(epilogue_output_type(pending.epilogue, c_type)) : elem_size;
+
+    // a row major C of the output size is read in place, it stays on the npu without a copy
+    if (pending.layout == MATMUL_LAYOUT_PERF || out_size != elem_size) {
+        tensor_result result = npu_alloc_tensor((size_t) info.M * info.N * out_size);
+        finish_matmul_into(pending, result.resultMatrix->virt_addr);
+        return result;
+    }
+
+    std::shared_ptr<MatmulPlanBase> plan = std::move(pending.plan);
+    const rknn_matmul_tensor_attr& c_attr = plan->io_attr().C;
+    plan->run_bound(pending.c);
+
+    if (pending.fused) {
+        MatmulPhaseTimer timer(MATMUL_PHASE_READBACK, info.M, info.K, info.N);
+        epilogue_block(
+            pending.c->virt_addr, info.N, pending.c->virt_addr, c_type, info.N, 0, 
+            info.M, info.N, pending.epilogue
+        );
+        MatmulStats::instance().copied_out((size_t) info.M * info.N * elem_size);
+    }
+
+    // the result can be fed to the next matmul without a copy
+    if (info.AC_layout) {
+        NpuMemoryRegistry::instance().add(
+            plan->context(), pending.c, NPU_LAYOUT_NATIVE_AC, native_group(&c_attr)
+        );
+    } else {
+        NpuMemoryRegistry::instance().add(plan->context(), pending.c);
+    }
+
+    return tensor_result(plan->context(), pending.c, plan->keep_alive());
+}
+
+/**
+ * @brief Run a matmul through the plan cache
+ *
+ * The result is written to a tensor created for this call, so it stays
+ * valid while the plan is reused by later calls.
+ *
+ * @param layout The layout of matrices A and C, see _matmul_layout
+ * @param b_layout The layout of matrix B (0 - normal, 1 - native)
+ * @param epilogue Applied while C is read, nullptr for none
+ * 
+ * @return tensor_result owning the result tensor and keeping the context alive
+ */
+tensor_result cached_matmul(
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    const void* a,
+    const void* b,
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL,
+    int16_t b_layout = 0,
+    const matmul_epilogue* epilogue = nullptr
+) {
+    _pending_matmul pending = prepare_matmul(
+        num_rows_a, num_cols_a, num_cols_b, type, a, b, layout, b_layout, epilogue
+    );
+    return finish_matmul(pending);
+}
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef MATMUL_CHAIN
+#define MATMUL_CHAIN
+
+#include "api_wrapper/matmul_api.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+/**
+ * A matrix of a matmul chain
+ *
+ * @param type The element type, RKNN_TENSOR_FLOAT16 or RKNN_TENSOR_INT8
+ * @param data The row major data, or npu memory made by a previous matmul
+ */
+struct chain_operand {
+    int32_t rows;
+    int32_t cols;
+    rknn_tensor_type type;
+    const void* data;
+};
+
+/**
+ * @brief The type of an intermediate product, it has to be an input type of the next matmul
+ */
+rknn_tensor_type chain_product_type(rknn_tensor_type a, rknn_tensor_type b) {
+    return a == RKNN_TENSOR_INT8 && b == RKNN_TENSOR_INT8 ? RKNN_TENSOR_INT8 : RKNN_TENSOR_FLOAT16;
+}
+
+/**
+ * The multiplication order of a matmul chain
+ *
+ * @param split split[i][j] is the last operand of the left factor of the product of operands i..j
+ * @param types types[i][j] is the element type of the product of operands i..j
+ * @param macs The multiply-accumulates of the whole chain, -1 when no order has valid types
+ */
+struct matmul_chain_order {
+    std::vector<std::vector<int32_t>> split;
+    std::vector<std::vector<rknn_tensor_type>> types;
+    int64_t macs;
+
+    /**
+     * @brief The order as a parenthesized expression, e.g. "(0 (1 2))"
+     */
+    std::string describe(int32_t i, int32_t j) const {
+        if (i == j) {
+            return std::to_string(i);
+        }
+        int32_t k = split[i][j];
+        return "(" + describe(i, k) + " " + describe(k + 1, j) + ")";
+    }
+};
+
+/**
+ * @brief Choose the multiplication order with the fewest multiply-accumulates
+ *
+ * The matrix chain dynamic program, restricted to orders where every product
+ * is a matmul the npu has: intermediates keep the narrow type (float16 or int8)
+ * so they can be bound as the input of the next matmul, only the final
+ * product has output_type. int8 intermediates are requantized, see evaluate_chain.
+ *
+ * @param operands The matrices, the columns of every one must match the rows of the next
+ * @param output_type The element type of the result
+ */
+matmul_chain_order order_matmul_chain(
+    const std::vector<chain_operand>& operands, rknn_tensor_type output_type) {
+
+    const int32_t n = operands.size();
+    for (int32_t i = 0; i + 1 < n; i++) {
+        if (operands[i].cols != operands[i + 1].rows) {
+            printf("matmul chain shape mismatch! operand %d cols=%d operand %d rows=%d\n",
+                i, operands[i].cols, i + 1, operands[i + 1].rows);
+            abort();
+        }
+    }
+
+    const int64_t invalid = -1;
+    std::vector<std::vector<int64_t>> cost(n, std::vector<int64_t>(n, invalid));
+    matmul_chain_order order;
+    order.split.assign(n, std::vector<int32_t>(n, -1));
+    order.types.assign(n, std::vector<rknn_tensor_type>(n, RKNN_TENSOR_FLOAT16));
+
+    for (int32_t i = 0; i < n; i++) {
+        cost[i][i] = 0;
+        order.types[i][i] = operands[i].type;
+    }
+
+    for (int32_t length = 2; length <= n; length++) {
+        for (int32_t i = 0; i + length - 1 < n; i++) {
+            const int32_t j = i + length - 1;
+            const bool last = i == 0 && j == n - 1;
+            for (int32_t k = i; k < j; k++) {
+                if (cost[i][k] < 0 || cost[k + 1][j] < 0) {
+                    continue;
+                }
+                rknn_tensor_type a = order.types[i][k], b = order.types[k + 1][j];
+                rknn_tensor_type c = last ? output_type : chain_product_type(a, b);
+                if (matmul_type_index(a, b, c) < 0) {
+                    continue;
+                }
+                int64_t total = cost[i][k] + cost[k + 1][j] +
+                    (int64_t) operands[i].rows * operands[k].cols * operands[j].cols;
+                if (cost[i][j] < 0 || total < cost[i][j]) {
+                    cost[i][j] = total;
+                    order.split[i][j] = k;
+                    order.types[i][j] = c;
+                }
+            }
+        }
+    }
+
+    order.macs = n > 0 ? cost[0][n - 1] : invalid;
+    return order;
+}
+
+/**
+ * @brief Check if a matmul runs on a single cached plan that binds it's inputs
+ *
+ * Tiled and multi core matmuls read their inputs as row major host data.
+ */
+bool chain_step_binds(int32_t M, int32_t K, int32_t N) {
+    const multicore_config& multicore = matmul_multicore_config();
+    return !needs_tiling(M, K, N) && 
+        !(multicore.enabled && (int64_t) M * K * N >= multicore.min_macs);
+}
+
+/**
+ * @brief Requantize an int32 product of int8 factors to int8 for the next matmul
+ *
+ * A product that fits in int8 is copied as it is, a larger one is scaled so it's
+ * largest magnitude becomes 127 and the scale is multiplied by the inverse factor.
+ *
+ * @param product The (rows, cols) row major int32 product, it is released
+ * @param scale The scale of the product, the chain value is scale * product
+ *
+ * @return tensor_result with the int8 product, free it with release_result
+ */
+tensor_result requantize_chain_product(
+    tensor_result product, int32_t rows, int32_t cols, float& scale) {
+
+    const int32_t* c = (const int32_t*) product.resultMatrix->virt_addr;
+    const int64_t size = (int64_t) rows * cols;
+    int64_t max_abs = 0;
+    #pragma omp parallel for reduction(max: max_abs)
+    for (int64_t i = 0; i < size; i++) {
+        max_abs = std::max(max_abs, (int64_t) std::abs((int64_t) c[i]));
+    }
+
+    matmul_epilogue requantize;
+    requantize.output = RKNN_TENSOR_INT8;
+    if (max_abs > 127) {
+        requantize.alpha = 127.0f / max_abs;
+        scale *= max_abs / 127.0f;
+    }
+    return apply_epilogue(product, rows, cols, RKNN_TENSOR_INT32, requantize);
+}
+
+/**
+ * @brief Evaluate the product of operands i..j in the chosen order
+ *
+ * A left factor is produced in the A layout of the matmul that consumes it
+ * and a right factor in the normal B layout, so every intermediate goes from
+ * the C tensor of one plan to the input of the next one without a copy.
+ *
+ * An int8 x int8 intermediate is accumulated in int32 and requantized to int8
+ * with a per tensor scale instead of saturating, see requantize_chain_product,
+ * and the final product is multiplied by the scales of it's factors.
+ *
+ * @param holder Owns the product, empty when the product is a single operand
+ * @param scale Set to the scale of the product, the chain value is scale * product
+ */
+const void* evaluate_chain(
+    const std::vector<chain_operand>& operands, const matmul_chain_order& order,
+    int32_t i, int32_t j, _matmul_layout layout, NpuTensor& holder, float& scale) {
+
+    scale = 1.0f;
+    if (i == j) {
+        return operands[i].data;
+    }
+
+    const int32_t k = order.split[i][j];
+    const bool last = i == 0 && j == (int32_t) operands.size() - 1;
+    NpuTensor left, right;
+    float left_scale, right_scale;
+    const int32_t M = operands[i].rows, K = operands[k].cols, N = operands[j].cols;
+    const _matmul_layout a_layout = layout != MATMUL_LAYOUT_NORMAL && chain_step_binds(M, K, N) ?
+        MATMUL_LAYOUT_NATIVE : MATMUL_LAYOUT_NORMAL;
+    const void* a = evaluate_chain(operands, order, i, k, a_layout, left, left_scale);
+    const void* b = evaluate_chain(operands, order, k + 1, j, MATMUL_LAYOUT_NORMAL, right, right_scale);
+    scale = left_scale * right_scale;
+
+    // the order only has products that are in the table
+    _rknn_matmul_type type = RKNN_FLOAT16_MM_FLOAT16_TO_FLOAT16;
+    find_matmul_type(order.types[i][k], order.types[k + 1][j], order.types[i][j], &type);
+    const _matmul_type_entry& entry = matmul_type_entry(type);
+    const bool int8_product = entry.a == RKNN_TENSOR_INT8 && entry.b == RKNN_TENSOR_INT8;
+
+    if (last && scale != 1.0f) {
+        // the epilogue applies the scales while C is read, it needs a row major C
+        find_widest_matmul_type(entry.a, entry.b, &type);
+        matmul_epilogue rescale;
+        rescale.alpha = scale;
+        rescale.output = entry.c;
+        holder = NpuTensor(matmul_npu(
+            M, K, N, type, (void*) a, (void*) b, rescale,
+            layout == MATMUL_LAYOUT_NORMAL ? MATMUL_LAYOUT_NORMAL : MATMUL_LAYOUT_PERF
+        ));
+        scale = 1.0f;
+    } else if (!last && int8_product) {
+        holder = NpuTensor(requantize_chain_product(
+            matmul_npu(M, K, N, RKNN_INT8_MM_INT8_TO_INT32, (void*) a, (void*) b), M, N, scale
+        ));
+    } else {
+        holder = NpuTensor(matmul_npu(M, K, N, type, (void*) a, (void*) b, layout));
+    }
+    return holder.data();
+}
+
+/**
+ * @brief Multiply a chain of matrices on the npu, in the order with the fewest operations
+ *
+ * @param operands The matrices, at least two
+ * @param output_type The element type of the result, the type of the last matmul's output
+ * @param layout The layout of the result, see _matmul_layout, with MATMUL_LAYOUT_PERF
+ *               (or MATMUL_LAYOUT_NATIVE) the intermediates are kept in the native layout
+ *
+ * @note An int8 chain of more than two matrices requantizes it's intermediates,
+ *       the result is then scaled back and row major even with MATMUL_LAYOUT_NATIVE
+ *
+ * @return tensor_result with the (operands.front().rows, operands.back().cols) result,
+ *         free it with release_result
+ */
+tensor_result matmul_chain(
+    const std::vector<chain_operand>& operands, rknn_tensor_type output_type,
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL) {
+
+    if (operands.size() < 2) {
+        printf("matmul chain needs at least two matrices\n");
+        abort();
+    }
+
+    matmul_chain_order order = order_matmul_chain(operands, output_type);
+    if (order.macs < 0) {
+        printf("matmul chain has no order the npu supports for these types\n");
+        abort();
+    }
+
+    NpuTensor result;
+    float scale;
+    evaluate_chain(operands, order, 0, operands.size() - 1, layout, result, scale);
+    return result.release();
+}
+
+#endif
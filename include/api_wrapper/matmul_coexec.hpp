@@ -0,0 +1,214 @@
+#ifndef MATMUL_COEXEC
+#define MATMUL_COEXEC
+
+#include "api_wrapper/matmul_multicore.hpp"
+#include "api_wrapper/matmul_dispatch.hpp"
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+/**
+ * How a matmul is split between the cpu and the npu
+ *
+ * The shares are indexed by dispatch_class (0 - float16 inputs, 1 - int8 inputs).
+ *
+ * @param enabled Let matmul_npu split matmuls of at least min_macs multiply-accumulates
+ * @param cpu_share The share of the rows of C computed on the cpu, the rest run on the npu
+ * @param adaptive Move cpu_share after every split matmul so both sides finish together
+ */
+struct coexec_config {
+    bool enabled;
+    float cpu_share[2];
+    bool adaptive;
+    int64_t min_macs;
+};
+
+/**
+ * @brief The process wide cpu / npu split used by matmul_npu
+ */
+coexec_config& matmul_coexec_config() {
+    static coexec_config config = {false, {0.1f, 0.05f}, true, (int64_t) 1 << 24};
+    return config;
+}
+
+/**
+ * The granularity of the cpu / npu split in rows of C
+ *
+ * The npu part of a shape then takes one of a few sizes, whose plans stay in the
+ * MatmulCache, instead of a new context for every share the adaptation moves to.
+ */
+constexpr int32_t COEXEC_ROW_GRANULARITY = 64;
+
+/**
+ * @brief The number of rows of C the cpu computes, the npu computes the rows after them
+ *
+ * Rounded to COEXEC_ROW_GRANULARITY, each side gets at least one granule when
+ * M holds two of them and the share is not 0 or 1.
+ */
+int32_t coexec_cpu_rows(int32_t M, float share) {
+    const int32_t g = COEXEC_ROW_GRANULARITY;
+    if (share <= 0.0f) {
+        return 0;
+    }
+    if (share >= 1.0f) {
+        return M;
+    }
+    if (M < 2 * g) {
+        return 0;
+    }
+    const int32_t rows = (int32_t) (M * share / g + 0.5f) * g;
+    return std::max(g, std::min((M - g) / g * g, rows));
+}
+
+/**
+ * @brief The lock of the cpu shares, they are moved by update_coexec_share while
+ *        other threads run matmuls
+ */
+std::mutex& coexec_share_lock() {
+    static std::mutex* lock = new std::mutex();
+    return *lock;
+}
+
+/**
+ * @brief Read the cpu share of a dispatch class
+ */
+float coexec_share(const coexec_config& config, int32_t cls) {
+    std::lock_guard<std::mutex> guard(coexec_share_lock());
+    return config.cpu_share[cls];
+}
+
+/**
+ * @brief Set the cpu share of a dispatch class
+ */
+void set_coexec_share(coexec_config& config, int32_t cls, float share) {
+    std::lock_guard<std::mutex> guard(coexec_share_lock());
+    config.cpu_share[cls] = share;
+}
+
+/**
+ * @brief Move the cpu share towards the split where both sides take the same time
+ *
+ * @param cpu_us, npu_us The measured time of each side
+ */
+void update_coexec_share(
+    coexec_config& config, int32_t cls, int32_t cpu_rows, double cpu_us, int32_t npu_rows, double npu_us) {
+    const double cpu_rate = cpu_rows / std::max(1.0, cpu_us);
+    const double npu_rate = npu_rows / std::max(1.0, npu_us);
+    const float balanced = (float) (cpu_rate / (cpu_rate + npu_rate));
+
+    // smoothed against the noise of a single run, and kept away from 0 and 1
+    // so both sides are still measured by the next run
+    std::lock_guard<std::mutex> guard(coexec_share_lock());
+    const float share = 0.5f * config.cpu_share[cls] + 0.5f * balanced;
+    config.cpu_share[cls] = std::max(1.0f / 64, std::min(63.0f / 64, share));
+}
+
+/**
+ * @brief Performs one matmul on the cpu and the npu at once
+ *
+ * The first rows of C are computed by the cpu gemm on the calling thread,
+ * while a second thread runs the rest on the npu (tiled or split between the
+ * npu cores when matmul_npu would do so). Both write their rows of the single
+ * contiguous result.
+ *
+ * @param config The share of the cpu, updated with the measured times when adaptive
+ * @param epilogue Applied while the npu rows are read and after the cpu gemm, nullptr for none
+ *
+ * @return tensor_result with the row major (num_rows_a, num_cols_b) result
+ */
+tensor_result coexec_matmul(
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    const void* a,
+    const void* b,
+    coexec_config& config = matmul_coexec_config(),
+    const matmul_epilogue* epilogue = nullptr
+) {
+    using clock = std::chrono::steady_clock;
+    const int32_t M = num_rows_a, K = num_cols_a, N = num_cols_b;
+    const _matmul_type_sizes sizes = matmul_type_sizes(type);
+    const int32_t cls = dispatch_class(type);
+
+    NpuTensor a_normal, b_normal;
+    a = normal_input(a, M, K, sizes.a, a_normal);
+    b = normal_input(b, K, N, sizes.b, b_normal);
+
+    const rknn_tensor_type c_type = matmul_type_entry(type).c;
+    const size_t out_size = tensor_type_size(matmul_output_type(type, epilogue));
+    tensor_result result = npu_alloc_tensor((size_t) M * N * out_size);
+    uint8_t* c = (uint8_t*) result.resultMatrix->virt_addr;
+
+    const int32_t cpu_rows = coexec_cpu_rows(M, coexec_share(config, cls));
+    const int32_t npu_rows = M - cpu_rows;
+    const uint8_t* npu_a = (const uint8_t*) a + (size_t) cpu_rows * K * sizes.a;
+    uint8_t* npu_c = c + (size_t) cpu_rows * N * out_size;
+    double npu_us = 0;
+
+    matmul_epilogue npu_epilogue;
+    if (epilogue != nullptr) {
+        npu_epilogue = offset_epilogue(*epilogue, cpu_rows, 0);
+    }
+    const matmul_epilogue* npu_fused = epilogue != nullptr ? &npu_epilogue : nullptr;
+
+    // npu_us starts once the contexts exist, creating one is not part of the rate
+    auto run_npu = [&]() {
+        const multicore_config& multicore = matmul_multicore_config();
+        if (needs_tiling(npu_rows, K, N) ||
+            (multicore.enabled && (int64_t) npu_rows * K * N >= multicore.min_macs)) {
+            // both write their rows of C in place, there is no part to copy
+            clock::time_point start = clock::now();
+            if (needs_tiling(npu_rows, K, N)) {
+                tiled_matmul_into(npu_rows, K, N, type, npu_a, b, npu_c, matmul_shape_limits(), npu_fused);
+            } else {
+                multicore_matmul_into(npu_rows, K, N, type, npu_a, b, npu_c, multicore, npu_fused);
+            }
+            npu_us = std::chrono::duration<double, std::micro>(clock::now() - start).count();
+        } else {
+            std::shared_ptr<MatmulPlanBase> plan = MatmulCache::instance().acquire(
+                {npu_rows, K, N, type, 0, 0, RKNN_NPU_CORE_AUTO}
+            );
+            clock::time_point start = clock::now();
+            const void* part = plan->run(npu_a, b);
+            {
+                MatmulPhaseTimer timer(MATMUL_PHASE_READBACK, npu_rows, K, N);
+                if (npu_fused != nullptr) {
+                    epilogue_block(npu_c, N, part, c_type, N, 0, npu_rows, N, *npu_fused);
+                } else {
+                    memcpy(npu_c, part, (size_t) npu_rows * N * sizes.c);
+                }
+                MatmulStats::instance().copied_out((size_t) npu_rows * N * sizes.c);
+            }
+            npu_us = std::chrono::duration<double, std::micro>(clock::now() - start).count();
+        }
+    };
+
+    std::thread npu_worker;
+    if (npu_rows > 0) {
+        npu_worker = std::thread(run_npu);
+    }
+
+    clock::time_point start = clock::now();
+    if (cpu_rows > 0 && epilogue != nullptr) {
+        // the cpu gemm has no epilogue of it's own, it's rows take a second pass
+        std::unique_ptr<uint8_t[]> cpu_c(new uint8_t[(size_t) cpu_rows * N * sizes.c]);
+        cpu_matmul(cpu_rows, K, N, type, a, K, b, N, cpu_c.get(), N);
+        epilogue_block(c, N, cpu_c.get(), c_type, N, 0, cpu_rows, N, *epilogue);
+    } else if (cpu_rows > 0) {
+        cpu_matmul(cpu_rows, K, N, type, a, K, b, N, c, N);
+    }
+    const double cpu_us = std::chrono::duration<double, std::micro>(clock::now() - start).count();
+
+    if (npu_worker.joinable()) {
+        npu_worker.join();
+    }
+
+    if (config.adaptive && cpu_rows > 0 && npu_rows > 0) {
+        update_coexec_share(config, cls, cpu_rows, cpu_us, npu_rows, npu_us);
+    }
+    return result;
+}
+
+#endif
@@ -0,0 +1,508 @@
+#ifndef MATMUL_CTX
+#define MATMUL_CTX
+
+#include <rknpu/rknn_matmul_api.h>
+#include <type_traits>
+#include <iostream>
+#include <cstring>
+#include <memory>
+#include "utils/half.hpp"
+#include "api_wrapper/npu_memory.hpp"
+#include "utils/layout.hpp"
+#include "utils/matmul_traits.hpp"
+
+/**
+ * Element sizes of the matrices of a matmul type
+ */
+struct _matmul_type_sizes {
+    size_t a;
+    size_t b;
+    size_t c;
+};
+
+/**
+ * @brief The matmul_type_table entry of a matmul type, aborts for types that are not in it
+ */
+const _matmul_type_entry& matmul_type_entry(_rknn_matmul_type type) {
+    const int32_t index = matmul_type_index(type);
+    if (index < 0) {
+        printf("unsupported matmul type %d\n", (int) type);
+        abort();
+    }
+    return matmul_type_table[index];
+}
+
+/**
+ * @brief The element sizes in bytes of matrices A, B and C for a matmul type
+ */
+_matmul_type_sizes matmul_type_sizes(_rknn_matmul_type type) {
+    const _matmul_type_entry& entry = matmul_type_entry(type);
+    return {entry.a_size, entry.b_size, entry.c_size};
+}
+
+/**
+ * Layout used for matrices A and C of a matmul
+ */
+enum _matmul_layout {
+    MATMUL_LAYOUT_NORMAL = 0,   /* row major A and C */
+    MATMUL_LAYOUT_PERF = 1,     /* native A and C on the npu, row major for the caller */
+    MATMUL_LAYOUT_NATIVE = 2,   /* native A and C, the result is kept in the native layout */
+};
+
+/**
+ * Struct that wraps all the built in rknn types 
+ * and contains the result pointer
+ * 
+ * @param To The type of the output matrix
+ */
+struct _matmul_ctx {
+    rknn_context ctx;
+    rknn_matmul_info info;
+    rknn_matmul_io_attr io_attr;
+    rknn_tensor_mem* matrixA;
+    rknn_tensor_mem* matrixB;
+    rknn_tensor_mem* matrixC;
+};
+
+/**
+ * Struct that contains the result tensor of the matmul and it's context
+ * 
+ * @param owner Keeps a shared context alive (e.g. a cached plan), 
+ *              when empty the result owns ctx and destroys it on release
+ */
+struct tensor_result {
+    rknn_context ctx;
+    rknn_tensor_mem* resultMatrix;
+    std::shared_ptr<void> owner;
+
+    tensor_result() : ctx(0), resultMatrix(nullptr) {}
+
+    tensor_result(rknn_context ctx, rknn_tensor_mem* resultMatrix) 
+        : ctx(ctx), resultMatrix(resultMatrix) {}
+
+    tensor_result(rknn_context ctx, rknn_tensor_mem* resultMatrix, std::shared_ptr<void> owner) 
+        : ctx(ctx), resultMatrix(resultMatrix), owner(std::move(owner)) {}
+};
+
+/**
+ * @brief Release the result tensor, and it's context if the result owns it
+ * 
+ * @param result The result to release, it is left empty
+ */
+void release_result(tensor_result& result) {
+    const bool owns_ctx = !result.owner && result.ctx != 0;
+    if (result.resultMatrix != nullptr) {
+        NpuMemoryRegistry::instance().remove(result.resultMatrix);
+        if (owns_ctx) {
+            NpuMemoryPool::instance().discard(result.ctx, result.resultMatrix);
+        } else {
+            // the context outlives the result, the tensor is recycled
+            NpuMemoryPool::instance().release(result.ctx, result.resultMatrix);
+        }
+    }
+    if (owns_ctx) {
+        NpuMemoryPool::instance().purge(result.ctx);
+        MatmulPhaseTimer timer(MATMUL_PHASE_DESTROY);
+        rknn_matmul_destroy(result.ctx);
+        MatmulStats::instance().context_destroyed();
+    }
+    result.owner.reset();
+    result.resultMatrix = nullptr;
+    result.ctx = 0;
+}
+
+/**
+ * @brief Move-only owner of an npu tensor
+ *
+ * Releases the tensor (and it's context, when the tensor owns it) exactly once,
+ * when it is destroyed or assigned over. Moving transfers the npu buffer without
+ * touching it's data, so a result can be handed on and fed to the next matmul.
+ */
+class NpuTensor {
+
+    private:
+
+        tensor_result tensor;
+
+    public:
+
+        NpuTensor() {}
+
+        explicit NpuTensor(tensor_result tensor) : tensor(std::move(tensor)) {}
+
+        NpuTensor(const NpuTensor&) = delete;
+        NpuTensor& operator=(const NpuTensor&) = delete;
+
+        NpuTensor(NpuTensor&& other) noexcept : tensor(other.release()) {}
+
+        NpuTensor& operator=(NpuTensor&& other) noexcept {
+            if (this != &other) {
+                reset();
+                tensor = other.release();
+            }
+            return *this;
+        }
+
+        ~NpuTensor() {
+            reset();
+        }
+
+        /**
+         * @brief Release the tensor now, the NpuTensor is left empty
+         */
+        void reset() {
+            release_result(tensor);
+        }
+
+        /**
+         * @brief Give up ownership of the tensor without releasing it
+         *
+         * @return The tensor, free it with release_result
+         */
+        tensor_result release() {
+            tensor_result released = std::move(tensor);
+            tensor = tensor_result();
+            return released;
+        }
+
+        /**
+         * @brief The data of the tensor, nullptr when empty
+         */
+        void* data() const {
+            return tensor.resultMatrix == nullptr ? nullptr : tensor.resultMatrix->virt_addr;
+        }
+
+        rknn_tensor_mem* mem() const { return tensor.resultMatrix; }
+        rknn_context context() const { return tensor.ctx; }
+
+        explicit operator bool() const { return tensor.resultMatrix != nullptr; }
+};
+
+/**
+ * @brief Allocate npu memory that can be used directly as a matmul input
+ * 
+ * @param size The size of the memory in bytes
+ * 
+ * @return tensor_result owning the memory, free it with release_result
+ */
+tensor_result npu_alloc_tensor(size_t size) {
+    std::shared_ptr<rknn_context> alloc_ctx = npu_alloc_context();
+    return tensor_result(*alloc_ctx, npu_alloc(size), alloc_ctx);
+}
+
+/**
+ * @brief ## __Create a matmul operation for the npu__
+ * 
+ * @param num_rows_a The number of rows in the first input mat
+ * @param num_cols_a The number of columns in the first input mat
+ * @param num_cols_b The number of columns in the second input mat
+ * @param type The matmul type flag
+ * @param ac_layout The layout of matrices A and C (0 - normal, 1 - native)
+ * @param b_layout The layout of matrix B (0 - normal, 1 - native)
+ * 
+ * @return _matmul_ctx with the currect context for the rknn_matmul_run function
+ */
+_matmul_ctx* make_matmul(
+    int32_t num_rows_a, int32_t num_cols_a, int32_t num_cols_b, _rknn_matmul_type type,
+    int16_t ac_layout = 0, int16_t b_layout = 0
+    ) {
+
+    /* create a matmul_ctx struct */
+    _matmul_ctx* matmul_ctx = (_matmul_ctx*)malloc(sizeof(_matmul_ctx));
+
+    /* set all field to zero */
+    memset(matmul_ctx, 0, sizeof(_matmul_ctx));
+
+    matmul_ctx->info.M             = num_rows_a; /* set first matrix rows */
+    matmul_ctx->info.K             = num_cols_a; /* set first matrix cols */
+    matmul_ctx->info.N             = num_cols_b; /* set second matrix cols */
+    matmul_ctx->info.type          = type; /* set the dtypes of the input and output matrices*/
+    matmul_ctx->info.AC_layout     = ac_layout; /* set the layout of matrices A and C */
+    matmul_ctx->info.B_layout      = b_layout; /* set the layout of matrix B */
+    
+
+    // create the matmul operation
+    {
+        MatmulPhaseTimer timer(MATMUL_PHASE_CREATE, num_rows_a, num_cols_a, num_cols_b);
+        int ret = rknn_matmul_create(&matmul_ctx->ctx, &matmul_ctx->info, &matmul_ctx->io_attr);
+        if (ret < 0) {
+            printf("rknn_matmul_create fail! ret=%d\n", ret);
+            abort();
+        }
+        MatmulStats::instance().context_created();
+    }
+
+    // create the memory for the matrices in the npu
+    NpuMemoryPool& pool = NpuMemoryPool::instance();
+    matmul_ctx->matrixA = pool.acquire(matmul_ctx->ctx, matmul_ctx->io_attr.A.size);
+    matmul_ctx->matrixB = pool.acquire(matmul_ctx->ctx, matmul_ctx->io_attr.B.size);
+    matmul_ctx->matrixC = pool.acquire(matmul_ctx->ctx, matmul_ctx->io_attr.C.size);
+
+
+    // set the memory in the npu
+    rknn_matmul_set_io_mem(matmul_ctx->ctx, matmul_ctx->matrixA, &matmul_ctx->io_attr.A);
+    rknn_matmul_set_io_mem(matmul_ctx->ctx, matmul_ctx->matrixB, &matmul_ctx->io_attr.B);
+    rknn_matmul_set_io_mem(matmul_ctx->ctx, matmul_ctx->matrixC, &matmul_ctx->io_attr.C);
+
+    return matmul_ctx;
+}
+
+/**
+ * @brief Set the matrix data in the npu
+ * 
+ * @param Ti The type of the input matrix
+ * @param ctx The context for the matmul operation
+ * @param mem The information of the matrix tensor memory
+ * @param attr The attributes of the matrix tensor
+ * @param info The matmul the data is for, only used to annotate the trace
+ */
+void set_matrix_data(
+    rknn_matmul_ctx* ctx, 
+    rknn_tensor_mem* mem, 
+    rknn_matmul_tensor_attr* attr, 
+    const void* data,
+    const rknn_matmul_info* info = nullptr ) {
+
+    MatmulPhaseTimer timer(
+        MATMUL_PHASE_COPY_IN, info ? info->M : 0, info ? info->K : 0, info ? info->N : 0
+    );
+    memcpy(mem->virt_addr, data, attr->size);
+    MatmulStats::instance().copied_in(attr->size);
+    rknn_matmul_set_io_mem(*ctx, mem, attr);
+}
+
+/**
+ * @brief The size in bytes of an element of a tensor type
+ */
+size_t tensor_type_size(rknn_tensor_type type) {
+    switch (type) {
+        case RKNN_TENSOR_FLOAT32:
+        case RKNN_TENSOR_INT32:
+        case RKNN_TENSOR_UINT32:
+            return 4;
+        case RKNN_TENSOR_FLOAT16:
+        case RKNN_TENSOR_INT16:
+        case RKNN_TENSOR_UINT16:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+/**
+ * @brief The number of elements in a group of the native A / C layout
+ * 
+ * @param attr The attributes of a tensor created with AC_layout = 1
+ */
+int32_t native_group(const rknn_matmul_tensor_attr* attr) {
+    if (attr->n_dims >= 3) {
+        return attr->dims[attr->n_dims - 1];
+    }
+    // groups are 16 bytes wide for every type
+    return 16 / tensor_type_size(attr->type);
+}
+
+/**
+ * @brief Copy a matrix between layouts
+ * 
+ * @param dst The output, in dst_layout
+ * @param src The input, in src_layout
+ * @param rows The number of rows in the matrix
+ * @param cols The number of columns in the matrix
+ * @param elem_size The size of an element in bytes
+ * @param info The info of the matmul, used for NPU_LAYOUT_NATIVE_B
+ */
+void convert_matrix_layout(
+    void* dst, int16_t dst_layout, int32_t dst_group,
+    const void* src, int16_t src_layout, int32_t src_group,
+    int32_t rows, int32_t cols, size_t elem_size, rknn_matmul_info* info) {
+
+    if (src_layout == NPU_LAYOUT_NATIVE_B && dst_layout != NPU_LAYOUT_NATIVE_B) {
+        printf("can not convert a matrix from the native B layout\n");
+        abort();
+    }
+
+    std::unique_ptr<uint8_t[]> normal;
+    if (src_layout == NPU_LAYOUT_NATIVE_AC && 
+        !(dst_layout == NPU_LAYOUT_NATIVE_AC && dst_group == src_group)) {
+        if (dst_layout == NPU_LAYOUT_NORMAL) {
+            unpack_native(dst, src, rows, cols, src_group, elem_size);
+            return;
+        }
+        normal.reset(new uint8_t[(size_t) rows * cols * elem_size]);
+        unpack_native(normal.get(), src, rows, cols, src_group, elem_size);
+        src = normal.get();
+        src_layout = NPU_LAYOUT_NORMAL;
+    }
+
+    if (src_layout == dst_layout) {
+        size_t size = dst_layout == NPU_LAYOUT_NATIVE_AC ?
+            (size_t) (cols + dst_group - 1) / dst_group * dst_group * rows * elem_size :
+            (size_t) rows * cols * elem_size;
+        memcpy(dst, src, size);
+    } else if (dst_layout == NPU_LAYOUT_NATIVE_AC) {
+        pack_native(dst, src, rows, cols, dst_group, elem_size);
+    } else {
+        int ret = rknn_B_normal_layout_to_native_layout((void*) src, dst, rows, cols, info);
+        if (ret < 0) {
+            printf("rknn_B_normal_layout_to_native_layout fail! ret=%d\n", ret);
+            abort();
+        }
+    }
+}
+
+/**
+ * @brief Bind the matrix data to the npu, without a copy when it is already npu memory
+ * 
+ * When data is the start of registered npu memory (npu_alloc_tensor or a matmul result)
+ * that is large enough and in the layout of the tensor, it is bound directly with 
+ * rknn_matmul_set_io_mem. Otherwise it is copied into mem, converting the layout 
+ * as part of the copy when the tensor uses a native layout.
+ * 
+ * @param ctx The context for the matmul operation
+ * @param mem The tensor memory of the context used for the copy
+ * @param attr The attributes of the matrix tensor
+ * @param data The data of the matrix, row major unless registered with another layout
+ * @param rows The number of rows in the matrix
+ * @param cols The number of columns in the matrix
+ * @param layout The layout of the tensor, one of _npu_mem_layout
+ * 
+ * @return Memory imported to ctx for the binding, destroy it after the run, or nullptr
+ */
+rknn_tensor_mem* bind_matrix_data(
+    _matmul_ctx* ctx, 
+    rknn_tensor_mem* mem, 
+    rknn_matmul_tensor_attr* attr, 
+    const void* data,
+    int32_t rows,
+    int32_t cols,
+    int16_t layout ) {
+
+    int32_t group = layout == NPU_LAYOUT_NATIVE_AC ? native_group(attr) : 0;
+
+    _npu_mem_entry entry = NpuMemoryRegistry::instance().find(data);
+    bool same_layout = entry.layout == layout && entry.group == group;
+
+    if (entry.mem == nullptr && layout == NPU_LAYOUT_NORMAL) {
+        set_matrix_data(&ctx->ctx, mem, attr, data, &ctx->info);
+        return nullptr;
+    }
+
+    if (entry.mem == nullptr || entry.mem->size < attr->size || !same_layout) {
+        MatmulPhaseTimer timer(MATMUL_PHASE_COPY_IN, ctx->info.M, ctx->info.K, ctx->info.N);
+        MatmulStats::instance().copied_in(attr->size);
+        convert_matrix_layout(
+            mem->virt_addr, layout, group,
+            data, entry.layout, entry.group,
+            rows, cols, tensor_type_size(attr->type), &ctx->info
+        );
+        rknn_matmul_set_io_mem(ctx->ctx, mem, attr);
+        return nullptr;
+    }
+
+    if (entry.ctx == ctx->ctx) {
+        rknn_matmul_set_io_mem(ctx->ctx, entry.mem, attr);
+        return nullptr;
+    }
+
+    // memory of another context is imported through it's fd
+    rknn_tensor_mem* imported = rknn_create_mem_from_fd(
+        ctx->ctx, entry.mem->fd, entry.mem->virt_addr, entry.mem->size, entry.mem->offset
+    );
+    if (imported == nullptr) {
+        MatmulPhaseTimer timer(MATMUL_PHASE_COPY_IN, ctx->info.M, ctx->info.K, ctx->info.N);
+        MatmulStats::instance().copied_in(attr->size);
+        convert_matrix_layout(
+            mem->virt_addr, layout, group,
+            data, entry.layout, entry.group,
+            rows, cols, tensor_type_size(attr->type), &ctx->info
+        );
+        rknn_matmul_set_io_mem(ctx->ctx, mem, attr);
+        return nullptr;
+    }
+    rknn_matmul_set_io_mem(ctx->ctx, imported, attr);
+    return imported;
+}
+
+/**
+ * @brief Copy a matrix kept in the native A / C layout to a new row major tensor
+ * 
+ * @param data The data of a result made with MATMUL_LAYOUT_NATIVE
+ * @param rows The number of rows in the matrix
+ * @param cols The number of columns in the matrix
+ * @param elem_size The size of an element in bytes
+ * 
+ * @return tensor_result with the row major matrix, free it with release_result
+ */
+tensor_result unpack_result(const void* data, int32_t rows, int32_t cols, size_t elem_size) {
+    _npu_mem_entry entry = NpuMemoryRegistry::instance().find(data);
+    if (entry.layout == NPU_LAYOUT_NATIVE_B) {
+        printf("unpack_result: can not unpack the native B layout\n");
+        abort();
+    }
+    tensor_result normal = npu_alloc_tensor((size_t) rows * cols * elem_size);
+    MatmulPhaseTimer timer(MATMUL_PHASE_READBACK, rows, 0, cols);
+    MatmulStats::instance().copied_out((uint64_t) rows * cols * elem_size);
+    if (entry.layout == NPU_LAYOUT_NATIVE_AC) {
+        unpack_native(normal.resultMatrix->virt_addr, data, rows, cols, entry.group, elem_size);
+    } else {
+        // results too large for the native layout (see tiled_matmul) are already row major
+        memcpy(normal.resultMatrix->virt_addr, data, (size_t) rows * cols * elem_size);
+    }
+    return normal;
+}
+
+/**
+ * @brief Get a row major view of a matrix, unpacking it when it was kept in the native layout
+ * 
+ * @param holder Keeps the unpacked copy alive while the returned pointer is used
+ * 
+ * @return data itself when it is already row major
+ */
+const void* normal_input(
+    const void* data, int32_t rows, int32_t cols, size_t elem_size, NpuTensor& holder) {
+    if (NpuMemoryRegistry::instance().find(data).layout == NPU_LAYOUT_NORMAL) {
+        return data;
+    }
+    holder = NpuTensor(unpack_result(data, rows, cols, elem_size));
+    return holder.data();
+}
+
+/**
+ * @brief Free the input tensors and hand out the result with it's context
+ * 
+ * @param ctx The context of the matmul operation
+ * 
+ * @return tensor_result that owns matrixC and the rknn context, 
+ *         free it with release_result (or keep it in an NpuTensor)
+ */
+tensor_result free_matmul(_matmul_ctx* ctx) {
+    tensor_result result(ctx->ctx, ctx->matrixC);
+    NpuMemoryPool::instance().discard(ctx->ctx, ctx->matrixA);
+    NpuMemoryPool::instance().discard(ctx->ctx, ctx->matrixB);
+    free(ctx);
+    return result;
+}
+
+/**
+ * @brief Free the matrices tensors and the matmul context itself
+ * 
+ * @param ctx The context of the matmul operation
+ * 
+ * @note Unlike free_matmul this also releases matrixC, 
+ *       use it when the result is not handed out to the caller
+ */
+void destroy_matmul(_matmul_ctx* ctx) {
+    NpuMemoryPool& pool = NpuMemoryPool::instance();
+    pool.discard(ctx->ctx, ctx->matrixA);
+    pool.discard(ctx->ctx, ctx->matrixB);
+    pool.discard(ctx->ctx, ctx->matrixC);
+    pool.purge(ctx->ctx);
+    MatmulPhaseTimer timer(MATMUL_PHASE_DESTROY, ctx->info.M, ctx->info.K, ctx->info.N);
+    rknn_matmul_destroy(ctx->ctx);
+    MatmulStats::instance().context_destroyed();
+    free(ctx);
+}
+
+
+#endif
@@ -0,0 +1,219 @@
+#ifndef MATMUL_DISPATCH
+#define MATMUL_DISPATCH
+
+#include "api_wrapper/matmul_cache.hpp"
+#include "utils/cpu_gemm.hpp"
+#include <chrono>
+#include <functional>
+#include <vector>
+
+/**
+ * Cost model that decides if a matmul runs on the cpu or on the npu
+ *
+ * Times are in microseconds and throughputs in multiply-accumulates per microsecond,
+ * the throughputs are indexed by dispatch_class (0 - float16 inputs, 1 - int8 inputs).
+ *
+ * @param enabled Let matmul_npu run matmuls on the cpu when the model predicts it is faster
+ * @param npu_run_us The fixed cost of a matmul on a cached context (binding, submit and wait)
+ * @param npu_create_us The cost of creating a context, paid when the plan cache has none for the shape
+ * @param copy_bytes_per_us The bandwidth of the copies to and from npu memory
+ * @param cpu_max_macs Overrides the model, matmuls of at most this many multiply-accumulates
+ *                     run on the cpu and larger ones on the npu, -1 to use the model
+ * @param calibrated The model was measured with calibrate_dispatch, otherwise it has rough rk3588 values
+ */
+struct dispatch_model {
+    bool enabled;
+    double npu_run_us;
+    double npu_create_us;
+    double copy_bytes_per_us;
+    double npu_macs_per_us[2];
+    double cpu_macs_per_us[2];
+    int64_t cpu_max_macs;
+    bool calibrated;
+};
+
+/**
+ * @brief The process wide cost model used by matmul_npu
+ */
+dispatch_model& matmul_dispatch_model() {
+    static dispatch_model model = {
+        false, 150.0, 3000.0, 2000.0, {4.0e5, 1.5e6}, {1.0e4, 2.0e4}, -1, false
+    };
+    return model;
+}
+
+/**
+ * @brief The throughput class of a matmul type, 1 for int8 inputs and 0 for float16 inputs
+ */
+int32_t dispatch_class(_rknn_matmul_type type) {
+    const int32_t index = matmul_type_index(type);
+    return index >= 0 && matmul_type_table[index].a == RKNN_TENSOR_INT8 ? 1 : 0;
+}
+
+/**
+ * @brief The predicted time of a matmul on the npu, in microseconds
+ *
+ * @param cached The plan cache has a context for the shape
+ */
+double npu_cost_us(
+    int32_t M, int32_t K, int32_t N, _rknn_matmul_type type, bool cached,
+    const dispatch_model& model = matmul_dispatch_model()) {
+    const _matmul_type_sizes sizes = matmul_type_sizes(type);
+    const double bytes = (double) M * K * sizes.a + (double) K * N * sizes.b + (double) M * N * sizes.c;
+    return model.npu_run_us + (cached ? 0.0 : model.npu_create_us) +
+        bytes / model.copy_bytes_per_us +
+        (double) M * K * N / model.npu_macs_per_us[dispatch_class(type)];
+}
+
+/**
+ * @brief The predicted time of a matmul on the cpu, in microseconds
+ */
+double cpu_cost_us(
+    int32_t M, int32_t K, int32_t N, _rknn_matmul_type type,
+    const dispatch_model& model = matmul_dispatch_model()) {
+    return (double) M * K * N / model.cpu_macs_per_us[dispatch_class(type)];
+}
+
+/**
+ * @brief The size of the largest square matmul that is faster on the cpu, with a cached context
+ *
+ * @return The multiply-accumulates of that matmul, the crossover point of the model
+ */
+int64_t dispatch_crossover_macs(_rknn_matmul_type type, const dispatch_model& model = matmul_dispatch_model()) {
+    int32_t n = 1;
+    while (n < 8192 && cpu_cost_us(n + 1, n + 1, n + 1, type, model) <
+        npu_cost_us(n + 1, n + 1, n + 1, type, true, model)) {
+        n++;
+    }
+    return (int64_t) n * n * n;
+}
+
+/**
+ * @brief Decide if matmul_npu should run a matmul on the cpu
+ *
+ * @param b The second input, weights packed in the native B layout always stay on the npu
+ */
+bool runs_on_cpu(
+    int32_t M, int32_t K, int32_t N, _rknn_matmul_type type, const void* b, _matmul_layout layout) {
+
+    const dispatch_model& model = matmul_dispatch_model();
+    if (!model.enabled || NpuMemoryRegistry::instance().find(b).layout == NPU_LAYOUT_NATIVE_B) {
+        return false;
+    }
+    if (model.cpu_max_macs >= 0) {
+        return (int64_t) M * K * N <= model.cpu_max_macs;
+    }
+    const int16_t ac_layout = layout == MATMUL_LAYOUT_NORMAL ? 0 : 1;
+    const bool cached = MatmulCache::instance().has_idle(
+        {M, K, N, type, ac_layout, 0, RKNN_NPU_CORE_AUTO}
+    );
+    return cpu_cost_us(M, K, N, type, model) < npu_cost_us(M, K, N, type, cached, model);
+}
+
+/**
+ * @brief Performs a matmul on the cpu with the numeric semantics of the npu
+ *
+ * float16 inputs are accumulated in float32 and int8 inputs in int32, float16
+ * outputs are rounded to nearest and int8 outputs saturate. The result is npu
+ * memory, so it is bound to the next npu matmul without a copy.
+ *
+ * @param layout The layout of C, see _matmul_layout
+ *
+ * @return tensor_result with the (num_rows_a, num_cols_b) result, free it with release_result
+ */
+tensor_result cpu_matmul_tensor(
+    int32_t M, int32_t K, int32_t N, _rknn_matmul_type type,
+    const void* a, const void* b, _matmul_layout layout = MATMUL_LAYOUT_NORMAL) {
+
+    const _matmul_type_sizes sizes = matmul_type_sizes(type);
+    NpuTensor a_normal, b_normal;
+    a = normal_input(a, M, K, sizes.a, a_normal);
+    b = normal_input(b, K, N, sizes.b, b_normal);
+
+    if (layout != MATMUL_LAYOUT_NATIVE) {
+        tensor_result result = npu_alloc_tensor((size_t) M * N * sizes.c);
+        cpu_matmul(M, K, N, type, a, K, b, N, result.resultMatrix->virt_addr, N);
+        return result;
+    }
+
+    // kept in the native layout like the result of an npu matmul
+    const int32_t group = 16 / sizes.c;
+    std::unique_ptr<uint8_t[]> normal(new uint8_t[(size_t) M * N * sizes.c]);
+    cpu_matmul(M, K, N, type, a, K, b, N, normal.get(), N);
+
+    tensor_result result = npu_alloc_tensor((size_t) (N + group - 1) / group * group * M * sizes.c);
+    pack_native(result.resultMatrix->virt_addr, normal.get(), M, N, group, sizes.c);
+    NpuMemoryRegistry::instance().add(
+        result.ctx, result.resultMatrix, NPU_LAYOUT_NATIVE_AC, group
+    );
+    return result;
+}
+
+/**
+ * @brief Fit the cost model to this board by timing the npu, the copies and the cpu gemm
+ *
+ * Takes a few hundred milliseconds, the measured model replaces matmul_dispatch_model
+ * except for enabled and cpu_max_macs.
+ *
+ * @return The measured model
+ */
+dispatch_model calibrate_dispatch() {
+    using clock = std::chrono::steady_clock;
+    auto time_us = [](int32_t repeats, const std::function<void()>& run) {
+        run();
+        clock::time_point start = clock::now();
+        for (int32_t i = 0; i < repeats; i++) {
+            run();
+        }
+        return std::chrono::duration<double, std::micro>(clock::now() - start).count() / repeats;
+    };
+
+    dispatch_model& model = matmul_dispatch_model();
+    dispatch_model measured = model;
+
+    const size_t copy_bytes = (size_t) 8 << 20;
+    std::vector<uint8_t> host(copy_bytes, 1);
+    NpuTensor target(npu_alloc_tensor(copy_bytes));
+    measured.copy_bytes_per_us = copy_bytes / std::max(1e-3, time_us(4, [&]() {
+        memcpy(target.data(), host.data(), copy_bytes);
+    }));
+
+    measured.npu_create_us = time_us(3, []() {
+        MatmulPlanBase plan(32, 32, 32, RKNN_INT8_MM_INT8_TO_INT32);
+    });
+
+    const _rknn_matmul_type types[2] = {RKNN_FLOAT16_MM_FLOAT16_TO_FLOAT32, RKNN_INT8_MM_INT8_TO_INT32};
+    const int32_t small = 32, large = 512;
+    std::vector<uint8_t> a((size_t) large * large * 2), b((size_t) large * large * 2), c((size_t) large * large * 4);
+
+    for (int32_t cls = 0; cls < 2; cls++) {
+        const _rknn_matmul_type type = types[cls];
+        const _matmul_type_sizes sizes = matmul_type_sizes(type);
+        auto npu_us = [&](int32_t n) {
+            return time_us(5, [&]() {
+                tensor_result r = cached_matmul(n, n, n, type, a.data(), b.data());
+                release_result(r);
+            }) - (double) n * n * (sizes.a + sizes.b + sizes.c) / measured.copy_bytes_per_us;
+        };
+        const double run_us = std::max(0.0, npu_us(small));
+        const double large_us = npu_us(large) - run_us;
+        const double macs = (double) large * large * large;
+        if (cls == 0) {
+            measured.npu_run_us = run_us;
+        }
+        measured.npu_macs_per_us[cls] = macs / std::max(1.0, large_us);
+
+        const int32_t m = 128, n = 256;
+        measured.cpu_macs_per_us[cls] = (double) m * n * n / std::max(1e-3, time_us(3, [&]() {
+            cpu_matmul(m, n, n, type, a.data(), n, b.data(), n, c.data(), n);
+        }));
+    }
+
+    measured.enabled = model.enabled;
+    measured.cpu_max_macs = model.cpu_max_macs;
+    measured.calibrated = true;
+    model = measured;
+    return measured;
+}
+
+#endif
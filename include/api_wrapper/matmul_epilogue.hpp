@@ -0,0 +1,338 @@
+#ifndef MATMUL_EPILOGUE
+#define MATMUL_EPILOGUE
+
+#include "api_wrapper/matmul_ctx.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+/**
+ * The activation an epilogue applies
+ */
+enum epilogue_activation {
+    EPILOGUE_NONE = 0,
+    EPILOGUE_RELU,
+    EPILOGUE_GELU,      /* tanh approximation */
+    EPILOGUE_SIGMOID
+};
+
+/**
+ * The axis an epilogue bias runs along
+ */
+enum epilogue_bias {
+    EPILOGUE_BIAS_COLUMN = 0,   /* one value per column of C, the bias of a linear layer */
+    EPILOGUE_BIAS_ROW           /* one value per row of C */
+};
+
+/**
+ * What to do to C while it is read out of the npu tensor
+ *
+ * Every element becomes clamp(activation(alpha * column_scale * corrected c + bias)) 
+ * converted to output, rounding to nearest and saturating integers.
+ * The corrected c is c + column_offset[n] + row_offset[m] * column_factor[n], the zero
+ * point correction of a quantized matmul.
+ *
+ * @param alpha Scales C, e.g. the scale of an int32 result
+ * @param column_scale Per column scale of num_cols_b values, nullptr for none
+ * @param column_offset Per column offset of num_cols_b values, nullptr for none
+ * @param row_offset, column_factor Per row and per column factors of the rank one
+ *                                  correction, nullptr for none
+ * @param bias Float bias of num_cols_b (or num_rows_a) values, nullptr for none
+ * @param bias_axis See epilogue_bias
+ * @param activation See epilogue_activation
+ * @param clamp_min, clamp_max The range the result is clamped to
+ * @param output The type of the result, RKNN_TENSOR_TYPE_MAX keeps the type of C
+ */
+struct matmul_epilogue {
+    float alpha = 1.0f;
+    const float* column_scale = nullptr;
+    const float* column_offset = nullptr;
+    const float* row_offset = nullptr;
+    const float* column_factor = nullptr;
+    const float* bias = nullptr;
+    epilogue_bias bias_axis = EPILOGUE_BIAS_COLUMN;
+    epilogue_activation activation = EPILOGUE_NONE;
+    float clamp_min = -std::numeric_limits<float>::infinity();
+    float clamp_max = std::numeric_limits<float>::infinity();
+    rknn_tensor_type output = RKNN_TENSOR_TYPE_MAX;
+};
+
+/**
+ * The number of columns an epilogue processes at a time, the block stays in the L1 cache
+ */
+constexpr int32_t EPILOGUE_BLOCK = 256;
+
+template<typename To>
+inline To epilogue_store(float value) {
+    return (To) value;
+}
+
+template<>
+inline float16 epilogue_store<float16>(float value) {
+    return half_float::half_cast<float16, std::round_to_nearest>(value);
+}
+
+template<>
+inline int8_t epilogue_store<int8_t>(float value) {
+    return (int8_t) std::min(127.0f, std::max(-128.0f, std::nearbyint(value)));
+}
+
+template<>
+inline int32_t epilogue_store<int32_t>(float value) {
+    // 2147483520 is the largest float below 2^31
+    return (int32_t) std::min(2147483520.0f, std::max(-2147483648.0f, std::nearbyint(value)));
+}
+
+/**
+ * @brief The type an epilogue writes for a C of type c_type
+ */
+inline rknn_tensor_type epilogue_output_type(const matmul_epilogue& epilogue, rknn_tensor_type c_type) {
+    return epilogue.output == RKNN_TENSOR_TYPE_MAX ? c_type : epilogue.output;
+}
+
+/**
+ * @brief The type of the result of a matmul, C or the output of it's epilogue
+ *
+ * @param epilogue nullptr for a matmul without one
+ */
+inline rknn_tensor_type matmul_output_type(_rknn_matmul_type type, const matmul_epilogue* epilogue) {
+    const rknn_tensor_type c_type = matmul_type_entry(type).c;
+    return epilogue != nullptr ? epilogue_output_type(*epilogue, c_type) : c_type;
+}
+
+/**
+ * @brief The epilogue of the block of C that starts at row row0 and column col0
+ *
+ * The per row and per column arrays are advanced to the block, so a tile or a part
+ * of C is read out with the epilogue of the whole matmul.
+ */
+inline matmul_epilogue offset_epilogue(const matmul_epilogue& epilogue, int32_t row0, int32_t col0) {
+    matmul_epilogue shifted = epilogue;
+    if (shifted.column_scale != nullptr) shifted.column_scale += col0;
+    if (shifted.column_offset != nullptr) shifted.column_offset += col0;
+    if (shifted.row_offset != nullptr) shifted.row_offset += row0;
+    if (shifted.column_factor != nullptr) shifted.column_factor += col0;
+    if (shifted.bias != nullptr) {
+        shifted.bias += shifted.bias_axis == EPILOGUE_BIAS_ROW ? row0 : col0;
+    }
+    return shifted;
+}
+
+/**
+ * @brief Apply an epilogue to a block of C while it is read, one pass over the elements
+ *
+ * The rows run in parallel and every block of a row goes through the steps
+ * in a float buffer with simd loops. The GELU and sigmoid loops vectorize where
+ * the math library has simd variants of exp (e.g. libmvec with -ffast-math), and
+ * run the same element wise code otherwise. out may be c itself when To and Ti 
+ * have the same size and C is row major, a block is read whole before it is written.
+ *
+ * @param out_ld The number of elements in a row of out
+ * @param c Row major C with c_ld elements per row, or native C of c_ld rows
+ * @param c_group The number of elements in a group of native C, 0 for row major
+ */
+template<typename Ti, typename To>
+void epilogue_pass(
+    To* out, int64_t out_ld, const Ti* c, int64_t c_ld, int32_t c_group, 
+    int32_t rows, int32_t cols, const matmul_epilogue& epilogue) {
+    const bool column_bias = epilogue.bias != nullptr && epilogue.bias_axis == EPILOGUE_BIAS_COLUMN;
+    const bool row_bias = epilogue.bias != nullptr && epilogue.bias_axis == EPILOGUE_BIAS_ROW;
+    const bool rank_one = epilogue.row_offset != nullptr && epilogue.column_factor != nullptr;
+    const float alpha = epilogue.alpha;
+    const float low = epilogue.clamp_min, high = epilogue.clamp_max;
+
+    #pragma omp parallel for schedule(static)
+    for (int32_t r = 0; r < rows; r++) {
+        float block[EPILOGUE_BLOCK];
+        const float shift = row_bias ? epilogue.bias[r] : 0.0f;
+        const float row_offset = rank_one ? epilogue.row_offset[r] : 0.0f;
+
+        for (int32_t c0 = 0; c0 < cols; c0 += EPILOGUE_BLOCK) {
+            const int32_t count = std::min(EPILOGUE_BLOCK, cols - c0);
+            To* dst = out + r * out_ld + c0;
+
+            if (c_group == 0) {
+                const Ti* in = c + r * c_ld + c0;
+                #pragma omp simd
+                for (int32_t j = 0; j < count; j++) {
+                    block[j] = (float) in[j];
+                }
+            } else {
+                // native C is (groups, rows, group), a row is read one group at a time
+                for (int32_t j = 0; j < count;) {
+                    const int32_t col = c0 + j;
+                    const int32_t skip = col % c_group;
+                    const int32_t take = std::min(c_group - skip, count - j);
+                    const Ti* in = c + ((int64_t) (col / c_group) * c_ld + r) * c_group + skip;
+                    #pragma omp simd
+                    for (int32_t g = 0; g < take; g++) {
+                        block[j + g] = (float) in[g];
+                    }
+                    j += take;
+                }
+            }
+            if (epilogue.column_offset != nullptr) {
+                const float* offset = epilogue.column_offset + c0;
+                #pragma omp simd
+                for (int32_t j = 0; j < count; j++) {
+                    block[j] += offset[j];
+                }
+            }
+            if (rank_one) {
+                const float* factor = epilogue.column_factor + c0;
+                #pragma omp simd
+                for (int32_t j = 0; j < count; j++) {
+                    block[j] += row_offset * factor[j];
+                }
+            }
+            if (epilogue.column_scale != nullptr) {
+                const float* scale = epilogue.column_scale + c0;
+                #pragma omp simd
+                for (int32_t j = 0; j < count; j++) {
+                    block[j] = block[j] * (alpha * scale[j]) + shift;
+                }
+            } else {
+                #pragma omp simd
+                for (int32_t j = 0; j < count; j++) {
+                    block[j] = block[j] * alpha + shift;
+                }
+            }
+            if (column_bias) {
+                const float* bias = epilogue.bias + c0;
+                #pragma omp simd
+                for (int32_t j = 0; j < count; j++) {
+                    block[j] += bias[j];
+                }
+            }
+
+            switch (epilogue.activation) {
+                case EPILOGUE_RELU:
+                    #pragma omp simd
+                    for (int32_t j = 0; j < count; j++) {
+                        block[j] = std::max(block[j], 0.0f);
+                    }
+                    break;
+                case EPILOGUE_GELU:
+                    // 0.5 * (1 + tanh(z)) is 1 / (1 + exp(-2z)), one exp like the sigmoid
+                    #pragma omp simd
+                    for (int32_t j = 0; j < count; j++) {
+                        const float x = block[j];
+                        block[j] = x / (1.0f + std::exp(-1.5957691216f * (x + 0.044715f * x * x * x)));
+                    }
+                    break;
+                case EPILOGUE_SIGMOID:
+                    #pragma omp simd
+                    for (int32_t j = 0; j < count; j++) {
+                        block[j] = 1.0f / (1.0f + std::exp(-block[j]));
+                    }
+                    break;
+                default:
+                    break;
+            }
+
+            #pragma omp simd
+            for (int32_t j = 0; j < count; j++) {
+                block[j] = std::min(high, std::max(low, block[j]));
+            }
+            #pragma omp simd
+            for (int32_t j = 0; j < count; j++) {
+                dst[j] = epilogue_store<To>(block[j]);
+            }
+        }
+    }
+}
+
+template<typename Ti>
+void epilogue_dispatch(
+    void* out, rknn_tensor_type out_type, int64_t out_ld, const Ti* c, int64_t c_ld, int32_t c_group,
+    int32_t rows, int32_t cols, const matmul_epilogue& epilogue) {
+    switch (out_type) {
+        case RKNN_TENSOR_FLOAT16:
+            epilogue_pass(static_cast<float16*>(out), out_ld, c, c_ld, c_group, rows, cols, epilogue);
+            break;
+        case RKNN_TENSOR_FLOAT32:
+            epilogue_pass(static_cast<float32*>(out), out_ld, c, c_ld, c_group, rows, cols, epilogue);
+            break;
+        case RKNN_TENSOR_INT8:
+            epilogue_pass(static_cast<int8_t*>(out), out_ld, c, c_ld, c_group, rows, cols, epilogue);
+            break;
+        case RKNN_TENSOR_INT32:
+            epilogue_pass(static_cast<int32_t*>(out), out_ld, c, c_ld, c_group, rows, cols, epilogue);
+            break;
+        default:
+            printf("matmul epilogue: unsupported output type %d\n", out_type);
+            abort();
+    }
+}
+
+/**
+ * @brief Read a (rows, cols) block of C into a row major destination through an epilogue
+ *
+ * @param out The destination, of the epilogue's output type (see epilogue_output_type)
+ * @param out_ld The number of elements in a row of out
+ * @param c Row major C with c_ld elements per row, or native C of c_ld rows
+ * @param c_type The type of C
+ * @param c_group The number of elements in a group of native C, 0 for row major
+ * @param epilogue See matmul_epilogue, offset to the block with offset_epilogue
+ */
+void epilogue_block(
+    void* out, int64_t out_ld, const void* c, rknn_tensor_type c_type, int64_t c_ld, int32_t c_group,
+    int32_t rows, int32_t cols, const matmul_epilogue& epilogue) {
+
+    const rknn_tensor_type out_type = epilogue_output_type(epilogue, c_type);
+    switch (c_type) {
+        case RKNN_TENSOR_FLOAT16:
+            epilogue_dispatch(out, out_type, out_ld, (const float16*) c, c_ld, c_group, rows, cols, epilogue);
+            break;
+        case RKNN_TENSOR_FLOAT32:
+            epilogue_dispatch(out, out_type, out_ld, (const float32*) c, c_ld, c_group, rows, cols, epilogue);
+            break;
+        case RKNN_TENSOR_INT8:
+            epilogue_dispatch(out, out_type, out_ld, (const int8_t*) c, c_ld, c_group, rows, cols, epilogue);
+            break;
+        case RKNN_TENSOR_INT32:
+            epilogue_dispatch(out, out_type, out_ld, (const int32_t*) c, c_ld, c_group, rows, cols, epilogue);
+            break;
+        default:
+            printf("matmul epilogue: unsupported result type %d\n", c_type);
+            abort();
+    }
+}
+
+/**
+ * @brief Apply an epilogue to a row major matmul result
+ *
+ * @param result The (rows, cols) result, it is released when the epilogue needs a new tensor
+ * @param c_type The type of the result
+ *
+ * @return tensor_result with the result of the epilogue, free it with release_result.
+ *         It is result itself when the output has the size of C.
+ */
+tensor_result apply_epilogue(
+    tensor_result result, int32_t rows, int32_t cols, rknn_tensor_type c_type,
+    const matmul_epilogue& epilogue) {
+
+    const size_t out_size = tensor_type_size(epilogue_output_type(epilogue, c_type));
+    const void* c = result.resultMatrix->virt_addr;
+
+    tensor_result out;
+    void* dst = result.resultMatrix->virt_addr;
+    if (out_size != tensor_type_size(c_type)) {
+        out = npu_alloc_tensor((size_t) rows * cols * out_size);
+        dst = out.resultMatrix->virt_addr;
+    }
+
+    {
+        MatmulPhaseTimer timer(MATMUL_PHASE_READBACK, rows, 0, cols);
+        MatmulStats::instance().copied_out((size_t) rows * cols * tensor_type_size(c_type));
+        epilogue_block(dst, cols, c, c_type, cols, 0, rows, cols, epilogue);
+    }
+
+    if (out.resultMatrix == nullptr) {
+        return result;
+    }
+    release_result(result);
+    return out;
+}
+
+#endif
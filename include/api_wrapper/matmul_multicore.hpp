@@ -0,0 +1,183 @@
+#ifndef MATMUL_MULTICORE
+#define MATMUL_MULTICORE
+
+#include "api_wrapper/matmul_tiling.hpp"
+#include <thread>
+#include <vector>
+
+#define NPU_MAX_CORES 3
+
+/**
+ * How a matmul is split between the npu cores
+ *
+ * @param enabled Let matmul_npu split matmuls of at least min_macs multiply-accumulates
+ * @param cores The number of npu cores to use, 1 to NPU_MAX_CORES
+ * @param ratios The relative share of the output each core computes
+ * @param split_n Split the columns of C (N) instead of the rows (M)
+ */
+struct multicore_config {
+    bool enabled;
+    int32_t cores;
+    float ratios[NPU_MAX_CORES];
+    bool split_n;
+    int64_t min_macs;
+};
+
+/**
+ * @brief The process wide multi core configuration used by matmul_npu
+ */
+multicore_config& matmul_multicore_config() {
+    static multicore_config config = {false, NPU_MAX_CORES, {1.0f, 1.0f, 1.0f}, false, (int64_t) 1 << 27};
+    return config;
+}
+
+/**
+ * @brief The core mask of a single npu core
+ */
+rknn_core_mask npu_core(int32_t core) {
+    static const rknn_core_mask masks[NPU_MAX_CORES] = {
+        RKNN_NPU_CORE_0, RKNN_NPU_CORE_1, RKNN_NPU_CORE_2
+    };
+    return masks[core];
+}
+
+/**
+ * @brief Split a dimension between the cores by the configured ratios
+ *
+ * @return The start of every part, with the end of the dimension appended
+ */
+std::vector<int32_t> split_by_ratios(int32_t size, const multicore_config& config) {
+    int32_t cores = std::max(1, std::min(config.cores, NPU_MAX_CORES));
+    float total = 0;
+    for (int32_t i = 0; i < cores; i++) {
+        total += config.ratios[i];
+    }
+
+    std::vector<int32_t> bounds(1, 0);
+    float covered = 0;
+    for (int32_t i = 0; i < cores; i++) {
+        covered += config.ratios[i];
+        int32_t end = i == cores - 1 ? size : (int32_t) (size * (covered / total) + 0.5f);
+        end = std::max(bounds.back(), std::min(size, end));
+        if (end > bounds.back()) {
+            bounds.push_back(end);
+        }
+    }
+    return bounds;
+}
+
+/**
+ * @brief Performs one matmul on several npu cores at once
+ *
+ * The output is split by M (or N) into one part per core, each part runs
+ * on a context pinned to it's core from it's own thread, and writes it's
+ * rows (or columns) of the single contiguous result.
+ *
+ * @param result The row major (num_rows_a, num_cols_b) destination, of the epilogue's output type
+ * @param config The cores to use and the share of each one
+ * @param epilogue Applied while every part is read, nullptr for none
+ */
+void multicore_matmul_into(
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    const void* a,
+    const void* b,
+    void* result,
+    const multicore_config& config = matmul_multicore_config(),
+    const matmul_epilogue* epilogue = nullptr
+) {
+    const int32_t M = num_rows_a, K = num_cols_a, N = num_cols_b;
+    const _matmul_type_sizes sizes = matmul_type_sizes(type);
+    const rknn_tensor_type c_type = matmul_type_entry(type).c;
+    const size_t out_size = tensor_type_size(matmul_output_type(type, epilogue));
+
+    NpuTensor a_normal, b_normal;
+    a = normal_input(a, M, K, sizes.a, a_normal);
+    b = normal_input(b, K, N, sizes.b, b_normal);
+
+    uint8_t* c = (uint8_t*) result;
+
+    std::vector<int32_t> bounds = split_by_ratios(config.split_n ? N : M, config);
+
+    auto run_part = [&](int32_t core) {
+        const int32_t start = bounds[core];
+        const int32_t size = bounds[core + 1] - start;
+        const int32_t rows = config.split_n ? M : size;
+        const int32_t cols = config.split_n ? size : N;
+
+        std::shared_ptr<MatmulPlanBase> plan = MatmulCache::instance().acquire(
+            {rows, K, cols, type, 0, 0, npu_core(core)}
+        );
+
+        {
+            MatmulPhaseTimer timer(MATMUL_PHASE_COPY_IN, rows, K, cols);
+            if (config.split_n) {
+                memcpy(plan->input_a()->virt_addr, a, (size_t) M * K * sizes.a);
+                copy_block(plan->input_b()->virt_addr, (const uint8_t*) b + start * sizes.b, K, cols, N, sizes.b);
+            } else {
+                memcpy(plan->input_a()->virt_addr, (const uint8_t*) a + (size_t) start * K * sizes.a, (size_t) rows * K * sizes.a);
+                memcpy(plan->input_b()->virt_addr, b, (size_t) K * N * sizes.b);
+            }
+            MatmulStats::instance().copied_in((size_t) rows * K * sizes.a + (size_t) K * cols * sizes.b);
+        }
+
+        const uint8_t* part = (const uint8_t*) plan->run_loaded();
+
+        MatmulPhaseTimer timer(MATMUL_PHASE_READBACK, rows, K, cols);
+        MatmulStats::instance().copied_out((size_t) rows * cols * sizes.c);
+        if (epilogue != nullptr) {
+            const int32_t row0 = config.split_n ? 0 : start;
+            const int32_t col0 = config.split_n ? start : 0;
+            epilogue_block(
+                c + ((size_t) row0 * N + col0) * out_size, N, part, c_type, cols, 0, rows, cols,
+                offset_epilogue(*epilogue, row0, col0)
+            );
+        } else if (config.split_n) {
+            for (int32_t r = 0; r < M; r++) {
+                memcpy(c + ((size_t) r * N + start) * sizes.c, part + (size_t) r * cols * sizes.c, cols * sizes.c);
+            }
+        } else {
+            memcpy(c + (size_t) start * N * sizes.c, part, (size_t) rows * N * sizes.c);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t core = 1; core + 1 < bounds.size(); core++) {
+        workers.emplace_back(run_part, (int32_t) core);
+    }
+    run_part(0);
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+}
+
+/**
+ * @brief Performs one matmul on several npu cores at once, see multicore_matmul_into
+ *
+ * @param epilogue Applied while every part is read, nullptr for none
+ *
+ * @return tensor_result with the row major (num_rows_a, num_cols_b) result
+ */
+tensor_result multicore_matmul(
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    const void* a,
+    const void* b,
+    const multicore_config& config = matmul_multicore_config(),
+    const matmul_epilogue* epilogue = nullptr
+) {
+    tensor_result result = npu_alloc_tensor(
+        (size_t) num_rows_a * num_cols_b * tensor_type_size(matmul_output_type(type, epilogue))
+    );
+    multicore_matmul_into(
+        num_rows_a, num_cols_a, num_cols_b, type, a, b, result.resultMatrix->virt_addr, config, epilogue
+    );
+    return result;
+}
+
+#endif
\ No newline at end of file
@@ -1,47 +1,667 @@
 #include "matmul_api.hpp"
+#include "matmul_async.hpp"
+#include "matmul_batched.hpp"
+#include "matmul_chain.hpp"
+#include "matmul_quant.hpp"
+#include "utils/conv2d.hpp"
 #include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
 
 namespace py = pybind11;
 
 void matmul_deleter(void* result) {
-    tensor_result* r = static_cast<tensor_result*>(result);
-    // Perform cleanup actions
-    rknn_destroy_mem(r->ctx, r->resultMatrix);
-    rknn_matmul_destroy(r->ctx);
-    delete r;  // Free the struct itself
+    // releases the npu tensor of the collected array
+    delete static_cast<NpuTensor*>(result);
+}
+
+/**
+ * @brief Wrap a matmul result as a numpy array that frees the result when collected
+ * 
+ * @param shape The shape of the row major result
+ */
+template<typename To>
+py::array_t<To> result_numpy(tensor_result r, std::vector<py::ssize_t> shape) {
+
+    NpuTensor* heap_result = new NpuTensor(std::move(r)); 
+
+    py::capsule free_when_done((void*) heap_result, matmul_deleter);
+
+    std::vector<py::ssize_t> strides(shape.size());
+    py::ssize_t stride = sizeof(To);
+    for (size_t i = shape.size(); i-- > 0;) {
+        strides[i] = stride;
+        stride *= shape[i];
+    }
+
+    return py::array_t<To>(
+        shape, strides, (To*) heap_result->data(), free_when_done
+    );
+}
+
+template<typename To>
+py::array_t<To> result_numpy(tensor_result r, py::ssize_t rows, py::ssize_t cols) {
+    return result_numpy<To>(std::move(r), std::vector<py::ssize_t>{rows, cols});
+}
+
+/**
+ * @brief Check a layout requested from python, results must be row major for numpy
+ */
+_matmul_layout numpy_layout(int layout) {
+    if (layout != MATMUL_LAYOUT_NORMAL && layout != MATMUL_LAYOUT_PERF) {
+        throw std::runtime_error("layout must be 0 (normal) or 1 (performance)");
+    }
+    return (_matmul_layout) layout;
+}
+
+template<typename To, typename Ti1, typename Ti2>
+py::array_t<To> matmul_numpy(
+    py::array_t<Ti1, py::array::c_style | py::array::forcecast> a, 
+    py::array_t<Ti2, py::array::c_style | py::array::forcecast> b,
+    int layout) {
+
+    py::buffer_info a_info = a.request();
+
+    py::buffer_info b_info = b.request();
+
+    if (a_info.ndim != 2 || b_info.ndim != 2 || a_info.shape[1] != b_info.shape[0]) {
+        throw std::runtime_error("Matrices must be 2D with matching inner dimensions");
+    }
+
+    const _matmul_layout mm_layout = numpy_layout(layout);
+    tensor_result r;
+    {
+        py::gil_scoped_release release;
+        r = matmul_npu<To, Ti1, Ti2>(
+            a_info.shape[0], 
+            a_info.shape[1], 
+            b_info.shape[1], 
+            (Ti1*) a_info.ptr, 
+            (Ti2*) b_info.ptr,
+            mm_layout
+        );
+    }
+
+    return result_numpy<To>(std::move(r), a_info.shape[0], b_info.shape[1]);
+
+}
+
+template<typename To, typename Ti1, typename Ti2>
+std::shared_ptr<NpuWeights> weights_numpy(
+    py::array_t<Ti2, py::array::c_style | py::array::forcecast> b) {
+
+    py::buffer_info b_info = b.request();
+
+    if (b_info.ndim != 2) {
+        throw std::runtime_error("Weights must be 2D");
+    }
+
+    return make_weights<To, Ti1, Ti2>(b_info.shape[0], b_info.shape[1], (Ti2*) b_info.ptr);
+}
+
+/**
+ * @brief Throw when the array types do not match the weights' matmul
+ *
+ * @param converted True when an epilogue converts C to To
+ */
+template<typename To, typename Ti1>
+void numpy_check_weights(const NpuWeights& weights, bool converted) {
+    const _matmul_type_entry& entry = matmul_type_entry(weights.type());
+    if (entry.a != tensor_type_of<Ti1>() || (!converted && entry.c != tensor_type_of<To>())) {
+        throw std::runtime_error("The matrix and result types must match the types the weights were packed for");
+    }
+}
+
+template<typename To, typename Ti1>
+py::array_t<To> matmul_weights_numpy(
+    py::array_t<Ti1, py::array::c_style | py::array::forcecast> a, 
+    const NpuWeights& weights,
+    int layout) {
+
+    py::buffer_info a_info = a.request();
+
+    if (a_info.ndim != 2 || a_info.shape[1] != weights.rows()) {
+        throw std::runtime_error("Matrix must be 2D with as many columns as the weights rows");
+    }
+    numpy_check_weights<To, Ti1>(weights, false);
+
+    const _matmul_layout mm_layout = numpy_layout(layout);
+    tensor_result r;
+    {
+        py::gil_scoped_release release;
+        r = matmul_npu(a_info.shape[0], a_info.ptr, weights, mm_layout);
+    }
+
+    return result_numpy<To>(std::move(r), a_info.shape[0], weights.cols());
+}
+
+/**
+ * @brief Build a matmul_epilogue from the arguments of a python call
+ * 
+ * @param bias None or a float32 array, it must stay alive while the epilogue is used
+ * @param activation "none", "relu", "gelu" or "sigmoid"
+ * @param bias_axis "column" or "row"
+ */
+matmul_epilogue numpy_epilogue(
+    const py::array_t<float32, py::array::c_style | py::array::forcecast>& bias, bool has_bias,
+    float alpha, const std::string& activation, const std::string& bias_axis, 
+    float clamp_min, float clamp_max, py::ssize_t rows, py::ssize_t cols) {
+
+    matmul_epilogue epilogue;
+    epilogue.alpha = alpha;
+    epilogue.clamp_min = clamp_min;
+    epilogue.clamp_max = clamp_max;
 
+    if (activation == "none") {
+        epilogue.activation = EPILOGUE_NONE;
+    } else if (activation == "relu") {
+        epilogue.activation = EPILOGUE_RELU;
+    } else if (activation == "gelu") {
+        epilogue.activation = EPILOGUE_GELU;
+    } else if (activation == "sigmoid") {
+        epilogue.activation = EPILOGUE_SIGMOID;
+    } else {
+        throw std::runtime_error("activation must be none, relu, gelu or sigmoid");
+    }
+
+    if (bias_axis == "column") {
+        epilogue.bias_axis = EPILOGUE_BIAS_COLUMN;
+    } else if (bias_axis == "row") {
+        epilogue.bias_axis = EPILOGUE_BIAS_ROW;
+    } else {
+        throw std::runtime_error("bias_axis must be column or row");
+    }
+
+    if (has_bias) {
+        const py::ssize_t length = epilogue.bias_axis == EPILOGUE_BIAS_COLUMN ? cols : rows;
+        if (!bias || bias.ndim() != 1 || bias.shape(0) != length) {
+            throw std::runtime_error("The bias must be 1D with one value per column (or row) of the result");
+        }
+        epilogue.bias = bias.data();
+    }
+    return epilogue;
 }
 
 template<typename To, typename Ti1, typename Ti2>
-py::array_t<To> matmul_numpy(py::array_t<Ti1> a, py::array_t<Ti2> b) {
+py::array_t<To> matmul_fused_numpy(
+    py::array_t<Ti1, py::array::c_style | py::array::forcecast> a, 
+    py::array_t<Ti2, py::array::c_style | py::array::forcecast> b,
+    py::object bias, float alpha, const std::string& activation, const std::string& bias_axis,
+    float clamp_min, float clamp_max, int layout) {
+
+    py::buffer_info a_info = a.request();
+    py::buffer_info b_info = b.request();
+
+    if (a_info.ndim != 2 || b_info.ndim != 2 || a_info.shape[1] != b_info.shape[0]) {
+        throw std::runtime_error("Matrices must be 2D with matching inner dimensions");
+    }
+
+    py::array_t<float32, py::array::c_style | py::array::forcecast> bias_array;
+    if (!bias.is_none()) {
+        bias_array = py::array_t<float32, py::array::c_style | py::array::forcecast>::ensure(bias);
+    }
+    const matmul_epilogue epilogue = numpy_epilogue(
+        bias_array, !bias.is_none(), alpha, activation, bias_axis, clamp_min, clamp_max,
+        a_info.shape[0], b_info.shape[1]
+    );
+
+    const _matmul_layout mm_layout = numpy_layout(layout);
+    tensor_result r;
+    {
+        py::gil_scoped_release release;
+        r = matmul_npu<To, Ti1, Ti2>(
+            a_info.shape[0], a_info.shape[1], b_info.shape[1], 
+            (Ti1*) a_info.ptr, (Ti2*) b_info.ptr, epilogue, mm_layout
+        );
+    }
+
+    return result_numpy<To>(std::move(r), a_info.shape[0], b_info.shape[1]);
+}
+
+template<typename To, typename Ti1>
+py::array_t<To> matmul_fused_weights_numpy(
+    py::array_t<Ti1, py::array::c_style | py::array::forcecast> a, 
+    const NpuWeights& weights,
+    py::object bias, float alpha, const std::string& activation, const std::string& bias_axis,
+    float clamp_min, float clamp_max, int layout) {
 
     py::buffer_info a_info = a.request();
 
+    if (a_info.ndim != 2 || a_info.shape[1] != weights.rows()) {
+        throw std::runtime_error("Matrix must be 2D with as many columns as the weights rows");
+    }
+    numpy_check_weights<To, Ti1>(weights, true);
+
+    py::array_t<float32, py::array::c_style | py::array::forcecast> bias_array;
+    if (!bias.is_none()) {
+        bias_array = py::array_t<float32, py::array::c_style | py::array::forcecast>::ensure(bias);
+    }
+    matmul_epilogue epilogue = numpy_epilogue(
+        bias_array, !bias.is_none(), alpha, activation, bias_axis, clamp_min, clamp_max,
+        a_info.shape[0], weights.cols()
+    );
+    epilogue.output = tensor_type_of<To>();
+
+    const _matmul_layout mm_layout = numpy_layout(layout);
+    tensor_result r;
+    {
+        py::gil_scoped_release release;
+        r = matmul_npu(a_info.shape[0], a_info.ptr, weights, epilogue, mm_layout);
+    }
+
+    return result_numpy<To>(std::move(r), a_info.shape[0], weights.cols());
+}
+
+std::shared_ptr<QuantizedWeights> quantized_weights_numpy(
+    py::array_t<float32, py::array::c_style | py::array::forcecast> b, bool symmetric) {
+
     py::buffer_info b_info = b.request();
 
-    if (a_info.ndim != 2 || b_info.ndim != 2) {
-        std::runtime_error("Matrices must be 2D");
+    if (b_info.ndim != 2) {
+        throw std::runtime_error("Weights must be 2D");
     }
 
-    tensor_result r = matmul_npu<To, Ti1, Ti2>(
-        a_info.shape[0], 
-        a_info.shape[1], 
-        b_info.shape[1], 
-        (Ti1*) a_info.ptr, 
-        (Ti2*) b_info.ptr
+    return make_quantized_weights(b_info.shape[0], b_info.shape[1], (const float*) b_info.ptr, symmetric);
+}
+
+py::array_t<float32> matmul_quantized_numpy(
+    py::array_t<float32, py::array::c_style | py::array::forcecast> a, 
+    const QuantizedWeights& weights,
+    py::object bias, float alpha, const std::string& activation, const std::string& bias_axis,
+    float clamp_min, float clamp_max, int layout) {
+
+    py::buffer_info a_info = a.request();
+
+    if (a_info.ndim != 2 || a_info.shape[1] != weights.rows()) {
+        throw std::runtime_error("Matrix must be 2D with as many columns as the weights rows");
+    }
+
+    py::array_t<float32, py::array::c_style | py::array::forcecast> bias_array;
+    if (!bias.is_none()) {
+        bias_array = py::array_t<float32, py::array::c_style | py::array::forcecast>::ensure(bias);
+    }
+    const matmul_epilogue epilogue = numpy_epilogue(
+        bias_array, !bias.is_none(), alpha, activation, bias_axis, clamp_min, clamp_max,
+        a_info.shape[0], weights.cols()
     );
 
-    tensor_result* heap_result = new tensor_result(r.ctx, r.resultMatrix); 
+    const _matmul_layout mm_layout = numpy_layout(layout);
+    tensor_result r;
+    {
+        py::gil_scoped_release release;
+        r = quantized_matmul(a_info.shape[0], (const float*) a_info.ptr, weights, epilogue, mm_layout);
+    }
 
-    py::capsule free_when_done((void*) heap_result, matmul_deleter);
+    return result_numpy<float32>(std::move(r), a_info.shape[0], weights.cols());
+}
 
-    return py::array_t<To>(
-        {a_info.shape[0], b_info.shape[1]}, 
-        {b_info.shape[1] * sizeof(To), sizeof(To)}, 
-        (To*) heap_result->resultMatrix->virt_addr, free_when_done
+py::array_t<float32> matmul_quantized_pair_numpy(
+    py::array_t<float32, py::array::c_style | py::array::forcecast> a, 
+    py::array_t<float32, py::array::c_style | py::array::forcecast> b,
+    py::object bias, float alpha, const std::string& activation, const std::string& bias_axis,
+    float clamp_min, float clamp_max, int layout) {
+
+    py::buffer_info b_info = b.request();
+
+    if (b_info.ndim != 2) {
+        throw std::runtime_error("Matrices must be 2D with matching inner dimensions");
+    }
+
+    QuantizedWeights weights(b_info.shape[0], b_info.shape[1], (const float*) b_info.ptr);
+    return matmul_quantized_numpy(
+        a, weights, bias, alpha, activation, bias_axis, clamp_min, clamp_max, layout
     );
+}
+
+template<typename T>
+std::shared_ptr<Int8Weights> int8_weights_numpy(py::array_t<T, py::array::c_style | py::array::forcecast> b) {
+
+    py::buffer_info b_info = b.request();
 
+    if (b_info.ndim != 2) {
+        throw std::runtime_error("Weights must be 2D");
+    }
 
+    return make_int8_weights(b_info.shape[0], b_info.shape[1], (const T*) b_info.ptr);
 }
 
+std::shared_ptr<Int8Weights> int8_weights_quantized_numpy(
+    py::array_t<int8_t, py::array::c_style | py::array::forcecast> q,
+    py::array_t<float32, py::array::c_style | py::array::forcecast> scales) {
+
+    py::buffer_info q_info = q.request();
+
+    if (q_info.ndim != 2 || scales.ndim() != 1 || scales.shape(0) != q_info.shape[1]) {
+        throw std::runtime_error("Weights must be 2D with one scale per column");
+    }
+
+    return std::make_shared<Int8Weights>(
+        q_info.shape[0], q_info.shape[1], (const int8_t*) q_info.ptr, scales.data()
+    );
+}
+
+template<typename To>
+py::array_t<To> matmul_weight_only_numpy(
+    py::array_t<float16, py::array::c_style | py::array::forcecast> a, 
+    const Int8Weights& weights,
+    py::object bias, float alpha, const std::string& activation, const std::string& bias_axis,
+    float clamp_min, float clamp_max, int layout) {
+
+    py::buffer_info a_info = a.request();
+
+    if (a_info.ndim != 2 || a_info.shape[1] != weights.rows()) {
+        throw std::runtime_error("Matrix must be 2D with as many columns as the weights rows");
+    }
+
+    py::array_t<float32, py::array::c_style | py::array::forcecast> bias_array;
+    if (!bias.is_none()) {
+        bias_array = py::array_t<float32, py::array::c_style | py::array::forcecast>::ensure(bias);
+    }
+    matmul_epilogue epilogue = numpy_epilogue(
+        bias_array, !bias.is_none(), alpha, activation, bias_axis, clamp_min, clamp_max,
+        a_info.shape[0], weights.cols()
+    );
+    epilogue.output = tensor_type_of<To>();
+
+    const _matmul_layout mm_layout = numpy_layout(layout);
+    tensor_result r;
+    {
+        py::gil_scoped_release release;
+        r = weight_only_matmul(a_info.shape[0], (const float16*) a_info.ptr, weights, epilogue, mm_layout);
+    }
+
+    return result_numpy<To>(std::move(r), a_info.shape[0], weights.cols());
+}
+
+/**
+ * @brief Move a (filter_rows, filter_cols, in_channels, out_channels) filter to npu memory
+ * 
+ * @param stride, padding, dilation The (rows, cols) geometry of the convolution
+ */
+template<typename To, typename Ti1, typename Ti2>
+std::shared_ptr<NpuConv2d> conv2d_filter_numpy(
+    py::array_t<Ti2, py::array::c_style | py::array::forcecast> filter,
+    std::pair<int32_t, int32_t> stride,
+    std::pair<int32_t, int32_t> padding,
+    std::pair<int32_t, int32_t> dilation) {
+
+    py::buffer_info f_info = filter.request();
+
+    if (f_info.ndim != 4) {
+        throw std::runtime_error("The filter must be 4D (rows, cols, in_channels, out_channels)");
+    }
+    if (stride.first <= 0 || stride.second <= 0 || dilation.first <= 0 || dilation.second <= 0 ||
+        padding.first < 0 || padding.second < 0) {
+        throw std::runtime_error("stride and dilation must be positive and padding not negative");
+    }
+    conv2d_params params;
+    params.stride_rows = stride.first;
+    params.stride_cols = stride.second;
+    params.pad_rows = padding.first;
+    params.pad_cols = padding.second;
+    params.dilation_rows = dilation.first;
+    params.dilation_cols = dilation.second;
+
+    return make_conv2d<To, Ti1, Ti2>(
+        f_info.shape[0], f_info.shape[1], f_info.shape[2], f_info.shape[3], (const Ti2*) f_info.ptr, params
+    );
+}
+
+/**
+ * @brief Convolve a (batch, rows, cols, in_channels) stack or a (rows, cols, in_channels) image
+ * 
+ * @return The channels last result, with the batch axis when the input had it
+ */
+template<typename To, typename Ti1>
+py::array_t<To> conv2d_numpy(
+    py::array_t<Ti1, py::array::c_style | py::array::forcecast> img,
+    const NpuConv2d& conv,
+    int mode) {
+
+    py::buffer_info i_info = img.request();
+
+    const bool batched = i_info.ndim == 4;
+    if ((i_info.ndim != 3 && !batched) || i_info.shape[i_info.ndim - 1] != conv.in_channels()) {
+        throw std::runtime_error("Images must be (batch, rows, cols, channels) or (rows, cols, channels)"
+            " with the channels of the filter");
+    }
+    const py::ssize_t batch = batched ? i_info.shape[0] : 1;
+    const py::ssize_t rows = i_info.shape[i_info.ndim - 3], cols = i_info.shape[i_info.ndim - 2];
+    const py::ssize_t out_rows = conv.output_rows(rows), out_cols = conv.output_cols(cols);
+    if (batch == 0 || out_rows <= 0 || out_cols <= 0) {
+        throw std::runtime_error("The filter does not fit the images");
+    }
+    if (mode < CONV2D_AUTO || mode > CONV2D_STREAM) {
+        throw std::runtime_error("mode must be 0 (auto), 1 (im2col) or 2 (stream)");
+    }
+
+    tensor_result r;
+    {
+        py::gil_scoped_release release;
+        r = conv.run(batch, rows, cols, i_info.ptr, (conv2d_mode) mode);
+    }
+
+    std::vector<py::ssize_t> shape = {out_rows, out_cols, conv.out_channels()};
+    if (batched) {
+        shape.insert(shape.begin(), batch);
+    }
+    return result_numpy<To>(std::move(r), shape);
+}
+
+/**
+ * @brief Batched matmul of a (batch, M, K) stack by a (batch, K, N) stack or a (K, N) matrix
+ * 
+ * @return The (batch, M, N) stack of the results
+ */
+template<typename To, typename Ti1, typename Ti2>
+py::array_t<To> matmul_batched_numpy(
+    py::array_t<Ti1, py::array::c_style | py::array::forcecast> a, 
+    py::array_t<Ti2, py::array::c_style | py::array::forcecast> b, 
+    int layout) {
+
+    py::buffer_info a_info = a.request();
+    py::buffer_info b_info = b.request();
+
+    const bool stacked = b_info.ndim == 3;
+    if (a_info.ndim != 3 || (b_info.ndim != 2 && !stacked) || a_info.shape[0] == 0) {
+        throw std::runtime_error("a must be a non empty 3D stack and b a 2D matrix or a 3D stack");
+    }
+    const py::ssize_t batch = a_info.shape[0], M = a_info.shape[1], K = a_info.shape[2];
+    const py::ssize_t N = b_info.shape[b_info.ndim - 1];
+    if (b_info.shape[b_info.ndim - 2] != K || (stacked && b_info.shape[0] != batch)) {
+        throw std::runtime_error("The stacks must have the same batch and matching inner dimensions");
+    }
+    const _matmul_layout mm_layout = numpy_layout(layout);
+
+    tensor_result r;
+    {
+        py::gil_scoped_release release;
+        r = matmul_npu_batched<To, Ti1, Ti2>(
+            batch, M, K, N, (const Ti1*) a_info.ptr, M * K, 
+            (const Ti2*) b_info.ptr, stacked ? K * N : 0, mm_layout
+        );
+    }
+
+    return result_numpy<To>(std::move(r), std::vector<py::ssize_t>{batch, M, N});
+}
+
+/**
+ * @brief Batched matmul of a (batch, M, K) stack by packed weights
+ */
+template<typename To, typename Ti1>
+py::array_t<To> matmul_batched_weights_numpy(
+    py::array_t<Ti1, py::array::c_style | py::array::forcecast> a, 
+    const NpuWeights& weights,
+    int layout) {
+
+    py::buffer_info a_info = a.request();
+
+    if (a_info.ndim != 3 || a_info.shape[0] == 0 || a_info.shape[2] != weights.rows()) {
+        throw std::runtime_error("a must be a non empty 3D stack with as many columns as the weights rows");
+    }
+    numpy_check_weights<To, Ti1>(weights, false);
+    const py::ssize_t batch = a_info.shape[0], M = a_info.shape[1];
+    const _matmul_layout mm_layout = numpy_layout(layout);
+
+    tensor_result r;
+    {
+        py::gil_scoped_release release;
+        r = matmul_npu_batched(batch, M, a_info.ptr, M * weights.rows(), weights, mm_layout);
+    }
+
+    return result_numpy<To>(std::move(r), std::vector<py::ssize_t>{batch, M, weights.cols()});
+}
+
+/**
+ * @brief Multiplies a list of 2D float16 or int8 arrays on the npu, in the order with the fewest operations
+ */
+template<typename To>
+py::array_t<To> matmul_chain_numpy(py::list mats, int layout) {
+
+    std::vector<py::array> arrays;
+    std::vector<chain_operand> operands;
+    for (py::handle item : mats) {
+        py::array array = py::array::ensure(item, py::array::c_style);
+        if (!array || array.ndim() != 2) {
+            throw std::runtime_error("Matrices must be 2D arrays");
+        }
+        const char kind = array.dtype().kind();
+        rknn_tensor_type type;
+        if (kind == 'f' && array.itemsize() == 2) {
+            type = RKNN_TENSOR_FLOAT16;
+        } else if (kind == 'i' && array.itemsize() == 1) {
+            type = RKNN_TENSOR_INT8;
+        } else {
+            throw std::runtime_error("Matrices must be float16 or int8");
+        }
+        operands.push_back({
+            (int32_t) array.shape(0), (int32_t) array.shape(1), type, array.data()
+        });
+        arrays.push_back(std::move(array));
+    }
+
+    if (operands.size() < 2) {
+        throw std::runtime_error("A matmul chain needs at least two matrices");
+    }
+    for (size_t i = 0; i + 1 < operands.size(); i++) {
+        if (operands[i].cols != operands[i + 1].rows) {
+            throw std::runtime_error("Every matrix must have as many columns as the next one has rows");
+        }
+    }
+    const rknn_tensor_type output_type = tensor_type_of<To>();
+    if (order_matmul_chain(operands, output_type).macs < 0) {
+        throw std::runtime_error("The npu has no matmul for these input and output types");
+    }
+    const _matmul_layout mm_layout = numpy_layout(layout);
+
+    tensor_result r;
+    {
+        py::gil_scoped_release release;
+        r = matmul_chain(operands, output_type, mm_layout);
+    }
+
+    return result_numpy<To>(std::move(r), operands.front().rows, operands.back().cols);
+}
+
+/**
+ * @brief A matmul submitted from python, result() turns it into a numpy array
+ *
+ * Holds the input arrays until the matmul finished, the future is declared
+ * last so it is destroyed (and waited for) before them.
+ */
+class NumpyFuture {
+
+    private:
+
+        std::vector<py::object> inputs;
+        std::shared_ptr<NpuWeights> weights;
+        py::ssize_t rows, cols;
+        py::object (*wrap)(tensor_result, py::ssize_t, py::ssize_t);
+        MatmulFuture future;
+
+    public:
+
+        NumpyFuture(
+            MatmulFuture future, std::vector<py::object> inputs, std::shared_ptr<NpuWeights> weights,
+            py::ssize_t rows, py::ssize_t cols, py::object (*wrap)(tensor_result, py::ssize_t, py::ssize_t))
+            : inputs(std::move(inputs)), weights(std::move(weights)), rows(rows), cols(cols), 
+              wrap(wrap), future(std::move(future)) {}
+
+        ~NumpyFuture() {
+            if (future.valid()) {
+                py::gil_scoped_release release;
+                future.wait();
+            }
+        }
+
+        bool done() const {
+            return !future.valid() || future.ready();
+        }
+
+        void wait() const {
+            if (future.valid()) {
+                py::gil_scoped_release release;
+                future.wait();
+            }
+        }
+
+        py::object result() {
+            if (!future.valid()) {
+                throw std::runtime_error("The result was already taken");
+            }
+            wait();
+            py::object array = wrap(future.get(), rows, cols);
+            inputs.clear();
+            weights.reset();
+            return array;
+        }
+};
+
+template<typename To>
+py::object result_object(tensor_result r, py::ssize_t rows, py::ssize_t cols) {
+    return result_numpy<To>(std::move(r), rows, cols);
+}
+
+template<typename To, typename Ti1, typename Ti2>
+std::shared_ptr<NumpyFuture> submit_numpy(
+    py::array_t<Ti1, py::array::c_style | py::array::forcecast> a, 
+    py::array_t<Ti2, py::array::c_style | py::array::forcecast> b, 
+    int layout) {
+
+    py::buffer_info a_info = a.request();
+    py::buffer_info b_info = b.request();
+
+    if (a_info.ndim != 2 || b_info.ndim != 2 || a_info.shape[1] != b_info.shape[0]) {
+        throw std::runtime_error("Matrices must be 2D with matching inner dimensions");
+    }
+
+    MatmulFuture future = submit_matmul<To, Ti1, Ti2>(
+        a_info.shape[0], a_info.shape[1], b_info.shape[1], 
+        (const Ti1*) a_info.ptr, (const Ti2*) b_info.ptr, numpy_layout(layout)
+    );
+
+    return std::make_shared<NumpyFuture>(
+        std::move(future), std::vector<py::object>{a, b}, nullptr,
+        a_info.shape[0], b_info.shape[1], &result_object<To>
+    );
+}
+
+template<typename To, typename Ti1>
+std::shared_ptr<NumpyFuture> submit_weights_numpy(
+    py::array_t<Ti1, py::array::c_style | py::array::forcecast> a, 
+    std::shared_ptr<NpuWeights> weights,
+    int layout) {
+
+    py::buffer_info a_info = a.request();
+
+    if (a_info.ndim != 2 || a_info.shape[1] != weights->rows()) {
+        throw std::runtime_error("Matrix must be 2D with as many columns as the weights rows");
+    }
+    numpy_check_weights<To, Ti1>(*weights, false);
+
+    MatmulFuture future = submit_matmul(a_info.shape[0], a_info.ptr, *weights, numpy_layout(layout));
+
+    return std::make_shared<NumpyFuture>(
+        std::move(future), std::vector<py::object>{a}, weights,
+        a_info.shape[0], weights->cols(), &result_object<To>
+    );
+}
@@ -0,0 +1,206 @@
+#ifndef MATMUL_PLAN
+#define MATMUL_PLAN
+
+#include "api_wrapper/matmul_ctx.hpp"
+
+/**
+ * @brief A matmul operation that is created once and run many times
+ *
+ * Holds the rknn context and the A, B and C tensors of a single
+ * (M, K, N, type) problem, so repeated multiplications of the same
+ * shape only pay for the copy-in and the run.
+ *
+ * @note The plan is not thread safe, use one plan per thread.
+ */
+class MatmulPlanBase {
+
+    protected:
+
+        std::shared_ptr<_matmul_ctx> ctx;
+        rknn_tensor_mem* imported_a = nullptr;
+        rknn_tensor_mem* imported_b = nullptr;
+        rknn_core_mask core_mask;
+
+    public:
+
+        /**
+         * @brief Create the rknn context and the tensors for the operation
+         *
+         * @param num_rows_a The number of rows in the first input mat
+         * @param num_cols_a The number of columns in the first input mat
+         * @param num_cols_b The number of columns in the second input mat
+         * @param type The matmul type flag
+         * @param ac_layout The layout of matrices A and C (0 - normal, 1 - native)
+         * @param b_layout The layout of matrix B (0 - normal, 1 - native)
+         * @param core_mask The npu cores to run on, the runtime chooses with RKNN_NPU_CORE_AUTO
+         */
+        MatmulPlanBase(
+            int32_t num_rows_a, int32_t num_cols_a, int32_t num_cols_b, _rknn_matmul_type type,
+            int16_t ac_layout = 0, int16_t b_layout = 0, 
+            rknn_core_mask core_mask = RKNN_NPU_CORE_AUTO
+        ) : ctx(
+                make_matmul(num_rows_a, num_cols_a, num_cols_b, type, ac_layout, b_layout), 
+                destroy_matmul
+            ), core_mask(core_mask) {
+            if (core_mask != RKNN_NPU_CORE_AUTO) {
+                int ret = rknn_matmul_set_core_mask(ctx->ctx, core_mask);
+                if (ret < 0) {
+                    printf("rknn_matmul_set_core_mask fail! ret=%d\n", ret);
+                    abort();
+                }
+            }
+        }
+
+        MatmulPlanBase(const MatmulPlanBase&) = delete;
+        MatmulPlanBase& operator=(const MatmulPlanBase&) = delete;
+
+        /**
+         * @brief Copy new input data to the npu and run the operation
+         *
+         * @note Inputs that already live in npu memory are bound without a copy,
+         *       host inputs are row major and packed to a native layout during the copy
+         *
+         * @param a The data of the first input matrix
+         * @param b The data of the second input matrix
+         *
+         * @return Pointer to the result, valid until the next run or the plan is destroyed,
+         *         in the native layout when the plan has AC_layout = 1 (see unpack_native)
+         */
+        void* run(const void* a, const void* b) {
+            run_into(a, b, ctx->matrixC);
+            return ctx->matrixC->virt_addr;
+        }
+
+        /**
+         * @brief Copy new input data to the npu and run the operation into an output tensor
+         *
+         * @param a The data of the first input matrix
+         * @param b The data of the second input matrix
+         * @param c Tensor created on this plan's context, at least io_attr().C.size bytes
+         */
+        void run_into(const void* a, const void* b, rknn_tensor_mem* c) {
+            load(a, b);
+            run_bound(c);
+        }
+
+        /**
+         * @brief Copy (or bind) the inputs without running, the first half of run_into
+         *
+         * Lets the copy-in of one plan overlap the npu run of another.
+         */
+        void load(const void* a, const void* b) {
+            const rknn_matmul_info& info = ctx->info;
+            imported_a = bind_matrix_data(
+                ctx.get(), ctx->matrixA, &ctx->io_attr.A, a, info.M, info.K,
+                info.AC_layout ? NPU_LAYOUT_NATIVE_AC : NPU_LAYOUT_NORMAL
+            );
+            imported_b = bind_matrix_data(
+                ctx.get(), ctx->matrixB, &ctx->io_attr.B, b, info.K, info.N,
+                info.B_layout ? NPU_LAYOUT_NATIVE_B : NPU_LAYOUT_NORMAL
+            );
+        }
+
+        /**
+         * @brief Run on the inputs bound by load, the second half of run_into
+         *
+         * @param c Tensor created on this plan's context, at least io_attr().C.size bytes
+         */
+        void run_bound(rknn_tensor_mem* c) {
+            rknn_matmul_set_io_mem(ctx->ctx, c, &ctx->io_attr.C);
+            {
+                MatmulPhaseTimer timer(MATMUL_PHASE_RUN, ctx->info.M, ctx->info.K, ctx->info.N, core_mask);
+                rknn_matmul_run(ctx->ctx);
+            }
+
+            if (imported_a != nullptr) {
+                rknn_destroy_mem(ctx->ctx, imported_a);
+                imported_a = nullptr;
+            }
+            if (imported_b != nullptr) {
+                rknn_destroy_mem(ctx->ctx, imported_b);
+                imported_b = nullptr;
+            }
+        }
+
+        /**
+         * @brief Run on the data already written to input_a and input_b
+         *
+         * @return Pointer to the result, valid until the next run or the plan is destroyed
+         */
+        void* run_loaded() {
+            rknn_matmul_set_io_mem(ctx->ctx, ctx->matrixA, &ctx->io_attr.A);
+            rknn_matmul_set_io_mem(ctx->ctx, ctx->matrixB, &ctx->io_attr.B);
+            rknn_matmul_set_io_mem(ctx->ctx, ctx->matrixC, &ctx->io_attr.C);
+            {
+                MatmulPhaseTimer timer(MATMUL_PHASE_RUN, ctx->info.M, ctx->info.K, ctx->info.N, core_mask);
+                rknn_matmul_run(ctx->ctx);
+            }
+            return ctx->matrixC->virt_addr;
+        }
+
+        /**
+         * @brief The plan's own input tensors, for callers that fill them in place
+         */
+        rknn_tensor_mem* input_a() const { return ctx->matrixA; }
+        rknn_tensor_mem* input_b() const { return ctx->matrixB; }
+
+        /**
+         * @brief Handle that keeps the rknn context alive after the plan is gone,
+         *        used by results whose tensors were created on this context
+         */
+        std::shared_ptr<void> keep_alive() const { return ctx; }
+
+        /**
+         * @brief The npu memory held by the plan, in bytes
+         */
+        size_t bytes() const { 
+            return (size_t) ctx->io_attr.A.size + ctx->io_attr.B.size + ctx->io_attr.C.size; 
+        }
+
+        /**
+         * @brief The tensor memory that holds the result of the last run
+         */
+        rknn_tensor_mem* result() const { return ctx->matrixC; }
+
+        rknn_context context() const { return ctx->ctx; }
+        const rknn_matmul_info& info() const { return ctx->info; }
+        const rknn_matmul_io_attr& io_attr() const { return ctx->io_attr; }
+
+        int32_t rows() const { return ctx->info.M; }
+        int32_t inner() const { return ctx->info.K; }
+        int32_t cols() const { return ctx->info.N; }
+        _rknn_matmul_type type() const { return ctx->info.type; }
+};
+
+/**
+ * @brief Typed version of MatmulPlanBase
+ *
+ * @param To - The type of the output matrix
+ * @param Ti1 - The type of the first input matrix
+ * @param Ti2 - The type of the second input matrix
+ */
+template<typename To, typename Ti1, typename Ti2>
+class MatmulPlan : public MatmulPlanBase {
+
+    public:
+
+        MatmulPlan(
+            int32_t num_rows_a, int32_t num_cols_a, int32_t num_cols_b,
+            int16_t ac_layout = 0, int16_t b_layout = 0
+        ) : MatmulPlanBase(
+                num_rows_a, num_cols_a, num_cols_b, choose_matmul_type<To, Ti1, Ti2>(),
+                ac_layout, b_layout
+            ) {}
+
+        /**
+         * @brief Copy new input data to the npu and run the operation
+         *
+         * @return Pointer to the (num_rows_a, num_cols_b) result,
+         *         valid until the next run or the plan is destroyed
+         */
+        To* run(const Ti1* a, const Ti2* b) {
+            return (To*) MatmulPlanBase::run(a, b);
+        }
+};
+
+#endif
@@ -0,0 +1,409 @@
+#ifndef MATMUL_QUANT
+#define MATMUL_QUANT
+
+#include "api_wrapper/matmul_api.hpp"
+#include <algorithm>
+#include <cmath>
+#include <type_traits>
+#include <vector>
+
+/**
+ * The affine int8 quantization of a tensor, real = scale * (q - zero_point)
+ */
+struct quant_params {
+    float scale = 1.0f;
+    int32_t zero_point = 0;
+};
+
+/**
+ * @brief The quantization of the range [low, high]
+ *
+ * @param symmetric Map [-max |x|, max |x|] to [-127, 127] with a zero point of 0,
+ *                  otherwise map [low, high] (widened to hold 0) to [-128, 127]
+ */
+quant_params quant_params_for_range(float low, float high, bool symmetric) {
+    quant_params params;
+    low = std::min(low, 0.0f);
+    high = std::max(high, 0.0f);
+    if (symmetric) {
+        const float bound = std::max(-low, high);
+        params.scale = bound > 0.0f ? bound / 127.0f : 1.0f;
+        return params;
+    }
+    params.scale = high > low ? (high - low) / 255.0f : 1.0f;
+    params.zero_point = std::min(127, std::max(-128, (int32_t) std::nearbyint(-128.0f - low / params.scale)));
+    return params;
+}
+
+/**
+ * @brief The per tensor quantization of count floats, from their min and max
+ */
+quant_params choose_quant_params(const float* data, size_t count, bool symmetric = false) {
+    float low = 0.0f, high = 0.0f;
+    #pragma omp parallel for simd reduction(min:low) reduction(max:high)
+    for (size_t i = 0; i < count; i++) {
+        low = std::min(low, data[i]);
+        high = std::max(high, data[i]);
+    }
+    return quant_params_for_range(low, high, symmetric);
+}
+
+/**
+ * @brief Quantize count floats to int8 with one scale and zero point
+ */
+void quantize_int8(const float* src, int8_t* dst, size_t count, quant_params params) {
+    const float inv_scale = 1.0f / params.scale;
+    const float zero_point = (float) params.zero_point;
+    #pragma omp parallel for simd schedule(static)
+    for (size_t i = 0; i < count; i++) {
+        const float q = std::nearbyint(src[i] * inv_scale) + zero_point;
+        dst[i] = (int8_t) std::min(127.0f, std::max(-128.0f, q));
+    }
+}
+
+/**
+ * @brief The sum of every row of a row major int8 matrix, as floats for the epilogue
+ */
+void int8_row_sums(const int8_t* data, int32_t rows, int32_t cols, float* sums) {
+    #pragma omp parallel for schedule(static)
+    for (int32_t r = 0; r < rows; r++) {
+        const int8_t* row = data + (size_t) r * cols;
+        int32_t sum = 0;
+        #pragma omp simd reduction(+:sum)
+        for (int32_t c = 0; c < cols; c++) {
+            sum += row[c];
+        }
+        sums[r] = (float) sum;
+    }
+}
+
+/**
+ * The number of columns a thread quantizes at a time
+ */
+constexpr int32_t INT8_COLUMN_BLOCK = 64;
+
+/**
+ * @brief Quantize the columns of a row major matrix to int8, each with it's own scale
+ *
+ * @param b The (rows, cols) float or float16 matrix
+ * @param symmetric See quant_params_for_range
+ * @param q The (rows, cols) quantized matrix
+ * @param scales, zero_points The cols scales and zero points
+ */
+template<typename T>
+void quantize_int8_columns(
+    const T* b, int32_t rows, int32_t cols, bool symmetric, int8_t* q, float* scales, float* zero_points) {
+
+    std::vector<float> low(cols, 0.0f), high(cols, 0.0f), inv_scales(cols);
+
+    // every thread owns a block of columns, the rows are streamed through it
+    constexpr int32_t block = INT8_COLUMN_BLOCK;
+    #pragma omp parallel for schedule(static)
+    for (int32_t c0 = 0; c0 < cols; c0 += block) {
+        const int32_t count = std::min(block, cols - c0);
+        float* lo = low.data() + c0;
+        float* hi = high.data() + c0;
+        for (int32_t r = 0; r < rows; r++) {
+            const T* row = b + (size_t) r * cols + c0;
+            #pragma omp simd
+            for (int32_t j = 0; j < count; j++) {
+                lo[j] = std::min(lo[j], (float) row[j]);
+                hi[j] = std::max(hi[j], (float) row[j]);
+            }
+        }
+        for (int32_t j = c0; j < c0 + count; j++) {
+            quant_params params = quant_params_for_range(low[j], high[j], symmetric);
+            scales[j] = params.scale;
+            zero_points[j] = (float) params.zero_point;
+            inv_scales[j] = 1.0f / params.scale;
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int32_t r = 0; r < rows; r++) {
+        const T* row = b + (size_t) r * cols;
+        int8_t* q_row = q + (size_t) r * cols;
+        #pragma omp simd
+        for (int32_t c = 0; c < cols; c++) {
+            const float value = std::nearbyint((float) row[c] * inv_scales[c]) + zero_points[c];
+            q_row[c] = (int8_t) std::min(127.0f, std::max(-128.0f, value));
+        }
+    }
+}
+
+/**
+ * @brief Float weights quantized to int8 per column and packed in npu memory
+ *
+ * Column n of B becomes scales[n] * (q - zero_points[n]). The weights are multiplied
+ * as int8 x int8 -> int32 and the dequantization and the zero point correction are
+ * folded into the epilogue, with the terms that only depend on B computed here once.
+ */
+class QuantizedWeights {
+
+    private:
+
+        std::shared_ptr<NpuWeights> packed;
+        std::vector<float> scales;
+        std::vector<float> zero_points;
+        std::vector<float> column_sums;
+        bool symmetric;
+
+    public:
+
+        /**
+         * @brief Quantize and pack the weights
+         *
+         * @param num_rows_b The number of rows in the weights (K)
+         * @param num_cols_b The number of columns in the weights (N)
+         * @param b The (K, N) row major float weights
+         * @param symmetric Quantize every column symmetrically (zero point 0), which
+         *                  drops the per row correction term from every matmul
+         */
+        QuantizedWeights(int32_t num_rows_b, int32_t num_cols_b, const float* b, bool symmetric = true)
+            : scales(num_cols_b), zero_points(num_cols_b), column_sums(num_cols_b, 0.0f), symmetric(symmetric) {
+
+            std::vector<int8_t> q((size_t) num_rows_b * num_cols_b);
+            quantize_int8_columns(b, num_rows_b, num_cols_b, symmetric, q.data(), scales.data(), zero_points.data());
+
+            constexpr int32_t block = INT8_COLUMN_BLOCK;
+            #pragma omp parallel for schedule(static)
+            for (int32_t c0 = 0; c0 < num_cols_b; c0 += block) {
+                const int32_t count = std::min(block, num_cols_b - c0);
+                int32_t sums[block] = {0};
+                for (int32_t r = 0; r < num_rows_b; r++) {
+                    const int8_t* q_row = q.data() + (size_t) r * num_cols_b + c0;
+                    #pragma omp simd
+                    for (int32_t j = 0; j < count; j++) {
+                        sums[j] += q_row[j];
+                    }
+                }
+                for (int32_t j = 0; j < count; j++) {
+                    column_sums[c0 + j] = (float) sums[j];
+                }
+            }
+
+            packed = make_weights<int32_t, int8_t, int8_t>(num_rows_b, num_cols_b, q.data());
+        }
+
+        QuantizedWeights(const QuantizedWeights&) = delete;
+        QuantizedWeights& operator=(const QuantizedWeights&) = delete;
+
+        /**
+         * @brief The packed int8 weights
+         */
+        const NpuWeights& weights() const { return *packed; }
+
+        int32_t rows() const { return packed->rows(); }
+        int32_t cols() const { return packed->cols(); }
+        bool is_symmetric() const { return symmetric; }
+
+        const float* column_scales() const { return scales.data(); }
+        const float* column_zero_points() const { return zero_points.data(); }
+
+        /**
+         * @brief The sum of every column of the quantized weights
+         */
+        const float* quantized_column_sums() const { return column_sums.data(); }
+};
+
+/**
+ * @brief Quantize float weights for quantized_matmul
+ */
+std::shared_ptr<QuantizedWeights> make_quantized_weights(
+    int32_t num_rows_b, int32_t num_cols_b, const float* b, bool symmetric = true) {
+    return std::make_shared<QuantizedWeights>(num_rows_b, num_cols_b, b, symmetric);
+}
+
+/**
+ * @brief Multiply float activations by quantized weights as an int8 matmul on the npu
+ *
+ * A is quantized per tensor straight into npu memory, the npu computes the int32
+ * product and the epilogue dequantizes it while C is read out:
+ *
+ *     C = scale_a * scale_b[n] * (acc - zp_a * sum_k qb[k, n] - zp_b[n] * sum_k qa[m, k] + K * zp_a * zp_b[n])
+ *
+ * @param num_rows_a The number of rows in A
+ * @param a The (num_rows_a, weights.rows()) row major float activations
+ * @param weights The quantized weights
+ * @param a_params The quantization of A
+ * @param epilogue Bias, activation, clamp and output type applied after the
+ *                 dequantization, alpha scales the result. The output is float32 by default.
+ * @param layout MATMUL_LAYOUT_NORMAL or MATMUL_LAYOUT_PERF
+ *
+ * @return tensor_result with the (num_rows_a, weights.cols()) result, free it with release_result
+ */
+tensor_result quantized_matmul(
+    uint32_t num_rows_a, const float* a, const QuantizedWeights& weights, quant_params a_params,
+    const matmul_epilogue& epilogue = matmul_epilogue(), _matmul_layout layout = MATMUL_LAYOUT_NORMAL) {
+
+    const int32_t k = weights.rows();
+    const int32_t n = weights.cols();
+    const size_t count = (size_t) num_rows_a * k;
+
+    NpuTensor qa(npu_alloc_tensor(count));
+    {
+        MatmulPhaseTimer timer(MATMUL_PHASE_COPY_IN, num_rows_a, k, 0);
+        MatmulStats::instance().copied_in(count * sizeof(float));
+        quantize_int8(a, (int8_t*) qa.data(), count, a_params);
+    }
+
+    // terms of the zero point correction, zero when both zero points are
+    const float zp_a = (float) a_params.zero_point;
+    std::vector<float> offsets;
+    if (a_params.zero_point != 0 || !weights.is_symmetric()) {
+        offsets.resize(n);
+        const float* sums = weights.quantized_column_sums();
+        const float* zp_b = weights.column_zero_points();
+        #pragma omp simd
+        for (int32_t c = 0; c < n; c++) {
+            offsets[c] = zp_a * ((float) k * zp_b[c] - sums[c]);
+        }
+    }
+    std::vector<float> row_sums, factors;
+    if (!weights.is_symmetric()) {
+        row_sums.resize(num_rows_a);
+        int8_row_sums((const int8_t*) qa.data(), num_rows_a, k, row_sums.data());
+        factors.resize(n);
+        const float* zp_b = weights.column_zero_points();
+        #pragma omp simd
+        for (int32_t c = 0; c < n; c++) {
+            factors[c] = -zp_b[c];
+        }
+    }
+
+    matmul_epilogue dequant = epilogue;
+    dequant.alpha = epilogue.alpha * a_params.scale;
+    dequant.column_scale = weights.column_scales();
+    dequant.column_offset = offsets.empty() ? nullptr : offsets.data();
+    dequant.row_offset = row_sums.empty() ? nullptr : row_sums.data();
+    dequant.column_factor = factors.empty() ? nullptr : factors.data();
+    if (dequant.output == RKNN_TENSOR_TYPE_MAX) {
+        dequant.output = RKNN_TENSOR_FLOAT32;
+    }
+
+    return matmul_npu(num_rows_a, qa.data(), weights.weights(), dequant, layout);
+}
+
+/**
+ * @brief Multiply float activations by quantized weights, A is quantized from it's
+ *        own min and max (dynamic quantization)
+ */
+tensor_result quantized_matmul(
+    uint32_t num_rows_a, const float* a, const QuantizedWeights& weights,
+    const matmul_epilogue& epilogue = matmul_epilogue(), _matmul_layout layout = MATMUL_LAYOUT_NORMAL) {
+    return quantized_matmul(
+        num_rows_a, a, weights, choose_quant_params(a, (size_t) num_rows_a * weights.rows()),
+        epilogue, layout
+    );
+}
+
+/**
+ * @brief Multiply two float matrices as an int8 matmul on the npu
+ *
+ * A is quantized per tensor and B per column. Quantize B once with
+ * make_quantized_weights when it is multiplied more than once.
+ */
+tensor_result quantized_matmul(
+    uint32_t num_rows_a, uint32_t num_cols_a, uint32_t num_cols_b, const float* a, const float* b,
+    const matmul_epilogue& epilogue = matmul_epilogue(), _matmul_layout layout = MATMUL_LAYOUT_NORMAL) {
+    QuantizedWeights weights(num_cols_a, num_cols_b, b);
+    return quantized_matmul(num_rows_a, a, weights, epilogue, layout);
+}
+
+/**
+ * @brief Weights quantized to int8 per column for the float16 x int8 -> float16 matmul
+ *
+ * Weight only quantization: the activations stay float16 and only the weights are
+ * int8, which halves the memory and the bandwidth of the weights compared to float16.
+ * Column n of B is scales[n] * q, the scales are applied while C is read out.
+ *
+ * @note The npu accumulates in float32, but C is float16 and the scales are only
+ *       applied after it is read, so |A x q| has to fit float16 (below 65504). With
+ *       q up to 127 that holds while K * max|a| * 127 < 65504, e.g. |a| <= 1 for
+ *       K <= 512. Scale the activations down (and the epilogue alpha up) otherwise.
+ */
+class Int8Weights {
+
+    private:
+
+        std::shared_ptr<NpuWeights> packed;
+        std::vector<float> scales;
+
+    public:
+
+        /**
+         * @brief Quantize the weights symmetrically per column and pack them
+         *
+         * @param num_rows_b The number of rows in the weights (K)
+         * @param num_cols_b The number of columns in the weights (N)
+         * @param b The (K, N) row major float or float16 weights
+         */
+        template<typename T>
+        Int8Weights(int32_t num_rows_b, int32_t num_cols_b, const T* b) : scales(num_cols_b) {
+            static_assert(
+                std::is_same<T, float32>::value || std::is_same<T, float16>::value,
+                "only float or float16 weights are quantized, pass the scales of int8 weights"
+            );
+            std::vector<int8_t> q((size_t) num_rows_b * num_cols_b);
+            std::vector<float> zero_points(num_cols_b);
+            quantize_int8_columns(b, num_rows_b, num_cols_b, true, q.data(), scales.data(), zero_points.data());
+            packed = make_weights<float16, float16, int8_t>(num_rows_b, num_cols_b, q.data());
+        }
+
+        /**
+         * @brief Pack weights that were quantized offline
+         *
+         * @param q The (K, N) row major int8 weights
+         * @param column_scales The N scales, column n of the weights is column_scales[n] * q
+         */
+        Int8Weights(int32_t num_rows_b, int32_t num_cols_b, const int8_t* q, const float* column_scales)
+            : packed(make_weights<float16, float16, int8_t>(num_rows_b, num_cols_b, q)),
+              scales(column_scales, column_scales + num_cols_b) {}
+
+        Int8Weights(const Int8Weights&) = delete;
+        Int8Weights& operator=(const Int8Weights&) = delete;
+
+        /**
+         * @brief The packed int8 weights
+         */
+        const NpuWeights& weights() const { return *packed; }
+
+        int32_t rows() const { return packed->rows(); }
+        int32_t cols() const { return packed->cols(); }
+
+        const float* column_scales() const { return scales.data(); }
+};
+
+/**
+ * @brief Quantize float or float16 weights for weight_only_matmul
+ */
+template<typename T>
+std::shared_ptr<Int8Weights> make_int8_weights(int32_t num_rows_b, int32_t num_cols_b, const T* b) {
+    return std::make_shared<Int8Weights>(num_rows_b, num_cols_b, b);
+}
+
+/**
+ * @brief Multiply float16 activations by int8 weights on the npu
+ *
+ * Runs RKNN_FLOAT16_MM_INT8_TO_FLOAT16 against the packed weights, the per column
+ * scales are applied by the epilogue while C is read out.
+ *
+ * @param num_rows_a The number of rows in A
+ * @param a The (num_rows_a, weights.rows()) float16 activations
+ * @param weights The int8 weights
+ * @param epilogue Bias, activation, clamp and output type applied after the
+ *                 scales. The output is float16 by default.
+ * @param layout MATMUL_LAYOUT_NORMAL or MATMUL_LAYOUT_PERF
+ *
+ * @return tensor_result with the (num_rows_a, weights.cols()) result, free it with release_result
+ */
+tensor_result weight_only_matmul(
+    uint32_t num_rows_a, const float16* a, const Int8Weights& weights,
+    const matmul_epilogue& epilogue = matmul_epilogue(), _matmul_layout layout = MATMUL_LAYOUT_NORMAL) {
+
+    matmul_epilogue scaled = epilogue;
+    scaled.column_scale = weights.column_scales();
+    return matmul_npu(num_rows_a, a, weights.weights(), scaled, layout);
+}
+
+#endif
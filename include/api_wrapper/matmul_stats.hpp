@@ -0,0 +1,178 @@
+#ifndef MATMUL_STATS
+#define MATMUL_STATS
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+
+/**
+ * The phases of a matmul on the npu
+ */
+enum matmul_phase {
+    MATMUL_PHASE_CREATE = 0,    /* rknn_matmul_create */
+    MATMUL_PHASE_ALLOC,         /* rknn_create_mem */
+    MATMUL_PHASE_COPY_IN,       /* copying and converting the inputs to npu memory */
+    MATMUL_PHASE_RUN,           /* rknn_matmul_run */
+    MATMUL_PHASE_READBACK,      /* copying and unpacking results out of the npu tensors */
+    MATMUL_PHASE_DESTROY,       /* rknn_matmul_destroy and rknn_destroy_mem */
+    MATMUL_PHASE_COUNT
+};
+
+/**
+ * @brief The name of a phase, as reported by the python stats
+ */
+const char* matmul_phase_name(matmul_phase phase) {
+    static const char* names[MATMUL_PHASE_COUNT] = {
+        "create", "alloc", "copy_in", "run", "readback", "destroy"
+    };
+    return names[phase];
+}
+
+/**
+ * Time spent in one phase
+ *
+ * @param count The number of times the phase ran
+ * @param total_ns, max_ns The total and the longest duration
+ */
+struct matmul_phase_stats {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+/**
+ * Snapshot of the instrumentation counters
+ *
+ * @param bytes_in The bytes copied to npu memory, bytes_out the bytes copied out of it
+ * @param contexts_created, contexts_destroyed The rknn matmul contexts
+ * @param buffers_allocated, buffers_freed The npu tensors created and destroyed
+ */
+struct matmul_stats {
+    matmul_phase_stats phases[MATMUL_PHASE_COUNT];
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t contexts_created;
+    uint64_t contexts_destroyed;
+    uint64_t buffers_allocated;
+    uint64_t buffers_freed;
+};
+
+/**
+ * @brief Process wide counters of the time and the bytes spent in every phase
+ *
+ * Off by default, MATNPU_STATS=1 turns it on at startup. When disabled every
+ * hook is a single relaxed atomic load, when enabled a phase costs two clock
+ * reads and a few relaxed atomic adds.
+ */
+class MatmulStats {
+
+    private:
+
+        struct _phase_counter {
+            std::atomic<uint64_t> count{0};
+            std::atomic<uint64_t> total_ns{0};
+            std::atomic<uint64_t> max_ns{0};
+        };
+
+        std::atomic<bool> on{false};
+        _phase_counter phases[MATMUL_PHASE_COUNT];
+        std::atomic<uint64_t> bytes_in{0};
+        std::atomic<uint64_t> bytes_out{0};
+        std::atomic<uint64_t> contexts_created{0};
+        std::atomic<uint64_t> contexts_destroyed{0};
+        std::atomic<uint64_t> buffers_allocated{0};
+        std::atomic<uint64_t> buffers_freed{0};
+
+        MatmulStats() {
+            const char* env = getenv("MATNPU_STATS");
+            on = env != nullptr && atoi(env) != 0;
+        }
+
+    public:
+
+        static MatmulStats& instance() {
+            static MatmulStats* stats = new MatmulStats();
+            return *stats;
+        }
+
+        bool enabled() const { return on.load(std::memory_order_relaxed); }
+        void enable(bool value) { on.store(value, std::memory_order_relaxed); }
+
+        void record(matmul_phase phase, uint64_t ns) {
+            _phase_counter& counter = phases[phase];
+            counter.count.fetch_add(1, std::memory_order_relaxed);
+            counter.total_ns.fetch_add(ns, std::memory_order_relaxed);
+            uint64_t longest = counter.max_ns.load(std::memory_order_relaxed);
+            while (ns > longest &&
+                !counter.max_ns.compare_exchange_weak(longest, ns, std::memory_order_relaxed)) {
+            }
+        }
+
+        void copied_in(uint64_t bytes) {
+            if (enabled()) {
+                bytes_in.fetch_add(bytes, std::memory_order_relaxed);
+            }
+        }
+
+        void copied_out(uint64_t bytes) {
+            if (enabled()) {
+                bytes_out.fetch_add(bytes, std::memory_order_relaxed);
+            }
+        }
+
+        void context_created() {
+            if (enabled()) {
+                contexts_created.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        void context_destroyed() {
+            if (enabled()) {
+                contexts_destroyed.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        void buffer_allocated() {
+            if (enabled()) {
+                buffers_allocated.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        void buffer_freed() {
+            if (enabled()) {
+                buffers_freed.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        matmul_stats snapshot() const {
+            matmul_stats stats;
+            for (int32_t i = 0; i < MATMUL_PHASE_COUNT; i++) {
+                stats.phases[i] = {
+                    phases[i].count.load(), phases[i].total_ns.load(), phases[i].max_ns.load()
+                };
+            }
+            stats.bytes_in = bytes_in.load();
+            stats.bytes_out = bytes_out.load();
+            stats.contexts_created = contexts_created.load();
+            stats.contexts_destroyed = contexts_destroyed.load();
+            stats.buffers_allocated = buffers_allocated.load();
+            stats.buffers_freed = buffers_freed.load();
+            return stats;
+        }
+
+        void reset() {
+            for (_phase_counter& counter : phases) {
+                counter.count = 0;
+                counter.total_ns = 0;
+                counter.max_ns = 0;
+            }
+            bytes_in = 0;
+            bytes_out = 0;
+            contexts_created = 0;
+            contexts_destroyed = 0;
+            buffers_allocated = 0;
+            buffers_freed = 0;
+        }
+};
+
+#endif
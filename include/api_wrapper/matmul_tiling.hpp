@@ -0,0 +1,289 @@
+#ifndef MATMUL_TILING
+#define MATMUL_TILING
+
+#include "api_wrapper/matmul_cache.hpp"
+#include <algorithm>
+#include <future>
+#include <map>
+#include <tuple>
+
+/**
+ * The largest M, K and N the npu accepts in a single matmul
+ */
+struct npu_shape_limits {
+    int32_t max_m;
+    int32_t max_k;
+    int32_t max_n;
+};
+
+/**
+ * @brief The process wide shape limits, larger matmuls are tiled
+ *
+ * @note Change them before the first matmul, e.g. for another runtime version
+ */
+npu_shape_limits& matmul_shape_limits() {
+    static npu_shape_limits limits = {4096, 8192, 4096};
+    return limits;
+}
+
+/**
+ * @brief Check if a matmul has to be split into tiles
+ */
+bool needs_tiling(uint32_t num_rows_a, uint32_t num_cols_a, uint32_t num_cols_b) {
+    const npu_shape_limits& limits = matmul_shape_limits();
+    return (int64_t) num_rows_a > limits.max_m ||
+        (int64_t) num_cols_a > limits.max_k ||
+        (int64_t) num_cols_b > limits.max_n;
+}
+
+/**
+ * @brief The matmul type used for the tiles of a split-K matmul
+ *
+ * Partial products are accumulated in int32 / fp32, so the tiles of
+ * types with a narrow output produce the wide output instead.
+ */
+_rknn_matmul_type split_k_type(_rknn_matmul_type type) {
+    switch (type) {
+        case RKNN_INT8_MM_INT8_TO_INT8:          return RKNN_INT8_MM_INT8_TO_INT32;
+        case RKNN_FLOAT16_MM_FLOAT16_TO_FLOAT16: return RKNN_FLOAT16_MM_FLOAT16_TO_FLOAT32;
+        default:                                 return type;
+    }
+}
+
+/**
+ * @brief Copy a (rows, cols) block out of a row major matrix
+ *
+ * @param ld The number of elements in a row of the source matrix
+ */
+void copy_block(void* dst, const void* src, int32_t rows, int32_t cols, int64_t ld, size_t elem_size) {
+    const size_t row_bytes = cols * elem_size;
+    if ((int64_t) cols == ld) {
+        memcpy(dst, src, rows * row_bytes);
+        return;
+    }
+    #pragma omp parallel for schedule(static)
+    for (int32_t r = 0; r < rows; r++) {
+        memcpy((uint8_t*) dst + r * row_bytes, (const uint8_t*) src + r * ld * elem_size, row_bytes);
+    }
+}
+
+/**
+ * @brief Add (or assign on the first K tile) a tile output to the accumulator
+ *
+ * @param Tacc The accumulator type, int32_t or float
+ * @param Tpart The tile output type
+ * @param ld The number of elements in a row of the accumulator
+ */
+template<typename Tacc, typename Tpart>
+void accumulate_tile(Tacc* acc, int64_t ld, const Tpart* part, int32_t rows, int32_t cols, bool first) {
+    #pragma omp parallel for schedule(static)
+    for (int32_t r = 0; r < rows; r++) {
+        Tacc* out = acc + r * ld;
+        const Tpart* in = part + (int64_t) r * cols;
+        if (first) {
+            for (int32_t c = 0; c < cols; c++) out[c] = (Tacc) in[c];
+        } else {
+            for (int32_t c = 0; c < cols; c++) out[c] += (Tacc) in[c];
+        }
+    }
+}
+
+/**
+ * A tile of the output and the slice of K it covers
+ */
+struct _matmul_tile {
+    int32_t m0, n0, k0;
+    int32_t rows, cols, inner;
+};
+
+/**
+ * @brief Performs a matmul larger than the npu limits as a sequence of npu legal tiles
+ *
+ * The output is split by M and N, and K is split with the partial products
+ * accumulated in int32 / fp32 (see split_k_type). Each tile shape takes two plans
+ * from the MatmulCache, so the copy of the next tile's inputs overlaps the npu
+ * run of the current tile.
+ *
+ * @param a The row major data of the first input matrix
+ * @param b The row major data of the second input matrix
+ * @param c The row major (num_rows_a, num_cols_b) destination, of the epilogue's output type
+ * @param limits The largest tile, at most the npu limits
+ * @param epilogue Applied while the tiles are stored, nullptr for none. With split-K it
+ *                 is applied to the accumulator once every K tile is in
+ */
+void tiled_matmul_into(
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    const void* a,
+    const void* b,
+    void* c,
+    npu_shape_limits limits = matmul_shape_limits(),
+    const matmul_epilogue* epilogue = nullptr
+) {
+    const int32_t M = num_rows_a, K = num_cols_a, N = num_cols_b;
+    const int32_t tile_m = std::min(M, limits.max_m);
+    const int32_t tile_k = std::min(K, limits.max_k);
+    const int32_t tile_n = std::min(N, limits.max_n);
+    const bool split_k = K > tile_k;
+
+    const _rknn_matmul_type tile_type = split_k ? split_k_type(type) : type;
+    const _matmul_type_sizes sizes = matmul_type_sizes(type);
+    const _matmul_type_sizes tile_sizes = matmul_type_sizes(tile_type);
+
+    // inputs that were kept in the native layout are unpacked once
+    NpuTensor a_normal, b_normal;
+    a = normal_input(a, M, K, sizes.a, a_normal);
+    b = normal_input(b, K, N, sizes.b, b_normal);
+
+    const rknn_tensor_type c_type = matmul_type_entry(type).c;
+    const size_t out_size = tensor_type_size(matmul_output_type(type, epilogue));
+
+    // int32 / fp32 outputs accumulate in place, narrow outputs (and the input of an
+    // epilogue) in a separate buffer
+    const bool float_acc = tile_type != RKNN_INT8_MM_INT8_TO_INT32;
+    const bool separate_acc = split_k && (sizes.c != 4 || epilogue != nullptr);
+    std::unique_ptr<uint8_t[]> acc_buffer;
+    if (separate_acc) {
+        acc_buffer.reset(new uint8_t[(size_t) M * N * 4]);
+    }
+    void* acc = separate_acc ? (void*) acc_buffer.get() : c;
+
+    std::vector<_matmul_tile> tiles;
+    for (int32_t m0 = 0; m0 < M; m0 += tile_m) {
+        for (int32_t n0 = 0; n0 < N; n0 += tile_n) {
+            for (int32_t k0 = 0; k0 < K; k0 += tile_k) {
+                tiles.push_back({
+                    m0, n0, k0,
+                    std::min(tile_m, M - m0), std::min(tile_n, N - n0), std::min(tile_k, K - k0)
+                });
+            }
+        }
+    }
+
+    // two plans per tile shape, one is loaded while the other runs
+    std::map<std::tuple<int32_t, int32_t, int32_t, int>, std::shared_ptr<MatmulPlanBase>> plans;
+    auto plan_for = [&](const _matmul_tile& tile, int parity) {
+        std::shared_ptr<MatmulPlanBase>& plan = plans[
+            std::make_tuple(tile.rows, tile.inner, tile.cols, parity)
+        ];
+        if (!plan) {
+            plan = MatmulCache::instance().acquire(
+                {tile.rows, tile.inner, tile.cols, tile_type, 0, 0, RKNN_NPU_CORE_AUTO}
+            );
+        }
+        return plan;
+    };
+
+    auto store = [&](const _matmul_tile& tile, const void* part) {
+        const int64_t offset = (int64_t) tile.m0 * N + tile.n0;
+        MatmulPhaseTimer timer(MATMUL_PHASE_READBACK, tile.rows, tile.inner, tile.cols);
+        MatmulStats::instance().copied_out((size_t) tile.rows * tile.cols * tile_sizes.c);
+        if (!split_k && epilogue != nullptr) {
+            epilogue_block(
+                (uint8_t*) acc + offset * out_size, N, part, c_type, tile.cols, 0, tile.rows, tile.cols,
+                offset_epilogue(*epilogue, tile.m0, tile.n0)
+            );
+        } else if (!split_k) {
+            for (int32_t r = 0; r < tile.rows; r++) {
+                memcpy(
+                    (uint8_t*) acc + (offset + (int64_t) r * N) * sizes.c,
+                    (const uint8_t*) part + (size_t) r * tile.cols * sizes.c,
+                    tile.cols * sizes.c
+                );
+            }
+        } else if (!float_acc) {
+            accumulate_tile((int32_t*) acc + offset, N, (const int32_t*) part, tile.rows, tile.cols, tile.k0 == 0);
+        } else if (tile_sizes.c == 4) {
+            accumulate_tile((float*) acc + offset, N, (const float*) part, tile.rows, tile.cols, tile.k0 == 0);
+        } else {
+            accumulate_tile((float*) acc + offset, N, (const float16*) part, tile.rows, tile.cols, tile.k0 == 0);
+        }
+    };
+
+    std::future<void*> running;
+    _matmul_tile running_tile = {};
+
+    for (size_t t = 0; t < tiles.size(); t++) {
+        const _matmul_tile& tile = tiles[t];
+        std::shared_ptr<MatmulPlanBase> plan = plan_for(tile, t % 2);
+
+        {
+            MatmulPhaseTimer timer(MATMUL_PHASE_COPY_IN, tile.rows, tile.inner, tile.cols);
+            copy_block(
+                plan->input_a()->virt_addr, (const uint8_t*) a + ((int64_t) tile.m0 * K + tile.k0) * sizes.a,
+                tile.rows, tile.inner, K, sizes.a
+            );
+            copy_block(
+                plan->input_b()->virt_addr, (const uint8_t*) b + ((int64_t) tile.k0 * N + tile.n0) * sizes.b,
+                tile.inner, tile.cols, N, sizes.b
+            );
+            MatmulStats::instance().copied_in((size_t) tile.inner * (tile.rows * sizes.a + tile.cols * sizes.b));
+        }
+
+        if (running.valid()) {
+            store(running_tile, running.get());
+        }
+        running = std::async(std::launch::async, [plan]() { return plan->run_loaded(); });
+        running_tile = tile;
+    }
+    if (running.valid()) {
+        store(running_tile, running.get());
+    }
+
+    if (separate_acc && epilogue != nullptr) {
+        // the epilogue reads the wide accumulator, the one pass over the finished C
+        epilogue_block(
+            c, N, acc_buffer.get(), float_acc ? RKNN_TENSOR_FLOAT32 : RKNN_TENSOR_INT32, N, 0, M, N, 
+            *epilogue
+        );
+    } else if (separate_acc) {
+        const int64_t count = (int64_t) M * N;
+        if (type == RKNN_INT8_MM_INT8_TO_INT8) {
+            const int32_t* in = (const int32_t*) acc_buffer.get();
+            int8_t* out = (int8_t*) c;
+            #pragma omp parallel for schedule(static)
+            for (int64_t i = 0; i < count; i++) {
+                out[i] = (int8_t) std::min(127, std::max(-128, in[i]));
+            }
+        } else {
+            const float* in = (const float*) acc_buffer.get();
+            float16* out = (float16*) c;
+            #pragma omp parallel for schedule(static)
+            for (int64_t i = 0; i < count; i++) {
+                out[i] = float16(in[i]);
+            }
+        }
+    }
+
+}
+
+/**
+ * @brief Performs a matmul larger than the npu limits as a sequence of npu legal tiles,
+ *        see tiled_matmul_into
+ *
+ * @param epilogue Applied while the tiles are stored, nullptr for none
+ *
+ * @return tensor_result with the row major (num_rows_a, num_cols_b) result
+ */
+tensor_result tiled_matmul(
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    const void* a,
+    const void* b,
+    npu_shape_limits limits = matmul_shape_limits(),
+    const matmul_epilogue* epilogue = nullptr
+) {
+    tensor_result result = npu_alloc_tensor(
+        (size_t) num_rows_a * num_cols_b * tensor_type_size(matmul_output_type(type, epilogue))
+    );
+    tiled_matmul_into(
+        num_rows_a, num_cols_a, num_cols_b, type, a, b, result.resultMatrix->virt_addr, limits, epilogue
+    );
+    return result;
+}
+
+#endif
\ No newline at end of file
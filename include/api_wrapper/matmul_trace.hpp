@@ -0,0 +1,267 @@
+#ifndef MATMUL_TRACE
+#define MATMUL_TRACE
+
+#include <rknpu/rknn_matmul_api.h>
+#include "api_wrapper/matmul_stats.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * A span recorded by the MatmulTracer
+ *
+ * @param name The phase, or the queue state, the span covers
+ * @param thread The tracer's id of the thread that recorded it
+ * @param start_ns, dur_ns The start since the trace started and the duration
+ * @param M, K, N The shape of the matmul, 0 when the span has no shape
+ * @param core_mask The rknn_core_mask of an npu run, -1 for spans that are not a run
+ */
+struct _trace_event {
+    const char* name;
+    int32_t thread;
+    int64_t start_ns;
+    int64_t dur_ns;
+    int32_t M, K, N;
+    int32_t core_mask;
+};
+
+/**
+ * @brief The small, stable id of the calling thread used in the trace
+ */
+int32_t trace_thread_id() {
+    static std::atomic<int32_t> next{1};
+    thread_local int32_t id = next.fetch_add(1);
+    return id;
+}
+
+/**
+ * @brief The name of the npu track a run with core_mask is drawn on
+ */
+const char* trace_core_name(int32_t core_mask) {
+    switch (core_mask) {
+        case RKNN_NPU_CORE_AUTO: return "npu auto";
+        case RKNN_NPU_CORE_0: return "npu core 0";
+        case RKNN_NPU_CORE_1: return "npu core 1";
+        case RKNN_NPU_CORE_2: return "npu core 2";
+        case RKNN_NPU_CORE_0_1: return "npu cores 0-1";
+        case RKNN_NPU_CORE_0_1_2: return "npu cores 0-2";
+        default: return "npu cores";
+    }
+}
+
+/**
+ * @brief Process wide recorder of matmul spans, written as a chrome trace event file
+ *
+ * Every phase timed by MatmulPhaseTimer becomes a span on the thread that ran it,
+ * npu runs are also drawn on a track per core mask and the async queue adds the
+ * time jobs wait to be loaded and to be run. Open the file in https://ui.perfetto.dev
+ * or chrome://tracing. MATNPU_TRACE=path traces the whole process and writes the
+ * file at exit. While stopped every hook is a single relaxed atomic load.
+ */
+class MatmulTracer {
+
+    private:
+
+        std::atomic<bool> on{false};
+        std::mutex lock;
+        std::vector<_trace_event> events;
+        size_t max_events = 0;
+        size_t dropped = 0;
+        std::chrono::steady_clock::time_point origin;
+        std::string exit_path;
+
+        MatmulTracer() {
+            const char* env = getenv("MATNPU_TRACE");
+            if (env != nullptr && env[0] != '\0') {
+                exit_path = env;
+                start();
+                atexit([]() {
+                    MatmulTracer& tracer = MatmulTracer::instance();
+                    tracer.stop();
+                    if (!tracer.write(tracer.exit_path)) {
+                        printf("Can not write the matmul trace to %s\n", tracer.exit_path.c_str());
+                    }
+                });
+            }
+        }
+
+    public:
+
+        static MatmulTracer& instance() {
+            static MatmulTracer* tracer = new MatmulTracer();
+            return *tracer;
+        }
+
+        bool tracing() const { return on.load(std::memory_order_relaxed); }
+
+        /**
+         * @brief Drop the recorded spans and start recording
+         *
+         * @param limit The most spans kept, later ones are counted as dropped
+         */
+        void start(size_t limit = 1 << 20) {
+            std::lock_guard<std::mutex> guard(lock);
+            events.clear();
+            dropped = 0;
+            max_events = limit;
+            origin = std::chrono::steady_clock::now();
+            on.store(true, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Stop recording, the spans are kept until the next start
+         */
+        void stop() {
+            on.store(false, std::memory_order_relaxed);
+        }
+
+        /**
+         * @brief Record a span of the calling thread
+         *
+         * @param name Static string naming the span
+         * @param core_mask The rknn_core_mask of an npu run, -1 otherwise
+         */
+        void span(
+            const char* name,
+            std::chrono::steady_clock::time_point start,
+            std::chrono::steady_clock::time_point end,
+            int32_t M = 0, int32_t K = 0, int32_t N = 0, int32_t core_mask = -1) {
+
+            const int32_t thread = trace_thread_id();
+            std::lock_guard<std::mutex> guard(lock);
+            if (!tracing()) {
+                return;
+            }
+            if (events.size() >= max_events) {
+                dropped++;
+                return;
+            }
+            events.push_back({
+                name, thread,
+                std::chrono::duration_cast<std::chrono::nanoseconds>(start - origin).count(),
+                std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(),
+                M, K, N, core_mask
+            });
+        }
+
+        size_t size() {
+            std::lock_guard<std::mutex> guard(lock);
+            return events.size();
+        }
+
+        /**
+         * @brief Write the recorded spans as chrome trace event json
+         *
+         * @return false when the file can not be written
+         */
+        bool write(const std::string& path) {
+            FILE* file = fopen(path.c_str(), "w");
+            if (file == nullptr) {
+                return false;
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            // pid 1 holds the host threads, pid 2 a track per npu core mask
+            fprintf(file, "{\"displayTimeUnit\":\"ns\",\"otherData\":{\"dropped\":%zu},\"traceEvents\":[\n", dropped);
+            fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"host\"}},\n");
+            fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":2,\"tid\":0,\"args\":{\"name\":\"npu\"}}");
+
+            std::vector<bool> threads, cores(RKNN_NPU_CORE_0_1_2 + 2);
+            for (const _trace_event& event : events) {
+                if ((size_t) event.thread >= threads.size()) {
+                    threads.resize(event.thread + 1);
+                }
+                if (!threads[event.thread]) {
+                    threads[event.thread] = true;
+                    fprintf(file,
+                        ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                        event.thread, event.thread
+                    );
+                }
+                const int32_t track = std::min(event.core_mask, (int32_t) RKNN_NPU_CORE_0_1_2 + 1);
+                if (event.core_mask >= 0 && !cores[track]) {
+                    cores[track] = true;
+                    fprintf(file,
+                        ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":2,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                        track, trace_core_name(event.core_mask)
+                    );
+                }
+            }
+
+            for (const _trace_event& event : events) {
+                char args[128];
+                int length = snprintf(args, sizeof(args), "\"M\":%d,\"K\":%d,\"N\":%d", event.M, event.K, event.N);
+                if (event.core_mask >= 0) {
+                    snprintf(args + length, sizeof(args) - length, ",\"cores\":\"%s\"", trace_core_name(event.core_mask));
+                }
+                fprintf(file,
+                    ",\n{\"name\":\"%s\",\"cat\":\"matmul\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"pid\":1,\"tid\":%d,\"args\":{%s}}",
+                    event.name, event.start_ns / 1e3, event.dur_ns / 1e3, event.thread, args
+                );
+                if (event.core_mask >= 0) {
+                    fprintf(file,
+                        ",\n{\"name\":\"%s\",\"cat\":\"npu\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                        "\"pid\":2,\"tid\":%d,\"args\":{\"thread\":%d,%s}}",
+                        event.name, event.start_ns / 1e3, event.dur_ns / 1e3,
+                        std::min(event.core_mask, (int32_t) RKNN_NPU_CORE_0_1_2 + 1), event.thread, args
+                    );
+                }
+            }
+            fprintf(file, "\n]}\n");
+            return fclose(file) == 0;
+        }
+};
+
+/**
+ * @brief Times the scope it lives in as one phase, for MatmulStats and the MatmulTracer
+ *
+ * @param M, K, N The shape the phase works on, annotated on the trace span
+ * @param core_mask The rknn_core_mask of an npu run, -1 for the other phases
+ */
+class MatmulPhaseTimer {
+
+    private:
+
+        matmul_phase phase;
+        int32_t M, K, N, core_mask;
+        bool counted, traced;
+        std::chrono::steady_clock::time_point start;
+
+    public:
+
+        explicit MatmulPhaseTimer(
+            matmul_phase phase, int32_t M = 0, int32_t K = 0, int32_t N = 0, int32_t core_mask = -1)
+            : phase(phase), M(M), K(K), N(N), core_mask(core_mask),
+              counted(MatmulStats::instance().enabled()), traced(MatmulTracer::instance().tracing()) {
+            if (counted || traced) {
+                start = std::chrono::steady_clock::now();
+            }
+        }
+
+        MatmulPhaseTimer(const MatmulPhaseTimer&) = delete;
+        MatmulPhaseTimer& operator=(const MatmulPhaseTimer&) = delete;
+
+        ~MatmulPhaseTimer() {
+            if (!counted && !traced) {
+                return;
+            }
+            std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+            if (counted) {
+                MatmulStats::instance().record(
+                    phase, std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()
+                );
+            }
+            if (traced) {
+                MatmulTracer::instance().span(matmul_phase_name(phase), start, end, M, K, N, core_mask);
+            }
+        }
+};
+
+#endif
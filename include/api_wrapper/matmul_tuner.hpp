@@ -0,0 +1,237 @@
+#ifndef MATMUL_TUNER
+#define MATMUL_TUNER
+
+#include "api_wrapper/matmul_coexec.hpp"
+#include "api_wrapper/matmul_tuning.hpp"
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+/**
+ * How matmul_npu uses the MatmulTuningDatabase
+ *
+ * @param tune_on_first_use Tune a shape missing from the database the first time it runs,
+ *                          set with MATNPU_TUNE=1
+ * @param repeats The timed runs of every candidate, the fastest one counts
+ */
+struct tuner_config {
+    bool tune_on_first_use;
+    int32_t repeats;
+};
+
+/**
+ * @brief The process wide tuner configuration
+ */
+tuner_config& matmul_tuner_config() {
+    static tuner_config config = {
+        getenv("MATNPU_TUNE") != nullptr && atoi(getenv("MATNPU_TUNE")) != 0, 5
+    };
+    return config;
+}
+
+/**
+ * @brief Runs a row major matmul the way a tuned configuration says
+ *
+ * @param epilogue Applied while C is read, nullptr for none
+ *
+ * @return tensor_result with the row major (num_rows_a, num_cols_b) result
+ */
+tensor_result tuned_matmul(
+    uint32_t num_rows_a,
+    uint32_t num_cols_a,
+    uint32_t num_cols_b,
+    _rknn_matmul_type type,
+    const void* a,
+    const void* b,
+    const tuned_config& config,
+    const matmul_epilogue* epilogue = nullptr
+) {
+    if (config.cpu_share > 0) {
+        coexec_config coexec = {true, {config.cpu_share, config.cpu_share}, false, 0};
+        return coexec_matmul(num_rows_a, num_cols_a, num_cols_b, type, a, b, coexec, epilogue);
+    }
+
+    if (needs_tiling(num_rows_a, num_cols_a, num_cols_b)) {
+        npu_shape_limits limits = matmul_shape_limits();
+        limits.max_m = config.tile_m > 0 ? std::min(limits.max_m, config.tile_m) : limits.max_m;
+        limits.max_k = config.tile_k > 0 ? std::min(limits.max_k, config.tile_k) : limits.max_k;
+        limits.max_n = config.tile_n > 0 ? std::min(limits.max_n, config.tile_n) : limits.max_n;
+        return tiled_matmul(num_rows_a, num_cols_a, num_cols_b, type, a, b, limits, epilogue);
+    }
+
+    if (config.cores > 1) {
+        multicore_config multicore = {true, config.cores, {1.0f, 1.0f, 1.0f}, config.split_n, 0};
+        return multicore_matmul(num_rows_a, num_cols_a, num_cols_b, type, a, b, multicore, epilogue);
+    }
+
+    return cached_matmul(
+        num_rows_a, num_cols_a, num_cols_b, type, a, b,
+        config.ac_layout ? MATMUL_LAYOUT_PERF : MATMUL_LAYOUT_NORMAL, config.b_layout, epilogue
+    );
+}
+
+/**
+ * @brief The configurations tune_matmul tries for a shape
+ */
+std::vector<tuned_config> tuning_candidates(int32_t M, int32_t K, int32_t N) {
+    std::vector<tuned_config> candidates;
+
+    if (needs_tiling(M, K, N)) {
+        // full and half tiles, the smaller ones overlap more copies with the runs
+        const npu_shape_limits limits = matmul_shape_limits();
+        for (int32_t m_div = 1; m_div <= 2; m_div++) {
+            for (int32_t k_div = 1; k_div <= 2; k_div++) {
+                candidates.push_back({
+                    0, 0, 1, false, 0.0f,
+                    std::min(M, limits.max_m) / m_div, std::min(K, limits.max_k) / k_div,
+                    std::min(N, limits.max_n), 0.0
+                });
+            }
+        }
+    } else {
+        const int16_t b_layouts = native_b_supported(K, N) ? 2 : 1;
+        for (int16_t ac_layout = 0; ac_layout < 2; ac_layout++) {
+            for (int16_t b_layout = 0; b_layout < b_layouts; b_layout++) {
+                candidates.push_back({ac_layout, b_layout, 1, false, 0.0f, 0, 0, 0, 0.0});
+            }
+        }
+        for (int32_t cores = 2; cores <= NPU_MAX_CORES; cores++) {
+            if (M >= cores * 4) {
+                candidates.push_back({0, 0, cores, false, 0.0f, 0, 0, 0, 0.0});
+            }
+            if (N >= cores * 32) {
+                candidates.push_back({0, 0, cores, true, 0.0f, 0, 0, 0, 0.0});
+            }
+        }
+    }
+
+    const float shares[3] = {0.05f, 0.1f, 0.2f};
+    for (float share : shares) {
+        const int32_t cpu_rows = coexec_cpu_rows(M, share);
+        if (cpu_rows > 0 && cpu_rows < M) {
+            candidates.push_back({0, 0, 1, false, share, 0, 0, 0, 0.0});
+        }
+    }
+    return candidates;
+}
+
+/**
+ * @brief Time every candidate configuration of a shape and keep the fastest
+ *
+ * The winner is recorded in the MatmulTuningDatabase, and saved to it's file
+ * when it has one.
+ *
+ * @param repeats The timed runs of every candidate, the fastest one counts
+ *
+ * @return The fastest configuration
+ */
+tuned_config tune_matmul(
+    int32_t M, int32_t K, int32_t N, _rknn_matmul_type type,
+    int32_t repeats = matmul_tuner_config().repeats) {
+
+    using clock = std::chrono::steady_clock;
+    MatmulTuningDatabase& database = MatmulTuningDatabase::instance();
+    // the shape's old entry would redirect the candidates that run through the plan cache
+    database.erase(M, K, N, type);
+
+    const _matmul_type_sizes sizes = matmul_type_sizes(type);
+    std::vector<uint8_t> a((size_t) M * K * sizes.a), b((size_t) K * N * sizes.b);
+    // small normal values keep the cpu gemm off denormals
+    auto fill = [](std::vector<uint8_t>& data, size_t elem_size) {
+        const float16 half_value(0.5f);
+        for (size_t i = 0; i < data.size(); i += elem_size) {
+            if (elem_size == 2) {
+                memcpy(&data[i], &half_value, 2);
+            } else {
+                data[i] = 1;
+            }
+        }
+    };
+    fill(a, sizes.a);
+    fill(b, sizes.b);
+
+    tuned_config best = {};
+    best.time_us = -1;
+    for (tuned_config candidate : tuning_candidates(M, K, N)) {
+        double fastest = 0;
+        // the first run creates the contexts and is not timed
+        for (int32_t i = 0; i <= std::max(1, repeats); i++) {
+            clock::time_point start = clock::now();
+            tensor_result result = tuned_matmul(M, K, N, type, a.data(), b.data(), candidate);
+            release_result(result);
+            const double us = std::chrono::duration<double, std::micro>(clock::now() - start).count();
+            if (i == 1 || (i > 1 && us < fastest)) {
+                fastest = us;
+            }
+        }
+        candidate.time_us = fastest;
+        if (best.time_us < 0 || fastest < best.time_us) {
+            best = candidate;
+        }
+    }
+
+    database.record(M, K, N, type, best);
+    const std::string path = database.path();
+    if (!path.empty() && !database.save(path)) {
+        printf("tune_matmul: can not save the tuning database to %s\n", path.c_str());
+    }
+    return best;
+}
+
+/**
+ * @brief The tuned configuration of a shape, tuning it first when tune_on_first_use is set
+ *
+ * @return false when the shape runs the default way
+ */
+bool find_tuned_config(int32_t M, int32_t K, int32_t N, _rknn_matmul_type type, tuned_config& config) {
+    if (MatmulTuningDatabase::instance().find(M, K, N, type, config)) {
+        return true;
+    }
+    if (!matmul_tuner_config().tune_on_first_use) {
+        return false;
+    }
+    config = tune_matmul(M, K, N, type);
+    return true;
+}
+
+/**
+ * @brief Create the contexts of every tuned shape in the MatmulCache
+ *
+ * Call it at startup so the first matmul of a tuned shape does not pay for
+ * creating it's contexts.
+ *
+ * @return The number of contexts created
+ */
+int32_t warm_tuned_plans() {
+    int32_t created = 0;
+    for (const auto& entry : MatmulTuningDatabase::instance().list()) {
+        int32_t M, K, N;
+        _rknn_matmul_type type;
+        std::tie(M, K, N, type) = entry.first;
+        const tuned_config& config = entry.second;
+        if (config.cpu_share > 0 || needs_tiling(M, K, N)) {
+            continue;
+        }
+
+        if (config.cores > 1) {
+            multicore_config multicore = {true, config.cores, {1.0f, 1.0f, 1.0f}, config.split_n, 0};
+            std::vector<int32_t> bounds = split_by_ratios(config.split_n ? N : M, multicore);
+            for (size_t core = 0; core + 1 < bounds.size(); core++) {
+                const int32_t size = bounds[core + 1] - bounds[core];
+                MatmulCache::instance().acquire({
+                    config.split_n ? M : size, K, config.split_n ? size : N, type, 0, 0,
+                    npu_core(core)
+                });
+                created++;
+            }
+        } else {
+            MatmulCache::instance().acquire(
+                {M, K, N, type, config.ac_layout, config.b_layout, RKNN_NPU_CORE_AUTO}
+            );
+            created++;
+        }
+    }
+    return created;
+}
+
+#endif
@@ -0,0 +1,200 @@
+#ifndef MATMUL_TUNING
+#define MATMUL_TUNING
+
+#include "utils/matmul_traits.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <shared_mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+/**
+ * The fastest way found to run a matmul shape
+ *
+ * @param ac_layout 1 runs a row major matmul in the native A / C layout and unpacks
+ *                  the result (MATMUL_LAYOUT_PERF), 0 in the normal layout
+ * @param b_layout 1 packs B to the native B layout during the copy
+ * @param cores 1 runs on a single context, 2 - 3 split the matmul between the npu cores
+ * @param split_n The multi core split is by the columns of C instead of the rows
+ * @param cpu_share The share of the rows of C computed on the cpu, 0 for npu only
+ * @param tile_m, tile_k, tile_n The tile of a matmul above the shape limits, 0 for the limit
+ * @param time_us The measured time of the matmul
+ */
+struct tuned_config {
+    int16_t ac_layout;
+    int16_t b_layout;
+    int32_t cores;
+    bool split_n;
+    float cpu_share;
+    int32_t tile_m;
+    int32_t tile_k;
+    int32_t tile_n;
+    double time_us;
+};
+
+/**
+ * @brief Process wide database of tuned matmul configurations keyed on (M, K, N, type)
+ *
+ * On first use it loads the file named by the MATNPU_TUNE_DB environment variable,
+ * and saves back to it after every tune_matmul, so a database tuned offline is
+ * used by production processes without tuning at runtime.
+ *
+ * The file has one line per shape:
+ * M K N type ac_layout b_layout cores split_n cpu_share tile_m tile_k tile_n time_us
+ */
+class MatmulTuningDatabase {
+
+    private:
+
+        typedef std::tuple<int32_t, int32_t, int32_t, int32_t> _tune_key;
+
+        mutable std::shared_mutex lock;
+        std::map<_tune_key, tuned_config> entries;
+        std::string file;
+
+        MatmulTuningDatabase() {
+            const char* path = getenv("MATNPU_TUNE_DB");
+            if (path != nullptr && path[0] != '\0') {
+                file = path;
+                load(file);
+            }
+        }
+
+    public:
+
+        static MatmulTuningDatabase& instance() {
+            static MatmulTuningDatabase* database = new MatmulTuningDatabase();
+            return *database;
+        }
+
+        /**
+         * @brief Look up the tuned configuration of a shape
+         *
+         * @return false when the shape was not tuned
+         */
+        bool find(int32_t M, int32_t K, int32_t N, _rknn_matmul_type type, tuned_config& config) const {
+            std::shared_lock<std::shared_mutex> read(lock);
+            auto it = entries.find(std::make_tuple(M, K, N, (int32_t) type));
+            if (it == entries.end()) {
+                return false;
+            }
+            config = it->second;
+            return true;
+        }
+
+        void record(int32_t M, int32_t K, int32_t N, _rknn_matmul_type type, const tuned_config& config) {
+            std::unique_lock<std::shared_mutex> write(lock);
+            entries[std::make_tuple(M, K, N, (int32_t) type)] = config;
+        }
+
+        void erase(int32_t M, int32_t K, int32_t N, _rknn_matmul_type type) {
+            std::unique_lock<std::shared_mutex> write(lock);
+            entries.erase(std::make_tuple(M, K, N, (int32_t) type));
+        }
+
+        void clear() {
+            std::unique_lock<std::shared_mutex> write(lock);
+            entries.clear();
+        }
+
+        /**
+         * @brief The tuned shapes, as (M, K, N, type) and their configuration
+         */
+        std::vector<std::pair<std::tuple<int32_t, int32_t, int32_t, _rknn_matmul_type>, tuned_config>> list() const {
+            std::shared_lock<std::shared_mutex> read(lock);
+            std::vector<std::pair<std::tuple<int32_t, int32_t, int32_t, _rknn_matmul_type>, tuned_config>> out;
+            for (const auto& entry : entries) {
+                out.push_back({
+                    std::make_tuple(
+                        std::get<0>(entry.first), std::get<1>(entry.first), std::get<2>(entry.first),
+                        (_rknn_matmul_type) std::get<3>(entry.first)
+                    ),
+                    entry.second
+                });
+            }
+            return out;
+        }
+
+        /**
+         * @brief The file the database is saved to, empty when it is only kept in memory
+         */
+        std::string path() const {
+            std::shared_lock<std::shared_mutex> read(lock);
+            return file;
+        }
+
+        void set_path(const std::string& path) {
+            std::unique_lock<std::shared_mutex> write(lock);
+            file = path;
+        }
+
+        /**
+         * @brief Merge the entries of a database file, replacing the shapes already known
+         *
+         * @return The number of entries read, -1 when the file can not be opened
+         */
+        int32_t load(const std::string& path) {
+            FILE* in = fopen(path.c_str(), "r");
+            if (in == nullptr) {
+                return -1;
+            }
+            int32_t count = 0;
+            char line[256];
+            while (fgets(line, sizeof(line), in) != nullptr) {
+                if (line[0] == '#') {
+                    continue;
+                }
+                int32_t M, K, N, type, ac_layout, b_layout, split_n;
+                tuned_config config;
+                if (sscanf(
+                        line, "%d %d %d %d %d %d %d %d %f %d %d %d %lf",
+                        &M, &K, &N, &type, &ac_layout, &b_layout, &config.cores, &split_n,
+                        &config.cpu_share, &config.tile_m, &config.tile_k, &config.tile_n,
+                        &config.time_us) != 13 ||
+                    matmul_type_index((_rknn_matmul_type) type) < 0) {
+                    continue;
+                }
+                config.ac_layout = ac_layout;
+                config.b_layout = b_layout;
+                config.split_n = split_n != 0;
+                record(M, K, N, (_rknn_matmul_type) type, config);
+                count++;
+            }
+            fclose(in);
+            return count;
+        }
+
+        /**
+         * @brief Write every entry to a database file
+         *
+         * @return false when the file can not be written
+         */
+        bool save(const std::string& path) const {
+            std::string temp = path + ".tmp";
+            FILE* out = fopen(temp.c_str(), "w");
+            if (out == nullptr) {
+                return false;
+            }
+            fprintf(out, "# M K N type ac_layout b_layout cores split_n cpu_share tile_m tile_k tile_n time_us\n");
+            {
+                std::shared_lock<std::shared_mutex> read(lock);
+                for (const auto& entry : entries) {
+                    const tuned_config& config = entry.second;
+                    fprintf(
+                        out, "%d %d %d %d %d %d %d %d %g %d %d %d %.1f\n",
+                        std::get<0>(entry.first), std::get<1>(entry.first), std::get<2>(entry.first),
+                        std::get<3>(entry.first), config.ac_layout, config.b_layout, config.cores,
+                        config.split_n ? 1 : 0, config.cpu_share,
+                        config.tile_m, config.tile_k, config.tile_n, config.time_us
+                    );
+                }
+            }
+            // replaced at once, so concurrent processes never read a partial file
+            bool written = fclose(out) == 0;
+            return written && rename(temp.c_str(), path.c_str()) == 0;
+        }
+};
+
+#endif
@@ -0,0 +1,205 @@
+#ifndef MATMUL_WEIGHTS
+#define MATMUL_WEIGHTS
+
+#include "api_wrapper/matmul_cache.hpp"
+#include "api_wrapper/matmul_tiling.hpp"
+
+/**
+ * @brief Check if the npu takes a (K, N) B in the native B layout
+ *
+ * The native B layout needs K and N aligned to 32 and a shape that runs in one context.
+ */
+bool native_b_supported(int32_t num_rows_b, int32_t num_cols_b) {
+    const npu_shape_limits& limits = matmul_shape_limits();
+    return num_rows_b % 32 == 0 && num_cols_b % 32 == 0 &&
+        num_rows_b <= limits.max_k && num_cols_b <= limits.max_n;
+}
+
+/**
+ * @brief Performs a matmul with more rows than the npu takes in chunks of rows against one B
+ *
+ * K and N must fit in one context, only A is split, so B can be in the native layout.
+ *
+ * @param b_layout The layout of B (0 - normal, 1 - native)
+ * @param layout The layout of A and C, C is row major with MATMUL_LAYOUT_PERF too
+ * @param epilogue Applied while every chunk is read, nullptr for none
+ *
+ * @return tensor_result with the row major (num_rows_a, num_cols_b) result, free it with release_result
+ */
+tensor_result row_chunked_matmul(
+    uint32_t num_rows_a, uint32_t num_cols_a, uint32_t num_cols_b, _rknn_matmul_type type, 
+    const void* a, const void* b, int16_t b_layout, _matmul_layout layout = MATMUL_LAYOUT_NORMAL,
+    const matmul_epilogue* epilogue = nullptr) {
+
+    const int32_t max_m = matmul_shape_limits().max_m;
+    const _matmul_type_sizes sizes = matmul_type_sizes(type);
+    NpuTensor a_normal;
+    a = normal_input(a, num_rows_a, num_cols_a, sizes.a, a_normal);
+
+    const size_t a_row = num_cols_a * sizes.a;
+    const size_t c_row = num_cols_b * tensor_type_size(matmul_output_type(type, epilogue));
+    const _matmul_layout chunk_layout = layout == MATMUL_LAYOUT_NORMAL ? 
+        MATMUL_LAYOUT_NORMAL : MATMUL_LAYOUT_PERF;
+
+    // every chunk is read straight into it's rows of the result
+    tensor_result result = npu_alloc_tensor(num_rows_a * c_row);
+    for (int32_t m0 = 0; m0 < (int32_t) num_rows_a; m0 += max_m) {
+        int32_t rows = std::min(max_m, (int32_t) num_rows_a - m0);
+        matmul_epilogue chunk_epilogue;
+        if (epilogue != nullptr) {
+            chunk_epilogue = offset_epilogue(*epilogue, m0, 0);
+        }
+        _pending_matmul pending = prepare_matmul(
+            rows, num_cols_a, num_cols_b, type, (const uint8_t*) a + m0 * a_row, b, 
+            chunk_layout, b_layout, epilogue != nullptr ? &chunk_epilogue : nullptr
+        );
+        finish_matmul_into(pending, (uint8_t*) result.resultMatrix->virt_addr + m0 * c_row);
+    }
+    return result;
+}
+
+/**
+ * @brief A B matrix that is moved to npu memory once and reused by every matmul
+ *
+ * Weights the npu takes in the native B layout (see native_b_supported) are packed
+ * to it, so multiplying many A matrices by them skips both the copy and the layout
+ * conversion of B (matmul with B_layout = 1). Other weights are kept row major in
+ * npu memory, they still skip the copy and run like any other row major B.
+ */
+class NpuWeights {
+
+    private:
+
+        NpuTensor packed;
+        int32_t k, n;
+        _rknn_matmul_type mm_type;
+        bool native;
+
+    public:
+
+        /**
+         * @brief Move the weights to npu memory, packed to the native layout when supported
+         *
+         * @param num_rows_b The number of rows in the weights (K)
+         * @param num_cols_b The number of columns in the weights (N)
+         * @param type The matmul type flag the weights are used with
+         * @param b The (K, N) row major data of the weights
+         */
+        NpuWeights(int32_t num_rows_b, int32_t num_cols_b, _rknn_matmul_type type, const void* b)
+            : k(num_rows_b), n(num_cols_b), mm_type(type), 
+              native(native_b_supported(num_rows_b, num_cols_b)) {
+
+            if (!native) {
+                const size_t size = (size_t) num_rows_b * num_cols_b * matmul_type_sizes(type).b;
+                packed = NpuTensor(npu_alloc_tensor(size));
+                memcpy(packed.data(), b, size);
+                MatmulStats::instance().copied_in(size);
+                return;
+            }
+
+            // the native B layout does not depend on M, take the sizes from a single row
+            // context that is destroyed with the pack instead of kept in the cache
+            MatmulPlanBase plan(1, num_rows_b, num_cols_b, type, 0, 1);
+            rknn_matmul_info info = plan.info();
+
+            packed = NpuTensor(npu_alloc_tensor(plan.io_attr().B.size));
+            NpuMemoryRegistry::instance().add(packed.context(), packed.mem(), NPU_LAYOUT_NATIVE_B);
+            int ret = rknn_B_normal_layout_to_native_layout(
+                (void*) b, packed.data(), num_rows_b, num_cols_b, &info
+            );
+            if (ret < 0) {
+                printf("rknn_B_normal_layout_to_native_layout fail! ret=%d\n", ret);
+                abort();
+            }
+        }
+
+        NpuWeights(const NpuWeights&) = delete;
+        NpuWeights& operator=(const NpuWeights&) = delete;
+
+        /**
+         * @brief The packed weights, bound to the npu without a copy
+         */
+        const void* data() const { return packed.data(); }
+
+        int32_t rows() const { return k; }
+        int32_t cols() const { return n; }
+        _rknn_matmul_type type() const { return mm_type; }
+
+        /**
+         * @brief True when the weights are in the native B layout, false when row major
+         */
+        bool is_native() const { return native; }
+};
+
+/**
+ * @brief Abort when A or C do not have the types of the weights' matmul
+ *
+ * @param a The type of the activations
+ * @param c The type of the result, RKNN_TENSOR_TYPE_MAX when an epilogue converts C
+ */
+void check_weights_types(const NpuWeights& weights, rknn_tensor_type a, rknn_tensor_type c) {
+    const _matmul_type_entry& entry = matmul_type_entry(weights.type());
+    if (entry.a != a || (c != RKNN_TENSOR_TYPE_MAX && entry.c != c)) {
+        printf("matmul weights type mismatch! A=%d C=%d, the weights multiply %d to %d\n", 
+            a, c, entry.a, entry.c);
+        abort();
+    }
+}
+
+/**
+ * @brief Pack weights for a typed matmul
+ *
+ * @param To - The type of the output matrix
+ * @param Ti1 - The type of the activations (A)
+ * @param Ti2 - The type of the weights (inferred automatically)
+ */
+template<typename To, typename Ti1, typename Ti2>
+std::shared_ptr<NpuWeights> make_weights(int32_t num_rows_b, int32_t num_cols_b, const Ti2* b) {
+    return std::make_shared<NpuWeights>(
+        num_rows_b, num_cols_b, choose_matmul_type<To, Ti1, Ti2>(), b
+    );
+}
+
+/**
+ * @brief Performs matrix multiplication on the npu with weights that are already resident
+ *
+ * @param num_rows_a The number of rows in the first input mat
+ * @param a The data of the first input matrix
+ * @param weights The packed second input matrix
+ * @param layout The layout of matrices A and C, see _matmul_layout
+ * @param epilogue Applied while C is read, nullptr for none
+ *
+ * @return tensor_result that has inside the pointer to the result of the matmul,
+ *         free it with release_result
+ *
+ * @note The shape of the result is (num_rows_a, weights.cols())
+ * @note More rows than matmul_shape_limits run in chunks against the same weights,
+ *       and return a row major result
+ * @note Row major weights (see NpuWeights::is_native) larger than matmul_shape_limits are tiled
+ */
+tensor_result matmul_npu(
+    uint32_t num_rows_a, const void* a, const NpuWeights& weights, 
+    _matmul_layout layout = MATMUL_LAYOUT_NORMAL, const matmul_epilogue* epilogue = nullptr) {
+
+    if (!weights.is_native() && needs_tiling(num_rows_a, weights.rows(), weights.cols())) {
+        return tiled_matmul(
+            num_rows_a, weights.rows(), weights.cols(), weights.type(), a, weights.data(), 
+            matmul_shape_limits(), epilogue
+        );
+    }
+
+    const int32_t max_m = matmul_shape_limits().max_m;
+    if ((int64_t) num_rows_a <= max_m) {
+        return cached_matmul(
+            num_rows_a, weights.rows(), weights.cols(), weights.type(), a, weights.data(), layout, 
+            weights.is_native() ? 1 : 0, epilogue
+        );
+    }
+
+    return row_chunked_matmul(
+        num_rows_a, weights.rows(), weights.cols(), weights.type(), a, weights.data(), 
+        weights.is_native() ? 1 : 0, layout, epilogue
+    );
+}
+
+#endif
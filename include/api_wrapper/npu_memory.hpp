@@ -0,0 +1,388 @@
+#ifndef NPU_MEMORY
+#define NPU_MEMORY
+
+#include <rknpu/rknn_matmul_api.h>
+#include "api_wrapper/matmul_trace.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * Layout of the data in npu memory
+ */
+enum _npu_mem_layout {
+    NPU_LAYOUT_NORMAL = 0,      /* row major */
+    NPU_LAYOUT_NATIVE_AC = 1,   /* native A / C layout, (cols / group, rows, group) */
+    NPU_LAYOUT_NATIVE_B = 2,    /* native B layout, as made by rknn_B_normal_layout_to_native_layout */
+};
+
+/**
+ * Npu tensor memory, the context it was created on and the layout of it's data
+ * 
+ * @param group The number of elements in a native A / C group, 0 for other layouts
+ */
+struct _npu_mem_entry {
+    rknn_context ctx;
+    rknn_tensor_mem* mem;
+    int16_t layout;
+    int32_t group;
+};
+
+/**
+ * @brief Registry of npu tensor memory by it's virtual address
+ *
+ * Lets the matmul path find out that a plain data pointer already
+ * lives in npu memory, and bind it instead of copying it.
+ */
+class NpuMemoryRegistry {
+
+    private:
+
+        std::shared_mutex lock;
+        std::unordered_map<const void*, _npu_mem_entry> entries;
+
+    public:
+
+        static NpuMemoryRegistry& instance() {
+            static NpuMemoryRegistry* registry = new NpuMemoryRegistry();
+            return *registry;
+        }
+
+        void add(
+            rknn_context ctx, rknn_tensor_mem* mem, 
+            int16_t layout = NPU_LAYOUT_NORMAL, int32_t group = 0) {
+            std::unique_lock<std::shared_mutex> write(lock);
+            entries[mem->virt_addr] = {ctx, mem, layout, group};
+        }
+
+        void remove(rknn_tensor_mem* mem) {
+            std::unique_lock<std::shared_mutex> write(lock);
+            auto it = entries.find(mem->virt_addr);
+            if (it != entries.end() && it->second.mem == mem) {
+                entries.erase(it);
+            }
+        }
+
+        /**
+         * @brief Find the npu memory that starts at data
+         *
+         * @return The entry, with mem == nullptr when data is not npu memory
+         */
+        _npu_mem_entry find(const void* data) {
+            std::shared_lock<std::shared_mutex> read(lock);
+            auto it = entries.find(data);
+            return it == entries.end() ? _npu_mem_entry{0, nullptr, NPU_LAYOUT_NORMAL, 0} : it->second;
+        }
+};
+
+/**
+ * Counters of the npu memory pool
+ *
+ * @param allocations The buffers created with rknn_create_mem
+ * @param reuses The acquires served from a released buffer
+ * @param frees The buffers destroyed with rknn_destroy_mem
+ * @param retained_buffers The released buffers kept for reuse
+ * @param retained_bytes The npu memory held by the retained buffers
+ */
+struct npu_pool_stats {
+    uint64_t allocations;
+    uint64_t reuses;
+    uint64_t frees;
+    uint64_t retained_buffers;
+    uint64_t retained_bytes;
+};
+
+/**
+ * @brief Size class pool of npu tensor memory
+ *
+ * Released buffers are kept per (context, size class) and handed out again
+ * by acquire, so the steady state of repeated matmuls does not allocate or
+ * free dma buffers. The least recently released buffers are destroyed when
+ * the retained bytes go above the limit, and all of them when an allocation
+ * fails.
+ */
+class NpuMemoryPool {
+
+    private:
+
+        struct _pooled_mem {
+            rknn_context ctx;
+            size_t size;
+            rknn_tensor_mem* mem;
+        };
+
+        struct _pool_key {
+            rknn_context ctx;
+            size_t size;
+
+            bool operator==(const _pool_key& other) const {
+                return ctx == other.ctx && size == other.size;
+            }
+        };
+
+        struct _pool_key_hash {
+            size_t operator()(const _pool_key& key) const {
+                return std::hash<uint64_t>()((uint64_t) key.ctx) * 31 + std::hash<size_t>()(key.size);
+            }
+        };
+
+        std::mutex lock;
+        /* released buffers, the least recently released first */
+        std::list<_pooled_mem> retained;
+        std::unordered_map<_pool_key, std::vector<std::list<_pooled_mem>::iterator>, _pool_key_hash> free_lists;
+
+        size_t max_bytes = (size_t) 256 << 20;
+        npu_pool_stats counters = {0, 0, 0, 0, 0};
+
+        /* unlink a retained buffer, called with the lock held */
+        void unlink(std::list<_pooled_mem>::iterator it) {
+            std::vector<std::list<_pooled_mem>::iterator>& list = free_lists[{it->ctx, it->size}];
+            for (size_t i = 0; i < list.size(); i++) {
+                if (list[i] == it) {
+                    list.erase(list.begin() + i);
+                    break;
+                }
+            }
+            if (list.empty()) {
+                free_lists.erase({it->ctx, it->size});
+            }
+            counters.retained_buffers -= 1;
+            counters.retained_bytes -= it->size;
+            retained.erase(it);
+        }
+
+        void destroy(const std::vector<_pooled_mem>& victims) {
+            MatmulPhaseTimer timer(MATMUL_PHASE_DESTROY);
+            for (const _pooled_mem& victim : victims) {
+                rknn_destroy_mem(victim.ctx, victim.mem);
+                MatmulStats::instance().buffer_freed();
+            }
+        }
+
+    public:
+
+        /**
+         * @brief The pool used by npu_alloc and the matmul results
+         *
+         * @note Intentionally never destroyed, results may outlive static destructors
+         */
+        static NpuMemoryPool& instance() {
+            static NpuMemoryPool* pool = new NpuMemoryPool();
+            return *pool;
+        }
+
+        /**
+         * @brief The size of the buffers a request is served from
+         *
+         * Whole pages, with four classes between every two powers of two.
+         */
+        static size_t size_class(size_t size) {
+            const size_t page = 4096;
+            if (size <= page) {
+                return page;
+            }
+            size_t power = page;
+            while (power * 2 < size) {
+                power *= 2;
+            }
+            size_t step = power / 4 < page ? page : power / 4;
+            return (size + step - 1) / step * step;
+        }
+
+        /**
+         * @brief Get a buffer of at least size bytes on a context
+         *
+         * @return The buffer, give it back with release
+         */
+        rknn_tensor_mem* acquire(rknn_context ctx, size_t size) {
+            const size_t size_bytes = size_class(size);
+            if (size_bytes > UINT32_MAX) {
+                // rknn_create_mem takes the size as uint32_t
+                printf("npu memory of %zu bytes is larger than rknn_create_mem accepts\n", size);
+                abort();
+            }
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                auto found = free_lists.find({ctx, size_bytes});
+                if (found != free_lists.end()) {
+                    rknn_tensor_mem* mem = found->second.back()->mem;
+                    unlink(found->second.back());
+                    counters.reuses += 1;
+                    return mem;
+                }
+                counters.allocations += 1;
+            }
+
+            MatmulPhaseTimer timer(MATMUL_PHASE_ALLOC);
+            rknn_tensor_mem* mem = rknn_create_mem(ctx, size_bytes);
+            if (mem == nullptr) {
+                // memory pressure, give back everything that is retained and try again
+                trim(0);
+                mem = rknn_create_mem(ctx, size_bytes);
+            }
+            if (mem == nullptr) {
+                printf("rknn_create_mem fail! size=%zu\n", size_bytes);
+                abort();
+            }
+            MatmulStats::instance().buffer_allocated();
+            return mem;
+        }
+
+        /**
+         * @brief Give a buffer back to the pool for reuse
+         *
+         * @param ctx The context the buffer was acquired on
+         */
+        void release(rknn_context ctx, rknn_tensor_mem* mem) {
+            const size_t size_bytes = size_class(mem->size);
+            std::vector<_pooled_mem> victims;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (size_bytes > max_bytes) {
+                    victims.push_back({ctx, size_bytes, mem});
+                } else {
+                    retained.push_back({ctx, size_bytes, mem});
+                    free_lists[{ctx, size_bytes}].push_back(std::prev(retained.end()));
+                    counters.retained_buffers += 1;
+                    counters.retained_bytes += size_bytes;
+                    while (counters.retained_bytes > max_bytes) {
+                        victims.push_back(retained.front());
+                        unlink(retained.begin());
+                    }
+                }
+                counters.frees += victims.size();
+            }
+            destroy(victims);
+        }
+
+        /**
+         * @brief Destroy a buffer of a context that is about to be destroyed
+         */
+        void discard(rknn_context ctx, rknn_tensor_mem* mem) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                counters.frees += 1;
+            }
+            MatmulPhaseTimer timer(MATMUL_PHASE_DESTROY);
+            rknn_destroy_mem(ctx, mem);
+            MatmulStats::instance().buffer_freed();
+        }
+
+        /**
+         * @brief Destroy the retained buffers of a context, call before destroying it
+         */
+        void purge(rknn_context ctx) {
+            std::vector<_pooled_mem> victims;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                for (auto it = retained.begin(); it != retained.end();) {
+                    auto next = std::next(it);
+                    if (it->ctx == ctx) {
+                        victims.push_back(*it);
+                        unlink(it);
+                    }
+                    it = next;
+                }
+                counters.frees += victims.size();
+            }
+            destroy(victims);
+        }
+
+        /**
+         * @brief Destroy the least recently released buffers until at most keep_bytes are retained
+         */
+        void trim(size_t keep_bytes) {
+            std::vector<_pooled_mem> victims;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                while (counters.retained_bytes > keep_bytes) {
+                    victims.push_back(retained.front());
+                    unlink(retained.begin());
+                }
+                counters.frees += victims.size();
+            }
+            destroy(victims);
+        }
+
+        /**
+         * @brief Set the npu memory the pool may retain, trimming down to it
+         */
+        void configure(size_t byte_limit) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                max_bytes = byte_limit;
+            }
+            trim(byte_limit);
+        }
+
+        npu_pool_stats stats() {
+            std::lock_guard<std::mutex> guard(lock);
+            return counters;
+        }
+};
+
+/**
+ * @brief Context used only to create npu memory that is not tied to a matmul
+ *
+ * rknn_create_mem needs a context, so a minimal matmul context is created
+ * once and kept for the lifetime of the process. Memory created on it is
+ * bound to other contexts through it's fd.
+ *
+ * @return Shared handle of the context, the context is the pointed value
+ */
+std::shared_ptr<rknn_context> npu_alloc_context() {
+    static std::shared_ptr<rknn_context> alloc_ctx = []() {
+        rknn_matmul_info info;
+        rknn_matmul_io_attr io_attr;
+        memset(&info, 0, sizeof(info));
+        memset(&io_attr, 0, sizeof(io_attr));
+        info.M = 1;
+        info.K = 32;
+        info.N = 32;
+        info.type = RKNN_INT8_MM_INT8_TO_INT32;
+
+        rknn_context* ctx = new rknn_context(0);
+        int ret = rknn_matmul_create(ctx, &info, &io_attr);
+        if (ret < 0) {
+            printf("rknn_matmul_create fail! ret=%d\n", ret);
+            abort();
+        }
+        /* never destroyed, memory created on it may outlive static destructors */
+        return std::shared_ptr<rknn_context>(ctx, [](rknn_context*) {});
+    }();
+    return alloc_ctx;
+}
+
+/**
+ * @brief Create npu memory that is registered for zero copy binding
+ *
+ * The memory comes from the NpuMemoryPool and may be larger than size,
+ * it aborts when that is more than the uint32_t size of rknn_create_mem.
+ *
+ * @param size The size of the memory in bytes
+ *
+ * @return The memory, free it with npu_free
+ */
+rknn_tensor_mem* npu_alloc(size_t size) {
+    rknn_context ctx = *npu_alloc_context();
+    rknn_tensor_mem* mem = NpuMemoryPool::instance().acquire(ctx, size);
+    NpuMemoryRegistry::instance().add(ctx, mem);
+    return mem;
+}
+
+/**
+ * @brief Free memory created by npu_alloc
+ */
+void npu_free(rknn_tensor_mem* mem) {
+    NpuMemoryRegistry::instance().remove(mem);
+    NpuMemoryPool::instance().release(*npu_alloc_context(), mem);
+}
+
+#endif
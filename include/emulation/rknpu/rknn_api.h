@@ -0,0 +1,82 @@
+/*
+ * Software emulation of the rknn runtime, the subset of rknn_api.h used by matmul-npu.
+ *
+ * The types and values match the Rockchip headers, so the library builds
+ * against either one. Compile src/emulation/rknn_emulator.cpp instead of
+ * linking librknnrt (make EMULATE=1, or MATNPU_EMULATE=1 for setup.py).
+ */
+#ifndef _RKNN_API_H
+#define _RKNN_API_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* lets benchmarks and tools tell the emulation from the npu */
+#define RKNN_EMULATED 1
+
+typedef uint64_t rknn_context;
+
+#define RKNN_MAX_DIMS 16
+#define RKNN_MAX_NAME_LEN 256
+
+#define RKNN_SUCC 0
+#define RKNN_ERR_FAIL -1
+#define RKNN_ERR_TIMEOUT -2
+#define RKNN_ERR_DEVICE_UNAVAILABLE -3
+#define RKNN_ERR_MALLOC_FAIL -4
+#define RKNN_ERR_PARAM_INVALID -5
+
+typedef enum _rknn_tensor_type {
+    RKNN_TENSOR_FLOAT32 = 0,
+    RKNN_TENSOR_FLOAT16,
+    RKNN_TENSOR_INT8,
+    RKNN_TENSOR_UINT8,
+    RKNN_TENSOR_INT16,
+    RKNN_TENSOR_UINT16,
+    RKNN_TENSOR_INT32,
+    RKNN_TENSOR_UINT32,
+    RKNN_TENSOR_INT64,
+    RKNN_TENSOR_BOOL,
+    RKNN_TENSOR_INT4,
+    RKNN_TENSOR_BFLOAT16,
+
+    RKNN_TENSOR_TYPE_MAX
+} rknn_tensor_type;
+
+typedef enum _rknn_core_mask {
+    RKNN_NPU_CORE_AUTO = 0,
+    RKNN_NPU_CORE_0 = 1,
+    RKNN_NPU_CORE_1 = 2,
+    RKNN_NPU_CORE_2 = 4,
+    RKNN_NPU_CORE_0_1 = RKNN_NPU_CORE_0 | RKNN_NPU_CORE_1,
+    RKNN_NPU_CORE_0_1_2 = RKNN_NPU_CORE_0_1 | RKNN_NPU_CORE_2,
+    RKNN_NPU_CORE_ALL = 0xffff,
+
+    RKNN_NPU_CORE_UNDEFINED,
+} rknn_core_mask;
+
+typedef struct _rknn_tensor_memory {
+    void* virt_addr;
+    uint64_t phys_addr;
+    int32_t fd;
+    int32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    void* priv_data;
+} rknn_tensor_mem;
+
+rknn_tensor_mem* rknn_create_mem_from_fd(
+    rknn_context ctx, int32_t fd, void* virt_addr, uint32_t size, int32_t offset);
+
+rknn_tensor_mem* rknn_create_mem(rknn_context ctx, uint32_t size);
+
+int rknn_destroy_mem(rknn_context ctx, rknn_tensor_mem* mem);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
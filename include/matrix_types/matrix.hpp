@@ -2,50 +2,336 @@
 #define MATRIX
 
 #include "api_wrapper/matmul_api.hpp"
+#include "api_wrapper/matmul_async.hpp"
+#include "api_wrapper/matmul_batched.hpp"
+#include "api_wrapper/matmul_chain.hpp"
+#include "api_wrapper/matmul_quant.hpp"
+#include "utils/conv2d.hpp"
 #include <memory>
 
+template <typename T>
+class MatrixFuture;
+
 template <typename T>
 class Matrix {
         
     private:
 
-        rknn_tensor_mem* tensor_mem;
-        rknn_context ctx;
+        NpuTensor tensor;
 
     public: 
 
         int rows, cols;
         T* data; 
 
-        Matrix() = default;
+        Matrix() : rows(0), cols(0), data(nullptr) {}
 
         Matrix(int rows, int cols, T* data) 
-        : tensor_mem(nullptr), ctx(0), rows(rows), cols(cols), data(data) {}
+        : rows(rows), cols(cols), data(data) {}
 
         Matrix(rknn_tensor_mem* tensor_mem, rknn_context ctx, int rows, int cols, T* data) 
-        : tensor_mem(tensor_mem), ctx(ctx), rows(rows), cols(cols), data(data) {}
+        : tensor(tensor_result(ctx, tensor_mem)), rows(rows), cols(cols), data(data) {}
+
+        Matrix(tensor_result tensor, int rows, int cols) 
+        : tensor(std::move(tensor)), rows(rows), cols(cols), 
+          data((T*) this->tensor.data()) {}
+
+        /**
+         * @brief Matrices own their npu memory, they are moved and never copied
+         */
+        Matrix(const Matrix&) = delete;
+        Matrix& operator=(const Matrix&) = delete;
+
+        Matrix(Matrix&& other) noexcept 
+        : tensor(std::move(other.tensor)), rows(other.rows), cols(other.cols), data(other.data) {
+            other.rows = 0;
+            other.cols = 0;
+            other.data = nullptr;
+        }
+
+        Matrix& operator=(Matrix&& other) noexcept {
+            if (this != &other) {
+                tensor = std::move(other.tensor);
+                rows = other.rows;
+                cols = other.cols;
+                data = other.data;
+                other.rows = 0;
+                other.cols = 0;
+                other.data = nullptr;
+            }
+            return *this;
+        }
 
-        ~Matrix() {
-            rknn_destroy_mem(ctx, tensor_mem);
-            rknn_matmul_destroy(ctx);
+        /**
+         * @brief Create a matrix whose data lives directly in npu memory
+         * 
+         * Write the data through the data pointer, matmul then binds it
+         * to the npu without copying it.
+         */
+        static Matrix<T> allocate(int rows, int cols) {
+            return Matrix<T>(npu_alloc_tensor((size_t) rows * cols * sizeof(T)), rows, cols);
         }
         
+        /**
+         * @brief Multiply by another matrix on the npu
+         * 
+         * @param layout The layout of matrices A and C, with MATMUL_LAYOUT_NATIVE the 
+         *               result stays in the native layout for the next matmul
+         * 
+         * @note The result lives in npu memory, passing it to the next matmul binds it 
+         *       without a copy
+         */
         template<typename To, typename Ti>
-        Matrix<To> matmul(Matrix<Ti> mat) {
+        Matrix<To> matmul(const Matrix<Ti>& mat, _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
             tensor_result result = matmul_npu<To, T, Ti>(
-                this->rows, this->cols, mat.cols, this->data, mat.data
+                this->rows, this->cols, mat.cols, this->data, mat.data, layout
             );
             
-            return Matrix<To>(
-                result.resultMatrix, 
-                result.ctx,
-                rows, mat.cols, 
-                (To*) result.resultMatrix->virt_addr
-            ); 
+            return Matrix<To>(std::move(result), rows, mat.cols); 
     } 
 
+        /**
+         * @brief Multiply by weights that are already packed in npu memory
+         * 
+         * @param To The type of the output matrix, must match the type of the weights
+         */
+        template<typename To>
+        Matrix<To> matmul(const NpuWeights& weights, _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
+            if (weights.rows() != cols) {
+                printf("matmul shape mismatch! cols=%d weights rows=%d\n", cols, weights.rows());
+                abort();
+            }
+            check_weights_types(weights, tensor_type_of<T>(), tensor_type_of<To>());
+            tensor_result result = matmul_npu(rows, data, weights, layout);
+            return Matrix<To>(std::move(result), rows, weights.cols());
+        }
 
+        /**
+         * @brief Multiply by another matrix and apply an epilogue while C is read out
+         * 
+         * @param To The type of the result, C is computed in float32 (int32 for int8)
+         *           and converted by the epilogue
+         * @param epilogue See matmul_epilogue
+         */
+        template<typename To, typename Ti>
+        Matrix<To> matmul(
+            const Matrix<Ti>& mat, const matmul_epilogue& epilogue, 
+            _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
+            tensor_result result = matmul_npu<To, T, Ti>(
+                this->rows, this->cols, mat.cols, this->data, mat.data, epilogue, layout
+            );
+            return Matrix<To>(std::move(result), rows, mat.cols);
+        }
+
+        /**
+         * @brief Multiply by packed weights and apply an epilogue while C is read out
+         * 
+         * @param To The type of the result, it sets epilogue.output
+         */
+        template<typename To>
+        Matrix<To> matmul(
+            const NpuWeights& weights, const matmul_epilogue& epilogue, 
+            _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
+            if (weights.rows() != cols) {
+                printf("matmul shape mismatch! cols=%d weights rows=%d\n", cols, weights.rows());
+                abort();
+            }
+            check_weights_types(weights, tensor_type_of<T>(), RKNN_TENSOR_TYPE_MAX);
+            matmul_epilogue typed = epilogue;
+            typed.output = tensor_type_of<To>();
+            tensor_result result = matmul_npu(rows, data, weights, typed, layout);
+            return Matrix<To>(std::move(result), rows, weights.cols());
+        }
+
+        /**
+         * @brief Multiply a float matrix by quantized weights as an int8 matmul
+         * 
+         * The matrix is quantized per tensor from it's min and max, see quantized_matmul.
+         * 
+         * @param To The type of the result, it sets epilogue.output
+         */
+        template<typename To = float32>
+        Matrix<To> matmul(
+            const QuantizedWeights& weights, const matmul_epilogue& epilogue = matmul_epilogue(), 
+            _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
+            static_assert(std::is_same<T, float32>::value, "only float32 matrices are quantized");
+            if (weights.rows() != cols) {
+                printf("matmul shape mismatch! cols=%d weights rows=%d\n", cols, weights.rows());
+                abort();
+            }
+            matmul_epilogue typed = epilogue;
+            typed.output = tensor_type_of<To>();
+            tensor_result result = quantized_matmul(rows, data, weights, typed, layout);
+            return Matrix<To>(std::move(result), rows, weights.cols());
+        }
+
+        /**
+         * @brief Multiply a float16 matrix by int8 weights, see weight_only_matmul
+         * 
+         * @param To The type of the result, it sets epilogue.output
+         */
+        template<typename To = float16>
+        Matrix<To> matmul(
+            const Int8Weights& weights, const matmul_epilogue& epilogue = matmul_epilogue(), 
+            _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
+            static_assert(std::is_same<T, float16>::value, "int8 weights multiply float16 matrices");
+            if (weights.rows() != cols) {
+                printf("matmul shape mismatch! cols=%d weights rows=%d\n", cols, weights.rows());
+                abort();
+            }
+            matmul_epilogue typed = epilogue;
+            typed.output = tensor_type_of<To>();
+            tensor_result result = weight_only_matmul(rows, data, weights, typed, layout);
+            return Matrix<To>(std::move(result), rows, weights.cols());
+        }
+
+        /**
+         * @brief Multiply a stack of matrices by a stack of matrices (or by one matrix)
+         * 
+         * The matrix holds batch (rows / batch, cols) items stacked on top of each other,
+         * mat holds either batch (mat.rows / batch, mat.cols) items or a single matrix
+         * that every item is multiplied by.
+         * 
+         * @return The (rows, mat.cols) stack of the results
+         */
+        template<typename To, typename Ti>
+        Matrix<To> matmul_batched(
+            int batch, const Matrix<Ti>& mat, _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
+            const bool stacked = mat.rows != cols;
+            if (batch <= 0 || rows % batch != 0 || (stacked && mat.rows != cols * batch)) {
+                printf("matmul_batched shape mismatch! batch=%d rows=%d cols=%d mat rows=%d\n", 
+                    batch, rows, cols, mat.rows);
+                abort();
+            }
+            const int item_rows = rows / batch;
+            tensor_result result = matmul_npu_batched<To, T, Ti>(
+                batch, item_rows, cols, mat.cols, 
+                data, (int64_t) item_rows * cols, mat.data, stacked ? (int64_t) cols * mat.cols : 0, layout
+            );
+            return Matrix<To>(std::move(result), rows, mat.cols);
+        }
+
+        /**
+         * @brief Multiply a stack of batch matrices by packed weights
+         */
+        template<typename To>
+        Matrix<To> matmul_batched(
+            int batch, const NpuWeights& weights, _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
+            if (batch <= 0 || rows % batch != 0 || weights.rows() != cols) {
+                printf("matmul_batched shape mismatch! batch=%d rows=%d cols=%d weights rows=%d\n", 
+                    batch, rows, cols, weights.rows());
+                abort();
+            }
+            check_weights_types(weights, tensor_type_of<T>(), tensor_type_of<To>());
+            const int item_rows = rows / batch;
+            tensor_result result = matmul_npu_batched(
+                batch, item_rows, data, (int64_t) item_rows * cols, weights, layout
+            );
+            return Matrix<To>(std::move(result), rows, weights.cols());
+        }
 
+        /**
+         * @brief Convolve the batch of channels last images the matrix holds
+         * 
+         * The matrix is (batch * img_rows * img_cols, in_channels), every row one pixel.
+         * 
+         * @return The (batch * output rows * output cols, out_channels) result, one row per pixel
+         */
+        template<typename To>
+        Matrix<To> conv2d(
+            const NpuConv2d& conv, int batch, int img_rows, int img_cols, conv2d_mode mode = CONV2D_AUTO) const {
+            if (rows != batch * img_rows * img_cols || cols != conv.in_channels()) {
+                printf("conv2d shape mismatch! rows=%d cols=%d images=%dx%dx%d in channels=%d\n", 
+                    rows, cols, batch, img_rows, img_cols, conv.in_channels());
+                abort();
+            }
+            tensor_result result = conv.run(batch, img_rows, img_cols, data, mode);
+            return Matrix<To>(
+                std::move(result), batch * conv.output_rows(img_rows) * conv.output_cols(img_cols), 
+                conv.out_channels()
+            );
+        }
+
+        /**
+         * @brief Submit a multiplication by another matrix without waiting for it
+         * 
+         * @note Both matrices are read after the call returns, keep them alive 
+         *       until the result is ready
+         */
+        template<typename To, typename Ti>
+        MatrixFuture<To> submit(const Matrix<Ti>& mat, _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
+            return MatrixFuture<To>(
+                submit_matmul<To, T, Ti>(rows, cols, mat.cols, data, mat.data, layout), rows, mat.cols
+            );
+        }
+
+        /**
+         * @brief Submit a multiplication by packed weights without waiting for it
+         */
+        template<typename To>
+        MatrixFuture<To> submit(const NpuWeights& weights, _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
+            if (weights.rows() != cols) {
+                printf("matmul shape mismatch! cols=%d weights rows=%d\n", cols, weights.rows());
+                abort();
+            }
+            check_weights_types(weights, tensor_type_of<T>(), tensor_type_of<To>());
+            return MatrixFuture<To>(submit_matmul(rows, data, weights, layout), rows, weights.cols());
+        }
+
+        /**
+         * @brief Row major copy of a matrix made with MATMUL_LAYOUT_NATIVE
+         */
+        Matrix<T> normal_layout() const {
+            return Matrix<T>(unpack_result(data, rows, cols, sizeof(T)), rows, cols);
+        }
+
+
+};
+
+/**
+ * @brief Multiply a chain of matrices on the npu, e.g. matmul_chain<float32>(a, b, c)
+ * 
+ * The order of the products is chosen to do the fewest operations, and every
+ * intermediate stays in npu memory and is bound to the next matmul without a copy.
+ * 
+ * @param To The type of the result, the intermediates are float16 (requantized int8 for int8 chains)
+ * @param layout The layout of the result, see _matmul_layout
+ */
+template<typename To, typename... Ts>
+Matrix<To> matmul_chain(_matmul_layout layout, const Matrix<Ts>&... mats) {
+    std::vector<chain_operand> operands = {
+        {mats.rows, mats.cols, tensor_type_of<Ts>(), mats.data}...
+    };
+    tensor_result result = matmul_chain(operands, tensor_type_of<To>(), layout);
+    return Matrix<To>(std::move(result), operands.front().rows, operands.back().cols);
+}
+
+template<typename To, typename... Ts>
+Matrix<To> matmul_chain(const Matrix<Ts>&... mats) {
+    return matmul_chain<To>(MATMUL_LAYOUT_NORMAL, mats...);
+}
+
+/**
+ * @brief Handle of a matmul submitted with Matrix::submit
+ */
+template <typename T>
+class MatrixFuture : public MatmulFuture {
+
+    private:
+
+        int rows, cols;
+
+    public:
+
+        MatrixFuture(MatmulFuture future, int rows, int cols) 
+        : MatmulFuture(std::move(future)), rows(rows), cols(cols) {}
+
+        /**
+         * @brief Block until the matmul finished and take the result
+         */
+        Matrix<T> get() {
+            return Matrix<T>(MatmulFuture::get(), rows, cols);
+        }
 };
 
 #endif
\ No newline at end of file
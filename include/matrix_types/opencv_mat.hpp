@@ -3,38 +3,307 @@
 
 #include <opencv4/opencv2/opencv.hpp>
 #include "api_wrapper/matmul_api.hpp"
+#include "api_wrapper/matmul_async.hpp"
+#include "api_wrapper/matmul_chain.hpp"
+#include "api_wrapper/matmul_quant.hpp"
+#include "utils/conv2d.hpp"
+#include <functional>
 #include "utils/choose_type.hpp"
 
+class MatNpuFuture;
 
 class MatNpu : public cv::Mat {
 
     private: 
-        rknn_tensor_mem* tensor_mem;
-        rknn_context ctx;
+        NpuTensor tensor;
 
-        MatNpu(int32_t rows, int32_t cols, int32_t type, void* data, 
-                rknn_tensor_mem* tensor_mem, rknn_context ctx) 
-            : cv::Mat(rows, cols, type, data), tensor_mem(tensor_mem), ctx(ctx) {}
+        friend class MatNpuFuture;
+
+        MatNpu(int32_t rows, int32_t cols, int32_t type, tensor_result result) 
+            : cv::Mat(rows, cols, type, result.resultMatrix->virt_addr), tensor(std::move(result)) {}
     
     public: 
 
         MatNpu(int32_t rows, int32_t cols, int32_t type, void* data) 
-            : cv::Mat(rows, cols, type, data), tensor_mem(nullptr), ctx(0) {}
+            : cv::Mat(rows, cols, type, data) {}
+
+        /**
+         * @brief Mats own their npu memory, they are moved and never copied
+         */
+        MatNpu(const MatNpu&) = delete;
+        MatNpu& operator=(const MatNpu&) = delete;
 
+        MatNpu(MatNpu&& other) = default;
+        MatNpu& operator=(MatNpu&& other) = default;
 
-        ~MatNpu() {
-            rknn_destroy_mem(ctx, tensor_mem);
-            rknn_matmul_destroy(ctx);
+        /**
+         * @brief Create a mat whose data lives directly in npu memory
+         * 
+         * Write the data through the mat, matmul then binds it
+         * to the npu without copying it.
+         */
+        static MatNpu allocate(int32_t rows, int32_t cols, int32_t type) {
+            return MatNpu(rows, cols, type, npu_alloc_tensor((size_t) rows * cols * CV_ELEM_SIZE(type)));
         }
         
-        MatNpu matmul(MatNpu mat, int32_t output_type) {
+        MatNpu matmul(
+            const MatNpu& mat, int32_t output_type, 
+            _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
             _rknn_matmul_type mm_type = choose_matmul_type(this->type(), mat.type(), output_type);
-            tensor_result result = matmul_npu(rows, cols, mat.cols, mm_type, data, mat.data);
+            tensor_result result = matmul_npu(rows, cols, mat.cols, mm_type, data, mat.data, layout);
+            return MatNpu(rows, mat.cols, output_type, std::move(result));
+        }
+
+        /**
+         * @brief Multiply by weights that are already packed in npu memory
+         */
+        MatNpu matmul(
+            const NpuWeights& weights, int32_t output_type, 
+            _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
+            if (weights.rows() != cols) {
+                printf("matmul shape mismatch! cols=%d weights rows=%d\n", cols, weights.rows());
+                abort();
+            }
+            check_weights_types(weights, cv_tensor_type(this->type()), cv_tensor_type(output_type));
+            tensor_result result = matmul_npu(rows, data, weights, layout);
+            return MatNpu(rows, weights.cols(), output_type, std::move(result));
+        }
+
+        /**
+         * @brief Multiply by another mat and apply an epilogue while C is read out
+         * 
+         * @param output_type The type of the result, any of CV_16F, CV_32F, CV_8S, CV_32S,
+         *                    C is computed in CV_32F (CV_32S for CV_8S inputs) and converted
+         */
+        MatNpu matmul(
+            const MatNpu& mat, int32_t output_type, const matmul_epilogue& epilogue,
+            _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
+            _rknn_matmul_type mm_type;
+            matmul_epilogue typed = epilogue;
+            typed.output = cv_tensor_type(output_type);
+            if (!find_widest_matmul_type(cv_tensor_type(this->type()), cv_tensor_type(mat.type()), &mm_type) ||
+                typed.output == RKNN_TENSOR_TYPE_MAX) {
+                printf("matmul epilogue: unsupported types %d x %d -> %d\n", this->type(), mat.type(), output_type);
+                abort();
+            }
+            tensor_result result = matmul_npu(rows, cols, mat.cols, mm_type, data, mat.data, typed, layout);
+            return MatNpu(rows, mat.cols, output_type, std::move(result));
+        }
+
+        /**
+         * @brief Multiply by packed weights and apply an epilogue while C is read out
+         */
+        MatNpu matmul(
+            const NpuWeights& weights, int32_t output_type, const matmul_epilogue& epilogue,
+            _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
+            matmul_epilogue typed = epilogue;
+            typed.output = cv_tensor_type(output_type);
+            if (weights.rows() != cols || typed.output == RKNN_TENSOR_TYPE_MAX) {
+                printf("matmul epilogue: cols=%d weights rows=%d output type=%d\n", 
+                    cols, weights.rows(), output_type);
+                abort();
+            }
+            check_weights_types(weights, cv_tensor_type(this->type()), RKNN_TENSOR_TYPE_MAX);
+            tensor_result result = matmul_npu(rows, data, weights, typed, layout);
+            return MatNpu(rows, weights.cols(), output_type, std::move(result));
+        }
+
+        /**
+         * @brief Multiply a CV_32F mat by quantized weights as an int8 matmul
+         * 
+         * @param output_type The type of the result, any of CV_16F, CV_32F, CV_8S, CV_32S
+         */
+        MatNpu matmul(
+            const QuantizedWeights& weights, int32_t output_type, 
+            const matmul_epilogue& epilogue = matmul_epilogue(),
+            _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
+            matmul_epilogue typed = epilogue;
+            typed.output = cv_tensor_type(output_type);
+            if (this->type() != CV_32F || weights.rows() != cols || typed.output == RKNN_TENSOR_TYPE_MAX) {
+                printf("quantized matmul: type=%d cols=%d weights rows=%d output type=%d\n", 
+                    this->type(), cols, weights.rows(), output_type);
+                abort();
+            }
+            tensor_result result = quantized_matmul(rows, (const float*) data, weights, typed, layout);
+            return MatNpu(rows, weights.cols(), output_type, std::move(result));
+        }
+
+        /**
+         * @brief Multiply a CV_16F mat by int8 weights, see weight_only_matmul
+         * 
+         * @param output_type The type of the result, any of CV_16F, CV_32F, CV_8S, CV_32S
+         */
+        MatNpu matmul(
+            const Int8Weights& weights, int32_t output_type, 
+            const matmul_epilogue& epilogue = matmul_epilogue(),
+            _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const {
+            matmul_epilogue typed = epilogue;
+            typed.output = cv_tensor_type(output_type);
+            if (this->type() != CV_16F || weights.rows() != cols || typed.output == RKNN_TENSOR_TYPE_MAX) {
+                printf("weight only matmul: type=%d cols=%d weights rows=%d output type=%d\n", 
+                    this->type(), cols, weights.rows(), output_type);
+                abort();
+            }
+            tensor_result result = weight_only_matmul(rows, (const float16*) data, weights, typed, layout);
+            return MatNpu(rows, weights.cols(), output_type, std::move(result));
+        }
+
+        /**
+         * @brief Convolve the mat as a channels last image, one mat channel per image channel
+         * 
+         * @param output_type The depth of the result, it has conv.out_channels() channels
+         */
+        MatNpu conv2d(const NpuConv2d& conv, int32_t output_type, conv2d_mode mode = CONV2D_AUTO) const {
+            if (channels() != conv.in_channels() || !isContinuous() || conv.out_channels() > CV_CN_MAX) {
+                printf("conv2d shape mismatch! channels=%d in channels=%d out channels=%d\n", 
+                    channels(), conv.in_channels(), conv.out_channels());
+                abort();
+            }
+            tensor_result result = conv.run(1, rows, cols, data, mode);
+            return MatNpu(
+                conv.output_rows(rows), conv.output_cols(cols), 
+                CV_MAKETYPE(CV_MAT_DEPTH(output_type), conv.out_channels()), std::move(result)
+            );
+        }
+
+        /**
+         * @brief Multiply a chain of mats on the npu, e.g. MatNpu::chain({a, b, c}, CV_32F)
+         * 
+         * The order of the products is chosen to do the fewest operations, and every
+         * intermediate stays in npu memory and is bound to the next matmul without a copy.
+         */
+        static MatNpu chain(
+            const std::vector<std::reference_wrapper<const MatNpu>>& mats, int32_t output_type,
+            _matmul_layout layout = MATMUL_LAYOUT_NORMAL) {
+            std::vector<chain_operand> operands;
+            for (const MatNpu& mat : mats) {
+                operands.push_back({mat.rows, mat.cols, cv_tensor_type(mat.type()), mat.data});
+            }
+            tensor_result result = matmul_chain(operands, cv_tensor_type(output_type), layout);
             return MatNpu(
-                rows, mat.cols, output_type, result.resultMatrix->virt_addr,
-                result.resultMatrix, result.ctx
+                operands.front().rows, operands.back().cols, output_type, std::move(result)
             );
         }
+
+        /**
+         * @brief Submit a multiplication by another mat without waiting for it
+         * 
+         * @note Both mats are read after the call returns, keep them alive 
+         *       until the result is ready
+         */
+        MatNpuFuture submit(
+            const MatNpu& mat, int32_t output_type, 
+            _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const;
+
+        /**
+         * @brief Submit a multiplication by packed weights without waiting for it
+         */
+        MatNpuFuture submit(
+            const NpuWeights& weights, int32_t output_type, 
+            _matmul_layout layout = MATMUL_LAYOUT_NORMAL) const;
 };
 
+/**
+ * @brief Handle of a matmul submitted with MatNpu::submit
+ */
+class MatNpuFuture : public MatmulFuture {
+
+    private:
+
+        int32_t rows, cols, type;
+
+    public:
+
+        MatNpuFuture(MatmulFuture future, int32_t rows, int32_t cols, int32_t type) 
+            : MatmulFuture(std::move(future)), rows(rows), cols(cols), type(type) {}
+
+        /**
+         * @brief Block until the matmul finished and take the result
+         */
+        MatNpu get() {
+            return MatNpu(rows, cols, type, MatmulFuture::get());
+        }
+};
+
+MatNpuFuture MatNpu::submit(const MatNpu& mat, int32_t output_type, _matmul_layout layout) const {
+    _rknn_matmul_type mm_type = choose_matmul_type(this->type(), mat.type(), output_type);
+    MatmulFuture future = submit_matmul(rows, cols, mat.cols, mm_type, data, mat.data, layout);
+    return MatNpuFuture(std::move(future), rows, mat.cols, output_type);
+}
+
+MatNpuFuture MatNpu::submit(const NpuWeights& weights, int32_t output_type, _matmul_layout layout) const {
+    if (weights.rows() != cols) {
+        printf("matmul shape mismatch! cols=%d weights rows=%d\n", cols, weights.rows());
+        abort();
+    }
+    check_weights_types(weights, cv_tensor_type(this->type()), cv_tensor_type(output_type));
+    MatmulFuture future = submit_matmul(rows, data, weights, layout);
+    return MatNpuFuture(std::move(future), rows, weights.cols(), output_type);
+}
+
+/**
+ * @brief Pack a mat as weights for MatNpu::matmul
+ * 
+ * @param b The (K, N) weights
+ * @param input_type The type of the activations that are multiplied by the weights
+ * @param output_type The type of the output matrix
+ */
+std::shared_ptr<NpuWeights> make_weights(const cv::Mat& b, int32_t input_type, int32_t output_type) {
+    _rknn_matmul_type mm_type = choose_matmul_type(input_type, b.type(), output_type);
+    cv::Mat contiguous = b.isContinuous() ? b : b.clone();
+    return std::make_shared<NpuWeights>(b.rows, b.cols, mm_type, contiguous.data);
+}
+
+/**
+ * @brief Quantize a CV_32F mat as int8 weights for MatNpu::matmul
+ * 
+ * @param symmetric See QuantizedWeights
+ */
+std::shared_ptr<QuantizedWeights> make_quantized_weights(const cv::Mat& b, bool symmetric = true) {
+    if (b.type() != CV_32F) {
+        printf("make_quantized_weights: the weights must be CV_32F, got %d\n", b.type());
+        abort();
+    }
+    cv::Mat contiguous = b.isContinuous() ? b : b.clone();
+    return make_quantized_weights(b.rows, b.cols, contiguous.ptr<float>(), symmetric);
+}
+
+/**
+ * @brief Quantize a CV_32F or CV_16F mat as int8 weights for a CV_16F MatNpu::matmul
+ */
+std::shared_ptr<Int8Weights> make_int8_weights(const cv::Mat& b) {
+    cv::Mat contiguous = b.isContinuous() ? b : b.clone();
+    if (b.type() == CV_32F) {
+        return make_int8_weights(b.rows, b.cols, contiguous.ptr<float>());
+    }
+    if (b.type() == CV_16F) {
+        return make_int8_weights(b.rows, b.cols, contiguous.ptr<float16>());
+    }
+    printf("make_int8_weights: the weights must be CV_32F or CV_16F, got %d\n", b.type());
+    abort();
+}
+
+/**
+ * @brief Move a filter to npu memory for MatNpu::conv2d
+ * 
+ * @param filter The (filter_rows * filter_cols * in_channels, out_channels) filter, 
+ *               the rows in (row, col, channel) order
+ * @param input_type The type of the images that are convolved
+ * @param output_type The type of the output
+ */
+std::shared_ptr<NpuConv2d> make_conv2d(
+    const cv::Mat& filter, int32_t filter_rows, int32_t filter_cols, 
+    int32_t input_type, int32_t output_type, conv2d_params params = conv2d_params()) {
+    if (filter.rows % (filter_rows * filter_cols) != 0) {
+        printf("conv2d filter shape mismatch! rows=%d filter=%dx%d\n", filter.rows, filter_rows, filter_cols);
+        abort();
+    }
+    _rknn_matmul_type mm_type = choose_matmul_type(input_type, filter.type(), output_type);
+    cv::Mat contiguous = filter.isContinuous() ? filter : filter.clone();
+    return std::make_shared<NpuConv2d>(
+        filter_rows, filter_cols, filter.rows / (filter_rows * filter_cols), filter.cols, 
+        mm_type, contiguous.data, params
+    );
+}
+
 #endif
\ No newline at end of file
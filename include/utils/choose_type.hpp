@@ -3,49 +3,50 @@
 
 #include <rknpu/rknn_matmul_api.h>
 #include <opencv4/opencv2/opencv.hpp>
+#include "utils/matmul_traits.hpp"
 
-typedef __fp16 float16;
-typedef float float32;
+/**
+ * @brief The opencv matrix type of every rknn tensor type a matmul uses
+ */
+constexpr struct {
+    int cv_type;
+    rknn_tensor_type type;
+} cv_tensor_types[] = {
+    {CV_16F, RKNN_TENSOR_FLOAT16},
+    {CV_32F, RKNN_TENSOR_FLOAT32},
+    {CV_8S,  RKNN_TENSOR_INT8},
+    {CV_32S, RKNN_TENSOR_INT32},
+};
 
+/**
+ * @brief The rknn tensor type of an opencv matrix type
+ *
+ * @return RKNN_TENSOR_TYPE_MAX for types the npu matmul doesn't take
+ */
+rknn_tensor_type cv_tensor_type(int type) {
+    for (const auto& entry : cv_tensor_types) {
+        if (entry.cv_type == type) {
+            return entry.type;
+        }
+    }
+    return RKNN_TENSOR_TYPE_MAX;
+}
 
 _rknn_matmul_type choose_matmul_type(int input1, int input2, int output) {
-    
-    if (
-        input1 == CV_16F &&
-        input2 == CV_16F &&
-        output == CV_16F ) { 
-        return RKNN_FLOAT16_MM_FLOAT16_TO_FLOAT16; 
-    } else if (
-        input1 == CV_16F &&
-        input2 == CV_16F &&
-        output == CV_32F ) { 
-        return RKNN_FLOAT16_MM_FLOAT16_TO_FLOAT32; 
-    } else if (
-        input1 == CV_16F &&
-        input2 == CV_8S &&
-        output == CV_16F ) { 
-        return RKNN_FLOAT16_MM_INT8_TO_FLOAT16; 
-    } else if (
-        input1 == CV_8S &&
-        input2 == CV_8S &&
-        output == CV_8S) { 
-        return RKNN_INT8_MM_INT8_TO_INT8; 
-    } else if (
-        input1 == CV_8S &&
-        input2 == CV_8S &&
-        output == CV_32S) { 
-        return RKNN_INT8_MM_INT8_TO_INT32; 
-    } else {
-        std::cout << "unsupported combination of types:\n";
-        std::cout << "please enter types from avilable types\n";
-        std::cout << "1. float16, float16, float16\n";
-        std::cout << "2. float16, float16, float32\n";
-        std::cout << "3. float16, int8_t, float16\n";
-        std::cout << "4. int8_t, int8_t, int8_t\n";
-        std::cout << "4. int8_t, int8_t, int32_t\n";
-        abort();
+
+    _rknn_matmul_type type;
+    if (find_matmul_type(cv_tensor_type(input1), cv_tensor_type(input2), cv_tensor_type(output), &type)) {
+        return type;
     }
 
+    std::cout << "unsupported combination of types:\n";
+    std::cout << "please enter types from avilable types\n";
+    std::cout << "1. CV_16F, CV_16F, CV_16F\n";
+    std::cout << "2. CV_16F, CV_16F, CV_32F\n";
+    std::cout << "3. CV_16F, CV_8S, CV_16F\n";
+    std::cout << "4. CV_8S, CV_8S, CV_8S\n";
+    std::cout << "5. CV_8S, CV_8S, CV_32S\n";
+    abort();
 }
 
-#endif
\ No newline at end of file
+#endif
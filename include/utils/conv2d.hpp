@@ -2,20 +2,387 @@
 #define CONV2D
 
 #include "api_wrapper/matmul_api.hpp"
+#include "api_wrapper/matmul_weights.hpp"
+#include <cstring>
+#include <deque>
+#include <future>
+#include <memory>
+#include <vector>
 
+/**
+ * The geometry of a 2D convolution
+ *
+ * @param stride_rows, stride_cols The step in the input between two output pixels
+ * @param pad_rows, pad_cols The zeros added before and after the input rows / columns
+ * @param dilation_rows, dilation_cols The step in the input between two filter taps
+ */
+struct conv2d_params {
+    int32_t stride_rows = 1, stride_cols = 1;
+    int32_t pad_rows = 0, pad_cols = 0;
+    int32_t dilation_rows = 1, dilation_cols = 1;
+};
 
-void* conv2d(
-    void* img, 
-    uint32_t img_rows,
-    uint32_t img_cols,  
-    void* filter, 
-    uint32_t filter_rows,
-    uint32_t filter_cols
-    ) {
-        
+/**
+ * @brief The output size of a convolution along one axis, <= 0 when the filter does not fit
+ */
+int32_t conv2d_output_size(int32_t input, int32_t filter, int32_t stride, int32_t pad, int32_t dilation) {
+    const int32_t reach = dilation * (filter - 1) + 1;
+    if (input + 2 * pad < reach) {
+        return 0;
+    }
+    return (input + 2 * pad - reach) / stride + 1;
+}
+
+/**
+ * @brief Lower output pixels [first, first + count) of a convolution to im2col rows
+ *
+ * Row i holds the filter_rows x filter_cols x channels input values output pixel
+ * first + i is computed from, in the (row, col, channel) order of the filter,
+ * followed by zeros up to ld. Pixels are numbered (b, y, x) over the batch of
+ * output images. Every tap is a copy of a whole run of channels, with unit column
+ * dilation a filter row of taps inside the image is a single copy. The rows are
+ * packed in parallel.
+ *
+ * @param out The (count, ld) im2col block
+ * @param img The (batch, img_rows, img_cols, channels) images
+ * @param elem_size The size of an element in bytes
+ * @param first, count The pixels to lower, they must be inside the batch
+ */
+void im2col(
+    void* out, int64_t ld, const void* img,
+    int32_t batch, int32_t img_rows, int32_t img_cols, int32_t channels,
+    int32_t filter_rows, int32_t filter_cols, const conv2d_params& params, size_t elem_size,
+    int64_t first, int64_t count) {
+
+    const int32_t out_rows = conv2d_output_size(
+        img_rows, filter_rows, params.stride_rows, params.pad_rows, params.dilation_rows
+    );
+    const int32_t out_cols = conv2d_output_size(
+        img_cols, filter_cols, params.stride_cols, params.pad_cols, params.dilation_cols
+    );
+    if (first < 0 || count < 0 || first + count > (int64_t) batch * out_rows * out_cols) {
+        printf("im2col: pixels [%lld, %lld) out of the %d images of %dx%d pixels\n", 
+            (long long) first, (long long) (first + count), batch, out_rows, out_cols);
+        abort();
+    }
+    const size_t run = channels * elem_size;
+    const size_t taps = (size_t) filter_rows * filter_cols * run;
+    const size_t row_bytes = ld * elem_size;
+
+    MatmulPhaseTimer timer(MATMUL_PHASE_COPY_IN, count, ld, 0);
+    MatmulStats::instance().copied_in(count * row_bytes);
+
+    #pragma omp parallel for schedule(static)
+    for (int64_t i = 0; i < count; i++) {
+        const int64_t pixel = first + i;
+        const int32_t x = pixel % out_cols;
+        const int32_t y = (pixel / out_cols) % out_rows;
+        const int64_t b = pixel / ((int64_t) out_cols * out_rows);
+        const uint8_t* image = (const uint8_t*) img + (size_t) b * img_rows * img_cols * run;
+        uint8_t* dst = (uint8_t*) out + i * row_bytes;
+
+        const int32_t x0 = x * params.stride_cols - params.pad_cols;
+        for (int32_t fr = 0; fr < filter_rows; fr++) {
+            const int32_t iy = y * params.stride_rows - params.pad_rows + fr * params.dilation_rows;
+            uint8_t* taps_row = dst + (size_t) fr * filter_cols * run;
+            if (iy < 0 || iy >= img_rows) {
+                memset(taps_row, 0, filter_cols * run);
+                continue;
+            }
+            const uint8_t* src = image + (size_t) iy * img_cols * run;
+            if (params.dilation_cols == 1 && x0 >= 0 && x0 + filter_cols <= img_cols) {
+                memcpy(taps_row, src + x0 * run, filter_cols * run);
+                continue;
+            }
+            for (int32_t fc = 0; fc < filter_cols; fc++) {
+                const int32_t ix = x0 + fc * params.dilation_cols;
+                if (ix < 0 || ix >= img_cols) {
+                    memset(taps_row + fc * run, 0, run);
+                } else {
+                    memcpy(taps_row + fc * run, src + ix * run, run);
+                }
+            }
+        }
+        if (row_bytes > taps) {
+            memset(dst + taps, 0, row_bytes - taps);
+        }
+    }
+}
+
+/**
+ * How NpuConv2d lowers the images
+ */
+enum conv2d_mode {
+    CONV2D_AUTO = 0,    /* streams when the im2col matrix is larger than conv2d_config::max_im2col_bytes */
+    CONV2D_IM2COL,      /* builds the whole im2col matrix and runs a single matmul */
+    CONV2D_STREAM       /* implicit gemm, im2col row blocks are packed while the previous block runs */
+};
 
+/**
+ * Process wide settings of the streamed convolution
+ *
+ * @param max_im2col_bytes The npu memory the im2col matrix may take, larger ones are
+ *                         streamed through a ring of buffers that fits in it
+ * @param ring The number of buffers in the ring, ring - 1 blocks run on the npu 
+ *             while the next one is packed
+ */
+struct conv2d_config {
+    size_t max_im2col_bytes;
+    int32_t ring;
+};
+
+conv2d_config& matmul_conv2d_config() {
+    static conv2d_config config = {(size_t) 64 << 20, 2};
+    return config;
 }
 
+/**
+ * @brief A 2D convolution whose filter is kept in npu memory between calls
+ *
+ * Images are channels last (batch, rows, cols, in_channels) and the result is
+ * channels last (batch, out rows, out cols, out_channels). Every call lowers the
+ * images to an im2col matrix in npu memory and multiplies it by the filter, large
+ * images stream the matrix in row blocks instead (see conv2d_mode).
+ * Filters with aligned sizes are packed once to the native B layout (see NpuWeights),
+ * the inner dimension is zero padded to a multiple of 32 for it. The others stay
+ * row major in npu memory and are bound to every matmul without a copy.
+ */
+class NpuConv2d {
+
+    private:
+
+        int32_t filter_rows, filter_cols, in_ch, out_ch, k;
+        _rknn_matmul_type mm_type;
+        conv2d_params geometry;
+        std::unique_ptr<NpuWeights> packed;
+        NpuTensor filter;
+
+        /**
+         * @brief Multiply rows of an im2col matrix in npu memory by the filter
+         */
+        tensor_result multiply(uint32_t num_rows, void* columns) const {
+            if (packed) {
+                return matmul_npu(num_rows, columns, *packed);
+            }
+            return matmul_npu(num_rows, k, out_ch, mm_type, columns, filter.data());
+        }
+
+        /**
+         * @brief Multiply rows of an im2col matrix in npu memory by the filter into 
+         *        their rows of a row major result
+         */
+        void multiply_into(int64_t num_rows, const void* columns, void* dst) const {
+            if (!packed && needs_tiling(num_rows, k, out_ch)) {
+                tiled_matmul_into(num_rows, k, out_ch, mm_type, columns, filter.data(), dst);
+                return;
+            }
+            _pending_matmul pending = packed ?
+                prepare_matmul(
+                    num_rows, k, out_ch, mm_type, columns, packed->data(), 
+                    MATMUL_LAYOUT_NORMAL, packed->is_native() ? 1 : 0
+                ) :
+                prepare_matmul(num_rows, k, out_ch, mm_type, columns, filter.data());
+            finish_matmul_into(pending, dst);
+        }
+
+        /**
+         * @brief Implicit gemm, packs im2col blocks of block rows into a ring of npu 
+         *        buffers while the blocks before them run and are read into the result
+         */
+        tensor_result stream(
+            int32_t batch, int32_t img_rows, int32_t img_cols, const void* img,
+            int64_t pixels, int64_t block, int32_t ring) const {
+
+            const _matmul_type_sizes sizes = matmul_type_sizes(mm_type);
+            const size_t c_row = (size_t) out_ch * sizes.c;
+            tensor_result result = npu_alloc_tensor(pixels * c_row);
+            uint8_t* c = (uint8_t*) result.resultMatrix->virt_addr;
+
+            std::vector<NpuTensor> buffers;
+            for (int32_t i = 0; i < ring; i++) {
+                buffers.emplace_back(npu_alloc_tensor(block * k * sizes.a));
+            }
+
+            // every block is read straight into it's rows of the result
+            std::deque<std::future<void>> running;
+            for (int64_t first = 0, i = 0; first < pixels; first += block, i++) {
+                // the buffer of block i - ring is packed again, that block has to be done
+                if (running.size() == (size_t) ring) {
+                    running.front().get();
+                    running.pop_front();
+                }
+                const int64_t rows = std::min(block, pixels - first);
+                void* buffer = buffers[i % ring].data();
+                im2col(
+                    buffer, k, img, batch, img_rows, img_cols, in_ch,
+                    filter_rows, filter_cols, geometry, sizes.a, first, rows
+                );
+                uint8_t* dst = c + first * c_row;
+                running.push_back(std::async(std::launch::async, [this, rows, buffer, dst]() {
+                    multiply_into(rows, buffer, dst);
+                }));
+            }
+            while (!running.empty()) {
+                running.front().get();
+                running.pop_front();
+            }
+            return result;
+        }
 
+    public:
+
+        /**
+         * @brief Move the filter to npu memory
+         *
+         * @param filter_rows, filter_cols The spatial size of the filter
+         * @param in_channels, out_channels The channels of the images and of the result
+         * @param type The matmul type flag, A is the images and B the filter
+         * @param data The (filter_rows, filter_cols, in_channels, out_channels) filter
+         * @param params The stride, padding and dilation
+         */
+        NpuConv2d(
+            int32_t filter_rows, int32_t filter_cols, int32_t in_channels, int32_t out_channels,
+            _rknn_matmul_type type, const void* data, conv2d_params params = conv2d_params()
+        ) : filter_rows(filter_rows), filter_cols(filter_cols),
+            in_ch(in_channels), out_ch(out_channels), mm_type(type), geometry(params) {
+
+            if (filter_rows <= 0 || filter_cols <= 0 || in_channels <= 0 || out_channels <= 0 ||
+                params.stride_rows <= 0 || params.stride_cols <= 0 ||
+                params.dilation_rows <= 0 || params.dilation_cols <= 0 ||
+                params.pad_rows < 0 || params.pad_cols < 0) {
+                printf("conv2d: invalid filter %dx%dx%dx%d or geometry\n",
+                    filter_rows, filter_cols, in_channels, out_channels);
+                abort();
+            }
+
+            const int32_t taps = filter_rows * filter_cols * in_channels;
+            const size_t b_size = matmul_type_sizes(type).b;
+            k = (taps + 31) / 32 * 32;
+
+            if (native_b_supported(k, out_channels)) {
+                std::vector<uint8_t> padded((size_t) k * out_channels * b_size, 0);
+                memcpy(padded.data(), data, (size_t) taps * out_channels * b_size);
+                packed.reset(new NpuWeights(k, out_channels, type, padded.data()));
+                return;
+            }
+
+            k = taps;
+            filter = NpuTensor(npu_alloc_tensor((size_t) k * out_channels * b_size));
+            memcpy(filter.data(), data, (size_t) k * out_channels * b_size);
+        }
+
+        NpuConv2d(const NpuConv2d&) = delete;
+        NpuConv2d& operator=(const NpuConv2d&) = delete;
+
+        int32_t output_rows(int32_t img_rows) const {
+            return conv2d_output_size(
+                img_rows, filter_rows, geometry.stride_rows, geometry.pad_rows, geometry.dilation_rows
+            );
+        }
+
+        int32_t output_cols(int32_t img_cols) const {
+            return conv2d_output_size(
+                img_cols, filter_cols, geometry.stride_cols, geometry.pad_cols, geometry.dilation_cols
+            );
+        }
+
+        /**
+         * @brief Convolve a batch of images
+         *
+         * @param img The (batch, img_rows, img_cols, in_channels) images
+         * @param mode Build the whole im2col matrix or stream it, see conv2d_mode
+         *
+         * @return tensor_result with the (batch, output_rows, output_cols, out_channels) result,
+         *         free it with release_result
+         *
+         * @note Streaming keeps the im2col memory under matmul_conv2d_config().max_im2col_bytes
+         *       for any image size, only the result grows with the images
+         */
+        tensor_result run(
+            int32_t batch, int32_t img_rows, int32_t img_cols, const void* img, 
+            conv2d_mode mode = CONV2D_AUTO) const {
+            const int32_t rows = output_rows(img_rows), cols = output_cols(img_cols);
+            if (batch <= 0 || rows <= 0 || cols <= 0) {
+                printf("conv2d: a %dx%d filter does not fit a batch of %d %dx%d images\n",
+                    filter_rows, filter_cols, batch, img_rows, img_cols);
+                abort();
+            }
+
+            const int64_t M = (int64_t) batch * rows * cols;
+            const size_t a_size = matmul_type_sizes(mm_type).a;
+            const conv2d_config& config = matmul_conv2d_config();
+            const int32_t ring = std::max(2, config.ring);
+            const int64_t block = std::min<int64_t>(
+                std::max<size_t>(1, config.max_im2col_bytes / (ring * k * a_size)), matmul_shape_limits().max_m
+            );
+            const bool whole_fits = (size_t) M * k * a_size <= config.max_im2col_bytes;
+
+            if (mode == CONV2D_STREAM || (mode == CONV2D_AUTO && !whole_fits)) {
+                return stream(batch, img_rows, img_cols, img, M, std::min(block, M), ring);
+            }
+
+            NpuTensor columns(npu_alloc_tensor((size_t) M * k * a_size));
+            im2col(
+                columns.data(), k, img, batch, img_rows, img_cols, in_ch,
+                filter_rows, filter_cols, geometry, a_size, 0, M
+            );
+            return multiply(M, columns.data());
+        }
+
+        int32_t rows() const { return filter_rows; }
+        int32_t cols() const { return filter_cols; }
+        int32_t in_channels() const { return in_ch; }
+        int32_t out_channels() const { return out_ch; }
+        const conv2d_params& params() const { return geometry; }
+        _rknn_matmul_type type() const { return mm_type; }
+};
+
+/**
+ * @brief Move a filter to npu memory for a typed convolution
+ *
+ * @param To - The type of the output
+ * @param Ti1 - The type of the images
+ * @param Ti2 - The type of the filter (inferred automatically)
+ */
+template<typename To, typename Ti1, typename Ti2>
+std::shared_ptr<NpuConv2d> make_conv2d(
+    int32_t filter_rows, int32_t filter_cols, int32_t in_channels, int32_t out_channels,
+    const Ti2* filter, conv2d_params params = conv2d_params()) {
+    return std::make_shared<NpuConv2d>(
+        filter_rows, filter_cols, in_channels, out_channels,
+        choose_matmul_type<To, Ti1, Ti2>(), filter, params
+    );
+}
+
+/**
+ * @brief Convolve a batch of images on the npu, im2col lowered to a single matmul
+ *
+ * @param img The (batch, img_rows, img_cols, in_channels) channels last images
+ * @param filter The (filter_rows, filter_cols, in_channels, out_channels) filter
+ *
+ * @return tensor_result with the channels last result, free it with release_result
+ *
+ * @note The filter is moved to the npu on every call, keep an NpuConv2d to reuse it
+ */
+template<typename To, typename Ti1, typename Ti2>
+tensor_result conv2d(
+    const Ti1* img,
+    int32_t batch,
+    int32_t img_rows,
+    int32_t img_cols,
+    int32_t in_channels,
+    const Ti2* filter,
+    int32_t filter_rows,
+    int32_t filter_cols,
+    int32_t out_channels,
+    conv2d_params params = conv2d_params(),
+    conv2d_mode mode = CONV2D_AUTO
+    ) {
+    NpuConv2d conv(
+        filter_rows, filter_cols, in_channels, out_channels,
+        choose_matmul_type<To, Ti1, Ti2>(), filter, params
+    );
+    return conv.run(batch, img_rows, img_cols, img, mode);
+}
 
-#endif
\ No newline at end of file
+#endif
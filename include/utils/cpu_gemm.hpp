@@ -0,0 +1,261 @@
+#ifndef CPU_GEMM
+#define CPU_GEMM
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <vector>
+#include "utils/matmul_traits.hpp"
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/**
+ * Block sizes of the cpu gemm
+ *
+ * Matrix B is packed once per CPU_GEMM_KC rows into panels of CPU_GEMM_NR columns,
+ * and every CPU_GEMM_MR rows of A are multiplied by a panel at a time, so the
+ * MR x NR accumulator block stays in registers.
+ */
+constexpr int32_t CPU_GEMM_MR = 4;
+constexpr int32_t CPU_GEMM_NR = 16;
+constexpr int32_t CPU_GEMM_KC = 256;
+constexpr int32_t CPU_GEMM_MC = 64;
+
+/**
+ * @brief The accumulator value of a matrix element
+ */
+template<typename Acc, typename T>
+inline Acc gemm_load(T value) {
+    return (Acc) value;
+}
+
+/**
+ * @brief Convert an accumulator to the output type, rounding to nearest and saturating integers
+ */
+template<typename To, typename Acc>
+inline To gemm_store(Acc value) {
+    return (To) value;
+}
+
+template<>
+inline float16 gemm_store<float16, float32>(float32 value) {
+    return half_float::half_cast<float16, std::round_to_nearest>(value);
+}
+
+template<>
+inline int8_t gemm_store<int8_t, int32_t>(int32_t value) {
+    return (int8_t) std::min<int32_t>(127, std::max<int32_t>(-128, value));
+}
+
+/**
+ * @brief Multiply a packed MR x kc block of A by a packed kc x NR panel of B, adding to acc
+ *
+ * @param a The block of A, kc groups of MR values
+ * @param b The panel of B, kc groups of NR values
+ * @param acc The MR x NR row major accumulators
+ */
+template<typename Acc>
+inline void gemm_micro_kernel(int32_t kc, const Acc* a, const Acc* b, Acc* acc) {
+    Acc block[CPU_GEMM_MR][CPU_GEMM_NR];
+    for (int32_t i = 0; i < CPU_GEMM_MR; i++) {
+        for (int32_t j = 0; j < CPU_GEMM_NR; j++) {
+            block[i][j] = acc[i * CPU_GEMM_NR + j];
+        }
+    }
+    for (int32_t k = 0; k < kc; k++) {
+        const Acc* a_k = a + k * CPU_GEMM_MR;
+        const Acc* b_k = b + k * CPU_GEMM_NR;
+        for (int32_t i = 0; i < CPU_GEMM_MR; i++) {
+            #pragma omp simd
+            for (int32_t j = 0; j < CPU_GEMM_NR; j++) {
+                block[i][j] += a_k[i] * b_k[j];
+            }
+        }
+    }
+    for (int32_t i = 0; i < CPU_GEMM_MR; i++) {
+        for (int32_t j = 0; j < CPU_GEMM_NR; j++) {
+            acc[i * CPU_GEMM_NR + j] = block[i][j];
+        }
+    }
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+
+template<>
+inline void gemm_micro_kernel<float32>(int32_t kc, const float32* a, const float32* b, float32* acc) {
+    __m256 c00 = _mm256_loadu_ps(acc),      c01 = _mm256_loadu_ps(acc + 8);
+    __m256 c10 = _mm256_loadu_ps(acc + 16), c11 = _mm256_loadu_ps(acc + 24);
+    __m256 c20 = _mm256_loadu_ps(acc + 32), c21 = _mm256_loadu_ps(acc + 40);
+    __m256 c30 = _mm256_loadu_ps(acc + 48), c31 = _mm256_loadu_ps(acc + 56);
+    for (int32_t k = 0; k < kc; k++) {
+        const __m256 b0 = _mm256_loadu_ps(b + k * CPU_GEMM_NR);
+        const __m256 b1 = _mm256_loadu_ps(b + k * CPU_GEMM_NR + 8);
+        const float32* a_k = a + k * CPU_GEMM_MR;
+        __m256 a0 = _mm256_broadcast_ss(a_k);
+        c00 = _mm256_fmadd_ps(a0, b0, c00); c01 = _mm256_fmadd_ps(a0, b1, c01);
+        __m256 a1 = _mm256_broadcast_ss(a_k + 1);
+        c10 = _mm256_fmadd_ps(a1, b0, c10); c11 = _mm256_fmadd_ps(a1, b1, c11);
+        __m256 a2 = _mm256_broadcast_ss(a_k + 2);
+        c20 = _mm256_fmadd_ps(a2, b0, c20); c21 = _mm256_fmadd_ps(a2, b1, c21);
+        __m256 a3 = _mm256_broadcast_ss(a_k + 3);
+        c30 = _mm256_fmadd_ps(a3, b0, c30); c31 = _mm256_fmadd_ps(a3, b1, c31);
+    }
+    _mm256_storeu_ps(acc, c00);      _mm256_storeu_ps(acc + 8, c01);
+    _mm256_storeu_ps(acc + 16, c10); _mm256_storeu_ps(acc + 24, c11);
+    _mm256_storeu_ps(acc + 32, c20); _mm256_storeu_ps(acc + 40, c21);
+    _mm256_storeu_ps(acc + 48, c30); _mm256_storeu_ps(acc + 56, c31);
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+template<>
+inline void gemm_micro_kernel<float32>(int32_t kc, const float32* a, const float32* b, float32* acc) {
+    float32x4_t c[CPU_GEMM_MR][4];
+    for (int32_t i = 0; i < CPU_GEMM_MR; i++) {
+        for (int32_t j = 0; j < 4; j++) {
+            c[i][j] = vld1q_f32(acc + i * CPU_GEMM_NR + j * 4);
+        }
+    }
+    for (int32_t k = 0; k < kc; k++) {
+        const float32* b_k = b + k * CPU_GEMM_NR;
+        const float32x4_t b0 = vld1q_f32(b_k), b1 = vld1q_f32(b_k + 4);
+        const float32x4_t b2 = vld1q_f32(b_k + 8), b3 = vld1q_f32(b_k + 12);
+        const float32x4_t a_k = vld1q_f32(a + k * CPU_GEMM_MR);
+        c[0][0] = vfmaq_laneq_f32(c[0][0], b0, a_k, 0); c[0][1] = vfmaq_laneq_f32(c[0][1], b1, a_k, 0);
+        c[0][2] = vfmaq_laneq_f32(c[0][2], b2, a_k, 0); c[0][3] = vfmaq_laneq_f32(c[0][3], b3, a_k, 0);
+        c[1][0] = vfmaq_laneq_f32(c[1][0], b0, a_k, 1); c[1][1] = vfmaq_laneq_f32(c[1][1], b1, a_k, 1);
+        c[1][2] = vfmaq_laneq_f32(c[1][2], b2, a_k, 1); c[1][3] = vfmaq_laneq_f32(c[1][3], b3, a_k, 1);
+        c[2][0] = vfmaq_laneq_f32(c[2][0], b0, a_k, 2); c[2][1] = vfmaq_laneq_f32(c[2][1], b1, a_k, 2);
+        c[2][2] = vfmaq_laneq_f32(c[2][2], b2, a_k, 2); c[2][3] = vfmaq_laneq_f32(c[2][3], b3, a_k, 2);
+        c[3][0] = vfmaq_laneq_f32(c[3][0], b0, a_k, 3); c[3][1] = vfmaq_laneq_f32(c[3][1], b1, a_k, 3);
+        c[3][2] = vfmaq_laneq_f32(c[3][2], b2, a_k, 3); c[3][3] = vfmaq_laneq_f32(c[3][3], b3, a_k, 3);
+    }
+    for (int32_t i = 0; i < CPU_GEMM_MR; i++) {
+        for (int32_t j = 0; j < 4; j++) {
+            vst1q_f32(acc + i * CPU_GEMM_NR + j * 4, c[i][j]);
+        }
+    }
+}
+
+#endif
+
+/**
+ * @brief Blocked matrix multiplication on the cpu, c = a x b
+ *
+ * The inputs are converted to the accumulator type while they are packed,
+ * the products of a row are always summed in the same order, so the result
+ * does not depend on the number of threads.
+ *
+ * @param Acc The type the products are accumulated in
+ * @param a The row major (M, K) first input, rows lda elements apart
+ * @param b The row major (K, N) second input, rows ldb elements apart
+ * @param c The row major (M, N) output, rows ldc elements apart
+ */
+template<typename Acc, typename To, typename Ti1, typename Ti2>
+void cpu_gemm(
+    int32_t M, int32_t K, int32_t N,
+    const Ti1* a, int64_t lda, const Ti2* b, int64_t ldb, To* c, int64_t ldc) {
+
+    const int32_t panels = (N + CPU_GEMM_NR - 1) / CPU_GEMM_NR;
+    const int32_t row_blocks = (M + CPU_GEMM_MC - 1) / CPU_GEMM_MC;
+    std::vector<Acc> acc((size_t) M * panels * CPU_GEMM_NR, (Acc) 0);
+    std::vector<Acc> packed_b((size_t) panels * CPU_GEMM_KC * CPU_GEMM_NR);
+
+    for (int32_t k0 = 0; k0 < K; k0 += CPU_GEMM_KC) {
+        const int32_t kc = std::min(CPU_GEMM_KC, K - k0);
+
+        #pragma omp parallel for schedule(static)
+        for (int32_t p = 0; p < panels; p++) {
+            Acc* panel = packed_b.data() + (size_t) p * CPU_GEMM_KC * CPU_GEMM_NR;
+            const int32_t n0 = p * CPU_GEMM_NR, nr = std::min(CPU_GEMM_NR, N - n0);
+            for (int32_t k = 0; k < kc; k++) {
+                const Ti2* row = b + (k0 + k) * ldb + n0;
+                for (int32_t j = 0; j < CPU_GEMM_NR; j++) {
+                    panel[k * CPU_GEMM_NR + j] = j < nr ? gemm_load<Acc>(row[j]) : (Acc) 0;
+                }
+            }
+        }
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int32_t rb = 0; rb < row_blocks; rb++) {
+            Acc packed_a[CPU_GEMM_KC * CPU_GEMM_MR];
+            const int32_t m_end = std::min(M, (rb + 1) * CPU_GEMM_MC);
+            for (int32_t m0 = rb * CPU_GEMM_MC; m0 < m_end; m0 += CPU_GEMM_MR) {
+                const int32_t mr = std::min(CPU_GEMM_MR, m_end - m0);
+                for (int32_t k = 0; k < kc; k++) {
+                    for (int32_t i = 0; i < CPU_GEMM_MR; i++) {
+                        packed_a[k * CPU_GEMM_MR + i] = i < mr ?
+                            gemm_load<Acc>(a[(m0 + i) * lda + k0 + k]) : (Acc) 0;
+                    }
+                }
+                for (int32_t p = 0; p < panels; p++) {
+                    Acc block[CPU_GEMM_MR * CPU_GEMM_NR];
+                    Acc* out = acc.data() + ((size_t) p * M + m0) * CPU_GEMM_NR;
+                    memcpy(block, out, sizeof(Acc) * mr * CPU_GEMM_NR);
+                    memset(block + mr * CPU_GEMM_NR, 0, sizeof(Acc) * (CPU_GEMM_MR - mr) * CPU_GEMM_NR);
+                    gemm_micro_kernel<Acc>(
+                        kc, packed_a, packed_b.data() + (size_t) p * CPU_GEMM_KC * CPU_GEMM_NR, block
+                    );
+                    memcpy(out, block, sizeof(Acc) * mr * CPU_GEMM_NR);
+                }
+            }
+        }
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int32_t m = 0; m < M; m++) {
+        for (int32_t n = 0; n < N; n++) {
+            const int32_t p = n / CPU_GEMM_NR;
+            c[m * ldc + n] = gemm_store<To>(
+                acc[((size_t) p * M + m) * CPU_GEMM_NR + n % CPU_GEMM_NR]
+            );
+        }
+    }
+}
+
+/**
+ * @brief Performs a typed matrix multiplication on the cpu, with the types of the npu matmul
+ *
+ * @param To - The type of the output matrix
+ * @param Ti1 - The type of the first input matrix (inferred automatically)
+ * @param Ti2 - The type of the second input matrix (inferred automatically)
+ */
+template<typename To, typename Ti1, typename Ti2>
+void cpu_matmul(int32_t M, int32_t K, int32_t N, const Ti1* a, const Ti2* b, To* c) {
+    choose_matmul_type<To, Ti1, Ti2>();
+    cpu_gemm<typename matmul_traits<To, Ti1, Ti2>::accumulator>(M, K, N, a, K, b, N, c, N);
+}
+
+/**
+ * @brief Performs a row major matrix multiplication on the cpu for a matmul type flag
+ *
+ * @param lda, ldb, ldc The number of elements between the rows of a, b and c
+ */
+inline void cpu_matmul(
+    int32_t M, int32_t K, int32_t N, _rknn_matmul_type type,
+    const void* a, int64_t lda, const void* b, int64_t ldb, void* c, int64_t ldc) {
+    switch (type) {
+        case RKNN_FLOAT16_MM_FLOAT16_TO_FLOAT16:
+            return cpu_gemm<float32>(M, K, N, (const float16*) a, lda, (const float16*) b, ldb, (float16*) c, ldc);
+        case RKNN_FLOAT16_MM_FLOAT16_TO_FLOAT32:
+            return cpu_gemm<float32>(M, K, N, (const float16*) a, lda, (const float16*) b, ldb, (float32*) c, ldc);
+        case RKNN_FLOAT16_MM_INT8_TO_FLOAT16:
+            return cpu_gemm<float32>(M, K, N, (const float16*) a, lda, (const int8_t*) b, ldb, (float16*) c, ldc);
+        case RKNN_INT8_MM_INT8_TO_INT8:
+            return cpu_gemm<int32_t>(M, K, N, (const int8_t*) a, lda, (const int8_t*) b, ldb, (int8_t*) c, ldc);
+        case RKNN_INT8_MM_INT8_TO_INT32:
+            return cpu_gemm<int32_t>(M, K, N, (const int8_t*) a, lda, (const int8_t*) b, ldb, (int32_t*) c, ldc);
+        default:
+            printf("unsupported matmul type %d\n", (int) type);
+            abort();
+    }
+}
+
+#endif
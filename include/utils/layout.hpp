@@ -0,0 +1,169 @@
+#ifndef LAYOUT
+#define LAYOUT
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/**
+ * @brief Copy one 16 byte group
+ */
+inline void copy_group16(uint8_t* dst, const uint8_t* src) {
+#if defined(__ARM_NEON)
+    vst1q_u8(dst, vld1q_u8(src));
+#else
+    memcpy(dst, src, 16);
+#endif
+}
+
+/**
+ * @brief pack_native for 16 byte groups of ElemSize byte elements
+ *
+ * The group is known at compile time, so every full group is a single
+ * 16 byte copy and only the last group of a row is padded.
+ */
+template<size_t ElemSize>
+inline void pack_native_groups(void* dst, const void* src, int32_t rows, int32_t cols) {
+    constexpr int32_t group = 16 / ElemSize;
+    const uint8_t* in = (const uint8_t*) src;
+    uint8_t* out = (uint8_t*) dst;
+    const size_t row_bytes = cols * ElemSize;
+    const int32_t full = cols / group;
+    const size_t tail = row_bytes - (size_t) full * 16;
+
+    #pragma omp parallel for schedule(static)
+    for (int32_t kb = 0; kb < full; kb++) {
+        uint8_t* block = out + (size_t) kb * rows * 16;
+        for (int32_t r = 0; r < rows; r++) {
+            copy_group16(block + r * 16, in + r * row_bytes + kb * 16);
+        }
+    }
+
+    if (tail != 0) {
+        uint8_t* block = out + (size_t) full * rows * 16;
+        for (int32_t r = 0; r < rows; r++) {
+            memcpy(block + r * 16, in + r * row_bytes + (size_t) full * 16, tail);
+            memset(block + r * 16 + tail, 0, 16 - tail);
+        }
+    }
+}
+
+/**
+ * @brief unpack_native for 16 byte groups of ElemSize byte elements
+ */
+template<size_t ElemSize>
+inline void unpack_native_groups(void* dst, const void* src, int32_t rows, int32_t cols) {
+    constexpr int32_t group = 16 / ElemSize;
+    const uint8_t* in = (const uint8_t*) src;
+    uint8_t* out = (uint8_t*) dst;
+    const size_t row_bytes = cols * ElemSize;
+    const int32_t full = cols / group;
+    const size_t tail = row_bytes - (size_t) full * 16;
+
+    #pragma omp parallel for schedule(static)
+    for (int32_t r = 0; r < rows; r++) {
+        uint8_t* row = out + r * row_bytes;
+        for (int32_t kb = 0; kb < full; kb++) {
+            copy_group16(row + kb * 16, in + ((size_t) kb * rows + r) * 16);
+        }
+        if (tail != 0) {
+            memcpy(row + (size_t) full * 16, in + ((size_t) full * rows + r) * 16, tail);
+        }
+    }
+}
+
+/**
+ * @brief Convert a row major matrix to the npu native A / C layout
+ *
+ * The native layout is (ceil(cols / group), rows, group), the last
+ * group of every row is padded with zeros.
+ *
+ * @param dst The native layout output, ceil(cols / group) * rows * group elements
+ * @param src The row major (rows, cols) input
+ * @param group The number of elements in a group
+ * @param elem_size The size of an element in bytes
+ */
+inline void pack_native(
+    void* dst, const void* src,
+    int32_t rows, int32_t cols, int32_t group, size_t elem_size) {
+
+    if (group * elem_size == 16) {
+        switch (elem_size) {
+            case 1: return pack_native_groups<1>(dst, src, rows, cols);
+            case 2: return pack_native_groups<2>(dst, src, rows, cols);
+            case 4: return pack_native_groups<4>(dst, src, rows, cols);
+        }
+    }
+
+    const uint8_t* in = (const uint8_t*) src;
+    uint8_t* out = (uint8_t*) dst;
+    const size_t group_bytes = group * elem_size;
+    const size_t row_bytes = cols * elem_size;
+    const int32_t blocks = (cols + group - 1) / group;
+
+    #pragma omp parallel for schedule(static)
+    for (int32_t kb = 0; kb < blocks; kb++) {
+        const size_t offset = kb * group_bytes;
+        const size_t valid = offset + group_bytes <= row_bytes ? group_bytes : row_bytes - offset;
+        uint8_t* block = out + (size_t) kb * rows * group_bytes;
+
+        if (group_bytes == 16 && valid == 16) {
+            for (int32_t r = 0; r < rows; r++) {
+                copy_group16(block + r * 16, in + r * row_bytes + offset);
+            }
+        } else {
+            for (int32_t r = 0; r < rows; r++) {
+                memcpy(block + r * group_bytes, in + r * row_bytes + offset, valid);
+                memset(block + r * group_bytes + valid, 0, group_bytes - valid);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Convert the npu native A / C layout back to a row major matrix
+ *
+ * @param dst The row major (rows, cols) output
+ * @param src The native layout input, see pack_native
+ * @param group The number of elements in a group
+ * @param elem_size The size of an element in bytes
+ */
+inline void unpack_native(
+    void* dst, const void* src,
+    int32_t rows, int32_t cols, int32_t group, size_t elem_size) {
+
+    if (group * elem_size == 16) {
+        switch (elem_size) {
+            case 1: return unpack_native_groups<1>(dst, src, rows, cols);
+            case 2: return unpack_native_groups<2>(dst, src, rows, cols);
+            case 4: return unpack_native_groups<4>(dst, src, rows, cols);
+        }
+    }
+
+    const uint8_t* in = (const uint8_t*) src;
+    uint8_t* out = (uint8_t*) dst;
+    const size_t group_bytes = group * elem_size;
+    const size_t row_bytes = cols * elem_size;
+    const int32_t blocks = (cols + group - 1) / group;
+
+    #pragma omp parallel for schedule(static)
+    for (int32_t r = 0; r < rows; r++) {
+        uint8_t* row = out + r * row_bytes;
+        for (int32_t kb = 0; kb < blocks; kb++) {
+            const size_t offset = kb * group_bytes;
+            const uint8_t* group_src = in + ((size_t) kb * rows + r) * group_bytes;
+            if (group_bytes == 16 && offset + 16 <= row_bytes) {
+                copy_group16(row + offset, group_src);
+            } else {
+                size_t valid = offset + group_bytes <= row_bytes ? group_bytes : row_bytes - offset;
+                memcpy(row + offset, group_src, valid);
+            }
+        }
+    }
+}
+
+#endif
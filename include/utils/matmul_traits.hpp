@@ -0,0 +1,224 @@
+#ifndef MATMUL_TRAITS
+#define MATMUL_TRAITS
+
+#include <rknpu/rknn_matmul_api.h>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include "utils/half.hpp"
+
+using float16 = half_float::half;
+typedef float float32;
+
+/**
+ * @brief The rknn tensor type of a matrix element type
+ *
+ * @param supported false for types the npu matmul has no tensor type for
+ */
+template<typename T>
+struct tensor_traits {
+    static constexpr bool supported = false;
+    static constexpr rknn_tensor_type type = RKNN_TENSOR_TYPE_MAX;
+};
+
+template<>
+struct tensor_traits<float16> {
+    static constexpr bool supported = true;
+    static constexpr rknn_tensor_type type = RKNN_TENSOR_FLOAT16;
+};
+
+template<>
+struct tensor_traits<float32> {
+    static constexpr bool supported = true;
+    static constexpr rknn_tensor_type type = RKNN_TENSOR_FLOAT32;
+};
+
+template<>
+struct tensor_traits<int8_t> {
+    static constexpr bool supported = true;
+    static constexpr rknn_tensor_type type = RKNN_TENSOR_INT8;
+};
+
+template<>
+struct tensor_traits<int32_t> {
+    static constexpr bool supported = true;
+    static constexpr rknn_tensor_type type = RKNN_TENSOR_INT32;
+};
+
+/**
+ * @brief The matrix element type of an rknn tensor type, the inverse of tensor_traits
+ */
+template<rknn_tensor_type Type>
+struct tensor_element;
+
+template<>
+struct tensor_element<RKNN_TENSOR_FLOAT16> {
+    using type = float16;
+};
+
+template<>
+struct tensor_element<RKNN_TENSOR_FLOAT32> {
+    using type = float32;
+};
+
+template<>
+struct tensor_element<RKNN_TENSOR_INT8> {
+    using type = int8_t;
+};
+
+template<>
+struct tensor_element<RKNN_TENSOR_INT32> {
+    using type = int32_t;
+};
+
+/**
+ * A matmul the npu has, and the tensor types of it's matrices
+ *
+ * @param acc The type the products are accumulated in
+ */
+struct _matmul_type_entry {
+    _rknn_matmul_type type;
+    rknn_tensor_type a;
+    rknn_tensor_type b;
+    rknn_tensor_type c;
+    rknn_tensor_type acc;
+    size_t a_size;
+    size_t b_size;
+    size_t c_size;
+};
+
+/**
+ * @brief Every matmul type the npu has, the typed, runtime and opencv dispatch all read this table
+ */
+constexpr _matmul_type_entry matmul_type_table[] = {
+    {RKNN_FLOAT16_MM_FLOAT16_TO_FLOAT16,
+        RKNN_TENSOR_FLOAT16, RKNN_TENSOR_FLOAT16, RKNN_TENSOR_FLOAT16, RKNN_TENSOR_FLOAT32, 2, 2, 2},
+    {RKNN_FLOAT16_MM_FLOAT16_TO_FLOAT32,
+        RKNN_TENSOR_FLOAT16, RKNN_TENSOR_FLOAT16, RKNN_TENSOR_FLOAT32, RKNN_TENSOR_FLOAT32, 2, 2, 4},
+    {RKNN_FLOAT16_MM_INT8_TO_FLOAT16,
+        RKNN_TENSOR_FLOAT16, RKNN_TENSOR_INT8,    RKNN_TENSOR_FLOAT16, RKNN_TENSOR_FLOAT32, 2, 1, 2},
+    {RKNN_INT8_MM_INT8_TO_INT8,
+        RKNN_TENSOR_INT8,    RKNN_TENSOR_INT8,    RKNN_TENSOR_INT8,    RKNN_TENSOR_INT32,   1, 1, 1},
+    {RKNN_INT8_MM_INT8_TO_INT32,
+        RKNN_TENSOR_INT8,    RKNN_TENSOR_INT8,    RKNN_TENSOR_INT32,   RKNN_TENSOR_INT32,   1, 1, 4},
+};
+
+constexpr int32_t matmul_type_count = sizeof(matmul_type_table) / sizeof(matmul_type_table[0]);
+
+/**
+ * @brief The index in matmul_type_table of the matmul for the types of A, B and C
+ *
+ * @return -1 when the npu has no such matmul
+ */
+constexpr int32_t matmul_type_index(rknn_tensor_type a, rknn_tensor_type b, rknn_tensor_type c) {
+    for (int32_t i = 0; i < matmul_type_count; i++) {
+        if (matmul_type_table[i].a == a && matmul_type_table[i].b == b && matmul_type_table[i].c == c) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief The index in matmul_type_table of a matmul type flag
+ *
+ * @return -1 for flags that are not in the table
+ */
+constexpr int32_t matmul_type_index(_rknn_matmul_type type) {
+    for (int32_t i = 0; i < matmul_type_count; i++) {
+        if (matmul_type_table[i].type == type) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Find the matmul type for the types of A, B and C
+ *
+ * @return false when the npu has no such matmul
+ */
+inline bool find_matmul_type(
+    rknn_tensor_type a, rknn_tensor_type b, rknn_tensor_type c, _rknn_matmul_type* type) {
+    const int32_t index = matmul_type_index(a, b, c);
+    if (index < 0) {
+        return false;
+    }
+    *type = matmul_type_table[index].type;
+    return true;
+}
+
+/**
+ * @brief Find the matmul for the types of A and B with the widest C
+ *
+ * The product keeps the most precision for an epilogue that converts it afterwards.
+ *
+ * @return false when the npu has no matmul for A and B
+ */
+inline bool find_widest_matmul_type(rknn_tensor_type a, rknn_tensor_type b, _rknn_matmul_type* type) {
+    int32_t widest = -1;
+    for (int32_t i = 0; i < matmul_type_count; i++) {
+        if (matmul_type_table[i].a == a && matmul_type_table[i].b == b &&
+            (widest < 0 || matmul_type_table[i].c_size > matmul_type_table[widest].c_size)) {
+            widest = i;
+        }
+    }
+    if (widest < 0) {
+        return false;
+    }
+    *type = matmul_type_table[widest].type;
+    return true;
+}
+
+/**
+ * @brief Compile time properties of the matmul of To = Ti1 x Ti2
+ *
+ * @param supported false when the npu has no such matmul, see choose_matmul_type
+ * @param type The matmul type flag
+ * @param accumulator The type the products are accumulated in
+ */
+template<typename To, typename Ti1, typename Ti2>
+struct matmul_traits {
+    static constexpr int32_t index = matmul_type_index(
+        tensor_traits<Ti1>::type, tensor_traits<Ti2>::type, tensor_traits<To>::type
+    );
+    static constexpr bool supported = index >= 0;
+
+    static constexpr _rknn_matmul_type type = matmul_type_table[supported ? index : 0].type;
+    using accumulator = typename tensor_element<matmul_type_table[supported ? index : 0].acc>::type;
+};
+
+/**
+ * @brief The matmul type flag for the types of the matrices, checked at compile time
+ *
+ * @param To    The type of the output matrix
+ * @param Ti1   The type of the first input martix
+ * @param Ti2   The type of the second input matrix
+ */
+template<typename To, typename Ti1, typename Ti2>
+constexpr _rknn_matmul_type choose_matmul_type() {
+    static_assert(
+        matmul_traits<To, Ti1, Ti2>::supported,
+        "unsupported combination of types, use (To, Ti1, Ti2) from: "
+        "(float16, float16, float16), (float32, float16, float16), (float16, float16, int8_t), "
+        "(int8_t, int8_t, int8_t), (int32_t, int8_t, int8_t)"
+    );
+    return matmul_traits<To, Ti1, Ti2>::type;
+}
+
+/**
+ * @brief The rknn tensor type of a matrix element type, checked at compile time
+ */
+template<typename T>
+constexpr rknn_tensor_type tensor_type_of() {
+    static_assert(
+        tensor_traits<T>::supported, "unsupported matrix type, use float16, float32, int8_t or int32_t"
+    );
+    return tensor_traits<T>::type;
+}
+
+static_assert(
+    sizeof(float16) == 2 && sizeof(float32) == 4, "the matrix types must match the npu tensor sizes"
+);
+
+#endif
@@ -9,15 +9,28 @@ import os
 
 module_name = "matnpu"
 
+# MATNPU_EMULATE=1 builds against the software rknn runtime, for hosts without a Rockchip npu
+emulate = os.environ.get("MATNPU_EMULATE", "0") == "1"
+
+if emulate:
+    sources = ["src/bindings.cpp", "src/emulation/rknn_emulator.cpp"]
+    include_dirs = ["./include/emulation", "./include", "./"]
+    libraries = []
+else:
+    sources = ["src/bindings.cpp"]
+    include_dirs = ["./include", "./", "/usr/local/include/rknpu"]
+    libraries = ['rknnrt']
+
 ext_modules = [
     Pybind11Extension(
         f"{module_name}",
-        ["src/bindings.cpp"],
+        sources,
         
-        include_dirs=["./include", "./", "/usr/local/include/rknpu"],
+        include_dirs=include_dirs,
         library_dirs = ["/usr/local/lib"],
-        libraries=['rknnrt'],
-        extra_compile_args = ["-fopenmp"]
+        libraries=libraries,
+        extra_compile_args = ["-fopenmp"],
+        extra_link_args = ["-fopenmp"]
     ),
 ]
 
@@ -1,33 +1,609 @@
 // bindings.cpp
 #include <pybind11/pybind11.h>
+#include <pybind11/stl.h>
 #include "api_wrapper/matmul_numpy.hpp"
 #include "utils/pybind11_float16.hpp"
 
 namespace py = pybind11;
 
+py::dict dispatch_dict(const dispatch_model& model) {
+    py::dict d;
+    d["enabled"] = model.enabled;
+    d["calibrated"] = model.calibrated;
+    d["npu_run_us"] = model.npu_run_us;
+    d["npu_create_us"] = model.npu_create_us;
+    d["copy_bytes_per_us"] = model.copy_bytes_per_us;
+    d["npu_macs_per_us"] = std::vector<double>(model.npu_macs_per_us, model.npu_macs_per_us + 2);
+    d["cpu_macs_per_us"] = std::vector<double>(model.cpu_macs_per_us, model.cpu_macs_per_us + 2);
+    d["cpu_max_macs"] = model.cpu_max_macs;
+    d["crossover_macs_f16"] = dispatch_crossover_macs(RKNN_FLOAT16_MM_FLOAT16_TO_FLOAT32, model);
+    d["crossover_macs_i8"] = dispatch_crossover_macs(RKNN_INT8_MM_INT8_TO_INT32, model);
+    return d;
+}
+
+py::dict tuned_dict(const tuned_config& config) {
+    py::dict d;
+    d["ac_layout"] = config.ac_layout;
+    d["b_layout"] = config.b_layout;
+    d["cores"] = config.cores;
+    d["split_n"] = config.split_n;
+    d["cpu_share"] = config.cpu_share;
+    d["tile"] = std::vector<int32_t>{config.tile_m, config.tile_k, config.tile_n};
+    d["time_us"] = config.time_us;
+    return d;
+}
+
+py::dict stats_dict(const matmul_stats& stats) {
+    py::dict d, phases;
+    for (int32_t i = 0; i < MATMUL_PHASE_COUNT; i++) {
+        py::dict phase;
+        phase["count"] = stats.phases[i].count;
+        phase["total_us"] = stats.phases[i].total_ns / 1e3;
+        phase["max_us"] = stats.phases[i].max_ns / 1e3;
+        phases[matmul_phase_name((matmul_phase) i)] = phase;
+    }
+    d["phases"] = phases;
+    d["bytes_in"] = stats.bytes_in;
+    d["bytes_out"] = stats.bytes_out;
+    d["contexts_created"] = stats.contexts_created;
+    d["contexts_destroyed"] = stats.contexts_destroyed;
+    d["buffers_allocated"] = stats.buffers_allocated;
+    d["buffers_freed"] = stats.buffers_freed;
+    return d;
+}
+
+rknn_tensor_type tensor_type_name(const std::string& name) {
+    if (name == "f16") {
+        return RKNN_TENSOR_FLOAT16;
+    } else if (name == "f32") {
+        return RKNN_TENSOR_FLOAT32;
+    } else if (name == "i8") {
+        return RKNN_TENSOR_INT8;
+    } else if (name == "i32") {
+        return RKNN_TENSOR_INT32;
+    }
+    throw std::runtime_error("Types are named f16, f32, i8 or i32");
+}
 
+/**
+ * @brief Register the fused matmuls with an epilogue that return To, for every input type
+ */
+template<typename To>
+void def_matmul_fused(py::module_& m, const char* name) {
+    const char* doc = "Multiplies two matrices on the npu and applies a bias, alpha, an activation "
+        "and a clamp while the result is read out";
+    const char* weights_doc = "Multiplies a matrix by packed weights on the npu and applies a bias, "
+        "alpha, an activation and a clamp while the result is read out";
+    const float inf = std::numeric_limits<float>::infinity();
+
+    m.def(name, &matmul_fused_numpy<To, float16, float16>, doc,
+        py::arg("a"), py::arg("b"), py::arg("bias") = py::none(), py::arg("alpha") = 1.0f,
+        py::arg("activation") = "none", py::arg("bias_axis") = "column",
+        py::arg("clamp_min") = -inf, py::arg("clamp_max") = inf, py::arg("layout") = 0
+    );
+    m.def(name, &matmul_fused_numpy<To, float16, int8_t>, doc,
+        py::arg("a"), py::arg("b"), py::arg("bias") = py::none(), py::arg("alpha") = 1.0f,
+        py::arg("activation") = "none", py::arg("bias_axis") = "column",
+        py::arg("clamp_min") = -inf, py::arg("clamp_max") = inf, py::arg("layout") = 0
+    );
+    m.def(name, &matmul_fused_numpy<To, int8_t, int8_t>, doc,
+        py::arg("a"), py::arg("b"), py::arg("bias") = py::none(), py::arg("alpha") = 1.0f,
+        py::arg("activation") = "none", py::arg("bias_axis") = "column",
+        py::arg("clamp_min") = -inf, py::arg("clamp_max") = inf, py::arg("layout") = 0
+    );
+    m.def(name, &matmul_fused_weights_numpy<To, float16>, weights_doc,
+        py::arg("a"), py::arg("weights"), py::arg("bias") = py::none(), py::arg("alpha") = 1.0f,
+        py::arg("activation") = "none", py::arg("bias_axis") = "column",
+        py::arg("clamp_min") = -inf, py::arg("clamp_max") = inf, py::arg("layout") = 0
+    );
+    m.def(name, &matmul_fused_weights_numpy<To, int8_t>, weights_doc,
+        py::arg("a"), py::arg("weights"), py::arg("bias") = py::none(), py::arg("alpha") = 1.0f,
+        py::arg("activation") = "none", py::arg("bias_axis") = "column",
+        py::arg("clamp_min") = -inf, py::arg("clamp_max") = inf, py::arg("layout") = 0
+    );
+}
 
 PYBIND11_MODULE(matnpu, m) {
   
     m.def("matmul_f16", &matmul_numpy<float16, float16, float16>,
         "A function that multiplies two matrices on the npu",
-        py::arg("a"), py::arg("b") 
+        py::arg("a"), py::arg("b"), py::arg("layout") = 0
     );
     m.def("matmul_f32", &matmul_numpy<float32, float16, float16>, 
         "A function that multiplies two matrices on the npu",
-        py::arg("a"), py::arg("b") 
+        py::arg("a"), py::arg("b"), py::arg("layout") = 0
     );
     m.def("matmul_f16", &matmul_numpy<float16, float16, int8_t>,
         "A function that multiplies two matrices on the npu",
-        py::arg("a"), py::arg("b") 
+        py::arg("a"), py::arg("b"), py::arg("layout") = 0
     );
     m.def("matmul_i8", &matmul_numpy<int8_t, int8_t, int8_t>, 
         "A function that multiplies two matrices on the npu",
-        py::arg("a"), py::arg("b") 
+        py::arg("a"), py::arg("b"), py::arg("layout") = 0
     );
     m.def("matmul_i32", &matmul_numpy<int32_t, int8_t, int8_t>,
         "A function that multiplies two matrices on the npu",
-        py::arg("a"), py::arg("b") 
+        py::arg("a"), py::arg("b"), py::arg("layout") = 0
+    );
+
+    py::class_<NpuWeights, std::shared_ptr<NpuWeights>>(m, "Weights",
+        "A matrix packed once to the npu native layout and kept in npu memory")
+        .def_property_readonly("shape", 
+            [](const NpuWeights& w) { return py::make_tuple(w.rows(), w.cols()); }
+        );
+
+    m.def("weights_f16", &weights_numpy<float16, float16, float16>,
+        "Pack weights for matmul_f16",
+        py::arg("b")
+    );
+    m.def("weights_f32", &weights_numpy<float32, float16, float16>,
+        "Pack weights for matmul_f32",
+        py::arg("b")
+    );
+    m.def("weights_f16", &weights_numpy<float16, float16, int8_t>,
+        "Pack int8 weights for matmul_f16",
+        py::arg("b")
+    );
+    m.def("weights_i8", &weights_numpy<int8_t, int8_t, int8_t>,
+        "Pack weights for matmul_i8",
+        py::arg("b")
+    );
+    m.def("weights_i32", &weights_numpy<int32_t, int8_t, int8_t>,
+        "Pack weights for matmul_i32",
+        py::arg("b")
+    );
+
+    py::class_<NpuConv2d, std::shared_ptr<NpuConv2d>>(m, "Conv2d",
+        "A 2D convolution whose filter is kept in npu memory")
+        .def_property_readonly("shape", 
+            [](const NpuConv2d& c) { 
+                return py::make_tuple(c.rows(), c.cols(), c.in_channels(), c.out_channels()); 
+            }
+        );
+
+    m.def("conv2d_filter_f16", &conv2d_filter_numpy<float16, float16, float16>,
+        "Move a (rows, cols, in_channels, out_channels) filter to the npu for conv2d_f16",
+        py::arg("filter"), py::arg("stride") = std::make_pair(1, 1), 
+        py::arg("padding") = std::make_pair(0, 0), py::arg("dilation") = std::make_pair(1, 1)
+    );
+    m.def("conv2d_filter_f32", &conv2d_filter_numpy<float32, float16, float16>,
+        "Move a (rows, cols, in_channels, out_channels) filter to the npu for conv2d_f32",
+        py::arg("filter"), py::arg("stride") = std::make_pair(1, 1), 
+        py::arg("padding") = std::make_pair(0, 0), py::arg("dilation") = std::make_pair(1, 1)
+    );
+    m.def("conv2d_filter_i8", &conv2d_filter_numpy<int8_t, int8_t, int8_t>,
+        "Move a (rows, cols, in_channels, out_channels) filter to the npu for conv2d_i8",
+        py::arg("filter"), py::arg("stride") = std::make_pair(1, 1), 
+        py::arg("padding") = std::make_pair(0, 0), py::arg("dilation") = std::make_pair(1, 1)
+    );
+    m.def("conv2d_filter_i32", &conv2d_filter_numpy<int32_t, int8_t, int8_t>,
+        "Move a (rows, cols, in_channels, out_channels) filter to the npu for conv2d_i32",
+        py::arg("filter"), py::arg("stride") = std::make_pair(1, 1), 
+        py::arg("padding") = std::make_pair(0, 0), py::arg("dilation") = std::make_pair(1, 1)
+    );
+
+    m.def("conv2d_f16", &conv2d_numpy<float16, float16>,
+        "Convolve channels last images on the npu, mode 2 streams the im2col matrix",
+        py::arg("img"), py::arg("conv"), py::arg("mode") = 0
+    );
+    m.def("conv2d_f32", &conv2d_numpy<float32, float16>,
+        "Convolve channels last images on the npu, mode 2 streams the im2col matrix",
+        py::arg("img"), py::arg("conv"), py::arg("mode") = 0
+    );
+    m.def("conv2d_i8", &conv2d_numpy<int8_t, int8_t>,
+        "Convolve channels last images on the npu, mode 2 streams the im2col matrix",
+        py::arg("img"), py::arg("conv"), py::arg("mode") = 0
+    );
+    m.def("conv2d_i32", &conv2d_numpy<int32_t, int8_t>,
+        "Convolve channels last images on the npu, mode 2 streams the im2col matrix",
+        py::arg("img"), py::arg("conv"), py::arg("mode") = 0
+    );
+
+    m.def("matmul_f16", &matmul_weights_numpy<float16, float16>,
+        "Multiplies a matrix by packed weights on the npu",
+        py::arg("a"), py::arg("weights"), py::arg("layout") = 0
+    );
+    m.def("matmul_f32", &matmul_weights_numpy<float32, float16>,
+        "Multiplies a matrix by packed weights on the npu",
+        py::arg("a"), py::arg("weights"), py::arg("layout") = 0
+    );
+    m.def("matmul_i8", &matmul_weights_numpy<int8_t, int8_t>,
+        "Multiplies a matrix by packed weights on the npu",
+        py::arg("a"), py::arg("weights"), py::arg("layout") = 0
+    );
+    m.def("matmul_i32", &matmul_weights_numpy<int32_t, int8_t>,
+        "Multiplies a matrix by packed weights on the npu",
+        py::arg("a"), py::arg("weights"), py::arg("layout") = 0
+    );
+
+    def_matmul_fused<float16>(m, "matmul_fused_f16");
+    def_matmul_fused<float32>(m, "matmul_fused_f32");
+    def_matmul_fused<int8_t>(m, "matmul_fused_i8");
+    def_matmul_fused<int32_t>(m, "matmul_fused_i32");
+
+    py::class_<QuantizedWeights, std::shared_ptr<QuantizedWeights>>(m, "QuantizedWeights",
+        "Float weights quantized to int8 per column and packed in npu memory")
+        .def_property_readonly("shape", 
+            [](const QuantizedWeights& w) { return py::make_tuple(w.rows(), w.cols()); }
+        )
+        .def_property_readonly("symmetric", &QuantizedWeights::is_symmetric);
+
+    m.def("quantize_weights", &quantized_weights_numpy,
+        "Quantize float32 weights to int8 with a scale (and zero point) per column",
+        py::arg("b"), py::arg("symmetric") = true
+    );
+    {
+        const float inf = std::numeric_limits<float>::infinity();
+        m.def("matmul_quantized", &matmul_quantized_numpy,
+            "Multiplies float32 activations by quantized weights as an int8 matmul on the npu",
+            py::arg("a"), py::arg("weights"), py::arg("bias") = py::none(), py::arg("alpha") = 1.0f,
+            py::arg("activation") = "none", py::arg("bias_axis") = "column",
+            py::arg("clamp_min") = -inf, py::arg("clamp_max") = inf, py::arg("layout") = 0
+        );
+        m.def("matmul_quantized", &matmul_quantized_pair_numpy,
+            "Quantizes two float32 matrices and multiplies them as an int8 matmul on the npu",
+            py::arg("a"), py::arg("b"), py::arg("bias") = py::none(), py::arg("alpha") = 1.0f,
+            py::arg("activation") = "none", py::arg("bias_axis") = "column",
+            py::arg("clamp_min") = -inf, py::arg("clamp_max") = inf, py::arg("layout") = 0
+        );
+    }
+
+    py::class_<Int8Weights, std::shared_ptr<Int8Weights>>(m, "Int8Weights",
+        "Weights quantized to int8 per column for float16 activations")
+        .def_property_readonly("shape", 
+            [](const Int8Weights& w) { return py::make_tuple(w.rows(), w.cols()); }
+        );
+
+    m.def("int8_weights", &int8_weights_numpy<float16>,
+        "Quantize float16 weights to int8 with a scale per column",
+        py::arg("b")
+    );
+    m.def("int8_weights", &int8_weights_numpy<float32>,
+        "Quantize float32 weights to int8 with a scale per column",
+        py::arg("b")
+    );
+    m.def("int8_weights", &int8_weights_quantized_numpy,
+        "Pack int8 weights quantized offline, column n is scales[n] * q",
+        py::arg("q"), py::arg("scales")
+    );
+    {
+        const float inf = std::numeric_limits<float>::infinity();
+        m.def("matmul_weight_only_f16", &matmul_weight_only_numpy<float16>,
+            "Multiplies float16 activations by int8 weights on the npu",
+            py::arg("a"), py::arg("weights"), py::arg("bias") = py::none(), py::arg("alpha") = 1.0f,
+            py::arg("activation") = "none", py::arg("bias_axis") = "column",
+            py::arg("clamp_min") = -inf, py::arg("clamp_max") = inf, py::arg("layout") = 0
+        );
+        m.def("matmul_weight_only_f32", &matmul_weight_only_numpy<float32>,
+            "Multiplies float16 activations by int8 weights on the npu",
+            py::arg("a"), py::arg("weights"), py::arg("bias") = py::none(), py::arg("alpha") = 1.0f,
+            py::arg("activation") = "none", py::arg("bias_axis") = "column",
+            py::arg("clamp_min") = -inf, py::arg("clamp_max") = inf, py::arg("layout") = 0
+        );
+    }
+
+    m.def("matmul_batched_f16", &matmul_batched_numpy<float16, float16, float16>,
+        "Multiplies a (batch, M, K) stack by a (batch, K, N) stack or a (K, N) matrix on the npu",
+        py::arg("a"), py::arg("b"), py::arg("layout") = 0
+    );
+    m.def("matmul_batched_f32", &matmul_batched_numpy<float32, float16, float16>,
+        "Multiplies a (batch, M, K) stack by a (batch, K, N) stack or a (K, N) matrix on the npu",
+        py::arg("a"), py::arg("b"), py::arg("layout") = 0
+    );
+    m.def("matmul_batched_f16", &matmul_batched_numpy<float16, float16, int8_t>,
+        "Multiplies a (batch, M, K) stack by a (batch, K, N) stack or a (K, N) matrix on the npu",
+        py::arg("a"), py::arg("b"), py::arg("layout") = 0
+    );
+    m.def("matmul_batched_i8", &matmul_batched_numpy<int8_t, int8_t, int8_t>,
+        "Multiplies a (batch, M, K) stack by a (batch, K, N) stack or a (K, N) matrix on the npu",
+        py::arg("a"), py::arg("b"), py::arg("layout") = 0
+    );
+    m.def("matmul_batched_i32", &matmul_batched_numpy<int32_t, int8_t, int8_t>,
+        "Multiplies a (batch, M, K) stack by a (batch, K, N) stack or a (K, N) matrix on the npu",
+        py::arg("a"), py::arg("b"), py::arg("layout") = 0
+    );
+
+    m.def("matmul_batched_f16", &matmul_batched_weights_numpy<float16, float16>,
+        "Multiplies a (batch, M, K) stack by packed weights on the npu",
+        py::arg("a"), py::arg("weights"), py::arg("layout") = 0
+    );
+    m.def("matmul_batched_f32", &matmul_batched_weights_numpy<float32, float16>,
+        "Multiplies a (batch, M, K) stack by packed weights on the npu",
+        py::arg("a"), py::arg("weights"), py::arg("layout") = 0
+    );
+    m.def("matmul_batched_i8", &matmul_batched_weights_numpy<int8_t, int8_t>,
+        "Multiplies a (batch, M, K) stack by packed weights on the npu",
+        py::arg("a"), py::arg("weights"), py::arg("layout") = 0
+    );
+    m.def("matmul_batched_i32", &matmul_batched_weights_numpy<int32_t, int8_t>,
+        "Multiplies a (batch, M, K) stack by packed weights on the npu",
+        py::arg("a"), py::arg("weights"), py::arg("layout") = 0
+    );
+
+    m.def("matmul_chain_f16", &matmul_chain_numpy<float16>,
+        "Multiplies a list of matrices on the npu, the intermediates stay in npu memory",
+        py::arg("mats"), py::arg("layout") = 0
+    );
+    m.def("matmul_chain_f32", &matmul_chain_numpy<float32>,
+        "Multiplies a list of matrices on the npu, the intermediates stay in npu memory",
+        py::arg("mats"), py::arg("layout") = 0
+    );
+    m.def("matmul_chain_i8", &matmul_chain_numpy<int8_t>,
+        "Multiplies a list of int8 matrices on the npu, the intermediates stay in npu memory",
+        py::arg("mats"), py::arg("layout") = 0
+    );
+    m.def("matmul_chain_i32", &matmul_chain_numpy<int32_t>,
+        "Multiplies a list of int8 matrices on the npu, the intermediates stay in npu memory",
+        py::arg("mats"), py::arg("layout") = 0
+    );
+
+    py::class_<NumpyFuture, std::shared_ptr<NumpyFuture>>(m, "Future",
+        "A matmul running on the npu in the background")
+        .def("done", &NumpyFuture::done, "Check if the matmul finished, without blocking")
+        .def("wait", &NumpyFuture::wait, "Block until the matmul finished, the GIL is released while waiting")
+        .def("result", &NumpyFuture::result, "Block until the matmul finished and return the result");
+
+    m.def("submit_f16", &submit_numpy<float16, float16, float16>,
+        "Submits a matmul to the npu and returns a Future without waiting for it",
+        py::arg("a"), py::arg("b"), py::arg("layout") = 0
+    );
+    m.def("submit_f32", &submit_numpy<float32, float16, float16>,
+        "Submits a matmul to the npu and returns a Future without waiting for it",
+        py::arg("a"), py::arg("b"), py::arg("layout") = 0
+    );
+    m.def("submit_f16", &submit_numpy<float16, float16, int8_t>,
+        "Submits a matmul to the npu and returns a Future without waiting for it",
+        py::arg("a"), py::arg("b"), py::arg("layout") = 0
+    );
+    m.def("submit_i8", &submit_numpy<int8_t, int8_t, int8_t>,
+        "Submits a matmul to the npu and returns a Future without waiting for it",
+        py::arg("a"), py::arg("b"), py::arg("layout") = 0
+    );
+    m.def("submit_i32", &submit_numpy<int32_t, int8_t, int8_t>,
+        "Submits a matmul to the npu and returns a Future without waiting for it",
+        py::arg("a"), py::arg("b"), py::arg("layout") = 0
+    );
+
+    m.def("submit_f16", &submit_weights_numpy<float16, float16>,
+        "Submits a multiplication by packed weights and returns a Future",
+        py::arg("a"), py::arg("weights"), py::arg("layout") = 0
+    );
+    m.def("submit_f32", &submit_weights_numpy<float32, float16>,
+        "Submits a multiplication by packed weights and returns a Future",
+        py::arg("a"), py::arg("weights"), py::arg("layout") = 0
+    );
+    m.def("submit_i8", &submit_weights_numpy<int8_t, int8_t>,
+        "Submits a multiplication by packed weights and returns a Future",
+        py::arg("a"), py::arg("weights"), py::arg("layout") = 0
+    );
+    m.def("submit_i32", &submit_weights_numpy<int32_t, int8_t>,
+        "Submits a multiplication by packed weights and returns a Future",
+        py::arg("a"), py::arg("weights"), py::arg("layout") = 0
+    );
+
+    m.def("configure_multicore", 
+        [](bool enabled, std::vector<float> ratios, bool split_n, int64_t min_macs) {
+            if (ratios.empty() || ratios.size() > NPU_MAX_CORES) {
+                throw std::runtime_error("ratios must have one to three entries");
+            }
+            multicore_config& config = matmul_multicore_config();
+            config.enabled = enabled;
+            config.cores = ratios.size();
+            for (size_t i = 0; i < ratios.size(); i++) {
+                config.ratios[i] = ratios[i];
+            }
+            config.split_n = split_n;
+            config.min_macs = min_macs;
+        },
+        "Split large matmuls between the npu cores by the given ratios",
+        py::arg("enabled"), py::arg("ratios") = std::vector<float>{1.0f, 1.0f, 1.0f}, 
+        py::arg("split_n") = false, py::arg("min_macs") = (int64_t) 1 << 27
+    );
+
+    m.def("configure_coexec",
+        [](bool enabled, std::vector<float> cpu_share, bool adaptive, int64_t min_macs) {
+            if (cpu_share.size() > 2) {
+                throw std::runtime_error("cpu_share must have the float16 and the int8 share");
+            }
+            coexec_config& config = matmul_coexec_config();
+            config.enabled = enabled;
+            for (size_t i = 0; i < cpu_share.size(); i++) {
+                set_coexec_share(config, i, std::max(0.0f, std::min(1.0f, cpu_share[i])));
+            }
+            config.adaptive = adaptive;
+            config.min_macs = min_macs;
+        },
+        "Split large matmuls between the cpu and the npu, cpu_share is the share of "
+        "the rows computed on the cpu for float16 and int8 inputs (empty keeps the current ones)",
+        py::arg("enabled"), py::arg("cpu_share") = std::vector<float>{},
+        py::arg("adaptive") = true, py::arg("min_macs") = (int64_t) 1 << 24
+    );
+    m.def("coexec_share",
+        []() {
+            const coexec_config& config = matmul_coexec_config();
+            return std::vector<float>{coexec_share(config, 0), coexec_share(config, 1)};
+        },
+        "The current cpu share of the float16 and the int8 matmuls"
+    );
+
+    m.def("configure_dispatch", 
+        [](bool enabled, int64_t cpu_max_macs) {
+            dispatch_model& model = matmul_dispatch_model();
+            model.enabled = enabled;
+            model.cpu_max_macs = cpu_max_macs;
+        },
+        "Run matmuls that the cost model predicts to be faster on the cpu there, "
+        "cpu_max_macs >= 0 replaces the model with a fixed threshold",
+        py::arg("enabled"), py::arg("cpu_max_macs") = -1
+    );
+    m.def("calibrate_dispatch", 
+        []() {
+            dispatch_model model;
+            {
+                py::gil_scoped_release release;
+                model = calibrate_dispatch();
+            }
+            return dispatch_dict(model);
+        },
+        "Fit the cpu / npu cost model by timing this board, returns the model"
+    );
+    m.def("dispatch_model", []() { return dispatch_dict(matmul_dispatch_model()); },
+        "The cpu / npu cost model and it's crossover points"
+    );
+
+    m.def("tune", 
+        [](int32_t M, int32_t K, int32_t N, const std::string& a, const std::string& b, 
+            const std::string& c, int32_t repeats) {
+            _rknn_matmul_type type;
+            if (!find_matmul_type(tensor_type_name(a), tensor_type_name(b), tensor_type_name(c), &type)) {
+                throw std::runtime_error("The npu has no " + a + " x " + b + " -> " + c + " matmul");
+            }
+            tuned_config config;
+            {
+                py::gil_scoped_release release;
+                config = tune_matmul(M, K, N, type, repeats);
+            }
+            return tuned_dict(config);
+        },
+        "Time the ways to run a (M, K) x (K, N) matmul and keep the fastest in the tuning database",
+        py::arg("M"), py::arg("K"), py::arg("N"), py::arg("a") = "f16", py::arg("b") = "f16",
+        py::arg("c") = "f32", py::arg("repeats") = 5
+    );
+    m.def("configure_tuner", 
+        [](bool tune_on_first_use, int32_t repeats) {
+            matmul_tuner_config() = {tune_on_first_use, repeats};
+        },
+        "Tune shapes missing from the tuning database the first time they run",
+        py::arg("tune_on_first_use"), py::arg("repeats") = 5
+    );
+    m.def("load_tuning", 
+        [](const std::string& path, bool save_back) {
+            int32_t count = MatmulTuningDatabase::instance().load(path);
+            if (count < 0) {
+                throw std::runtime_error("Can not open the tuning database " + path);
+            }
+            if (save_back) {
+                MatmulTuningDatabase::instance().set_path(path);
+            }
+            return count;
+        },
+        "Merge a tuning database file, save_back saves later tuning to the same file",
+        py::arg("path"), py::arg("save_back") = true
+    );
+    m.def("save_tuning", 
+        [](const std::string& path) {
+            if (!MatmulTuningDatabase::instance().save(path)) {
+                throw std::runtime_error("Can not write the tuning database " + path);
+            }
+        },
+        "Write the tuning database to a file",
+        py::arg("path")
+    );
+    m.def("tuning_entries", 
+        []() {
+            py::list entries;
+            for (const auto& entry : MatmulTuningDatabase::instance().list()) {
+                py::dict d = tuned_dict(entry.second);
+                d["M"] = std::get<0>(entry.first);
+                d["K"] = std::get<1>(entry.first);
+                d["N"] = std::get<2>(entry.first);
+                d["type"] = (int32_t) std::get<3>(entry.first);
+                entries.append(d);
+            }
+            return entries;
+        },
+        "The tuned shapes and their configurations"
+    );
+    m.def("warm_tuned_plans", []() { return warm_tuned_plans(); },
+        "Create the npu contexts of every tuned shape, returns how many were created"
+    );
+
+    m.def("enable_stats", [](bool enabled) { MatmulStats::instance().enable(enabled); },
+        "Turn the per phase timers and the byte counters on or off",
+        py::arg("enabled") = true
+    );
+    m.def("stats", []() { return stats_dict(MatmulStats::instance().snapshot()); },
+        "The time spent in every phase, the bytes copied and the contexts and buffers created"
+    );
+    m.def("reset_stats", []() { MatmulStats::instance().reset(); },
+        "Zero the instrumentation counters"
+    );
+
+    m.def("start_trace", [](size_t max_events) { MatmulTracer::instance().start(max_events); },
+        "Record a span for every matmul phase, drops the spans of the previous trace",
+        py::arg("max_events") = (size_t) 1 << 20
+    );
+    m.def("stop_trace", []() { MatmulTracer::instance().stop(); },
+        "Stop recording spans"
+    );
+    m.def("write_trace", 
+        [](const std::string& path) {
+            if (!MatmulTracer::instance().write(path)) {
+                throw std::runtime_error("Can not write the matmul trace to " + path);
+            }
+        },
+        "Write the recorded spans as a chrome trace event file, open it in ui.perfetto.dev",
+        py::arg("path")
+    );
+
+    m.def("configure_conv2d", 
+        [](size_t max_im2col_bytes, int32_t ring) {
+            if (ring < 2) {
+                throw std::runtime_error("The ring needs at least two buffers");
+            }
+            matmul_conv2d_config() = {max_im2col_bytes, ring};
+        },
+        "Stream convolutions whose im2col matrix is larger than max_im2col_bytes "
+        "through a ring of npu buffers",
+        py::arg("max_im2col_bytes"), py::arg("ring") = 2
+    );
+
+    m.def("configure_cache", 
+        [](size_t max_contexts, size_t max_bytes) {
+            MatmulCache::instance().configure(max_contexts, max_bytes);
+        },
+        "Set the maximum number of cached npu contexts and the npu memory they may hold",
+        py::arg("max_contexts"), py::arg("max_bytes")
+    );
+    m.def("clear_cache", []() { MatmulCache::instance().clear(); },
+        "Destroy all the cached npu contexts"
+    );
+    m.def("cache_stats", 
+        []() {
+            matmul_cache_stats stats = MatmulCache::instance().stats();
+            py::dict d;
+            d["hits"] = stats.hits;
+            d["misses"] = stats.misses;
+            d["evictions"] = stats.evictions;
+            d["contexts"] = stats.contexts;
+            d["bytes"] = stats.bytes;
+            return d;
+        },
+        "Hit, miss and eviction counters of the npu context cache"
+    );
+
+    m.def("configure_pool", 
+        [](size_t max_bytes) { NpuMemoryPool::instance().configure(max_bytes); },
+        "Set the npu memory the tensor pool may keep for reuse",
+        py::arg("max_bytes")
+    );
+    m.def("trim_pool", 
+        [](size_t keep_bytes) { NpuMemoryPool::instance().trim(keep_bytes); },
+        "Free the least recently used pooled tensors until at most keep_bytes are kept",
+        py::arg("keep_bytes") = 0
+    );
+    m.def("pool_stats", 
+        []() {
+            npu_pool_stats stats = NpuMemoryPool::instance().stats();
+            py::dict d;
+            d["allocations"] = stats.allocations;
+            d["reuses"] = stats.reuses;
+            d["frees"] = stats.frees;
+            d["retained_buffers"] = stats.retained_buffers;
+            d["retained_bytes"] = stats.retained_bytes;
+            return d;
+        },
+        "Allocation, reuse and retention counters of the npu tensor pool"
     );
 
 }
@@ -0,0 +1,237 @@
+/*
+ * Software emulation of the rknn matmul runtime
+ *
+ * Implements the part of librknnrt used by matmul-npu on the cpu, so the
+ * library, the examples and the python module run on any linux host.
+ * The results follow the npu types: float16 inputs are accumulated in float32,
+ * int8 inputs in int32, and int8 outputs saturate.
+ */
+#include <rknpu/rknn_matmul_api.h>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "utils/cpu_gemm.hpp"
+#include "utils/layout.hpp"
+
+/**
+ * An emulated matmul context
+ *
+ * @param a, b, c The tensors bound with rknn_matmul_set_io_mem
+ */
+struct _emulated_matmul {
+    rknn_matmul_info info;
+    rknn_matmul_io_attr io_attr;
+    rknn_tensor_mem* a = nullptr;
+    rknn_tensor_mem* b = nullptr;
+    rknn_tensor_mem* c = nullptr;
+};
+
+static std::atomic<int32_t> next_fd{1000};
+
+static size_t element_size(rknn_tensor_type type) {
+    return type == RKNN_TENSOR_FLOAT32 || type == RKNN_TENSOR_INT32 ? 4 :
+        type == RKNN_TENSOR_FLOAT16 ? 2 : 1;
+}
+
+/**
+ * @brief The size of the (N / n_block, K / k_block, n_block, k_block) blocks of the native B layout
+ */
+static void native_b_blocks(rknn_tensor_type b_type, int32_t* n_block, int32_t* k_block) {
+    *n_block = b_type == RKNN_TENSOR_INT8 ? 32 : 16;
+    *k_block = 32;
+}
+
+static size_t native_b_index(int32_t k, int32_t n, int32_t K, int32_t n_block, int32_t k_block) {
+    const int32_t k_blocks = (K + k_block - 1) / k_block;
+    return (((size_t) (n / n_block) * k_blocks + k / k_block) * n_block + n % n_block) * k_block + k % k_block;
+}
+
+static void set_attr(
+    rknn_matmul_tensor_attr* attr, const char* name, rknn_tensor_type type,
+    std::initializer_list<uint32_t> dims) {
+    memset(attr, 0, sizeof(*attr));
+    strncpy(attr->name, name, RKNN_MAX_NAME_LEN - 1);
+    attr->type = type;
+    attr->size = element_size(type);
+    for (uint32_t dim : dims) {
+        attr->dims[attr->n_dims++] = dim;
+        attr->size *= dim;
+    }
+}
+
+extern "C" {
+
+int rknn_matmul_create(rknn_matmul_ctx* ctx, rknn_matmul_info* info, rknn_matmul_io_attr* io_attr) {
+    if (ctx == nullptr || info == nullptr || io_attr == nullptr ||
+        info->M <= 0 || info->K <= 0 || info->N <= 0) {
+        return RKNN_ERR_PARAM_INVALID;
+    }
+    const int32_t index = matmul_type_index((_rknn_matmul_type) info->type);
+    if (index < 0) {
+        return RKNN_ERR_PARAM_INVALID;
+    }
+    const _matmul_type_entry& types = matmul_type_table[index];
+    const uint32_t M = info->M, K = info->K, N = info->N;
+
+    if (info->AC_layout) {
+        const uint32_t a_group = 16 / types.a_size, c_group = 16 / types.c_size;
+        set_attr(&io_attr->A, "A", types.a, {(K + a_group - 1) / a_group, M, a_group});
+        set_attr(&io_attr->C, "C", types.c, {(N + c_group - 1) / c_group, M, c_group});
+    } else {
+        set_attr(&io_attr->A, "A", types.a, {M, K});
+        set_attr(&io_attr->C, "C", types.c, {M, N});
+    }
+    if (info->B_layout) {
+        int32_t n_block, k_block;
+        native_b_blocks(types.b, &n_block, &k_block);
+        set_attr(&io_attr->B, "B", types.b, {
+            (N + n_block - 1) / n_block, (K + k_block - 1) / k_block,
+            (uint32_t) n_block, (uint32_t) k_block
+        });
+    } else {
+        set_attr(&io_attr->B, "B", types.b, {K, N});
+    }
+
+    _emulated_matmul* matmul = new _emulated_matmul();
+    matmul->info = *info;
+    matmul->io_attr = *io_attr;
+    *ctx = (rknn_matmul_ctx) matmul;
+    return RKNN_SUCC;
+}
+
+int rknn_matmul_destroy(rknn_matmul_ctx ctx) {
+    if (ctx == 0) {
+        return RKNN_ERR_PARAM_INVALID;
+    }
+    delete (_emulated_matmul*) ctx;
+    return RKNN_SUCC;
+}
+
+rknn_tensor_mem* rknn_create_mem(rknn_context ctx, uint32_t size) {
+    void* data = calloc(size > 0 ? size : 1, 1);
+    if (data == nullptr) {
+        return nullptr;
+    }
+    rknn_tensor_mem* mem = new rknn_tensor_mem();
+    mem->virt_addr = data;
+    mem->fd = next_fd++;
+    mem->size = size;
+    // memory created here is freed with the mem, imported memory is not
+    mem->priv_data = data;
+    return mem;
+}
+
+rknn_tensor_mem* rknn_create_mem_from_fd(
+    rknn_context ctx, int32_t fd, void* virt_addr, uint32_t size, int32_t offset) {
+    rknn_tensor_mem* mem = new rknn_tensor_mem();
+    mem->virt_addr = virt_addr;
+    mem->fd = fd;
+    mem->offset = offset;
+    mem->size = size;
+    return mem;
+}
+
+int rknn_destroy_mem(rknn_context ctx, rknn_tensor_mem* mem) {
+    if (mem == nullptr) {
+        return RKNN_ERR_PARAM_INVALID;
+    }
+    free(mem->priv_data);
+    delete mem;
+    return RKNN_SUCC;
+}
+
+int rknn_matmul_set_io_mem(rknn_matmul_ctx ctx, rknn_tensor_mem* mem, rknn_matmul_tensor_attr* attr) {
+    _emulated_matmul* matmul = (_emulated_matmul*) ctx;
+    if (matmul == nullptr || mem == nullptr || attr == nullptr || mem->size < attr->size) {
+        return RKNN_ERR_PARAM_INVALID;
+    }
+    if (strcmp(attr->name, "A") == 0) {
+        matmul->a = mem;
+    } else if (strcmp(attr->name, "B") == 0) {
+        matmul->b = mem;
+    } else if (strcmp(attr->name, "C") == 0) {
+        matmul->c = mem;
+    } else {
+        return RKNN_ERR_PARAM_INVALID;
+    }
+    return RKNN_SUCC;
+}
+
+int rknn_matmul_set_core_mask(rknn_matmul_ctx context, rknn_core_mask core_mask) {
+    return context == 0 ? RKNN_ERR_PARAM_INVALID : RKNN_SUCC;
+}
+
+int rknn_B_normal_layout_to_native_layout(void* B_input, void* B_output, int K, int N, rknn_matmul_info* info) {
+    const int32_t index = matmul_type_index((_rknn_matmul_type) info->type);
+    if (index < 0 || B_input == nullptr || B_output == nullptr) {
+        return RKNN_ERR_PARAM_INVALID;
+    }
+    const size_t elem = matmul_type_table[index].b_size;
+    int32_t n_block, k_block;
+    native_b_blocks(matmul_type_table[index].b, &n_block, &k_block);
+    const size_t blocks = (size_t) ((N + n_block - 1) / n_block) * ((K + k_block - 1) / k_block);
+    memset(B_output, 0, blocks * n_block * k_block * elem);
+
+    const uint8_t* in = (const uint8_t*) B_input;
+    uint8_t* out = (uint8_t*) B_output;
+    #pragma omp parallel for schedule(static)
+    for (int32_t k = 0; k < K; k++) {
+        for (int32_t n = 0; n < N; n++) {
+            memcpy(
+                out + native_b_index(k, n, K, n_block, k_block) * elem,
+                in + ((size_t) k * N + n) * elem, elem
+            );
+        }
+    }
+    return RKNN_SUCC;
+}
+
+int rknn_matmul_run(rknn_matmul_ctx ctx) {
+    _emulated_matmul* matmul = (_emulated_matmul*) ctx;
+    if (matmul == nullptr || matmul->a == nullptr || matmul->b == nullptr || matmul->c == nullptr) {
+        return RKNN_ERR_PARAM_INVALID;
+    }
+    const rknn_matmul_info& info = matmul->info;
+    const _matmul_type_entry& types = matmul_type_table[matmul_type_index((_rknn_matmul_type) info.type)];
+    const int32_t M = info.M, K = info.K, N = info.N;
+
+    // the native layouts are converted to row major around a row major gemm
+    const void* a = matmul->a->virt_addr;
+    std::vector<uint8_t> a_normal;
+    if (info.AC_layout) {
+        a_normal.resize((size_t) M * K * types.a_size);
+        unpack_native(a_normal.data(), a, M, K, matmul->io_attr.A.dims[2], types.a_size);
+        a = a_normal.data();
+    }
+
+    const void* b = matmul->b->virt_addr;
+    std::vector<uint8_t> b_normal;
+    if (info.B_layout) {
+        int32_t n_block, k_block;
+        native_b_blocks(types.b, &n_block, &k_block);
+        b_normal.resize((size_t) K * N * types.b_size);
+        const uint8_t* in = (const uint8_t*) b;
+        #pragma omp parallel for schedule(static)
+        for (int32_t k = 0; k < K; k++) {
+            for (int32_t n = 0; n < N; n++) {
+                memcpy(
+                    b_normal.data() + ((size_t) k * N + n) * types.b_size,
+                    in + native_b_index(k, n, K, n_block, k_block) * types.b_size, types.b_size
+                );
+            }
+        }
+        b = b_normal.data();
+    }
+
+    if (info.AC_layout) {
+        std::vector<uint8_t> c_normal((size_t) M * N * types.c_size);
+        cpu_matmul(M, K, N, types.type, a, K, b, N, c_normal.data(), N);
+        pack_native(matmul->c->virt_addr, c_normal.data(), M, N, matmul->io_attr.C.dims[2], types.c_size);
+    } else {
+        cpu_matmul(M, K, N, types.type, a, K, b, N, matmul->c->virt_addr, N);
+    }
+    return RKNN_SUCC;
+}
+
+}
@@ -0,0 +1,821 @@
+#include "matrix_types/matrix.hpp"
+#include "utils/cpu_gemm.hpp"
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+/*
+ * Checks the npu matmuls against cpu_matmul, build and run it with make test
+ * (make EMULATE=1 test on hosts without an npu). Exits with 1 when a check fails.
+ */
+
+static std::atomic<int32_t> failures{0};
+
+void fail(const char* what) {
+    printf("FAIL %s\n", what);
+    failures++;
+}
+
+/**
+ * @brief An element of a matrix of any tensor type as a double
+ */
+double element(const void* data, rknn_tensor_type type, size_t i) {
+    switch (type) {
+        case RKNN_TENSOR_FLOAT16:
+            return (float) ((const float16*) data)[i];
+        case RKNN_TENSOR_FLOAT32:
+            return ((const float32*) data)[i];
+        case RKNN_TENSOR_INT8:
+            return ((const int8_t*) data)[i];
+        case RKNN_TENSOR_INT32:
+            return ((const int32_t*) data)[i];
+        default:
+            printf("test: unsupported tensor type %d\n", type);
+            abort();
+    }
+}
+
+/**
+ * @brief Fill a matrix with small random values, integers for int8 and eighths for float16
+ */
+std::vector<uint8_t> random_matrix(size_t count, rknn_tensor_type type, std::mt19937& rng) {
+    std::vector<uint8_t> data(count * tensor_type_size(type));
+    for (size_t i = 0; i < count; i++) {
+        const int32_t value = (int32_t) (rng() % 9) - 4;
+        if (type == RKNN_TENSOR_INT8) {
+            ((int8_t*) data.data())[i] = value;
+        } else {
+            ((float16*) data.data())[i] = float16(value / 8.0f);
+        }
+    }
+    return data;
+}
+
+/**
+ * @brief Compare a result with the expected values
+ *
+ * @param tolerance The allowed error relative to 1 + |expected|, 0 for exact results
+ */
+bool check(
+    const char* name, const void* got, rknn_tensor_type type,
+    const std::vector<double>& expected, double tolerance) {
+    for (size_t i = 0; i < expected.size(); i++) {
+        const double value = element(got, type, i);
+        if (!(std::abs(value - expected[i]) <= tolerance * (1.0 + std::abs(expected[i])))) {
+            printf("FAIL %s: element %zu is %f, expected %f\n", name, i, value, expected[i]);
+            failures++;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief The tolerance of a result type, float16 results are rounded by the npu
+ */
+double tolerance_of(rknn_tensor_type type) {
+    switch (type) {
+        case RKNN_TENSOR_FLOAT16:
+            return 1e-2;
+        case RKNN_TENSOR_FLOAT32:
+            return 1e-4;
+        default:
+            return 0.0;
+    }
+}
+
+/**
+ * @brief The result of cpu_matmul as doubles
+ */
+std::vector<double> cpu_reference(
+    int32_t M, int32_t K, int32_t N, const _matmul_type_entry& entry, const void* a, const void* b) {
+    std::vector<uint8_t> c((size_t) M * N * entry.c_size);
+    cpu_matmul(M, K, N, entry.type, a, K, b, N, c.data(), N);
+    std::vector<double> expected((size_t) M * N);
+    for (size_t i = 0; i < expected.size(); i++) {
+        expected[i] = element(c.data(), entry.c, i);
+    }
+    return expected;
+}
+
+/**
+ * @brief The product of two double matrices
+ */
+std::vector<double> reference(
+    int32_t M, int32_t K, int32_t N, const std::vector<double>& a, const std::vector<double>& b) {
+    std::vector<double> c((size_t) M * N, 0.0);
+    for (int32_t m = 0; m < M; m++) {
+        for (int32_t k = 0; k < K; k++) {
+            for (int32_t n = 0; n < N; n++) {
+                c[(size_t) m * N + n] += a[(size_t) m * K + k] * b[(size_t) k * N + n];
+            }
+        }
+    }
+    return c;
+}
+
+std::vector<double> to_double(const void* data, rknn_tensor_type type, size_t count) {
+    std::vector<double> values(count);
+    for (size_t i = 0; i < count; i++) {
+        values[i] = element(data, type, i);
+    }
+    return values;
+}
+
+/**
+ * @brief Run a matmul of every type in every layout and compare it with cpu_matmul
+ */
+void test_types(const char* name, int32_t M, int32_t K, int32_t N, std::mt19937& rng) {
+    for (const _matmul_type_entry& entry : matmul_type_table) {
+        std::vector<uint8_t> a = random_matrix((size_t) M * K, entry.a, rng);
+        std::vector<uint8_t> b = random_matrix((size_t) K * N, entry.b, rng);
+        const std::vector<double> expected = cpu_reference(M, K, N, entry, a.data(), b.data());
+
+        for (int32_t layout = MATMUL_LAYOUT_NORMAL; layout <= MATMUL_LAYOUT_NATIVE; layout++) {
+            NpuTensor c(matmul_npu(M, K, N, entry.type, a.data(), b.data(), (_matmul_layout) layout));
+            NpuTensor holder;
+            const void* normal = normal_input(c.data(), M, N, entry.c_size, holder);
+            if (!check(name, normal, entry.c, expected, tolerance_of(entry.c))) {
+                printf("    type %d layout %d (%d, %d, %d)\n", entry.type, layout, M, K, N);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Repeated shapes reuse their plan, the least recently used plans are evicted
+ *        by context count and by bytes, and concurrent lookups get their own plans
+ */
+void test_cache(std::mt19937& rng) {
+    MatmulCache& cache = MatmulCache::instance();
+    const _matmul_type_entry& entry = matmul_type_table[matmul_type_index(RKNN_INT8_MM_INT8_TO_INT32)];
+    const int32_t K = 64, N = 32;
+    std::vector<uint8_t> a = random_matrix(8 * K, entry.a, rng);
+    std::vector<uint8_t> b = random_matrix(K * N, entry.b, rng);
+    auto run = [&](int32_t M) {
+        NpuTensor c(matmul_npu(M, K, N, entry.type, a.data(), b.data()));
+        check("cache", c.data(), entry.c, cpu_reference(M, K, N, entry, a.data(), b.data()), 0.0);
+    };
+
+    cache.configure(2, (size_t) 512 << 20);
+    cache.clear();
+    matmul_cache_stats before = cache.stats();
+    run(8);
+    run(8);
+    matmul_cache_stats after = cache.stats();
+    if (after.misses - before.misses != 1 || after.hits - before.hits != 1 || after.contexts != 1) {
+        fail("cache: a repeated shape reuses it's plan");
+    }
+
+    run(4);
+    run(2);
+    after = cache.stats();
+    if (after.contexts != 2 || after.evictions - before.evictions != 1) {
+        fail("cache: the plans above the context limit are evicted");
+    }
+    before = after;
+    run(2);
+    run(8);
+    after = cache.stats();
+    if (after.hits - before.hits != 1 || after.misses - before.misses != 1) {
+        fail("cache: the least recently used plan is the one evicted");
+    }
+
+    cache.configure(32, 1);
+    run(8);
+    after = cache.stats();
+    if (after.contexts != 0 || after.bytes != 0) {
+        fail("cache: plans above the byte limit are not kept");
+    }
+    cache.configure(32, (size_t) 512 << 20);
+
+    const int32_t threads = 8, runs = 16;
+    before = cache.stats();
+    std::vector<std::thread> workers;
+    for (int32_t t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            for (int32_t i = 0; i < runs; i++) {
+                run(8);
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    after = cache.stats();
+    if (after.hits + after.misses - before.hits - before.misses != (uint64_t) threads * runs ||
+        after.contexts > (uint64_t) threads) {
+        fail("cache: concurrent lookups");
+    }
+}
+
+/**
+ * @brief Matrices in npu memory are found in the NpuMemoryRegistry and bound without a copy,
+ *        results are npu memory and are bound to the next matmul
+ */
+void test_zero_copy(std::mt19937& rng) {
+    const _matmul_type_entry& entry = matmul_type_table[matmul_type_index(RKNN_FLOAT16_MM_FLOAT16_TO_FLOAT16)];
+    const int32_t M = 37, K = 64, N = 32;
+    std::vector<uint8_t> a = random_matrix((size_t) M * K, entry.a, rng);
+    std::vector<uint8_t> b = random_matrix((size_t) K * N, entry.b, rng);
+    std::vector<uint8_t> b2 = random_matrix((size_t) N * N, entry.b, rng);
+
+    NpuTensor a_npu(npu_alloc_tensor(a.size())), b_npu(npu_alloc_tensor(b.size()));
+    memcpy(a_npu.data(), a.data(), a.size());
+    memcpy(b_npu.data(), b.data(), b.size());
+    if (NpuMemoryRegistry::instance().find(a_npu.data()).mem == nullptr ||
+        NpuMemoryRegistry::instance().find(a.data()).mem != nullptr) {
+        fail("zero copy: only npu memory is in the registry");
+    }
+
+    NpuTensor c(matmul_npu(M, K, N, entry.type, a_npu.data(), b_npu.data()));
+    check("zero copy", c.data(), entry.c, cpu_reference(M, K, N, entry, a.data(), b.data()), 1e-2);
+    if (NpuMemoryRegistry::instance().find(c.data()).mem == nullptr) {
+        fail("zero copy: a result is registered npu memory");
+    }
+
+    NpuTensor d(matmul_npu(M, N, N, entry.type, c.data(), b2.data()));
+    check("zero copy result", d.data(), entry.c, cpu_reference(M, N, N, entry, c.data(), b2.data()), 1e-2);
+}
+
+/**
+ * @brief Packed weights with aligned (native B) and unaligned (row major) shapes
+ */
+void test_weights(std::mt19937& rng) {
+    const int32_t shapes[][3] = {{37, 64, 96}, {37, 70, 45}, {100, 64, 64}};
+    for (const _matmul_type_entry& entry : matmul_type_table) {
+        for (const auto& shape : shapes) {
+            const int32_t M = shape[0], K = shape[1], N = shape[2];
+            std::vector<uint8_t> a = random_matrix((size_t) M * K, entry.a, rng);
+            std::vector<uint8_t> b = random_matrix((size_t) K * N, entry.b, rng);
+            NpuWeights weights(K, N, entry.type, b.data());
+            const std::vector<double> expected = cpu_reference(M, K, N, entry, a.data(), b.data());
+
+            for (int32_t layout = MATMUL_LAYOUT_NORMAL; layout <= MATMUL_LAYOUT_NATIVE; layout++) {
+                NpuTensor c(matmul_npu(M, a.data(), weights, (_matmul_layout) layout));
+                NpuTensor holder;
+                const void* normal = normal_input(c.data(), M, N, entry.c_size, holder);
+                if (!check("weights", normal, entry.c, expected, tolerance_of(entry.c))) {
+                    printf("    type %d layout %d native %d (%d, %d, %d)\n",
+                        entry.type, layout, weights.is_native(), M, K, N);
+                }
+            }
+        }
+    }
+
+    // more rows than the limits run in chunks against the same weights
+    const _matmul_type_entry& entry = matmul_type_table[matmul_type_index(RKNN_INT8_MM_INT8_TO_INT32)];
+    const npu_shape_limits limits = matmul_shape_limits();
+    matmul_shape_limits().max_m = 16;
+    std::vector<uint8_t> a = random_matrix(100 * 64, entry.a, rng);
+    std::vector<uint8_t> b = random_matrix(64 * 64, entry.b, rng);
+    NpuWeights weights(64, 64, entry.type, b.data());
+    NpuTensor c(matmul_npu(100, a.data(), weights));
+    check("weights chunked", c.data(), entry.c, cpu_reference(100, 64, 64, entry, a.data(), b.data()), 0.0);
+    matmul_shape_limits() = limits;
+}
+
+/**
+ * @brief Matmuls larger than the shape limits, split along M, N and K
+ */
+void test_tiling(std::mt19937& rng) {
+    const npu_shape_limits limits = matmul_shape_limits();
+    matmul_shape_limits() = {16, 32, 16};
+    test_types("tiled", 37, 70, 45, rng);
+    matmul_shape_limits() = limits;
+}
+
+/**
+ * @brief Matmuls split between the npu cores along M and along N
+ */
+void test_multicore(std::mt19937& rng) {
+    const multicore_config config = matmul_multicore_config();
+    matmul_multicore_config().enabled = true;
+    matmul_multicore_config().min_macs = 0;
+    matmul_multicore_config().split_n = false;
+    test_types("multicore rows", 37, 70, 45, rng);
+    matmul_multicore_config().split_n = true;
+    test_types("multicore cols", 37, 70, 96, rng);
+    matmul_multicore_config() = config;
+}
+
+/**
+ * @brief Submitted matmuls of one shape, futures that are never taken and errors of a job
+ */
+void test_async(std::mt19937& rng) {
+    const _matmul_type_entry& entry = matmul_type_table[matmul_type_index(RKNN_FLOAT16_MM_FLOAT16_TO_FLOAT32)];
+    const int32_t jobs = 8, M = 37, K = 70, N = 45;
+    std::vector<std::vector<uint8_t>> a, b;
+    for (int32_t i = 0; i < jobs; i++) {
+        a.push_back(random_matrix((size_t) M * K, entry.a, rng));
+        b.push_back(random_matrix((size_t) K * N, entry.b, rng));
+    }
+
+    std::vector<MatmulFuture> futures;
+    for (int32_t i = 0; i < jobs; i++) {
+        futures.push_back(submit_matmul(
+            M, K, N, entry.type, a[i].data(), b[i].data(),
+            i % 2 == 0 ? MATMUL_LAYOUT_NORMAL : MATMUL_LAYOUT_PERF
+        ));
+    }
+    for (int32_t i = 0; i < jobs; i++) {
+        NpuTensor c(futures[i].get());
+        check("submit", c.data(), entry.c, cpu_reference(M, K, N, entry, a[i].data(), b[i].data()), 1e-4);
+        if (futures[i].valid()) {
+            fail("submit: get takes the result");
+        }
+        // a future without a result does not block
+        futures[i].wait();
+        if (!futures[i].ready()) {
+            fail("submit: a taken future is ready");
+        }
+    }
+    {
+        MatmulFuture moved = submit_matmul(M, K, N, entry.type, a[0].data(), b[0].data());
+        MatmulFuture taken = std::move(moved);
+        moved.wait();
+        if (moved.valid() || !moved.ready() || !taken.valid()) {
+            fail("submit: a moved from future has no result");
+        }
+    }
+
+    // the result of a future that is destroyed unclaimed goes back to the pool
+    auto live_buffers = []() {
+        const npu_pool_stats stats = NpuMemoryPool::instance().stats();
+        return stats.allocations - stats.frees - stats.retained_buffers;
+    };
+    const uint64_t live = live_buffers();
+    for (int32_t i = 0; i < jobs; i++) {
+        MatmulFuture dropped = submit_matmul(M, K, N, entry.type, a[i].data(), b[i].data());
+    }
+    {
+        MatmulFuture replaced = submit_matmul(M, K, N, entry.type, a[0].data(), b[0].data());
+        replaced = submit_matmul(M, K, N, entry.type, a[1].data(), b[1].data());
+    }
+    if (live_buffers() != live) {
+        fail("submit: unclaimed results are released");
+    }
+
+    // an exception of a job reaches get, and the queue keeps running
+    std::future<tensor_result> failed = MatmulQueue::instance().submit(
+        []() -> _pending_matmul { throw std::runtime_error("load failed"); }
+    );
+    try {
+        tensor_result r = failed.get();
+        release_result(r);
+        fail("submit: the error of a job is passed to get");
+    } catch (const std::runtime_error&) {}
+    NpuTensor c(submit_matmul(M, K, N, entry.type, a[0].data(), b[0].data()).get());
+    check("submit after an error", c.data(), entry.c, cpu_reference(M, K, N, entry, a[0].data(), b[0].data()), 1e-4);
+}
+
+/**
+ * @brief Batches with a B per item, a shared B and shared weights
+ */
+void test_batched(std::mt19937& rng) {
+    const _matmul_type_entry& entry = matmul_type_table[matmul_type_index(RKNN_INT8_MM_INT8_TO_INT32)];
+    const int32_t batch = 5, M = 37, K = 64, N = 64;
+    std::vector<uint8_t> a = random_matrix((size_t) batch * M * K, entry.a, rng);
+    std::vector<uint8_t> b = random_matrix((size_t) batch * K * N, entry.b, rng);
+    NpuWeights weights(K, N, entry.type, b.data());
+
+    for (int32_t layout = MATMUL_LAYOUT_NORMAL; layout <= MATMUL_LAYOUT_PERF; layout++) {
+        NpuTensor items(matmul_npu_batched(
+            batch, M, K, N, entry.type, a.data(), (int64_t) M * K, b.data(), (int64_t) K * N,
+            (_matmul_layout) layout
+        ));
+        NpuTensor shared(matmul_npu_batched(
+            batch, M, K, N, entry.type, a.data(), (int64_t) M * K, b.data(), 0, (_matmul_layout) layout
+        ));
+        NpuTensor packed(matmul_npu_batched(
+            batch, M, a.data(), (int64_t) M * K, weights, (_matmul_layout) layout
+        ));
+
+        for (int32_t i = 0; i < batch; i++) {
+            const uint8_t* a_item = a.data() + (size_t) i * M * K;
+            const size_t c_item = (size_t) i * M * N * entry.c_size;
+            check("batched", (const uint8_t*) items.data() + c_item, entry.c,
+                cpu_reference(M, K, N, entry, a_item, b.data() + (size_t) i * K * N), 0.0);
+            const std::vector<double> expected = cpu_reference(M, K, N, entry, a_item, b.data());
+            check("batched shared", (const uint8_t*) shared.data() + c_item, entry.c, expected, 0.0);
+            check("batched weights", (const uint8_t*) packed.data() + c_item, entry.c, expected, 0.0);
+        }
+    }
+}
+
+/**
+ * @brief Released buffers are recycled by size class, the pool keeps at most it's
+ *        byte limit and trim gives the retained buffers back
+ */
+void test_pool() {
+    NpuMemoryPool& pool = NpuMemoryPool::instance();
+    const size_t size = NpuMemoryPool::size_class(10000);
+    pool.trim(0);
+
+    npu_pool_stats before = pool.stats();
+    {
+        NpuTensor first(npu_alloc_tensor(10000));
+    }
+    {
+        NpuTensor second(npu_alloc_tensor(9000));
+    }
+    npu_pool_stats after = pool.stats();
+    if (after.allocations - before.allocations != 1 || after.reuses - before.reuses != 1 ||
+        after.retained_buffers != 1 || after.retained_bytes != size) {
+        fail("pool: a released buffer serves the next request of it's size class");
+    }
+
+    pool.configure(2 * size);
+    before = pool.stats();
+    {
+        NpuTensor x(npu_alloc_tensor(10000)), y(npu_alloc_tensor(10000)), z(npu_alloc_tensor(10000));
+    }
+    after = pool.stats();
+    if (after.retained_bytes != 2 * size || after.frees - before.frees != 1) {
+        fail("pool: the retained bytes stay within the limit");
+    }
+
+    pool.trim(0);
+    if (pool.stats().retained_bytes != 0 || pool.stats().retained_buffers != 0) {
+        fail("pool: trim gives the retained buffers back");
+    }
+    pool.configure((size_t) 256 << 20);
+}
+
+/**
+ * @brief Chains of float16 and int8 matrices, the int8 intermediates are requantized
+ */
+void test_chain(std::mt19937& rng) {
+    const int32_t dims[] = {40, 64, 4, 48, 30};
+    for (rknn_tensor_type type : {RKNN_TENSOR_FLOAT16, RKNN_TENSOR_INT8}) {
+        std::vector<std::vector<uint8_t>> mats;
+        std::vector<chain_operand> operands;
+        for (int32_t i = 0; i < 4; i++) {
+            mats.push_back(random_matrix((size_t) dims[i] * dims[i + 1], type, rng));
+            operands.push_back({dims[i], dims[i + 1], type, mats.back().data()});
+        }
+
+        std::vector<double> expected = to_double(mats[0].data(), type, (size_t) dims[0] * dims[1]);
+        double largest = 0.0;
+        for (int32_t i = 1; i < 4; i++) {
+            expected = reference(
+                dims[0], dims[i], dims[i + 1], expected,
+                to_double(mats[i].data(), type, (size_t) dims[i] * dims[i + 1])
+            );
+        }
+        for (double value : expected) {
+            largest = std::max(largest, std::abs(value));
+        }
+
+        const rknn_tensor_type output = type == RKNN_TENSOR_INT8 ? RKNN_TENSOR_INT32 : RKNN_TENSOR_FLOAT32;
+        for (int32_t layout = MATMUL_LAYOUT_NORMAL; layout <= MATMUL_LAYOUT_NATIVE; layout++) {
+            NpuTensor c(matmul_chain(operands, output, (_matmul_layout) layout));
+            NpuTensor holder;
+            const void* normal = normal_input(c.data(), dims[0], dims[4], 4, holder);
+            std::vector<double> got = to_double(normal, output, expected.size());
+            for (size_t i = 0; i < expected.size(); i++) {
+                // requantized and float16 intermediates are within 2% of the largest value
+                if (std::abs(got[i] - expected[i]) > 0.02 * largest + 1.0) {
+                    printf("FAIL chain: type %d layout %d element %zu is %f, expected %f\n",
+                        type, layout, i, got[i], expected[i]);
+                    failures++;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief The cpu_max_macs override, the cost model and it's crossover, and results
+ *        computed on the cpu
+ */
+void test_dispatch(std::mt19937& rng) {
+    dispatch_model& model = matmul_dispatch_model();
+    const dispatch_model saved = model;
+    const _matmul_type_entry& entry = matmul_type_table[matmul_type_index(RKNN_INT8_MM_INT8_TO_INT32)];
+    model.enabled = true;
+
+    model.cpu_max_macs = 1000;
+    if (!runs_on_cpu(10, 10, 10, entry.type, nullptr, MATMUL_LAYOUT_NORMAL) ||
+        runs_on_cpu(10, 10, 11, entry.type, nullptr, MATMUL_LAYOUT_NORMAL)) {
+        fail("dispatch: cpu_max_macs overrides the model");
+    }
+
+    model.cpu_max_macs = -1;
+    const int64_t crossover = dispatch_crossover_macs(entry.type);
+    const int32_t n = (int32_t) std::llround(std::cbrt((double) crossover));
+    if (crossover <= 0 || !runs_on_cpu(n, n, n, entry.type, nullptr, MATMUL_LAYOUT_NORMAL) ||
+        runs_on_cpu(2048, 2048, 2048, entry.type, nullptr, MATMUL_LAYOUT_NORMAL)) {
+        fail("dispatch: matmuls below the crossover run on the cpu");
+    }
+
+    std::vector<uint8_t> b = random_matrix(64 * 64, entry.b, rng);
+    NpuWeights weights(64, 64, entry.type, b.data());
+    if (runs_on_cpu(2, 64, 64, entry.type, weights.data(), MATMUL_LAYOUT_NORMAL)) {
+        fail("dispatch: native B weights stay on the npu");
+    }
+
+    model.cpu_max_macs = (int64_t) 1 << 30;
+    test_types("cpu dispatch", 37, 70, 45, rng);
+    model = saved;
+}
+
+/**
+ * @brief Matmuls split between the cpu and the npu, with every share
+ */
+void test_coexec(std::mt19937& rng) {
+    coexec_config& config = matmul_coexec_config();
+    const coexec_config saved = config;
+    config.enabled = true;
+    config.min_macs = 0;
+    config.adaptive = false;
+
+    for (float share : {0.3f, 0.0f, 1.0f}) {
+        config.cpu_share[0] = config.cpu_share[1] = share;
+        test_types("coexec", 200, 70, 45, rng);
+    }
+
+    config.adaptive = true;
+    config.cpu_share[0] = config.cpu_share[1] = 0.5f;
+    test_types("coexec adaptive", 200, 70, 45, rng);
+    if (!(config.cpu_share[0] > 0.0f && config.cpu_share[0] < 1.0f &&
+        config.cpu_share[1] > 0.0f && config.cpu_share[1] < 1.0f)) {
+        fail("coexec: the adapted shares stay between 0 and 1");
+    }
+    config = saved;
+}
+
+/**
+ * @brief The tuning database survives a save and load, and every tuning candidate
+ *        gives the same result
+ */
+void test_tuning(std::mt19937& rng) {
+    MatmulTuningDatabase& database = MatmulTuningDatabase::instance();
+    const _matmul_type_entry& entry = matmul_type_table[matmul_type_index(RKNN_INT8_MM_INT8_TO_INT32)];
+    const std::string path = "/tmp/matnpu_test_tuning.db";
+    database.set_path("");
+    database.clear();
+
+    tuned_config config = {1, 0, 1, false, 0.0f, 0, 0, 0, 12.5};
+    database.record(37, 64, 32, entry.type, config);
+    config.ac_layout = 0;
+    config.cores = 2;
+    config.split_n = true;
+    database.record(200, 64, 64, entry.type, config);
+    if (!database.save(path)) {
+        fail("tuning: the database is saved");
+    }
+    database.clear();
+    tuned_config loaded;
+    if (database.load(path) != 2 || !database.find(37, 64, 32, entry.type, loaded) ||
+        loaded.ac_layout != 1 || loaded.cores != 1 || loaded.time_us != 12.5 ||
+        !database.find(200, 64, 64, entry.type, loaded) || loaded.cores != 2 || !loaded.split_n) {
+        fail("tuning: the database is loaded back");
+    }
+    remove(path.c_str());
+
+    const npu_shape_limits limits = matmul_shape_limits();
+    const int32_t shapes[][3] = {{200, 64, 64}, {37, 70, 45}};
+    for (int32_t tiled = 0; tiled < 2; tiled++) {
+        const int32_t M = shapes[tiled][0], K = shapes[tiled][1], N = shapes[tiled][2];
+        if (tiled) {
+            matmul_shape_limits() = {16, 32, 16};
+        }
+        std::vector<uint8_t> a = random_matrix((size_t) M * K, entry.a, rng);
+        std::vector<uint8_t> b = random_matrix((size_t) K * N, entry.b, rng);
+        const std::vector<double> expected = cpu_reference(M, K, N, entry, a.data(), b.data());
+        for (const tuned_config& candidate : tuning_candidates(M, K, N)) {
+            database.record(M, K, N, entry.type, candidate);
+            NpuTensor c(matmul_npu(M, K, N, entry.type, a.data(), b.data()));
+            check(tiled ? "tuned tiles" : "tuned", c.data(), entry.c, expected, 0.0);
+        }
+
+        const tuned_config best = tune_matmul(M, K, N, entry.type, 1);
+        if (!database.find(M, K, N, entry.type, loaded) || loaded.time_us != best.time_us) {
+            fail("tuning: tune_matmul records the fastest candidate");
+        }
+        matmul_shape_limits() = limits;
+    }
+    database.clear();
+}
+
+/**
+ * @brief The counters follow the matmuls while enabled and stay still while disabled
+ */
+void test_stats(std::mt19937& rng) {
+    MatmulStats& stats = MatmulStats::instance();
+    const bool enabled = stats.enabled();
+    const _matmul_type_entry& entry = matmul_type_table[matmul_type_index(RKNN_INT8_MM_INT8_TO_INT32)];
+    const int32_t M = 37, K = 64, N = 32;
+    std::vector<uint8_t> a = random_matrix((size_t) M * K, entry.a, rng);
+    std::vector<uint8_t> b = random_matrix((size_t) K * N, entry.b, rng);
+
+    // the perf layout unpacks C, a normal layout C is handed out without a copy
+    stats.enable(true);
+    stats.reset();
+    {
+        NpuTensor c(matmul_npu(M, K, N, entry.type, a.data(), b.data(), MATMUL_LAYOUT_PERF));
+    }
+    const matmul_stats counted = stats.snapshot();
+    const matmul_phase_stats& run = counted.phases[MATMUL_PHASE_RUN];
+    if (run.count != 1 || run.max_ns > run.total_ns ||
+        counted.bytes_in < (uint64_t) M * K + K * N || counted.bytes_out < (uint64_t) M * N * 4) {
+        fail("stats: a matmul is counted");
+    }
+
+    stats.enable(false);
+    {
+        NpuTensor c(matmul_npu(M, K, N, entry.type, a.data(), b.data(), MATMUL_LAYOUT_PERF));
+    }
+    const matmul_stats idle = stats.snapshot();
+    if (idle.phases[MATMUL_PHASE_RUN].count != 1 || idle.bytes_in != counted.bytes_in ||
+        idle.bytes_out != counted.bytes_out) {
+        fail("stats: nothing is counted while disabled");
+    }
+
+    stats.reset();
+    if (stats.snapshot().phases[MATMUL_PHASE_RUN].count != 0 || stats.snapshot().bytes_in != 0) {
+        fail("stats: reset clears the counters");
+    }
+    stats.enable(enabled);
+}
+
+/**
+ * @brief Convolutions with stride, padding and dilation, built at once and streamed, with
+ *        a packed filter, a row major filter and a tiled one
+ */
+void test_conv2d(std::mt19937& rng) {
+    const int32_t batch = 2, rows = 11, cols = 9, in_ch = 5, f_rows = 3, f_cols = 3;
+    conv2d_params params;
+    params.stride_rows = 2;
+    params.pad_rows = 1;
+    params.pad_cols = 2;
+    params.dilation_cols = 2;
+
+    std::vector<uint8_t> img = random_matrix((size_t) batch * rows * cols * in_ch, RKNN_TENSOR_FLOAT16, rng);
+    const float16* x = (const float16*) img.data();
+    const npu_shape_limits limits = matmul_shape_limits();
+
+    // 32 output channels pack to native B, 20 stay row major, and tile with small limits
+    for (int32_t variant = 0; variant < 3; variant++) {
+        const int32_t out_ch = variant == 0 ? 32 : 20;
+        if (variant == 2) {
+            matmul_shape_limits() = {16, 32, 16};
+        }
+        std::vector<uint8_t> filter = random_matrix((size_t) f_rows * f_cols * in_ch * out_ch, RKNN_TENSOR_FLOAT16, rng);
+        const float16* w = (const float16*) filter.data();
+        auto conv = make_conv2d<float32, float16, float16>(f_rows, f_cols, in_ch, out_ch, w, params);
+        const int32_t out_rows = conv->output_rows(rows), out_cols = conv->output_cols(cols);
+
+        std::vector<double> expected((size_t) batch * out_rows * out_cols * out_ch, 0.0);
+        for (int32_t n = 0; n < batch; n++) {
+            for (int32_t y = 0; y < out_rows; y++) {
+                for (int32_t z = 0; z < out_cols; z++) {
+                    double* out = &expected[(((size_t) n * out_rows + y) * out_cols + z) * out_ch];
+                    for (int32_t fr = 0; fr < f_rows; fr++) {
+                        for (int32_t fc = 0; fc < f_cols; fc++) {
+                            const int32_t iy = y * params.stride_rows - params.pad_rows + fr * params.dilation_rows;
+                            const int32_t ix = z * params.stride_cols - params.pad_cols + fc * params.dilation_cols;
+                            if (iy < 0 || iy >= rows || ix < 0 || ix >= cols) {
+                                continue;
+                            }
+                            for (int32_t c = 0; c < in_ch; c++) {
+                                const double v = (float) x[(((size_t) n * rows + iy) * cols + ix) * in_ch + c];
+                                for (int32_t o = 0; o < out_ch; o++) {
+                                    out[o] += v * (float) w[(((size_t) fr * f_cols + fc) * in_ch + c) * out_ch + o];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        for (conv2d_mode mode : {CONV2D_IM2COL, CONV2D_STREAM}) {
+            NpuTensor c(conv->run(batch, rows, cols, x, mode));
+            check(mode == CONV2D_IM2COL ? "conv2d" : "conv2d stream", c.data(), RKNN_TENSOR_FLOAT32, expected, 1e-4);
+        }
+        matmul_shape_limits() = limits;
+    }
+}
+
+/**
+ * @brief Scale, bias, activation, clamp and conversion applied while C is read
+ */
+void test_epilogue(std::mt19937& rng) {
+    const _matmul_type_entry& entry = matmul_type_table[matmul_type_index(RKNN_INT8_MM_INT8_TO_INT32)];
+    const int32_t M = 37, K = 70, N = 45;
+    std::vector<uint8_t> a = random_matrix((size_t) M * K, entry.a, rng);
+    std::vector<uint8_t> b = random_matrix((size_t) K * N, entry.b, rng);
+    std::vector<float> bias(N);
+    for (int32_t n = 0; n < N; n++) {
+        bias[n] = n - N / 2;
+    }
+
+    matmul_epilogue epilogue;
+    epilogue.alpha = 0.5f;
+    epilogue.bias = bias.data();
+    epilogue.activation = EPILOGUE_RELU;
+    epilogue.clamp_max = 20.0f;
+    epilogue.output = RKNN_TENSOR_FLOAT32;
+
+    std::vector<double> expected = cpu_reference(M, K, N, entry, a.data(), b.data());
+    for (size_t i = 0; i < expected.size(); i++) {
+        const double value = 0.5 * expected[i] + bias[i % N];
+        expected[i] = std::min(20.0, std::max(0.0, value));
+    }
+
+    const npu_shape_limits limits = matmul_shape_limits();
+    for (bool tiled : {false, true}) {
+        if (tiled) {
+            matmul_shape_limits() = {16, 32, 16};
+        }
+        for (int32_t layout = MATMUL_LAYOUT_NORMAL; layout <= MATMUL_LAYOUT_PERF; layout++) {
+            NpuTensor c(matmul_npu(
+                M, K, N, entry.type, a.data(), b.data(), epilogue, (_matmul_layout) layout
+            ));
+            check(tiled ? "epilogue tiled" : "epilogue", c.data(), RKNN_TENSOR_FLOAT32, expected, 1e-5);
+        }
+    }
+    matmul_shape_limits() = limits;
+}
+
+/**
+ * @brief int8 matmuls of float matrices, and float16 activations by int8 weights
+ */
+void test_quant(std::mt19937& rng) {
+    const int32_t M = 37, K = 64, N = 48;
+    std::vector<float> a((size_t) M * K), b((size_t) K * N);
+    for (float& value : a) {
+        value = (int32_t) (rng() % 2001) / 1000.0f - 1.0f;
+    }
+    for (float& value : b) {
+        value = (int32_t) (rng() % 2001) / 500.0f - 1.5f;
+    }
+    std::vector<double> expected = reference(
+        M, K, N, std::vector<double>(a.begin(), a.end()), std::vector<double>(b.begin(), b.end())
+    );
+    double largest = 0.0;
+    for (double value : expected) {
+        largest = std::max(largest, std::abs(value));
+    }
+
+    auto expect_close = [&](const char* name, const float* got) {
+        for (size_t i = 0; i < expected.size(); i++) {
+            if (std::abs(got[i] - expected[i]) > 0.02 * largest) {
+                printf("FAIL %s: element %zu is %f, expected %f\n", name, i, got[i], expected[i]);
+                failures++;
+                return;
+            }
+        }
+    };
+
+    QuantizedWeights symmetric(K, N, b.data());
+    QuantizedWeights asymmetric(K, N, b.data(), false);
+    NpuTensor c(quantized_matmul(M, a.data(), symmetric));
+    expect_close("quantized", (const float*) c.data());
+    NpuTensor d(quantized_matmul(M, a.data(), asymmetric, matmul_epilogue(), MATMUL_LAYOUT_PERF));
+    expect_close("quantized asymmetric", (const float*) d.data());
+
+    std::vector<float16> half_a(a.begin(), a.end());
+    Int8Weights int8_weights(K, N, b.data());
+    matmul_epilogue to_float;
+    to_float.output = RKNN_TENSOR_FLOAT32;
+    NpuTensor e(weight_only_matmul(M, half_a.data(), int8_weights, to_float));
+    expect_close("weight only", (const float*) e.data());
+}
+
+int main() {
+
+    std::mt19937 rng(1);
+
+    test_cache(rng);
+    test_zero_copy(rng);
+    test_weights(rng);
+    test_types("types", 37, 70, 45, rng);
+    test_types("types aligned", 64, 64, 64, rng);
+    test_tiling(rng);
+    test_multicore(rng);
+    test_async(rng);
+    test_batched(rng);
+    test_pool();
+    test_chain(rng);
+    test_dispatch(rng);
+    test_coexec(rng);
+    test_tuning(rng);
+    test_stats(rng);
+    test_conv2d(rng);
+    test_epilogue(rng);
+    test_quant(rng);
+
+    if (failures > 0) {
+        printf("%d checks failed\n", failures.load());
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}